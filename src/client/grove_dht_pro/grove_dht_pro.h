@@ -17,6 +17,8 @@ namespace GrovePi
 
 		  const static uint8_t BLUE_MODULE = 0;
 		  const static uint8_t WHITE_MODULE = 1;
+		  // Grove Temperature & Humidity Sensor V2.0 (I2C), [_pin] is the I2C bus (0/1)
+		  const static uint8_t DHT20_MODULE = 2;
 
 		  DHT(const uint8_t _module_type = BLUE_MODULE, const uint8_t _pin = 4)
 			  : module_type(_module_type), pin(_pin) {
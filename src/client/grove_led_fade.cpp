@@ -42,7 +42,7 @@ using namespace GrovePi;
 int main()
 {
 	int LED_pin = 16; // Grove LED is connected to digital port D16 on the GrovePi
-	int brigthness = 0; // initial brigthness of 0 (0 to 255)
+	unsigned int fade_ms = 2000; // length of one fade
 
 	try
 	{
@@ -53,19 +53,15 @@ int main()
 		// do indefinitely
 		while(true)
 		{
-			// reset if above 255
-			// the GrovePi has 8-bit DAC
-			if(brigthness > 255)
-				brigthness = 0;
+			// the Pico steps the brightness on its own timer,
+			// so each fade is a single command
+			analogRamp(LED_pin, 0, 255, fade_ms);
+			printf("[pin %d][led fading in]\n", LED_pin);
+			delay(fade_ms);
 
-			// and set the LED brigthness
-			analogWrite(LED_pin, brigthness);
-			float percentage_brightness = 100 * float(brigthness) / 255;
-			printf("[pin %d][led brigthness = %.2f%%]\n", LED_pin, percentage_brightness);
-
-			// increment brigthness for next iteration
-			brigthness += 10;
-			delay(50);
+			analogRamp(LED_pin, 255, 0, fade_ms);
+			printf("[pin %d][led fading out]\n", LED_pin);
+			delay(fade_ms);
 		}
 	}
 	catch(I2CError &error)
@@ -43,13 +43,32 @@
 #include "grovepi.h"
 
 #include <errno.h>
+#include <ctype.h>
 #include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
 #include <termios.h>
 #include <glob.h>
+#include <dirent.h>
+#include <algorithm>
+#include <poll.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <set>
 
 static const bool DEBUG = false;
 
-static int serial_fd = -1;
+// 計測 (make STATS=1 で -DGROVEPI_STATS を付けてビルドしたときだけ有効)
+#ifdef GROVEPI_STATS
+static const bool STATS = true;
+#else
+static const bool STATS = false;
+#endif
 
 namespace GrovePi
 {
@@ -105,166 +124,3648 @@ uint8_t GrovePi::readByte()
 	throw I2CError("[readByte is not supported in USB GrovePi mode]\n");
 }
 
-static int open_serial_port()
+// 受信リングバッファの容量 (2 のべき乗)
+static const size_t RX_RING_SIZE = 4096;
+
+// バイナリフレームモード
+// 要求: A5 | op | pin | len(LE16) | payload | crc8
+// 応答: 5A | op | status | len(LE16) | payload | crc8
+// crc8 は op から payload までが対象 (多項式 0x31, 初期値 0xFF)
+static const uint8_t FRAME_SYNC_REQUEST = 0xA5;
+static const uint8_t FRAME_SYNC_REPLY = 0x5A;
+static const size_t FRAME_HEADER_SIZE = 5;
+static const size_t FRAME_MAX_PAYLOAD = 1024;
+
+enum FrameOp
+{
+	OP_PIN_MODE = 0x01,
+	OP_DIGITAL_WRITE = 0x02,
+	OP_DIGITAL_READ = 0x03,
+	OP_ANALOG_WRITE = 0x04,
+	OP_ANALOG_READ = 0x05,
+	OP_ULTRASONIC_READ = 0x06,
+	OP_SET_TEXT = 0x07,
+	OP_SET_RGB = 0x08,
+	OP_DHT_READ = 0x09,
+	OP_LED_STRIP_WRITE = 0x0A,
+	OP_SNAPSHOT = 0x0B,
+	OP_TEXT = 0x7E,
+	OP_ASCII_MODE = 0x7F,
+	OP_EVENT = 0xE0
+};
+
+static const uint8_t FRAME_STATUS_OK = 0;
+
+static uint8_t crc8_update(uint8_t crc, uint8_t byte)
+{
+	crc ^= byte;
+	for(int i = 0; i < 8; ++i)
+		crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x31) : (uint8_t)(crc << 1);
+	return crc;
+}
+
+/**
+ * 要求フレームを組み立てる
+ * @param  buf     出力先 (FRAME_HEADER_SIZE + len + 1 バイト以上)
+ * @param  op      オペコード
+ * @param  pin     ピン番号 (LCD ならバス番号)
+ * @param  payload payload
+ * @param  len     payload の長さ
+ * @return         フレームの長さ
+ */
+static size_t build_frame(uint8_t *buf, uint8_t op, uint8_t pin, const uint8_t *payload, size_t len)
+{
+	buf[0] = FRAME_SYNC_REQUEST;
+	buf[1] = op;
+	buf[2] = pin;
+	buf[3] = (uint8_t)(len & 0xFF);
+	buf[4] = (uint8_t)(len >> 8);
+	if(len > 0)
+		memcpy(buf + FRAME_HEADER_SIZE, payload, len);
+
+	uint8_t crc = 0xFF;
+	for(size_t i = 1; i < FRAME_HEADER_SIZE + len; ++i)
+		crc = crc8_update(crc, buf[i]);
+	buf[FRAME_HEADER_SIZE + len] = crc;
+	return FRAME_HEADER_SIZE + len + 1;
+}
+
+// 計測用のコマンド種別 (バイナリモードのオペコード 0x01〜0x09 と同じ順)
+enum CommandKind
+{
+	CMD_PIN_MODE,
+	CMD_DIGITAL_WRITE,
+	CMD_DIGITAL_READ,
+	CMD_ANALOG_WRITE,
+	CMD_ANALOG_READ,
+	CMD_ULTRASONIC_READ,
+	CMD_SET_TEXT,
+	CMD_SET_RGB,
+	CMD_DHT_READ,
+	CMD_BATCH,
+	CMD_OTHER,
+	CMD_COUNT
+};
+
+static const char *const COMMAND_NAMES[CMD_COUNT] = {
+	"pinMode",
+	"digitalWrite",
+	"digitalRead",
+	"analogWrite",
+	"analogRead",
+	"ultrasonicRead",
+	"setText",
+	"setRGB",
+	"dhtRead",
+	"batch",
+	"other"
+};
+
+static uint8_t command_of_op(uint8_t op)
+{
+	if(op >= OP_PIN_MODE && op <= OP_DHT_READ)
+		return (uint8_t)(CMD_PIN_MODE + (op - OP_PIN_MODE));
+	return CMD_OTHER;
+}
+
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point since)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - since).count();
+}
+
+// 固定の形のコマンド行 (setText 以外) を組み立てるバッファの大きさ
+// snprintf を使わず put_text / put_uint で直接書き込む
+static const size_t COMMAND_BUF_SIZE = 64;
+
+/**
+ * 文字列リテラルを書き込む (長さはコンパイル時に決まる)
+ * @param  buf  出力先
+ * @param  pos  書き込む位置
+ * @param  text 文字列リテラル
+ * @return      書き込んだ後の位置
+ */
+template <size_t N>
+static size_t put_text(char *buf, size_t pos, const char (&text)[N])
+{
+	memcpy(buf + pos, text, N - 1);
+	return pos + N - 1;
+}
+
+/**
+ * 符号なし整数を 10 進で書き込む
+ * @param  buf   出力先
+ * @param  pos   書き込む位置
+ * @param  value 値
+ * @return       書き込んだ後の位置
+ */
+static size_t put_uint(char *buf, size_t pos, uint32_t value)
+{
+	char digits[10];
+	size_t n = 0;
+	do
+	{
+		digits[n++] = (char)('0' + value % 10);
+		value /= 10;
+	} while(value != 0);
+	while(n > 0)
+		buf[pos++] = digits[--n];
+	return pos;
+}
+
+/**
+ * 1 台分の計測値
+ * 受信スレッドからも更新するバイト数・待ち時間は atomic、
+ * それ以外は io_mutex の下で更新する
+ */
+struct DeviceStats
+{
+	std::atomic<uint64_t> bytes_out;
+	std::atomic<uint64_t> bytes_in;
+	std::atomic<uint64_t> writes;
+	std::atomic<uint64_t> write_us;
+	std::atomic<uint64_t> wait_us;
+	uint64_t timeouts;
+	uint64_t count[CMD_COUNT];
+	uint64_t errors[CMD_COUNT];
+	GrovePi::LatencyHistogram latency[CMD_COUNT];
+
+	DeviceStats() {
+		reset();
+	}
+
+	void reset() {
+		bytes_out = bytes_in = writes = write_us = wait_us = 0;
+		timeouts = 0;
+		for(size_t i = 0; i < CMD_COUNT; ++i)
+		{
+			count[i] = errors[i] = 0;
+			latency[i] = GrovePi::LatencyHistogram();
+		}
+	}
+};
+
+// 出力の書き込みキャッシュ (setWriteCache / setWriteBehind) のキー
+// 0-255 はピンの出力, 256-511 は LCD バスのバックライト色
+static const int CACHE_KEYS = 512;
+static const int CACHE_RGB_BASE = 256;
+static const int NO_CACHE_KEY = -1;
+static const int32_t CACHE_UNKNOWN = -1;
+static const int32_t CACHE_ANALOG = 0x100; // analogWrite の値 (digitalWrite の値と区別する)
+
+/**
+ * 応答待ちキュー
+ * 送信済みで応答をまだ受け取っていないコマンドを送信順に保持する。
+ * タグの無い応答行は、タグの無いコマンドのうち先頭のものに対応する。
+ * タグ付きの応答行 ("#<n> ...") は、同じタグのコマンドに対応する (順不同)。
+ */
+struct GrovePi::ReplySlot
+{
+	enum ModeSwitch
+	{
+		KEEP_MODE,
+		TO_BINARY,
+		TO_ASCII
+	};
+
+	std::string line;
+	bool done;
+	bool failed;
+	bool is_frame;
+	GrovePi::Frame frame;
+	ModeSwitch mode_switch;
+	std::function<void(const std::string &)> callback;
+
+	uint8_t command; // 計測用のコマンド種別
+	std::chrono::steady_clock::time_point submitted;
+
+	int cache_key; // 失敗したら書き込みキャッシュから消すキー
+	uint32_t tag;  // 要求タグ (0 ならタグ無し)
+
+	std::string request; // 送信したバイト列 (再接続したら送り直す)
+
+	bool discard; // タイムアウトで待つのをやめた (遅れて届いた応答は読み捨てる)
+
+	ReplySlot()
+		: done(false), failed(false), is_frame(false), mode_switch(KEEP_MODE), command(CMD_OTHER),
+		  cache_key(NO_CACHE_KEY), tag(0), discard(false) {
+	}
+
+	// 使い回す前に初期状態へ戻す (line と request の確保済み領域は残す)
+	void reset() {
+		line.clear();
+		request.clear();
+		done = failed = is_frame = discard = false;
+		mode_switch = KEEP_MODE;
+		callback = nullptr;
+		command = CMD_OTHER;
+		cache_key = NO_CACHE_KEY;
+		tag = 0;
+	}
+};
+
+static const size_t MAX_IN_FLIGHT = 32;
+// 使い回す ReplySlot の数 (これを超えて Reply を持ち続けると都度確保する)
+static const size_t SLOT_POOL_SIZE = 2 * MAX_IN_FLIGHT;
+static const uint32_t MAX_REQUEST_TAG = 65535;
+
+// 再接続の間隔 [ms] (失敗するたびに倍にする)
+static const int RECONNECT_MIN_MS = 5;
+static const int RECONNECT_MAX_MS = 200;
+// 状態を復元するコマンドの応答を待つ時間 [ms]
+static const int RESTORE_TIMEOUT_MS = 1000;
+
+/**
+ * Pico 1 台分の接続状態
+ * シリアル送受信・受信バッファ・応答待ちキューは io_mutex で保護する。
+ * 受信スレッドの動作中は、受信をそのスレッドだけが行う。
+ */
+struct GrovePi::DeviceState
+{
+	std::string path;          // 明示されたデバイスパス (空なら自動検出)
+	std::string serial_number; // USB シリアル番号で選ぶ場合
+	std::string port_name;     // 実際に開いたデバイスパス
+	std::string last_serial;   // 最後に開いた Pico の USB シリアル番号 (再接続では同じものを探す)
+	int fd;
+
+	// 接続が切れたことを検出し、再接続を待っているか
+	// (受信スレッドはロックを外して受信するので atomic にする)
+	std::atomic<bool> lost;
+	bool reconnecting; // いずれかのスレッドが再接続中か
+
+	char rx_ring[RX_RING_SIZE];
+	size_t rx_head; // 次に取り出す位置 (単調増加)
+	size_t rx_tail; // 次に書き込む位置 (単調増加)
+	size_t rx_scan; // 改行探索を再開する位置
+
+	int read_timeout_ms;
+
+	std::mutex io_mutex;
+	std::condition_variable reply_cv;
+	// 送信できるのは MAX_IN_FLIGHT 件までなので、確保済みの vector で足りる
+	// (deque は先頭から取り出していくと数十件ごとに領域を確保し直す)
+	std::vector<std::shared_ptr<ReplySlot> > in_flight;
+	size_t discarded; // in_flight のうち読み捨てる印の付いたもの (abandon() を参照)
+
+	// 応答待ちの ReplySlot は使い回して、コマンドごとのメモリ確保をなくす
+	std::vector<std::shared_ptr<ReplySlot> > slot_pool;
+	size_t slot_cursor;
+	std::shared_ptr<ReplySlot> completed_slot; // 送信しなかった書き込みの成功済みの応答
+	std::string rx_text; // 受信した行・テキストフレーム (確保済み領域を使い回す)
+
+	std::thread event_thread;
+	bool event_thread_active;
+	std::atomic<bool> event_thread_stop;
+
+	// "!<name> ..." 形式の非同期通知のハンドラ
+	std::mutex handler_mutex;
+	std::map<std::string, GrovePi::EventHandler> event_handlers;
+	GrovePi::ConnectionHandler connection_handler;
+
+	// バイナリフレームモード中か (切り替えは応答の受信時に行う)
+	std::atomic<bool> binary_mode;
+	bool mode_switching;
+
+	// テキストのコマンドに "#<n> " のタグを付けるか
+	bool request_tags;
+	uint32_t next_tag;
+
+	DeviceStats stats;
+
+	// 出力の書き込みキャッシュ (cache_mutex で保護する。io_mutex より後に取ること)
+	std::mutex cache_mutex;
+	std::atomic<bool> cache_enabled;
+	bool write_behind;
+	int32_t cache_values[CACHE_KEYS];  // Pico 側の出力値 (write-behind なら送信予定の値)
+	bool cache_pending[CACHE_KEYS];    // write-behind で未送信か
+	std::vector<uint16_t> pending_writes; // 未送信のキー (最初に変更した順)
+
+	// 再接続したときに復元する pinMode と出力値 (cache_mutex で保護する)
+	int8_t restore_modes[256];
+	int32_t restore_outputs[CACHE_KEYS];
+	// ピンを使うバックグラウンド処理 (watch, stream, 連続測距, LED テープ) の開始コマンド
+	std::string restore_setups[256];
+
+	DeviceState()
+		: fd(-1), lost(false), reconnecting(false), rx_head(0), rx_tail(0), rx_scan(0), read_timeout_ms(5000),
+		  discarded(0), slot_cursor(0), completed_slot(std::make_shared<ReplySlot>()), event_thread_active(false), event_thread_stop(false),
+		  binary_mode(false), mode_switching(false), request_tags(false), next_tag(1),
+		  cache_enabled(false), write_behind(false) {
+		for(int i = 0; i < CACHE_KEYS; ++i)
+		{
+			cache_values[i] = CACHE_UNKNOWN;
+			cache_pending[i] = false;
+			restore_outputs[i] = CACHE_UNKNOWN;
+		}
+		for(int i = 0; i < 256; ++i)
+			restore_modes[i] = -1;
+		completed_slot->done = true;
+		in_flight.reserve(MAX_IN_FLIGHT);
+		slot_pool.reserve(SLOT_POOL_SIZE);
+		rx_text.reserve(COMMAND_BUF_SIZE);
+	}
+
+	void rx_reset();
+	int open_port();
+	void close_port();
+	void drop_port();
+	void serial_write(const char *buf, size_t size);
+	size_t rx_fill(int port, int timeout_ms);
+	char rx_at(size_t pos) const { return rx_ring[pos & (RX_RING_SIZE - 1)]; }
+	bool rx_take_line(std::string &line);
+	bool rx_take_frame(GrovePi::Frame &frame, std::string &text, bool &crc_ok);
+	void fail_in_flight();
+	void abandon(GrovePi::ReplySlot *waiter);
+	void take_discarded(const std::shared_ptr<GrovePi::ReplySlot> &slot);
+	std::shared_ptr<GrovePi::ReplySlot> acquire_slot();
+	void send_request(std::unique_lock<std::mutex> &lk, const std::shared_ptr<GrovePi::ReplySlot> &slot);
+	bool reconnect(std::unique_lock<std::mutex> &lk, int timeout_ms);
+	void restore();
+	std::string restore_call(const std::string &command);
+	void notify_connection(std::unique_lock<std::mutex> &lk, bool connected);
+	std::shared_ptr<GrovePi::ReplySlot> take_in_flight(uint32_t tag);
+	void dispatch_event(const std::string &line);
+	void dispatch_line(std::string &line, std::unique_lock<std::mutex> &lk);
+	void dispatch_frame(const GrovePi::Frame &frame, bool crc_ok);
+	bool rx_dispatch_one(std::unique_lock<std::mutex> &lk);
+	template <typename Pred>
+	void wait_replies(std::unique_lock<std::mutex> &lk, Pred done, GrovePi::ReplySlot *waiter = NULL);
+	void event_thread_main();
+	void stop_event_thread();
+	void record_sent(GrovePi::ReplySlot &slot, uint8_t command);
+	void record_reply(const GrovePi::ReplySlot &slot, size_t errors);
+	int cache_store(int key, int32_t value);
+	bool cache_forget(int key);
+	void cache_forget_all();
+	void remember_mode(uint8_t pin, uint8_t mode);
+	void remember_output(int key, int32_t value);
+	void remember_setup(uint8_t pin, const std::string &command);
+	std::string restore_line();
+};
+
+void GrovePi::DeviceState::record_sent(GrovePi::ReplySlot &slot, uint8_t command)
+{
+	slot.command = command;
+	slot.submitted = std::chrono::steady_clock::now();
+	++stats.count[command];
+}
+
+/**
+ * 応答 1 件の遅延とエラー数を記録する
+ * @param slot   応答を受け取ったコマンド
+ * @param errors エラーの数 (バッチなら失敗したコマンドの数)
+ */
+void GrovePi::DeviceState::record_reply(const GrovePi::ReplySlot &slot, size_t errors)
+{
+	stats.latency[slot.command].record(elapsed_us(slot.submitted));
+	stats.errors[slot.command] += errors;
+}
+
+/**
+ * 応答行に含まれる "error" の数を数える (バッチは ";" 区切り)
+ * @param  line 応答行
+ * @return      エラーの数
+ */
+static size_t count_errors(const std::string &line)
+{
+	size_t errors = 0;
+	size_t start = 0;
+	while(true)
+	{
+		size_t end = line.find(';', start);
+		size_t len = (end == std::string::npos ? line.size() : end) - start;
+		if(line.compare(start, len, "error") == 0)
+			++errors;
+		if(end == std::string::npos)
+			return errors;
+		start = end + 1;
+	}
+}
+
+void GrovePi::DeviceState::rx_reset()
+{
+	rx_head = rx_tail = rx_scan = 0;
+}
+
+/**
+ * パターンに一致する最初のパスを返す
+ * @param  pattern glob のパターン
+ * @return         見つからなければ空文字列
+ */
+static std::string glob_first(const char *pattern)
+{
+	std::string path;
+	glob_t g;
+	if(glob(pattern, 0, NULL, &g) == 0)
+	{
+		if(g.gl_pathc > 0)
+			path = g.gl_pathv[0];
+		globfree(&g);
+	}
+	return path;
+}
+
+// Raspberry Pi の USB ベンダー ID (Pico の MicroPython / pico-sdk の CDC が使う)
+static const char PICO_USB_VENDOR[] = "2e8a";
+
+/**
+ * tty に対応する USB デバイスの属性を sysfs から読む
+ * @param  tty  tty の名前 (例: "ttyACM0")
+ * @param  attr 属性名 ("serial", "idVendor" など)
+ * @return      読めなければ空文字列
+ */
+static std::string usb_attr(const std::string &tty, const char *attr)
+{
+	// device はインタフェースを指すので、その親のデバイスが USB の属性を持つ
+	std::string file = "/sys/class/tty/" + tty + "/device/../" + attr;
+	FILE *fp = fopen(file.c_str(), "r");
+	if(fp == NULL)
+		return std::string();
+
+	char buf[128];
+	std::string value;
+	if(fgets(buf, sizeof(buf), fp) != NULL)
+	{
+		buf[strcspn(buf, "\r\n")] = '\0';
+		value = buf;
+	}
+	fclose(fp);
+	return value;
+}
+
+static std::string tty_name(const std::string &dev)
+{
+	size_t slash = dev.rfind('/');
+	return slash == std::string::npos ? dev : dev.substr(slash + 1);
+}
+
+struct UsbTty
+{
+	std::string name;   // "ttyACM0" など
+	std::string serial; // USB シリアル番号
+	bool pico;          // Raspberry Pi のベンダー ID か
+};
+
+static bool usb_tty_before(const UsbTty &a, const UsbTty &b)
+{
+	if(a.pico != b.pico)
+		return a.pico;
+	return a.name < b.name;
+}
+
+/**
+ * /sys/class/tty から USB シリアル (ttyACM*, ttyUSB*) を列挙する
+ * @return Pico を先に、それぞれ名前順に並べたもの (sysfs が無ければ空)
+ */
+static std::vector<UsbTty> scan_usb_ttys()
+{
+	std::vector<UsbTty> found;
+	DIR *dir = opendir("/sys/class/tty");
+	if(dir == NULL)
+		return found;
+
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL)
+	{
+		if(strncmp(entry->d_name, "ttyACM", 6) != 0 && strncmp(entry->d_name, "ttyUSB", 6) != 0)
+			continue;
+		UsbTty tty;
+		tty.name = entry->d_name;
+		tty.serial = usb_attr(tty.name, "serial");
+		tty.pico = usb_attr(tty.name, "idVendor") == PICO_USB_VENDOR;
+		found.push_back(tty);
+	}
+	closedir(dir);
+
+	std::sort(found.begin(), found.end(), usb_tty_before);
+	return found;
+}
+
+// 検出結果の保存先
+// 1 行に "<USB シリアル番号> <デバイスパス>" を、最後に開いたものから順に書く
+// (シリアル番号が分からなければ "-")
+static const size_t DISCOVERY_CACHE_ENTRIES = 8;
+
+/**
+ * GROVEPI_CACHE で変更でき、空文字列なら保存しない
+ * 既定は $XDG_RUNTIME_DIR/grovepi.cache (無ければ /tmp/grovepi-<uid>.cache)
+ */
+static std::string discovery_cache_file()
+{
+	const char *env = getenv("GROVEPI_CACHE");
+	if(env != NULL)
+		return env;
+
+	const char *runtime = getenv("XDG_RUNTIME_DIR");
+	if(runtime != NULL && runtime[0] != '\0')
+		return std::string(runtime) + "/grovepi.cache";
+
+	char buf[64];
+	snprintf(buf, sizeof(buf), "/tmp/grovepi-%u.cache", (unsigned)getuid());
+	return buf;
+}
+
+typedef std::vector<std::pair<std::string, std::string> > DiscoveryCache;
+
+static DiscoveryCache read_discovery_cache(const std::string &file)
+{
+	DiscoveryCache entries;
+	FILE *fp = file.empty() ? NULL : fopen(file.c_str(), "r");
+	if(fp == NULL)
+		return entries;
+
+	char serial[128], dev[256];
+	while(entries.size() < DISCOVERY_CACHE_ENTRIES && fscanf(fp, "%127s %255s", serial, dev) == 2)
+		entries.push_back(std::make_pair(std::string(serial), std::string(dev)));
+	fclose(fp);
+	return entries;
+}
+
+/**
+ * 開いたデバイスを検出結果の先頭に記録する
+ * 書き込み途中のファイルを他のプロセスが読まないよう、別名で書いてから置き換える
+ */
+static void write_discovery_cache(const std::string &file, const std::string &serial, const std::string &dev)
+{
+	if(file.empty())
+		return;
+
+	std::string key = serial.empty() ? "-" : serial;
+	DiscoveryCache entries = read_discovery_cache(file);
+	if(!entries.empty() && entries[0].first == key && entries[0].second == dev)
+		return;
+
+	std::string tmp = file + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if(fp == NULL)
+		return;
+	fprintf(fp, "%s %s\n", key.c_str(), dev.c_str());
+	for(size_t i = 0, n = 1; i < entries.size() && n < DISCOVERY_CACHE_ENTRIES; ++i)
+	{
+		if(entries[i].first == key || entries[i].second == dev)
+			continue;
+		fprintf(fp, "%s %s\n", entries[i].first.c_str(), entries[i].second.c_str());
+		++n;
+	}
+	if(fclose(fp) != 0 || rename(tmp.c_str(), file.c_str()) != 0)
+		unlink(tmp.c_str());
+}
+
+/**
+ * 前回開いたデバイスのパスを検出結果から探す
+ * 再接続や抜き差しで同じパスが別の USB デバイスに割り当てられることがあるので、
+ * 今のパスが Pico のもので、記録したシリアル番号と一致するかを sysfs で確かめる
+ * @param  entries 検出結果
+ * @param  serial  USB シリアル番号 (空なら最後に開いたもの)
+ * @return         見つからない・別のデバイスに変わっていれば空文字列
+ */
+static std::string cached_port(const DiscoveryCache &entries, const std::string &serial)
+{
+	for(size_t i = 0; i < entries.size(); ++i)
+	{
+		const std::string &key = entries[i].first;
+		if(!serial.empty() && key != serial)
+			continue;
+
+		const std::string &dev = entries[i].second;
+		std::string name = tty_name(dev);
+		if(usb_attr(name, "idVendor") != PICO_USB_VENDOR)
+			continue;
+		if(key != "-" && usb_attr(name, "serial") != key)
+			continue;
+		return dev;
+	}
+	return std::string();
+}
+
+// コマンドの記録 (環境変数 GROVEPI_TRACE にファイル名を指定したときだけ)
+// 1 行目は "# grovepi-trace 1"、以降は 1 行に "<最初の記録からの経過時間 [us]> <コマンド行>"
+// タグは付けずに送信した順に書くので、grovepi_soak.out --trace で同じ間隔のまま再生できる
+struct TraceFile
+{
+	FILE *fp;
+	std::mutex mutex;
+	std::chrono::steady_clock::time_point start;
+	bool started;
+
+	TraceFile() : fp(NULL), started(false) {
+		const char *env = getenv("GROVEPI_TRACE");
+		if(env == NULL || env[0] == '\0')
+			return;
+		fp = fopen(env, "w");
+		if(fp == NULL)
+			return;
+		// 異常終了しても途中までは残るよう、行ごとに書き出す
+		setvbuf(fp, NULL, _IOLBF, 0);
+		fprintf(fp, "# grovepi-trace 1\n");
+	}
+	~TraceFile() {
+		if(fp != NULL)
+			fclose(fp);
+	}
+};
+
+static TraceFile &trace_file()
+{
+	static TraceFile trace;
+	return trace;
+}
+
+/**
+ * 送信するコマンドを記録する (バイナリフレームのコマンドは trace_frame() で同じ意味の行にする)
+ * @param command 改行・タグを含まないコマンド行
+ * @param len     コマンド行の長さ
+ */
+static void trace_command(const char *command, size_t len)
+{
+	TraceFile &trace = trace_file();
+	if(trace.fp == NULL)
+		return;
+
+	std::lock_guard<std::mutex> lk(trace.mutex);
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if(!trace.started)
+	{
+		trace.start = now;
+		trace.started = true;
+	}
+	long long us = std::chrono::duration_cast<std::chrono::microseconds>(now - trace.start).count();
+	fprintf(trace.fp, "%lld ", us);
+	fwrite(command, 1, len, trace.fp);
+	fputc('\n', trace.fp);
+}
+
+/**
+ * シリアルポートを開いて raw モードに設定する
+ * @param  dev デバイスパス
+ * @return     ファイルディスクリプタ (開けなければ -1)
+ */
+static int open_serial(const char *dev)
+{
+	int port = ::open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(port < 0)
+		return -1;
+
+	struct termios tio;
+	if(tcgetattr(port, &tio) != 0)
+	{
+		::close(port);
+		return -1;
+	}
+
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, B115200);
+	cfsetospeed(&tio, B115200);
+	tio.c_cflag |= (CLOCAL | CREAD);
+	tio.c_cflag &= ~CRTSCTS;
+
+	if(tcsetattr(port, TCSANOW, &tio) != 0)
+	{
+		::close(port);
+		return -1;
+	}
+	return port;
+}
+
+/**
+ * シリアルポートを開く
+ * 明示されたパス、GROVEPI_SERIAL、前回開いた Pico (検出結果のファイル)、
+ * sysfs で見つけた USB シリアル (Pico を優先)、/dev/tty.usbmodem* の順に試す
+ * USB シリアル番号を指定した場合と再接続では、同じシリアル番号のデバイスだけを探す
+ * @return ファイルディスクリプタ
+ */
+int GrovePi::DeviceState::open_port()
+{
+	if(fd >= 0)
+		return fd;
+
+	std::string cache_file;
+	std::string want = serial_number.empty() ? last_serial : serial_number;
+	std::string opened;
+	int port = -1;
+	bool discovered = false;
+
+	if(!path.empty())
+	{
+		port = open_serial(path.c_str());
+		opened = path;
+	}
+	else
+	{
+		const char *env_path = getenv("GROVEPI_SERIAL");
+		if(serial_number.empty() && env_path != NULL && env_path[0] != '\0')
+		{
+			port = open_serial(env_path);
+			opened = env_path;
+		}
+
+		discovered = port < 0;
+		if(port < 0)
+		{
+			cache_file = discovery_cache_file();
+			opened = cached_port(read_discovery_cache(cache_file), want);
+			if(!opened.empty())
+				port = open_serial(opened.c_str());
+		}
+
+		if(port < 0)
+		{
+			std::vector<UsbTty> ttys = scan_usb_ttys();
+			// 探しているシリアル番号のものを先に、自動検出ならその後に他のものを試す
+			for(int pass = 0; pass < 2 && port < 0; ++pass)
+			{
+				if(pass == 1 && !serial_number.empty())
+					break;
+				for(size_t i = 0; i < ttys.size() && port < 0; ++i)
+				{
+					if((pass == 0) != (!want.empty() && ttys[i].serial == want))
+						continue;
+					opened = "/dev/" + ttys[i].name;
+					port = open_serial(opened.c_str());
+				}
+			}
+
+			if(port < 0 && ttys.empty() && serial_number.empty())
+			{
+				opened = glob_first("/dev/tty.usbmodem*");
+				if(!opened.empty())
+					port = open_serial(opened.c_str());
+			}
+			if(port < 0 && !serial_number.empty())
+				throw GrovePi::I2CError("[GrovePiError no serial device with that USB serial number]\n");
+		}
+	}
+
+	if(port < 0)
+		throw GrovePi::I2CError("[GrovePiError opening serial device]\n");
+
+	fd = port;
+	port_name = opened;
+	rx_reset();
+	if(discovered)
+	{
+		last_serial = usb_attr(tty_name(opened), "serial");
+		write_discovery_cache(cache_file, last_serial, opened);
+	}
+	if(DEBUG)
+		fprintf(stderr, "[GrovePi] opened serial at %s\n", opened.c_str());
+	return fd;
+}
+
+void GrovePi::DeviceState::close_port()
+{
+	drop_port();
+	binary_mode = false;
+	lost = false;
+	fail_in_flight();
+}
+
+/**
+ * シリアルポートを閉じる (応答待ちのコマンドは残す)
+ */
+void GrovePi::DeviceState::drop_port()
+{
+	if(fd >= 0)
+		::close(fd);
+	fd = -1;
+	port_name.clear();
+	rx_reset();
+}
+
+void GrovePi::DeviceState::serial_write(const char *buf, size_t size)
+{
+	int port = open_port();
+	ssize_t total = 0;
+	ssize_t len = (ssize_t)size;
+	std::chrono::steady_clock::time_point start;
+	if(STATS)
+		start = std::chrono::steady_clock::now();
+
+	while(total < len)
+	{
+		ssize_t w = ::write(port, buf + total, len - total);
+		if(w < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				lost = true;
+			throw GrovePi::I2CError("[GrovePiError writing to serial]\n");
+		}
+		total += w;
+	}
+
+	if(STATS)
+	{
+		stats.write_us += elapsed_us(start);
+		stats.bytes_out += size;
+		++stats.writes;
+	}
+}
+
+/**
+ * 受信済みデータをリングバッファへ取り込む
+ * poll() で最大 timeout_ms 待ち、読めるだけまとめて read する
+ * @param  port       シリアルのファイルディスクリプタ
+ * @param  timeout_ms 待ち時間 [ms]
+ * @return            取り込んだバイト数 (タイムアウト時は 0)
+ */
+size_t GrovePi::DeviceState::rx_fill(int port, int timeout_ms)
+{
+	size_t used = rx_tail - rx_head;
+	if(used == RX_RING_SIZE)
+		throw GrovePi::I2CError("[GrovePiError reading from serial: line too long]\n");
+
+	struct pollfd pfd;
+	pfd.fd = port;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	std::chrono::steady_clock::time_point start;
+	if(STATS)
+		start = std::chrono::steady_clock::now();
+	int pr = poll(&pfd, 1, timeout_ms);
+	if(STATS)
+		stats.wait_us += elapsed_us(start);
+	if(pr < 0)
+	{
+		if(errno == EINTR)
+			return 0;
+		throw GrovePi::I2CError("[GrovePiError reading from serial]\n");
+	}
+	if(pr == 0)
+		return 0;
+	if(pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+	{
+		lost = true;
+		throw GrovePi::I2CError("[GrovePiError reading from serial: device lost]\n");
+	}
+
+	// 空き領域はリング末尾と先頭の 2 区間に分かれうるので readv でまとめて読む
+	size_t free_space = RX_RING_SIZE - used;
+	size_t tail_pos = rx_tail & (RX_RING_SIZE - 1);
+	size_t first = RX_RING_SIZE - tail_pos;
+	if(first > free_space)
+		first = free_space;
+
+	struct iovec iov[2];
+	iov[0].iov_base = rx_ring + tail_pos;
+	iov[0].iov_len = first;
+	iov[1].iov_base = rx_ring;
+	iov[1].iov_len = free_space - first;
+
+	ssize_t r = readv(port, iov, iov[1].iov_len > 0 ? 2 : 1);
+	if(r < 0)
+	{
+		if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		lost = true;
+		throw GrovePi::I2CError("[GrovePiError reading from serial]\n");
+	}
+
+	rx_tail += (size_t)r;
+	if(STATS)
+		stats.bytes_in += (size_t)r;
+	return (size_t)r;
+}
+
+/**
+ * リングバッファの [begin, end) を文字列の末尾へコピーする
+ * リングの折り返しをまたぐ場合も 2 回の append で済ませる
+ */
+static void rx_copy(std::string &out, const char *ring, size_t begin, size_t end)
+{
+	size_t pos = begin & (RX_RING_SIZE - 1);
+	size_t len = end - begin;
+	size_t first = RX_RING_SIZE - pos;
+	if(first > len)
+		first = len;
+	out.append(ring + pos, first);
+	out.append(ring, len - first);
+}
+
+/**
+ * リングバッファから 1 行分を取り出す
+ * @param  line 取り出した行 (改行・CR は含まない)
+ * @return      1 行揃っていれば true
+ */
+bool GrovePi::DeviceState::rx_take_line(std::string &line)
+{
+	if(rx_scan < rx_head)
+		rx_scan = rx_head;
+
+	for(; rx_scan < rx_tail; ++rx_scan)
+	{
+		if(rx_at(rx_scan) != '\n')
+			continue;
+
+		line.clear();
+		rx_copy(line, rx_ring, rx_head, rx_scan);
+		if(line.find('\r') != std::string::npos)
+			line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+		rx_head = rx_scan = rx_scan + 1;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * リングバッファからバイナリ応答フレームを 1 つ取り出す
+ * 同期バイト以外は読み捨てる
+ * @param  frame  ヘッダと (短ければ) payload の格納先
+ * @param  text   テキスト・通知フレームの payload の格納先
+ * @param  crc_ok CRC が一致したか
+ * @return        フレームが揃っていれば true
+ */
+bool GrovePi::DeviceState::rx_take_frame(GrovePi::Frame &frame, std::string &text, bool &crc_ok)
+{
+	size_t len = 0;
+	while(true)
+	{
+		while(rx_head < rx_tail && (uint8_t)rx_at(rx_head) != FRAME_SYNC_REPLY)
+			++rx_head;
+
+		if(rx_tail - rx_head < FRAME_HEADER_SIZE)
+			return false;
+
+		len = (uint8_t)rx_at(rx_head + 3) | ((size_t)(uint8_t)rx_at(rx_head + 4) << 8);
+		if(len <= FRAME_MAX_PAYLOAD)
+			break;
+
+		// 同期バイトの誤検出とみなして読み飛ばす
+		++rx_head;
+	}
+	if(rx_tail - rx_head < FRAME_HEADER_SIZE + len + 1)
+		return false;
+
+	uint8_t crc = 0xFF;
+	for(size_t i = 1; i < FRAME_HEADER_SIZE + len; ++i)
+		crc = crc8_update(crc, (uint8_t)rx_at(rx_head + i));
+	crc_ok = (crc == (uint8_t)rx_at(rx_head + FRAME_HEADER_SIZE + len));
+
+	frame.op = (uint8_t)rx_at(rx_head + 1);
+	frame.status = (uint8_t)rx_at(rx_head + 2);
+	frame.length = (uint16_t)len;
+
+	size_t payload = rx_head + FRAME_HEADER_SIZE;
+	if(frame.op == OP_TEXT || frame.op == OP_EVENT)
+	{
+		text.clear();
+		if(frame.op == OP_EVENT)
+			text.push_back('!');
+		rx_copy(text, rx_ring, payload, payload + len);
+	}
+	else
+	{
+		for(size_t i = 0; i < len && i < sizeof(frame.payload); ++i)
+			frame.payload[i] = (uint8_t)rx_at(payload + i);
+	}
+
+	rx_head += FRAME_HEADER_SIZE + len + 1;
+	return true;
+}
+
+/**
+ * 応答待ちのコマンドをすべて失敗扱いにする
+ * 読み取りエラー後は応答との対応が取れなくなるため
+ */
+void GrovePi::DeviceState::fail_in_flight()
+{
+	for(size_t i = 0; i < in_flight.size(); ++i)
+	{
+		in_flight[i]->failed = true;
+		if(STATS)
+			++stats.errors[in_flight[i]->command];
+	}
+	in_flight.clear();
+	discarded = 0;
+	reply_cv.notify_all();
+
+	// 応答が失われた (切断・タイムアウト) 後は Pico 側の出力が分からない
+	cache_forget_all();
+}
+
+/**
+ * 応答を待ちきれなかったコマンドを失敗扱いにする
+ * タグの無いコマンドは、遅れて届く応答を次のコマンドが受け取らないよう、読み捨てる印を
+ * 付けてキューに残す。印の付いたものが残っている間は、テキストのコマンドにタグを付けて
+ * 送る (応答が失われていても、それより後のコマンドが他の応答を受け取らない)
+ * @param waiter 待っていたコマンド (NULL なら応答待ちのすべて)
+ */
+void GrovePi::DeviceState::abandon(GrovePi::ReplySlot *waiter)
+{
+	for(size_t i = 0; i < in_flight.size();)
+	{
+		GrovePi::ReplySlot &slot = *in_flight[i];
+		if((waiter != NULL && &slot != waiter) || slot.discard)
+		{
+			++i;
+			continue;
+		}
+		slot.failed = true;
+		if(STATS)
+			++stats.errors[slot.command];
+		if(slot.tag != 0)
+		{
+			// タグ付きの応答は、対応するコマンドが無ければ dispatch_line() が捨てる
+			in_flight.erase(in_flight.begin() + i);
+			continue;
+		}
+		slot.discard = true;
+		++discarded;
+		++i;
+	}
+	if(waiter != NULL)
+		waiter->failed = true;
+
+	// 応答が失われたものが溜まり続けないよう、古い印から諦める
+	for(size_t i = 0; discarded > MAX_IN_FLIGHT && i < in_flight.size();)
+	{
+		if(in_flight[i]->discard)
+		{
+			in_flight.erase(in_flight.begin() + i);
+			--discarded;
+		}
+		else
+			++i;
+	}
+	reply_cv.notify_all();
+
+	// 待つのをやめた書き込みが Pico 側で実行されたかは分からない
+	cache_forget_all();
+}
+
+/**
+ * 読み捨てる印の付いたコマンドが応答を受け取った (キューからは取り出し済み)
+ * @param slot 取り出したコマンド
+ */
+void GrovePi::DeviceState::take_discarded(const std::shared_ptr<GrovePi::ReplySlot> &slot)
+{
+	slot->discard = false;
+	--discarded;
+	reply_cv.notify_all();
+}
+
+/**
+ * 応答待ちに使う ReplySlot を用意する
+ * プールの中で他に誰も持っていないもの (Reply が破棄済み) を初期化して使い回し、
+ * 見つからなければ新しく作る
+ * @return 初期状態の ReplySlot
+ */
+std::shared_ptr<GrovePi::ReplySlot> GrovePi::DeviceState::acquire_slot()
+{
+	// 新しい所有者はこのロックの下でしか増えないので、use_count() が 1 ならプールだけが持っている
+	for(size_t n = 0; n < slot_pool.size(); ++n)
+	{
+		if(++slot_cursor >= slot_pool.size())
+			slot_cursor = 0;
+		const std::shared_ptr<GrovePi::ReplySlot> &slot = slot_pool[slot_cursor];
+		if(slot.use_count() == 1)
+		{
+			// 最後に手放したスレッドの読み取りより後に書き換える
+			std::atomic_thread_fence(std::memory_order_acquire);
+			slot->reset();
+			return slot;
+		}
+	}
+
+	std::shared_ptr<GrovePi::ReplySlot> slot = std::make_shared<GrovePi::ReplySlot>();
+	if(slot_pool.size() < SLOT_POOL_SIZE)
+	{
+		// 受信した行は line と rx_text の間で入れ替えるので、どちらも短い応答なら足りる大きさにしておく
+		slot->line.reserve(COMMAND_BUF_SIZE);
+		slot->request.reserve(COMMAND_BUF_SIZE);
+		slot_pool.push_back(slot);
+	}
+	return slot;
+}
+
+/**
+ * 要求を送信して応答待ちキューに入れる
+ * 接続が切れていれば、送れなかった要求も応答待ちに残し、再接続してから送り直す
+ * @param lk   io_mutex のロック
+ * @param slot 応答を受け取るコマンド (slot->request が送信するバイト列)
+ */
+void GrovePi::DeviceState::send_request(std::unique_lock<std::mutex> &lk,
+                                        const std::shared_ptr<GrovePi::ReplySlot> &slot)
+{
+	if(!lost)
+	{
+		try
+		{
+			serial_write(slot->request.data(), slot->request.size());
+		}
+		catch(GrovePi::I2CError &)
+		{
+			if(!lost)
+				throw;
+		}
+	}
+	in_flight.push_back(slot);
+
+	// 受信スレッドや他のスレッドが再接続するなら、それに任せる
+	if(lost && !event_thread_active && !reconnecting && !reconnect(lk, read_timeout_ms))
+	{
+		fail_in_flight();
+		throw GrovePi::I2CError("[GrovePiError reconnecting to serial device]\n");
+	}
+}
+
+/**
+ * 切断された Pico に接続し直す
+ * 同じ Pico を探して開き直し、pinMode と出力値を復元してから応答待ちのコマンドを送り直す
+ * 失敗したら間隔を倍にしながら繰り返す
+ * 接続の変化は onConnectionChange() のハンドラへロックを外して知らせる
+ * @param  lk         io_mutex のロック
+ * @param  timeout_ms 諦めるまでの時間 [ms] (負なら受信スレッドが止められるまで)
+ * @return            接続し直せたら true
+ */
+bool GrovePi::DeviceState::reconnect(std::unique_lock<std::mutex> &lk, int timeout_ms)
+{
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms < 0 ? 0 : timeout_ms);
+
+	reconnecting = true;
+	if(fd >= 0)
+	{
+		// 切断を検出してから最初の呼び出し
+		// (binary_mode は切断前のモードのまま残し、再接続したらそのモードに戻す)
+		drop_port();
+		if(DEBUG)
+			fprintf(stderr, "[GrovePi] serial device lost, reconnecting\n");
+		notify_connection(lk, false);
+	}
+
+	int delay_ms = 0;
+	while(true)
+	{
+		if(delay_ms > 0)
+		{
+			lk.unlock();
+			std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+			lk.lock();
+		}
+		if(event_thread_stop || !lost)
+			break;
+
+		try
+		{
+			open_port();
+			restore();
+			lost = false;
+			break;
+		}
+		catch(GrovePi::I2CError &)
+		{
+			drop_port();
+			lost = true;
+		}
+
+		if(timeout_ms >= 0 && std::chrono::steady_clock::now() >= deadline)
+			break;
+		delay_ms = delay_ms == 0 ? RECONNECT_MIN_MS : std::min(delay_ms * 2, RECONNECT_MAX_MS);
+	}
+
+	reconnecting = false;
+	reply_cv.notify_all();
+	if(lost)
+		return false;
+
+	if(DEBUG)
+		fprintf(stderr, "[GrovePi] reconnected at %s\n", port_name.c_str());
+	notify_connection(lk, true);
+	return true;
+}
+
+/**
+ * 開き直したポートで Pico の状態を戻し、応答待ちのコマンドを送り直す
+ */
+void GrovePi::DeviceState::restore()
+{
+	// Pico がバイナリモードのままかもしれないので、ASCII モードへ戻す要求と改行を先に送る
+	uint8_t buf[FRAME_HEADER_SIZE + 2];
+	size_t n = build_frame(buf, OP_ASCII_MODE, 0, NULL, 0);
+	buf[n++] = '\n';
+	serial_write((const char *)buf, n);
+
+	// 復元のバッチ (無ければ stats()) の応答が届くまでの行は、今の要求や
+	// 切断前のコマンドへの応答なので読み捨てる
+	std::string line = restore_line();
+	restore_call(line.empty() ? "stats()" : line);
+	if(binary_mode && !restore_call("binaryMode(1)").empty())
+		throw GrovePi::I2CError("[GrovePiError in binaryMode]\n");
+
+	// 切断の間に Pico 側の出力が変わっているかもしれない
+	cache_forget_all();
+
+	for(std::vector<std::shared_ptr<GrovePi::ReplySlot> >::iterator it = in_flight.begin(); it != in_flight.end(); ++it)
+		serial_write((*it)->request.data(), (*it)->request.size());
+}
+
+/**
+ * 状態を復元するコマンドを送り、その応答を待つ (再接続中用)
+ * アプリケーションのコマンドと区別できるよう、要求タグの範囲外の "#0" を付ける
+ * @param  command コマンド行
+ * @return         "#0" を除いた応答
+ */
+std::string GrovePi::DeviceState::restore_call(const std::string &command)
+{
+	std::string request = "#0 " + command;
+	request.push_back('\n');
+	serial_write(request.data(), request.size());
+
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(RESTORE_TIMEOUT_MS);
+
+	std::string line;
+	while(true)
+	{
+		while(rx_take_line(line))
+		{
+			if(line.compare(0, 2, "#0") == 0 && (line.size() == 2 || line[2] == ' '))
+				return line.size() == 2 ? std::string() : line.substr(3);
+		}
+
+		int remaining = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+			deadline - std::chrono::steady_clock::now()).count();
+		if(remaining <= 0)
+			throw GrovePi::I2CError("[GrovePiError reading from serial: timeout]\n");
+		rx_fill(fd, remaining);
+	}
+}
+
+/**
+ * onConnectionChange() のハンドラを呼び出す
+ * @param lk        io_mutex のロック (呼び出しの間は外す)
+ * @param connected 接続し直せたら true, 切断されたら false
+ */
+void GrovePi::DeviceState::notify_connection(std::unique_lock<std::mutex> &lk, bool connected)
+{
+	GrovePi::ConnectionHandler handler;
+	{
+		std::lock_guard<std::mutex> hk(handler_mutex);
+		handler = connection_handler;
+	}
+	if(!handler)
+		return;
+
+	lk.unlock();
+	handler(connected);
+	lk.lock();
+}
+
+/**
+ * 応答待ちキューから応答を受け取るコマンドを取り出す
+ * @param  tag 応答のタグ (0 ならタグの無いコマンドのうち先頭のもの)
+ * @return     対応するコマンドが無ければ空
+ */
+std::shared_ptr<GrovePi::ReplySlot> GrovePi::DeviceState::take_in_flight(uint32_t tag)
+{
+	std::shared_ptr<GrovePi::ReplySlot> slot;
+	for(std::vector<std::shared_ptr<GrovePi::ReplySlot> >::iterator it = in_flight.begin(); it != in_flight.end(); ++it)
+	{
+		if((*it)->tag == tag)
+		{
+			slot = *it;
+			in_flight.erase(it);
+			break;
+		}
+	}
+	return slot;
+}
+
+/**
+ * 応答行の先頭のタグ "#<n>" を取り除く
+ * @param  line 応答行 (タグと続く空白 1 文字を取り除く)
+ * @return      タグ (不正なタグなら 0)
+ */
+static uint32_t strip_tag(std::string &line)
+{
+	uint32_t tag = 0;
+	size_t i = 1;
+	for(; i < line.size() && isdigit((unsigned char)line[i]); ++i)
+	{
+		tag = tag * 10 + (uint32_t)(line[i] - '0');
+		if(tag > MAX_REQUEST_TAG)
+			return 0;
+	}
+	if(i == 1 || (i < line.size() && line[i] != ' '))
+		return 0;
+	line.erase(0, i < line.size() ? i + 1 : i);
+	return tag;
+}
+
+/**
+ * 非同期通知 1 行を登録済みのハンドラへ渡す
+ * @param line "!" で始まる受信行
+ */
+void GrovePi::DeviceState::dispatch_event(const std::string &line)
+{
+	size_t end = line.find(' ');
+	std::string name = line.substr(1, end == std::string::npos ? std::string::npos : end - 1);
+	std::string args = end == std::string::npos ? std::string() : line.substr(end + 1);
+
+	GrovePi::EventHandler handler;
+	{
+		std::lock_guard<std::mutex> lk(handler_mutex);
+		std::map<std::string, GrovePi::EventHandler>::iterator it = event_handlers.find(name);
+		if(it != event_handlers.end())
+			handler = it->second;
+	}
+	if(handler)
+		handler(args);
+}
+
+/**
+ * 受信した 1 行を処理する
+ * 非同期通知はハンドラへ、それ以外はキュー先頭のコマンドの応答とする
+ * ハンドラとコールバックはロックを外して呼び出す
+ * @param line 受信行
+ * @param lk   io_mutex のロック
+ */
+void GrovePi::DeviceState::dispatch_line(std::string &line, std::unique_lock<std::mutex> &lk)
+{
+	if(!line.empty() && line[0] == '!')
+	{
+		// ロックを外している間に受信バッファの行が上書きされないよう、手元へ移す
+		std::string event;
+		event.swap(line);
+		lk.unlock();
+		dispatch_event(event);
+		lk.lock();
+		return;
+	}
+
+	uint32_t tag = 0;
+	if(!line.empty() && line[0] == '#')
+	{
+		// 不正なタグの応答は捨てる
+		tag = strip_tag(line);
+		if(tag == 0)
+			return;
+	}
+
+	// 対応するコマンドの無い応答は捨てる
+	// (タグ付きなら、失敗扱いにした後に届いた古い応答も読み捨てて同期が取り直せる)
+	std::shared_ptr<GrovePi::ReplySlot> slot = take_in_flight(tag);
+	if(!slot)
+		return;
+	if(slot->discard)
+	{
+		// 待つのをやめたコマンドへの遅れた応答 (モードの切り替えだけは反映する)
+		if(slot->mode_switch == GrovePi::ReplySlot::TO_BINARY && line.empty())
+			binary_mode = true;
+		take_discarded(slot);
+		return;
+	}
+
+	slot->line.swap(line);
+	slot->done = true;
+	if(STATS)
+		record_reply(*slot, count_errors(slot->line));
+	if(slot->mode_switch == GrovePi::ReplySlot::TO_BINARY && slot->line.empty())
+		binary_mode = true;
+	if(slot->cache_key != NO_CACHE_KEY && slot->line == "error")
+		cache_forget(slot->cache_key);
+	reply_cv.notify_all();
+
+	if(slot->callback)
+	{
+		lk.unlock();
+		slot->callback(slot->line);
+		lk.lock();
+	}
+}
+
+/**
+ * 受信したバイナリ応答フレームをキュー先頭のコマンドに割り当てる
+ * @param frame  受信フレーム
+ * @param crc_ok CRC が一致したか (不一致ならそのコマンドを失敗扱いにする)
+ */
+void GrovePi::DeviceState::dispatch_frame(const GrovePi::Frame &frame, bool crc_ok)
+{
+	std::shared_ptr<GrovePi::ReplySlot> slot = take_in_flight(0);
+	if(!slot)
+		return;
+	if(slot->discard)
+	{
+		if(slot->mode_switch == GrovePi::ReplySlot::TO_ASCII && crc_ok && frame.status == FRAME_STATUS_OK)
+			binary_mode = false;
+		take_discarded(slot);
+		return;
+	}
+	if(STATS)
+		record_reply(*slot, (!crc_ok || frame.status != FRAME_STATUS_OK) ? 1 : 0);
+	if(slot->cache_key != NO_CACHE_KEY && (!crc_ok || frame.status != FRAME_STATUS_OK))
+		cache_forget(slot->cache_key);
+	if(!crc_ok)
+		slot->failed = true;
+	else
+	{
+		slot->is_frame = true;
+		slot->frame = frame;
+		slot->done = true;
+		if(slot->mode_switch == GrovePi::ReplySlot::TO_ASCII && frame.status == FRAME_STATUS_OK)
+			binary_mode = false;
+	}
+	reply_cv.notify_all();
+}
+
+/**
+ * 受信バッファから応答・通知を 1 件取り出して処理する
+ * @param  lk io_mutex のロック
+ * @return    1 件処理できれば true
+ */
+bool GrovePi::DeviceState::rx_dispatch_one(std::unique_lock<std::mutex> &lk)
+{
+	std::string &text = rx_text;
+	if(!binary_mode)
+	{
+		if(!rx_take_line(text))
+			return false;
+		dispatch_line(text, lk);
+		return true;
+	}
+
+	GrovePi::Frame frame;
+	bool crc_ok = false;
+	if(!rx_take_frame(frame, text, crc_ok))
+		return false;
+
+	if(frame.op == OP_EVENT || frame.op == OP_TEXT)
+	{
+		if(!crc_ok)
+			dispatch_frame(frame, false);
+		else
+			dispatch_line(text, lk);
+	}
+	else
+		dispatch_frame(frame, crc_ok);
+	return true;
+}
+
+/**
+ * 条件が満たされるまで応答を待つ
+ * 受信スレッドが動作していればその通知を待ち、
+ * そうでなければ呼び出し元のスレッドで受信する
+ * タイムアウトしたら waiter だけを (NULL なら応答待ちのすべてを) 失敗扱いにする
+ * @param lk     io_mutex のロック
+ * @param done   待ち終える条件
+ * @param waiter 応答を待っているコマンド
+ */
+template <typename Pred>
+void GrovePi::DeviceState::wait_replies(std::unique_lock<std::mutex> &lk, Pred done, GrovePi::ReplySlot *waiter)
+{
+	const int timeout_ms = read_timeout_ms;
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms < 0 ? 0 : timeout_ms);
+
+	while(!done())
+	{
+		// 受信スレッドや他のスレッドの再接続はその通知を待つ
+		if(event_thread_active || reconnecting)
+		{
+			if(timeout_ms < 0)
+				reply_cv.wait(lk);
+			else if(reply_cv.wait_until(lk, deadline) == std::cv_status::timeout && !done())
+			{
+				if(STATS)
+					++stats.timeouts;
+				abandon(waiter);
+				throw GrovePi::I2CError("[GrovePiError reading from serial: timeout]\n");
+			}
+			continue;
+		}
+
+		if(lost)
+		{
+			int remaining = -1;
+			if(timeout_ms >= 0)
+			{
+				remaining = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now()).count();
+				if(remaining < 0)
+					remaining = 0;
+			}
+			if(!reconnect(lk, remaining))
+			{
+				fail_in_flight();
+				throw GrovePi::I2CError("[GrovePiError reconnecting to serial device]\n");
+			}
+			continue;
+		}
+
+		if(rx_dispatch_one(lk))
+			continue;
+
+		int remaining = -1;
+		if(timeout_ms >= 0)
+		{
+			remaining = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+				deadline - std::chrono::steady_clock::now()).count();
+			if(remaining < 0)
+				remaining = 0;
+		}
+
+		bool timed_out;
+		try
+		{
+			timed_out = rx_fill(open_port(), remaining) == 0 && timeout_ms >= 0 &&
+			            std::chrono::steady_clock::now() >= deadline;
+		}
+		catch(...)
+		{
+			// 切断なら次の周回で再接続して待ち続ける
+			if(lost)
+				continue;
+			fail_in_flight();
+			throw;
+		}
+		if(timed_out)
+		{
+			if(STATS)
+				++stats.timeouts;
+			abandon(waiter);
+			throw GrovePi::I2CError("[GrovePiError reading from serial: timeout]\n");
+		}
+	}
+}
+
+/**
+ * 受信スレッド本体
+ * 応答・通知が揃うたびに振り分ける
+ */
+void GrovePi::DeviceState::event_thread_main()
+{
+	std::unique_lock<std::mutex> lk(io_mutex);
+	while(!event_thread_stop)
+	{
+		if(rx_dispatch_one(lk))
+			continue;
+
+		// 受信バッファはこのスレッドしか触らないので、待つ間はロックを外す
+		int port = fd;
+		lk.unlock();
+		try
+		{
+			rx_fill(port, 50);
+		}
+		catch(GrovePi::I2CError &error)
+		{
+			lk.lock();
+			if(lost && reconnect(lk, -1))
+				continue;
+			if(DEBUG)
+				fprintf(stderr, "[GrovePi] event thread stopped: %s", error.what());
+			event_thread_active = false;
+			fail_in_flight();
+			return;
+		}
+		lk.lock();
+	}
+}
+
+void GrovePi::DeviceState::stop_event_thread()
+{
+	{
+		std::lock_guard<std::mutex> lk(io_mutex);
+		if(!event_thread.joinable())
+			return;
+		event_thread_stop = true;
+	}
+	event_thread.join();
+
+	std::lock_guard<std::mutex> lk(io_mutex);
+	event_thread_active = false;
+	event_thread_stop = false;
+	reply_cv.notify_all();
+}
+
+// 生存中のデバイス (シグナルによる計測値の出力用)
+static std::mutex devices_mutex;
+static std::set<GrovePi::DeviceState *> devices;
+
+static void register_device(GrovePi::DeviceState *state)
+{
+	std::lock_guard<std::mutex> lk(devices_mutex);
+	devices.insert(state);
+}
+
+/**
+ * connect to the first Pico found
+ * (GROVEPI_SERIAL, then the port remembered in the discovery cache file,
+ * then the USB serial ports in sysfs with Picos first, then /dev/tty.usbmodem*)
+ * the port is opened on first use
+ */
+GrovePi::Device::Device() : state(std::make_shared<DeviceState>())
+{
+	register_device(state.get());
+}
+
+/**
+ * connect to the Pico at the given serial port
+ * @param path device path (e.g. "/dev/ttyACM1")
+ */
+GrovePi::Device::Device(const std::string &path) : state(std::make_shared<DeviceState>())
+{
+	state->path = path;
+	register_device(state.get());
+}
+
+/**
+ * connect to the Pico with the given USB serial number
+ * (as shown by "lsusb -v" or in /dev/serial/by-id)
+ * @param serial USB serial number
+ */
+GrovePi::Device::Device(const USBSerial &serial) : state(std::make_shared<DeviceState>())
+{
+	state->serial_number = serial.number;
+	register_device(state.get());
+}
+
+GrovePi::Device::~Device()
+{
+	{
+		std::lock_guard<std::mutex> lk(devices_mutex);
+		devices.erase(state.get());
+	}
+	close();
+}
+
+/**
+ * open the serial port now instead of on first use
+ */
+void GrovePi::Device::open()
+{
+	std::lock_guard<std::mutex> lk(state->io_mutex);
+	state->open_port();
+}
+
+/**
+ * stop the event thread and close the serial port
+ * pending replies fail, the next command opens the port again
+ */
+void GrovePi::Device::close()
+{
+	state->stop_event_thread();
+
+	std::lock_guard<std::mutex> lk(state->io_mutex);
+	state->close_port();
+}
+
+/**
+ * @return path of the opened serial port (empty if not open)
+ */
+std::string GrovePi::Device::portName()
+{
+	std::lock_guard<std::mutex> lk(state->io_mutex);
+	return state->port_name;
+}
+
+/**
+ * set how long a command waits for the reply line
+ * @param milliseconds timeout (negative value waits forever)
+ */
+void GrovePi::Device::setReadTimeout(int milliseconds)
+{
+	std::lock_guard<std::mutex> lk(state->io_mutex);
+	state->read_timeout_ms = milliseconds;
+}
+
+/**
+ * テキストのコマンドを送信する
+ * 送信するバイト列は使い回す ReplySlot の中で組み立てるので、定常状態ではメモリを確保しない
+ * @param  state    送信先の接続
+ * @param  kind     計測用のコマンド種別
+ * @param  command  改行を含まないコマンド行
+ * @param  len      コマンド行の長さ
+ * @param  callback  応答を受け取ったときに呼ぶ関数
+ * @param  cache_key 失敗したら書き込みキャッシュから消すキー
+ * @return           応答のハンドル
+ */
+static GrovePi::Reply submit_text(const std::shared_ptr<GrovePi::DeviceState> &state, uint8_t kind,
+                                  const char *command, size_t len,
+                                  std::function<void(const std::string &)> callback = nullptr,
+                                  int cache_key = NO_CACHE_KEY)
+{
+	using namespace GrovePi;
+
+	DeviceState &s = *state;
+	std::unique_lock<std::mutex> lk(s.io_mutex);
+	s.wait_replies(lk, [&s]() { return !s.mode_switching && s.in_flight.size() - s.discarded < MAX_IN_FLIGHT; });
+
+	std::shared_ptr<ReplySlot> slot = s.acquire_slot();
+	slot->callback = std::move(callback);
+	slot->cache_key = cache_key;
+	trace_command(command, len);
+	if(s.binary_mode)
+	{
+		// バイナリモード中はテキストのコマンドをそのままフレームに包んで送る
+		if(len > FRAME_MAX_PAYLOAD)
+			throw I2CError("[GrovePiError command too long for binary mode]\n");
+		uint8_t buf[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD + 1];
+		size_t n = build_frame(buf, OP_TEXT, 0, (const uint8_t *)command, len);
+		slot->request.assign((const char *)buf, n);
+		if(STATS)
+			s.record_sent(*slot, kind);
+		s.send_request(lk, slot);
+		return Reply(state, slot);
+	}
+
+	// 読み捨てる応答が残っている間は、タグで対応を取る
+	if(s.request_tags || s.discarded > 0)
+	{
+		slot->tag = s.next_tag;
+		s.next_tag = s.next_tag == MAX_REQUEST_TAG ? 1 : s.next_tag + 1;
+		char prefix[16];
+		size_t n = put_text(prefix, 0, "#");
+		n = put_uint(prefix, n, slot->tag);
+		prefix[n++] = ' ';
+		slot->request.append(prefix, n);
+	}
+	slot->request.append(command, len);
+	slot->request.push_back('\n');
+	if(STATS)
+		s.record_sent(*slot, kind);
+	s.send_request(lk, slot);
+	return Reply(state, slot);
+}
+
+// 頻繁に呼ばないコマンド (submit() やバッチ、波形など) 用
+static GrovePi::Reply submit_text(const std::shared_ptr<GrovePi::DeviceState> &state, uint8_t kind,
+                                  const std::string &command,
+                                  std::function<void(const std::string &)> callback = nullptr,
+                                  int cache_key = NO_CACHE_KEY)
+{
+	return submit_text(state, kind, command.data(), command.size(), std::move(callback), cache_key);
+}
+
+static void flush_writes(const std::shared_ptr<GrovePi::DeviceState> &state);
+static void trace_frame(uint8_t op, uint8_t pin, const uint8_t *payload, size_t len);
+
+/**
+ * send a command line without waiting for its reply
+ * replies are matched to commands in FIFO order
+ * @param  command  command line without the trailing LF
+ * @param  callback optional function called with the reply line when it arrives
+ * @return          handle to the pending reply
+ */
+GrovePi::Reply GrovePi::Device::submit(const std::string &command, std::function<void(const std::string &)> callback)
+{
+	// 任意のコマンドは出力を変えうるので、書き込みキャッシュを使い直す
+	if(state->cache_enabled)
+	{
+		flush_writes(state);
+		state->cache_forget_all();
+	}
+	return submit_text(state, CMD_OTHER, command, callback);
+}
+
+/**
+ * バイナリフレームのコマンドを送信する
+ * @param  state   送信先の接続
+ * @param  op      オペコード
+ * @param  pin     ピン番号 (LCD ならバス番号)
+ * @param  payload payload
+ * @param  len       payload の長さ
+ * @param  cache_key 失敗したら書き込みキャッシュから消すキー
+ * @return           応答のハンドル
+ */
+static GrovePi::Reply submit_frame(const std::shared_ptr<GrovePi::DeviceState> &state,
+                                   uint8_t op, uint8_t pin, const uint8_t *payload, size_t len,
+                                   int cache_key = NO_CACHE_KEY)
+{
+	GrovePi::DeviceState &s = *state;
+	std::unique_lock<std::mutex> lk(s.io_mutex);
+	s.wait_replies(lk, [&s]() { return !s.mode_switching && s.in_flight.size() - s.discarded < MAX_IN_FLIGHT; });
+
+	if(!s.binary_mode)
+		throw GrovePi::I2CError("[GrovePiError binary mode was switched off]\n");
+
+	uint8_t buf[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD + 1];
+	size_t n = build_frame(buf, op, pin, payload, len);
+
+	std::shared_ptr<GrovePi::ReplySlot> slot = s.acquire_slot();
+	slot->request.assign((const char *)buf, n);
+	slot->cache_key = cache_key;
+	trace_frame(op, pin, payload, len);
+	if(STATS)
+		s.record_sent(*slot, command_of_op(op));
+	s.send_request(lk, slot);
+	return GrovePi::Reply(state, slot);
+}
+
+/**
+ * switch the transport between the ASCII protocol (default) and
+ * the compact binary frames
+ * waits until every submitted command has got its reply first
+ * @param enable true for binary frames, false for ASCII lines
+ */
+void GrovePi::Device::setBinaryMode(bool enable)
+{
+	DeviceState &s = *state;
+	std::unique_lock<std::mutex> lk(s.io_mutex);
+	s.wait_replies(lk, [&s]() { return !s.mode_switching && s.in_flight.size() == s.discarded; });
+	if(s.binary_mode == enable)
+		return;
+
+	std::shared_ptr<ReplySlot> slot = s.acquire_slot();
+	if(STATS)
+		s.record_sent(*slot, CMD_OTHER);
+	// 切り替えの応答を受け取るまで他のコマンドは送らない
+	s.mode_switching = true;
+	try
+	{
+		if(enable)
+		{
+			slot->mode_switch = ReplySlot::TO_BINARY;
+			slot->request = "binaryMode(1)\n";
+			s.send_request(lk, slot);
+		}
+		else
+		{
+			slot->mode_switch = ReplySlot::TO_ASCII;
+			uint8_t buf[FRAME_HEADER_SIZE + 1];
+			size_t n = build_frame(buf, OP_ASCII_MODE, 0, NULL, 0);
+			slot->request.assign((const char *)buf, n);
+			s.send_request(lk, slot);
+		}
+		s.wait_replies(lk, [&slot]() { return slot->done || slot->failed; }, slot.get());
+	}
+	catch(...)
+	{
+		s.mode_switching = false;
+		s.reply_cv.notify_all();
+		throw;
+	}
+	s.mode_switching = false;
+	s.reply_cv.notify_all();
+
+	if(s.binary_mode != enable)
+		throw I2CError("[GrovePiError in binaryMode]\n");
+}
+
+bool GrovePi::Device::binaryMode()
+{
+	return state->binary_mode;
+}
+
+/**
+ * tag every ASCII command line with "#<n> " so the Pico may answer
+ * out of order (needs firmware that understands request tags)
+ * replies of commands already in flight are still matched in order
+ * @param enable true to tag the following commands
+ */
+void GrovePi::Device::setRequestTags(bool enable)
+{
+	std::lock_guard<std::mutex> lk(state->io_mutex);
+	state->request_tags = enable;
+}
+
+bool GrovePi::Device::requestTags()
+{
+	std::lock_guard<std::mutex> lk(state->io_mutex);
+	return state->request_tags;
+}
+
+/**
+ * block until every submitted command has got its reply
+ */
+void GrovePi::Device::waitAll()
+{
+	DeviceState &s = *state;
+	std::unique_lock<std::mutex> lk(s.io_mutex);
+	s.wait_replies(lk, [&s]() { return s.in_flight.size() == s.discarded; });
+}
+
+bool GrovePi::Reply::ready() const
+{
+	if(!slot)
+		return false;
+
+	std::lock_guard<std::mutex> lk(device->io_mutex);
+	return slot->done || slot->failed;
+}
+
+/**
+ * wait for the reply line
+ * replies of earlier commands are consumed on the way
+ * @return the reply line (without LF)
+ */
+const std::string &GrovePi::Reply::line() const
+{
+	if(!slot)
+		throw I2CError("[GrovePiError empty reply handle]\n");
+
+	std::unique_lock<std::mutex> lk(device->io_mutex);
+	const std::shared_ptr<ReplySlot> &s = slot;
+	device->wait_replies(lk, [&s]() { return s->done || s->failed; }, s.get());
+
+	if(slot->failed)
+		throw I2CError("[GrovePiError reply lost]\n");
+	if(slot->is_frame)
+		throw I2CError("[GrovePiError reply is a binary frame]\n");
+	return slot->line;
+}
+
+/**
+ * wait for the reply
+ * @return the binary reply frame, or NULL if the reply is a text line
+ */
+const GrovePi::Frame *GrovePi::Reply::frame() const
+{
+	if(!slot)
+		throw I2CError("[GrovePiError empty reply handle]\n");
+
+	std::unique_lock<std::mutex> lk(device->io_mutex);
+	const std::shared_ptr<ReplySlot> &s = slot;
+	device->wait_replies(lk, [&s]() { return s->done || s->failed; }, s.get());
+
+	if(slot->failed)
+		throw I2CError("[GrovePiError reply lost]\n");
+	return slot->is_frame ? &slot->frame : NULL;
+}
+
+/**
+ * register the handler called when the serial connection is lost (false)
+ * and when it has been reopened and the pin modes, outputs and background
+ * work (see setRestoreCommand) restored (true)
+ * commands submitted in between are queued and sent after the reconnect
+ * @param handler function to call, or nullptr to remove it
+ */
+void GrovePi::Device::onConnectionChange(ConnectionHandler handler)
+{
+	std::lock_guard<std::mutex> lk(state->handler_mutex);
+	state->connection_handler = handler;
+}
+
+/**
+ * record the command that starts background work on a pin of the Pico
+ * (a watch, stream, continuous ranging, LED strip or repeating PWM
+ * sequence); it is sent again
+ * after the pin modes and outputs when the connection is reopened
+ * pinMode() and writes to the pin forget it, as they stop that work on the Pico
+ * @param pin     number the work uses
+ * @param command command to send again, or "" when the work was stopped
+ */
+void GrovePi::Device::setRestoreCommand(uint8_t pin, const std::string &command)
+{
+	state->remember_setup(pin, command);
+}
+
+/**
+ * register the handler for asynchronous "!<name> ..." lines pushed by the Pico
+ * the handler gets the text after the name and is called from the thread
+ * that happens to read the line (the event thread if it is running)
+ * @param name    event name (e.g. "stream")
+ * @param handler function to call, or nullptr to remove it
+ */
+void GrovePi::Device::setEventHandler(const std::string &name, EventHandler handler)
+{
+	std::lock_guard<std::mutex> lk(state->handler_mutex);
+	if(handler)
+		state->event_handlers[name] = handler;
+	else
+		state->event_handlers.erase(name);
+}
+
+/**
+ * start a background thread that reads from the serial port
+ * so that asynchronous events are delivered without any command waiting
+ * calling it again while the thread is running does nothing
+ */
+void GrovePi::Device::startEventThread()
+{
+	DeviceState &s = *state;
+	std::lock_guard<std::mutex> lk(s.io_mutex);
+	if(s.event_thread_active)
+		return;
+
+	s.open_port();
+	// エラーで止まったスレッドが残っていれば回収する
+	if(s.event_thread.joinable())
+		s.event_thread.join();
+
+	s.event_thread_stop = false;
+	s.event_thread_active = true;
+	s.event_thread = std::thread(&DeviceState::event_thread_main, &s);
+}
+
+/**
+ * stop the background reader thread
+ * commands read their replies in the calling thread again afterwards
+ */
+void GrovePi::Device::stopEventThread()
+{
+	state->stop_event_thread();
+}
+
+/**
+ * 計測値の写しを作る
+ * @param  state 対象の接続 (io_mutex を取得済みであること)
+ * @return       計測値
+ */
+static GrovePi::Stats snapshot_stats(GrovePi::DeviceState &state)
+{
+	GrovePi::Stats out;
+	const DeviceStats &st = state.stats;
+
+	out.enabled = STATS;
+	out.port = state.port_name;
+	out.bytes_out = st.bytes_out;
+	out.bytes_in = st.bytes_in;
+	out.writes = st.writes;
+	out.write_us = st.write_us;
+	out.wait_us = st.wait_us;
+	out.timeouts = st.timeouts;
+	for(size_t i = 0; i < CMD_COUNT; ++i)
+	{
+		GrovePi::CommandStats c;
+		c.name = COMMAND_NAMES[i];
+		c.count = st.count[i];
+		c.errors = st.errors[i];
+		c.latency = st.latency[i];
+		out.commands.push_back(c);
+	}
+	return out;
+}
+
+/**
+ * counters of this device since it was created (or resetStats())
+ * everything is zero unless the library is built with GROVEPI_STATS
+ * @return copy of the counters
+ */
+GrovePi::Stats GrovePi::Device::getStats()
+{
+	std::lock_guard<std::mutex> lk(state->io_mutex);
+	return snapshot_stats(*state);
+}
+
+void GrovePi::Device::resetStats()
+{
+	std::lock_guard<std::mutex> lk(state->io_mutex);
+	state->stats.reset();
+}
+
+/**
+ * バケット番号
+ * 16 未満はそのまま、それ以上は 2 のべき乗ごとに 8 分割する
+ * @param  us 値 [us]
+ * @return    バケット番号
+ */
+size_t GrovePi::LatencyHistogram::bucketOf(uint64_t us)
+{
+	if(us < 16)
+		return (size_t)us;
+
+	int msb = 63 - __builtin_clzll(us);
+	int shift = msb - 3;
+	size_t bucket = 16 + (size_t)(msb - 4) * 8 + (size_t)((us >> shift) - 8);
+	return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+/**
+ * @param  bucket バケット番号
+ * @return        バケットの上限値 [us]
+ */
+uint64_t GrovePi::LatencyHistogram::bucketValue(size_t bucket)
+{
+	if(bucket < 16)
+		return bucket;
+
+	size_t msb = (bucket - 16) / 8 + 4;
+	uint64_t mantissa = (bucket - 16) % 8 + 8;
+	return ((mantissa + 1) << (msb - 3)) - 1;
+}
+
+void GrovePi::LatencyHistogram::record(uint64_t us)
+{
+	++counts[bucketOf(us)];
+	++total;
+	if(us > max_us)
+		max_us = us;
+}
+
+/**
+ * @param  p percentile (0.0 - 1.0)
+ * @return   upper bound of the bucket holding that percentile [us]
+ */
+uint64_t GrovePi::LatencyHistogram::percentile(double p) const
+{
+	if(total == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(p * total + 0.5);
+	if(rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	for(size_t i = 0; i < BUCKETS; ++i)
+	{
+		seen += counts[i];
+		if(seen >= rank)
+		{
+			uint64_t value = bucketValue(i);
+			return value < max_us ? value : max_us;
+		}
+	}
+	return max_us;
+}
+
+/**
+ * print the counters as a table
+ * @param out where to print (e.g. stderr)
+ */
+void GrovePi::Stats::print(FILE *out) const
+{
+	if(!enabled)
+	{
+		fprintf(out, "[GrovePi] stats disabled (build with -DGROVEPI_STATS)\n");
+		return;
+	}
+
+	fprintf(out, "[GrovePi] %s: out %llu bytes / %llu writes (%llu us), in %llu bytes, "
+	             "waited %llu us, %llu timeouts\n",
+	        port.empty() ? "(not open)" : port.c_str(),
+	        (unsigned long long)bytes_out, (unsigned long long)writes, (unsigned long long)write_us,
+	        (unsigned long long)bytes_in, (unsigned long long)wait_us, (unsigned long long)timeouts);
+	fprintf(out, "  %-15s %10s %8s %8s %8s %8s %8s\n", "command", "count", "errors", "p50_us", "p90_us", "p99_us", "max_us");
+	for(size_t i = 0; i < commands.size(); ++i)
+	{
+		const CommandStats &c = commands[i];
+		if(c.count == 0 && c.errors == 0)
+			continue;
+		fprintf(out, "  %-15s %10llu %8llu %8llu %8llu %8llu %8llu\n", c.name,
+		        (unsigned long long)c.count, (unsigned long long)c.errors,
+		        (unsigned long long)c.latency.percentile(0.50), (unsigned long long)c.latency.percentile(0.90),
+		        (unsigned long long)c.latency.percentile(0.99), (unsigned long long)c.latency.max_us);
+	}
+}
+
+// シグナルハンドラからは pipe に書くだけにして、出力は専用スレッドで行う
+static int stats_pipe[2] = { -1, -1 };
+
+static void on_stats_signal(int)
+{
+	int saved = errno;
+	char c = 0;
+	if(write(stats_pipe[1], &c, 1) < 0)
+	{
+		// 書けなければ今回の出力は諦める
+	}
+	errno = saved;
+}
+
+static void stats_dump_main()
+{
+	char c;
+	while(read(stats_pipe[0], &c, 1) >= 0)
+	{
+		std::lock_guard<std::mutex> lk(devices_mutex);
+		for(std::set<GrovePi::DeviceState *>::iterator it = devices.begin(); it != devices.end(); ++it)
+		{
+			GrovePi::Stats st;
+			{
+				std::lock_guard<std::mutex> io((*it)->io_mutex);
+				st = snapshot_stats(**it);
+			}
+			st.print(stderr);
+		}
+	}
+}
+
+/**
+ * print the counters of every open device to stderr whenever the signal arrives
+ * (e.g. "kill -USR1 <pid>")
+ * @param signo signal number
+ */
+void GrovePi::dumpStatsOnSignal(int signo)
+{
+	static std::mutex install_mutex;
+	std::lock_guard<std::mutex> lk(install_mutex);
+
+	if(stats_pipe[0] < 0)
+	{
+		if(pipe(stats_pipe) != 0)
+			throw I2CError("[GrovePiError installing stats signal handler]\n");
+		fcntl(stats_pipe[1], F_SETFL, O_NONBLOCK);
+		std::thread(stats_dump_main).detach();
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_stats_signal;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if(sigaction(signo, &sa, NULL) != 0)
+		throw I2CError("[GrovePiError installing stats signal handler]\n");
+}
+
+/**
+ * the device used by the free functions (GrovePi::analogRead() etc.)
+ * @return the default device
+ */
+GrovePi::Device &GrovePi::defaultDevice()
+{
+	static Device device;
+	return device;
+}
+
+void GrovePi::initGrovePi()
+{
+	defaultDevice().open();
+}
+
+void GrovePi::setReadTimeout(int milliseconds)
+{
+	defaultDevice().setReadTimeout(milliseconds);
+}
+
+/**
+ * sleep raspberry
+ * @param milliseconds time
+ */
+void GrovePi::delay(unsigned int milliseconds)
+{
+	usleep(milliseconds * 1000);
+}
+
+GrovePi::Reply GrovePi::submit(const std::string &command, std::function<void(const std::string &)> callback)
+{
+	return defaultDevice().submit(command, callback);
+}
+
+void GrovePi::waitAll()
+{
+	defaultDevice().waitAll();
+}
+
+void GrovePi::setBinaryMode(bool enable)
+{
+	defaultDevice().setBinaryMode(enable);
+}
+
+bool GrovePi::binaryMode()
+{
+	return defaultDevice().binaryMode();
+}
+
+void GrovePi::setRequestTags(bool enable)
+{
+	defaultDevice().setRequestTags(enable);
+}
+
+bool GrovePi::requestTags()
+{
+	return defaultDevice().requestTags();
+}
+
+void GrovePi::setEventHandler(const std::string &name, EventHandler handler)
+{
+	defaultDevice().setEventHandler(name, handler);
+}
+
+void GrovePi::onConnectionChange(ConnectionHandler handler)
+{
+	defaultDevice().onConnectionChange(handler);
+}
+
+void GrovePi::startEventThread()
+{
+	defaultDevice().startEventThread();
+}
+
+void GrovePi::stopEventThread()
+{
+	defaultDevice().stopEventThread();
+}
+
+GrovePi::Stats GrovePi::getStats()
+{
+	return defaultDevice().getStats();
+}
+
+void GrovePi::resetStats()
+{
+	defaultDevice().resetStats();
+}
+
+// 応答行のパース関数 (error を例外に変換する)
+
+/**
+ * 応答 1 件 (バッチなら ";" で区切った 1 つ) をコピーせずに指す
+ */
+struct ReplyText
+{
+	const char *data;
+	size_t size;
+
+	ReplyText(const std::string &line) : data(line.data()), size(line.size()) {
+	}
+	ReplyText(const char *_data, size_t _size) : data(_data), size(_size) {
+	}
+
+	bool is_error() const {
+		return size == 5 && memcmp(data, "error", 5) == 0;
+	}
+};
+
+/**
+ * 応答の先頭の 10 進整数を読む (strtol と同じく、前の空白は読み飛ばし、数字が無ければ 0)
+ */
+static long parse_long(const ReplyText &resp)
+{
+	const char *p = resp.data;
+	const char *end = resp.data + resp.size;
+	while(p < end && *p == ' ')
+		++p;
+	bool negative = (p < end && *p == '-');
+	if(negative || (p < end && *p == '+'))
+		++p;
+
+	long value = 0;
+	for(; p < end && *p >= '0' && *p <= '9'; ++p)
+		value = value * 10 + (*p - '0');
+	return negative ? -value : value;
+}
+
+static void parse_pinMode(const ReplyText &resp)
+{
+	if(resp.is_error())
+		throw GrovePi::I2CError("[GrovePiError in pinMode]\n");
+}
+
+static void parse_digitalWrite(const ReplyText &resp)
+{
+	if(resp.is_error())
+		throw GrovePi::I2CError("[GrovePiError in digitalWrite]\n");
+}
+
+static bool parse_digitalRead(const ReplyText &resp)
+{
+	if(resp.is_error())
+		throw GrovePi::I2CError("[GrovePiError in digitalRead]\n");
+	return parse_long(resp) != 0;
+}
+
+static void parse_analogWrite(const ReplyText &resp)
+{
+	if(resp.is_error())
+		throw GrovePi::I2CError("[GrovePiError in analogWrite]\n");
+}
+
+static short parse_analogRead(const ReplyText &resp)
+{
+	if(resp.is_error())
+		throw GrovePi::I2CError("[GrovePiError in analogRead]\n");
+
+	long raw = parse_long(resp);
+	if(raw < 0)
+		return -1;
+
+	short scaled = (short)(raw >> 6);
+	return scaled;
+}
+
+static short parse_ultrasonicRead(const ReplyText &resp)
+{
+	if(resp.is_error())
+		return -1;
+
+	long dist = parse_long(resp);
+	if(dist < 0)
+		return -1;
+	return (short)dist;
+}
+
+static void parse_setText(const ReplyText &resp)
+{
+	if(resp.is_error())
+		throw GrovePi::I2CError("[GrovePiError in setText]\n");
+}
+
+static void parse_setRGB(const ReplyText &resp)
+{
+	if(resp.is_error())
+		throw GrovePi::I2CError("[GrovePiError in setRGB]\n");
+}
+
+static GrovePi::AnalogAverage parse_analogReadAvg(const ReplyText &resp, unsigned int samples, bool with_stddev)
+{
+	if(resp.is_error())
+		throw GrovePi::I2CError("[GrovePiError in analogReadAvg]\n");
+
+	// sscanf 用に終端付きでスタックへコピーする ("<mean> <min> <max> [<stddev>]" は十分短い)
+	char text[64];
+	size_t len = resp.size < sizeof(text) - 1 ? resp.size : sizeof(text) - 1;
+	memcpy(text, resp.data, len);
+	text[len] = '\0';
+
+	GrovePi::AnalogAverage avg;
+	unsigned int lo, hi;
+	avg.stddev = -1;
+	avg.samples = samples;
+	int n = sscanf(text, "%f %u %u %f", &avg.mean, &lo, &hi, &avg.stddev);
+	if(n < 3 || (with_stddev && n < 4))
+		throw GrovePi::I2CError("[GrovePiError parsing analogReadAvg response]\n");
+	avg.min = (uint16_t)lo;
+	avg.max = (uint16_t)hi;
+	return avg;
+}
+
+static GrovePi::DHTReading parse_dhtRead(const ReplyText &resp)
+{
+	if(resp.is_error())
+		throw GrovePi::I2CError("[GrovePiError in dhtRead]\n");
+
+	// sscanf 用に終端付きでスタックへコピーする ("<temp> <humidity> <age_ms>" は十分短い)
+	char text[64];
+	size_t len = resp.size < sizeof(text) - 1 ? resp.size : sizeof(text) - 1;
+	memcpy(text, resp.data, len);
+	text[len] = '\0';
+
+	// 古いファームウェアは経過時間を返さない
+	GrovePi::DHTReading reading;
+	int age_ms = -1;
+	if(sscanf(text, "%f %f %d", &reading.temp, &reading.humidity, &age_ms) < 2)
+		throw GrovePi::I2CError("[GrovePiError parsing dhtRead response]\n");
+	reading.age_ms = age_ms;
+	return reading;
+}
+
+// 応答のデコード関数 (テキスト行・バイナリフレームの両方に対応)
+
+/**
+ * バイナリ応答フレームを取り出し、状態を確認する
+ * @param  reply 応答のハンドル
+ * @param  len   必要な payload の長さ
+ * @param  error 失敗時の例外メッセージ
+ * @return       フレーム (テキスト応答なら NULL)
+ */
+static const GrovePi::Frame *checked_frame(const GrovePi::Reply &reply, size_t len, const char *error)
+{
+	const GrovePi::Frame *frame = reply.frame();
+	if(frame != NULL && (frame->status != FRAME_STATUS_OK || frame->length < len))
+		throw GrovePi::I2CError(error);
+	return frame;
+}
+
+static uint16_t frame_u16(const GrovePi::Frame &frame, size_t offset)
+{
+	return (uint16_t)(frame.payload[offset] | (frame.payload[offset + 1] << 8));
+}
+
+static void decode_pinMode(const GrovePi::Reply &reply)
+{
+	if(checked_frame(reply, 0, "[GrovePiError in pinMode]\n") == NULL)
+		parse_pinMode(reply.line());
+}
+
+static void decode_digitalWrite(const GrovePi::Reply &reply)
+{
+	if(checked_frame(reply, 0, "[GrovePiError in digitalWrite]\n") == NULL)
+		parse_digitalWrite(reply.line());
+}
+
+static bool decode_digitalRead(const GrovePi::Reply &reply)
+{
+	const GrovePi::Frame *frame = checked_frame(reply, 1, "[GrovePiError in digitalRead]\n");
+	if(frame != NULL)
+		return frame->payload[0] != 0;
+	return parse_digitalRead(reply.line());
+}
+
+static void decode_analogWrite(const GrovePi::Reply &reply)
+{
+	if(checked_frame(reply, 0, "[GrovePiError in analogWrite]\n") == NULL)
+		parse_analogWrite(reply.line());
+}
+
+static short decode_analogRead(const GrovePi::Reply &reply)
+{
+	const GrovePi::Frame *frame = checked_frame(reply, 2, "[GrovePiError in analogRead]\n");
+	if(frame != NULL)
+		return (short)(frame_u16(*frame, 0) >> 6);
+	return parse_analogRead(reply.line());
+}
+
+static short decode_ultrasonicRead(const GrovePi::Reply &reply)
+{
+	const GrovePi::Frame *frame = reply.frame();
+	if(frame == NULL)
+		return parse_ultrasonicRead(reply.line());
+	if(frame->status != FRAME_STATUS_OK || frame->length < 2)
+		return -1;
+	return (short)frame_u16(*frame, 0);
+}
+
+static void decode_setText(const GrovePi::Reply &reply)
+{
+	if(checked_frame(reply, 0, "[GrovePiError in setText]\n") == NULL)
+		parse_setText(reply.line());
+}
+
+static void decode_setRGB(const GrovePi::Reply &reply)
+{
+	if(checked_frame(reply, 0, "[GrovePiError in setRGB]\n") == NULL)
+		parse_setRGB(reply.line());
+}
+
+static GrovePi::DHTReading decode_dhtRead(const GrovePi::Reply &reply)
+{
+	const GrovePi::Frame *frame = checked_frame(reply, 4, "[GrovePiError in dhtRead]\n");
+	if(frame == NULL)
+		return parse_dhtRead(reply.line());
+
+	// 温度 (符号付き) と湿度を 0.1 単位の整数で、続いて計測からの経過時間 [ms] を受け取る
+	GrovePi::DHTReading reading;
+	reading.temp = (int16_t)frame_u16(*frame, 0) / 10.0f;
+	reading.humidity = frame_u16(*frame, 2) / 10.0f;
+	reading.age_ms = -1;
+	if(frame->length >= 8)
+		reading.age_ms = (int32_t)(frame_u16(*frame, 4) | ((uint32_t)frame_u16(*frame, 6) << 16));
+	return reading;
+}
+
+// コマンド行の組み立て (同期/パイプライン/バッチで共通)
+// 固定の形のものは COMMAND_BUF_SIZE バイトのバッファへ書き込み、長さを返す
+
+static size_t format_pinMode(char *buf, uint8_t pin, uint8_t mode)
+{
+	size_t n = put_uint(buf, put_text(buf, 0, "pinMode("), pin);
+	return (mode == GrovePi::INPUT) ? put_text(buf, n, ", INPUT)") : put_text(buf, n, ", OUTPUT)");
+}
+
+static size_t format_digitalWrite(char *buf, uint8_t pin, bool value)
+{
+	size_t n = put_uint(buf, put_text(buf, 0, "digitalWrite("), pin);
+	return value ? put_text(buf, n, ", HIGH)") : put_text(buf, n, ", LOW)");
+}
+
+static size_t format_digitalRead(char *buf, uint8_t pin)
+{
+	return put_text(buf, put_uint(buf, put_text(buf, 0, "digitalRead("), pin), ")");
+}
+
+static size_t format_analogWrite(char *buf, uint8_t pin, uint8_t value)
+{
+	size_t n = put_uint(buf, put_text(buf, 0, "analogWrite("), pin);
+	return put_text(buf, put_uint(buf, put_text(buf, n, ", "), value), ")");
+}
+
+static size_t format_analogRead(char *buf, uint8_t pin)
+{
+	return put_text(buf, put_uint(buf, put_text(buf, 0, "analogRead("), pin), ")");
+}
+
+static size_t format_ultrasonicRead(char *buf, uint8_t pin)
+{
+	return put_text(buf, put_uint(buf, put_text(buf, 0, "ultrasonicRead("), pin), ")");
+}
+
+/**
+ * LCD に表示するテキストを追加する (改行は空白にする)
+ * @param out  追加先
+ * @param text 表示文字列 (NULL なら空)
+ */
+static void append_lcd_text(std::string &out, const char *text)
+{
+	if(text == NULL)
+		return;
+
+	size_t start = out.size();
+	out += text;
+	for(size_t i = start; i < out.size(); ++i)
+	{
+		if(out[i] == '\r' || out[i] == '\n')
+			out[i] = ' ';
+	}
+}
+
+/**
+ * setText のコマンド行を追加する
+ * @param out  追加先 (確保済みの領域を使い回せるよう呼び出し側が持つ)
+ * @param bus  I2C バス番号
+ * @param text 表示文字列
+ */
+static void format_setText(std::string &out, uint8_t bus, const char *text)
+{
+	char header[COMMAND_BUF_SIZE];
+	size_t n = put_text(header, put_uint(header, put_text(header, 0, "setText("), bus), ", ");
+	out.append(header, n);
+	append_lcd_text(out, text);
+	out.push_back(')');
+}
+
+static size_t format_setRGB(char *buf, uint8_t bus, uint8_t r, uint8_t g, uint8_t b)
+{
+	size_t n = put_uint(buf, put_text(buf, 0, "setRGB("), bus);
+	n = put_uint(buf, put_text(buf, n, ", "), r);
+	n = put_uint(buf, put_text(buf, n, ", "), g);
+	n = put_uint(buf, put_text(buf, n, ", "), b);
+	return put_text(buf, n, ")");
+}
+
+static size_t format_dhtRead(char *buf, uint8_t pin, uint8_t module_type)
+{
+	size_t n = put_uint(buf, put_text(buf, 0, "dhtRead("), pin);
+	return put_text(buf, put_uint(buf, put_text(buf, n, ", "), module_type), ")");
+}
+
+/**
+ * base64 にして追加する (ledStripWrite のピクセル)
+ * @param out  追加先
+ * @param data バイト列
+ * @param len  data の長さ
+ */
+static void append_base64(std::string &out, const uint8_t *data, size_t len)
+{
+	static const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	out.reserve(out.size() + (len + 2) / 3 * 4 + 1);
+	for(size_t i = 0; i < len; i += 3)
+	{
+		uint32_t v = (uint32_t)data[i] << 16;
+		if(i + 1 < len)
+			v |= (uint32_t)data[i + 1] << 8;
+		if(i + 2 < len)
+			v |= data[i + 2];
+		out.push_back(BASE64[(v >> 18) & 0x3f]);
+		out.push_back(BASE64[(v >> 12) & 0x3f]);
+		out.push_back(i + 1 < len ? BASE64[(v >> 6) & 0x3f] : '=');
+		out.push_back(i + 2 < len ? BASE64[v & 0x3f] : '=');
+	}
+}
+
+/**
+ * バイナリフレームのコマンドを、同じ意味のテキストのコマンド行として記録する
+ * (記録したファイルは ASCII モードでも再生できる)
+ * @param op      オペコード
+ * @param pin     ピン番号 (LCD ならバス番号)
+ * @param payload payload
+ * @param len     payload の長さ
+ */
+static void trace_frame(uint8_t op, uint8_t pin, const uint8_t *payload, size_t len)
+{
+	if(trace_file().fp == NULL)
+		return;
+
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = 0;
+	switch(op)
+	{
+		case OP_PIN_MODE:
+			n = format_pinMode(buf, pin, payload[0] ? GrovePi::OUTPUT : GrovePi::INPUT);
+			break;
+		case OP_DIGITAL_WRITE:
+			n = format_digitalWrite(buf, pin, payload[0] != 0);
+			break;
+		case OP_DIGITAL_READ:
+			n = format_digitalRead(buf, pin);
+			break;
+		case OP_ANALOG_WRITE:
+			n = format_analogWrite(buf, pin, payload[0]);
+			break;
+		case OP_ANALOG_READ:
+			n = format_analogRead(buf, pin);
+			break;
+		case OP_ULTRASONIC_READ:
+			n = format_ultrasonicRead(buf, pin);
+			break;
+		case OP_SET_RGB:
+			n = format_setRGB(buf, pin, payload[0], payload[1], payload[2]);
+			break;
+		case OP_DHT_READ:
+			n = format_dhtRead(buf, pin, payload[0]);
+			break;
+		case OP_SNAPSHOT:
+			n = put_text(buf, put_uint(buf, put_text(buf, 0, "snapshot("), payload[0]), ")");
+			break;
+		case OP_SET_TEXT:
+		case OP_LED_STRIP_WRITE:
+		{
+			// payload は表示するテキスト (改行は置き換え済み) か RGB のピクセル
+			std::string cmd(op == OP_SET_TEXT ? "setText(" : "ledStripWrite(");
+			n = put_text(buf, put_uint(buf, 0, pin), ", ");
+			cmd.append(buf, n);
+			if(op == OP_SET_TEXT)
+				cmd.append((const char *)payload, len);
+			else
+				append_base64(cmd, payload, len);
+			cmd.push_back(')');
+			trace_command(cmd.data(), cmd.size());
+			return;
+		}
+		default:
+			return;
+	}
+	trace_command(buf, n);
+}
+
+/**
+ * 書き込みキャッシュのキーと値から出力のコマンドを作る
+ * @param  buf   出力先 (COMMAND_BUF_SIZE バイト)
+ * @param  key   キャッシュのキー
+ * @param  value キャッシュの値
+ * @return       コマンド行の長さ
+ */
+static size_t format_output(char *buf, int key, int32_t value)
+{
+	if(key >= CACHE_RGB_BASE)
+		return format_setRGB(buf, (uint8_t)(key - CACHE_RGB_BASE),
+		                     (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value);
+	if(value & CACHE_ANALOG)
+		return format_analogWrite(buf, (uint8_t)key, (uint8_t)value);
+	return format_digitalWrite(buf, (uint8_t)key, value != 0);
+}
+
+// 出力の書き込みキャッシュ
+
+enum
+{
+	WRITE_NOW,      // 送信する
+	WRITE_SKIPPED,  // Pico 側がすでにその値なので送らない
+	WRITE_DEFERRED  // write-behind: flushWrites() でまとめて送る
+};
+
+/**
+ * 出力の書き込みを記録し、送信が必要かを返す
+ * @param  key   キャッシュのキー
+ * @param  value 書き込む値
+ * @return       WRITE_NOW / WRITE_SKIPPED / WRITE_DEFERRED
+ */
+int GrovePi::DeviceState::cache_store(int key, int32_t value)
 {
-	if(serial_fd >= 0)
-		return serial_fd;
+	std::lock_guard<std::mutex> lk(cache_mutex);
+	if(!cache_enabled)
+		return WRITE_NOW;
 
-	const char *env_path = getenv("GROVEPI_SERIAL");
-	std::string mac_path;
-	std::string acm_path;
-	std::string usb_path;
+	if(cache_values[key] == value)
+		return cache_pending[key] ? WRITE_DEFERRED : WRITE_SKIPPED;
 
-	glob_t g_mac;
-	int ret_mac = glob("/dev/tty.usbmodem*", 0, NULL, &g_mac);
-	if(ret_mac == 0)
+	cache_values[key] = value;
+	if(!write_behind)
+		return WRITE_NOW;
+
+	if(!cache_pending[key])
+	{
+		cache_pending[key] = true;
+		pending_writes.push_back((uint16_t)key);
+	}
+	return WRITE_DEFERRED;
+}
+
+/**
+ * キャッシュしている値を捨てる (未送信の書き込みも取り消す)
+ * @param  key キャッシュのキー
+ * @return     未送信の書き込みがあったか
+ */
+bool GrovePi::DeviceState::cache_forget(int key)
+{
+	std::lock_guard<std::mutex> lk(cache_mutex);
+	bool pending = cache_pending[key];
+	cache_values[key] = CACHE_UNKNOWN;
+	cache_pending[key] = false;
+	return pending;
+}
+
+/**
+ * Pico 側の出力が分からなくなったときに、送信済みの値をすべて捨てる
+ * 未送信の書き込みは次の flushWrites() で送るので残す
+ */
+void GrovePi::DeviceState::cache_forget_all()
+{
+	std::lock_guard<std::mutex> lk(cache_mutex);
+	for(int key = 0; key < CACHE_KEYS; ++key)
+	{
+		if(!cache_pending[key])
+			cache_values[key] = CACHE_UNKNOWN;
+	}
+}
+
+/**
+ * 再接続したときに復元するピンのモードを記録する (それまでの出力値は捨てる)
+ */
+void GrovePi::DeviceState::remember_mode(uint8_t pin, uint8_t mode)
+{
+	std::lock_guard<std::mutex> lk(cache_mutex);
+	restore_modes[pin] = (int8_t)(mode == INPUT ? INPUT : OUTPUT);
+	restore_outputs[pin] = CACHE_UNKNOWN;
+	// Pico 側でも pinMode でそのピンのバックグラウンド処理が止まる
+	restore_setups[pin].clear();
+}
+
+/**
+ * 再接続したときに復元する出力値を記録する
+ * @param key   キャッシュのキー
+ * @param value キャッシュの値
+ */
+void GrovePi::DeviceState::remember_output(int key, int32_t value)
+{
+	std::lock_guard<std::mutex> lk(cache_mutex);
+	restore_outputs[key] = value;
+	if(key < CACHE_RGB_BASE)
+		restore_setups[key].clear();
+}
+
+/**
+ * 再接続したときに送り直す、ピンのバックグラウンド処理の開始コマンドを記録する
+ * @param pin     ピン番号
+ * @param command 開始コマンド (空ならそのピンでは何も送り直さない)
+ */
+void GrovePi::DeviceState::remember_setup(uint8_t pin, const std::string &command)
+{
+	std::lock_guard<std::mutex> lk(cache_mutex);
+	restore_setups[pin] = command;
+}
+
+/**
+ * 記録した pinMode と出力値を復元し、バックグラウンド処理を開始し直すバッチを作る
+ * @return ";" 区切りのコマンド行 (復元するものが無ければ空文字列)
+ */
+std::string GrovePi::DeviceState::restore_line()
+{
+	std::lock_guard<std::mutex> lk(cache_mutex);
+	std::string line;
+	char buf[COMMAND_BUF_SIZE];
+	for(int pin = 0; pin < 256; ++pin)
+	{
+		if(restore_modes[pin] < 0)
+			continue;
+		size_t n = format_pinMode(buf, (uint8_t)pin, (uint8_t)restore_modes[pin]);
+		if(!line.empty())
+			line += "; ";
+		line.append(buf, n);
+	}
+	for(int key = 0; key < CACHE_KEYS; ++key)
+	{
+		if(restore_outputs[key] == CACHE_UNKNOWN)
+			continue;
+		size_t n = format_output(buf, key, restore_outputs[key]);
+		if(!line.empty())
+			line += "; ";
+		line.append(buf, n);
+	}
+	for(int pin = 0; pin < 256; ++pin)
+	{
+		if(restore_setups[pin].empty())
+			continue;
+		if(!line.empty())
+			line += "; ";
+		line += restore_setups[pin];
+	}
+	return line;
+}
+
+/**
+ * 送信しなかった書き込みの応答として、成功済みのハンドルを作る
+ */
+static GrovePi::Reply completed_reply(const std::shared_ptr<GrovePi::DeviceState> &state)
+{
+	// 書き換えられることのない共有の slot を返す
+	return GrovePi::Reply(state, state->completed_slot);
+}
+
+/**
+ * 書き込みキャッシュの値を出力コマンドとして送る
+ * @param  state 送信先の接続
+ * @param  key   キャッシュのキー
+ * @param  value 書き込む値
+ * @return       応答のハンドル
+ */
+static GrovePi::Future<void> send_output(const std::shared_ptr<GrovePi::DeviceState> &state, int key, int32_t value)
+{
+	using namespace GrovePi;
+
+	char buf[COMMAND_BUF_SIZE];
+	if(key >= CACHE_RGB_BASE)
+	{
+		uint8_t bus = (uint8_t)(key - CACHE_RGB_BASE);
+		uint8_t payload[3] = { (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value };
+		if(state->binary_mode)
+			return Future<void>(submit_frame(state, OP_SET_RGB, bus, payload, sizeof(payload), key), decode_setRGB);
+
+		size_t n = format_setRGB(buf, bus, payload[0], payload[1], payload[2]);
+		return Future<void>(submit_text(state, CMD_SET_RGB, buf, n, nullptr, key), decode_setRGB);
+	}
+
+	uint8_t pin = (uint8_t)key;
+	uint8_t payload = (uint8_t)value;
+	if(value & CACHE_ANALOG)
+	{
+		if(state->binary_mode)
+			return Future<void>(submit_frame(state, OP_ANALOG_WRITE, pin, &payload, 1, key), decode_analogWrite);
+
+		size_t n = format_analogWrite(buf, pin, payload);
+		return Future<void>(submit_text(state, CMD_ANALOG_WRITE, buf, n, nullptr, key), decode_analogWrite);
+	}
+
+	if(state->binary_mode)
+		return Future<void>(submit_frame(state, OP_DIGITAL_WRITE, pin, &payload, 1, key), decode_digitalWrite);
+
+	size_t n = format_digitalWrite(buf, pin, payload != 0);
+	return Future<void>(submit_text(state, CMD_DIGITAL_WRITE, buf, n, nullptr, key), decode_digitalWrite);
+}
+
+/**
+ * 出力コマンドをキャッシュに通してから送る
+ * @param  state 送信先の接続
+ * @param  key   キャッシュのキー
+ * @param  value 書き込む値
+ * @param  decode 送らなかった場合に返すハンドルのデコード関数
+ * @return       応答のハンドル
+ */
+static GrovePi::Future<void> write_output(const std::shared_ptr<GrovePi::DeviceState> &state, int key, int32_t value,
+                                          GrovePi::Future<void>::Decoder decode)
+{
+	state->remember_output(key, value);
+	if(state->cache_store(key, value) != WRITE_NOW)
+		return GrovePi::Future<void>(completed_reply(state), decode);
+	return send_output(state, key, value);
+}
+
+/**
+ * write-behind で溜まっている書き込みをすべて送る
+ * ASCII モードでは 1 行のバッチ、バイナリモードでは連続したフレームになる
+ * 失敗した書き込みはキャッシュから消し、最初のエラーを投げる
+ * @param state 送信先の接続
+ */
+static void flush_writes(const std::shared_ptr<GrovePi::DeviceState> &state)
+{
+	using namespace GrovePi;
+
+	std::vector<std::pair<int, int32_t> > writes;
+	{
+		DeviceState &s = *state;
+		std::lock_guard<std::mutex> lk(s.cache_mutex);
+		for(size_t i = 0; i < s.pending_writes.size(); ++i)
+		{
+			int key = s.pending_writes[i];
+			if(!s.cache_pending[key])
+				continue;
+			s.cache_pending[key] = false;
+			writes.push_back(std::make_pair(key, s.cache_values[key]));
+		}
+		s.pending_writes.clear();
+	}
+	if(writes.empty())
+		return;
+
+	if(state->binary_mode || writes.size() == 1)
+	{
+		std::vector<Future<void> > replies;
+		for(size_t i = 0; i < writes.size(); ++i)
+			replies.push_back(send_output(state, writes[i].first, writes[i].second));
+
+		bool failed = false;
+		std::string first_error;
+		for(size_t i = 0; i < replies.size(); ++i)
+		{
+			try
+			{
+				replies[i].get();
+			}
+			catch(I2CError &error)
+			{
+				if(!failed)
+					first_error = error.what();
+				failed = true;
+			}
+		}
+		if(failed)
+			throw I2CError(first_error.c_str());
+		return;
+	}
+
+	std::string line;
+	for(size_t i = 0; i < writes.size(); ++i)
+	{
+		char buf[COMMAND_BUF_SIZE];
+		size_t n = format_output(buf, writes[i].first, writes[i].second);
+		if(i > 0)
+			line += "; ";
+		line.append(buf, n);
+	}
+
+	Reply reply;
+	try
+	{
+		reply = submit_text(state, CMD_BATCH, line);
+		reply.line();
+	}
+	catch(I2CError &)
+	{
+		for(size_t i = 0; i < writes.size(); ++i)
+			state->cache_forget(writes[i].first);
+		throw;
+	}
+	const std::string &resp = reply.line();
+
+	// 応答は書き込みと同じ数の ";" 区切りで、成功なら空、失敗なら "error"
+	bool failed = false;
+	size_t start = 0;
+	for(size_t i = 0; i < writes.size(); ++i)
+	{
+		size_t end = resp.find(';', start);
+		ReplyText part(resp.data() + start, (end == std::string::npos ? resp.size() : end) - start);
+		if(part.is_error() || (end == std::string::npos && i + 1 < writes.size()))
+		{
+			state->cache_forget(writes[i].first);
+			failed = true;
+		}
+		start = (end == std::string::npos) ? resp.size() : end + 1;
+	}
+	if(failed)
+		throw I2CError("[GrovePiError in flushWrites]\n");
+}
+
+/**
+ * ピンを読み取り・モード変更に使う前に、そのピンのキャッシュを捨てる
+ * 未送信の書き込みがあれば、コマンドの順番を保つために先に送る
+ * @param state 送信先の接続
+ * @param pin   ピン番号
+ */
+static void touch_pin(const std::shared_ptr<GrovePi::DeviceState> &state, uint8_t pin)
+{
+	if(!state->cache_enabled)
+		return;
+
+	bool pending;
+	{
+		std::lock_guard<std::mutex> lk(state->cache_mutex);
+		pending = state->cache_pending[pin];
+	}
+	if(pending)
+		flush_writes(state);
+	state->cache_forget(pin);
+}
+
+/**
+ * remember the outputs written by digitalWrite(), analogWrite() and setRGB()
+ * and skip writes that would not change anything
+ * the cache forgets a pin on pinMode() or when the pin is read,
+ * and everything after a lost reply or reconnect
+ * @param enable true to cache outputs, false to write every call through
+ */
+void GrovePi::Device::setWriteCache(bool enable)
+{
+	if(!enable)
+		flush_writes(state);
+
+	std::lock_guard<std::mutex> lk(state->cache_mutex);
+	state->cache_enabled = enable;
+	if(!enable)
+	{
+		state->write_behind = false;
+		for(int key = 0; key < CACHE_KEYS; ++key)
+			state->cache_values[key] = CACHE_UNKNOWN;
+	}
+}
+
+/**
+ * write-behind mode: digitalWrite(), analogWrite() and setRGB() only update
+ * the cache and return at once, flushWrites() sends the changed outputs
+ * as one batch (several changes of the same output are sent once)
+ * enables the write cache, disabling it sends the pending writes
+ * @param enable true to defer the writes until flushWrites()
+ */
+void GrovePi::Device::setWriteBehind(bool enable)
+{
+	if(!enable)
+		flush_writes(state);
+
+	std::lock_guard<std::mutex> lk(state->cache_mutex);
+	if(enable)
+		state->cache_enabled = true;
+	state->write_behind = enable;
+}
+
+/**
+ * send the writes deferred by the write-behind mode and wait for their replies
+ * call it once per control loop tick
+ */
+void GrovePi::Device::flushWrites()
+{
+	flush_writes(state);
+}
+
+void GrovePi::setWriteCache(bool enable)
+{
+	defaultDevice().setWriteCache(enable);
+}
+
+void GrovePi::setWriteBehind(bool enable)
+{
+	defaultDevice().setWriteBehind(enable);
+}
+
+void GrovePi::flushWrites()
+{
+	defaultDevice().flushWrites();
+}
+
+GrovePi::Future<void> GrovePi::Device::pinModeAsync(uint8_t pin, uint8_t mode)
+{
+	touch_pin(state, pin);
+	state->remember_mode(pin, mode);
+	if(state->binary_mode)
+	{
+		uint8_t payload = (mode == INPUT) ? 0 : 1;
+		return Future<void>(submit_frame(state, OP_PIN_MODE, pin, &payload, 1), decode_pinMode);
+	}
+
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_pinMode(buf, pin, mode);
+	return Future<void>(submit_text(state, CMD_PIN_MODE, buf, n), decode_pinMode);
+}
+
+GrovePi::Future<void> GrovePi::Device::digitalWriteAsync(uint8_t pin, bool value)
+{
+	return write_output(state, pin, value ? 1 : 0, decode_digitalWrite);
+}
+
+GrovePi::Future<bool> GrovePi::Device::digitalReadAsync(uint8_t pin)
+{
+	touch_pin(state, pin);
+	if(state->binary_mode)
+		return Future<bool>(submit_frame(state, OP_DIGITAL_READ, pin, NULL, 0), decode_digitalRead);
+
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_digitalRead(buf, pin);
+	return Future<bool>(submit_text(state, CMD_DIGITAL_READ, buf, n), decode_digitalRead);
+}
+
+GrovePi::Future<void> GrovePi::Device::analogWriteAsync(uint8_t pin, uint8_t value)
+{
+	return write_output(state, pin, CACHE_ANALOG | value, decode_analogWrite);
+}
+
+GrovePi::Future<short> GrovePi::Device::analogReadAsync(uint8_t pin)
+{
+	touch_pin(state, pin);
+	if(state->binary_mode)
+		return Future<short>(submit_frame(state, OP_ANALOG_READ, pin, NULL, 0), decode_analogRead);
+
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_analogRead(buf, pin);
+	return Future<short>(submit_text(state, CMD_ANALOG_READ, buf, n), decode_analogRead);
+}
+
+GrovePi::Future<short> GrovePi::Device::ultrasonicReadAsync(uint8_t pin)
+{
+	touch_pin(state, pin);
+	if(state->binary_mode)
+		return Future<short>(submit_frame(state, OP_ULTRASONIC_READ, pin, NULL, 0), decode_ultrasonicRead);
+
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_ultrasonicRead(buf, pin);
+	return Future<short>(submit_text(state, CMD_ULTRASONIC_READ, buf, n), decode_ultrasonicRead);
+}
+
+GrovePi::Future<void> GrovePi::Device::setTextAsync(uint8_t bus, const char *text)
+{
+	// 組み立て用の文字列はスレッドごとに使い回し、呼び出しのたびに確保しない
+	static thread_local std::string cmd;
+	cmd.clear();
+	if(state->binary_mode)
+	{
+		// 表示するテキストをそのまま payload にする
+		append_lcd_text(cmd, text);
+		return Future<void>(submit_frame(state, OP_SET_TEXT, bus, (const uint8_t *)cmd.data(), cmd.size()),
+		                    decode_setText);
+	}
+
+	format_setText(cmd, bus, text);
+	return Future<void>(submit_text(state, CMD_SET_TEXT, cmd.data(), cmd.size()), decode_setText);
+}
+
+GrovePi::Future<void> GrovePi::Device::setRGBAsync(uint8_t bus, uint8_t r, uint8_t g, uint8_t b)
+{
+	int32_t rgb = ((int32_t)r << 16) | ((int32_t)g << 8) | b;
+	return write_output(state, CACHE_RGB_BASE + bus, rgb, decode_setRGB);
+}
+
+GrovePi::Future<GrovePi::DHTReading> GrovePi::Device::dhtReadAsync(uint8_t pin, uint8_t module_type)
+{
+	touch_pin(state, pin);
+	if(state->binary_mode)
+		return Future<DHTReading>(submit_frame(state, OP_DHT_READ, pin, &module_type, 1), decode_dhtRead);
+
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_dhtRead(buf, pin, module_type);
+	return Future<DHTReading>(submit_text(state, CMD_DHT_READ, buf, n), decode_dhtRead);
+}
+
+/**
+ * snapshot の応答 "<mask> <t_us> <値...>" (値は mask のビット順) をパースする
+ */
+static GrovePi::Snapshot parse_snapshot(const std::string &resp)
+{
+	if(resp == "error")
+		throw GrovePi::I2CError("[GrovePiError in snapshot]\n");
+
+	GrovePi::Snapshot snap;
+	memset(&snap, 0, sizeof(snap));
+
+	const char *p = resp.c_str();
+	char *end;
+	snap.mask = (uint8_t)strtoul(p, &end, 10);
+	p = end;
+	snap.pico_us = (uint32_t)strtoul(p, &end, 10);
+	if(end == p)
+		throw GrovePi::I2CError("[GrovePiError parsing snapshot response]\n");
+	for(int bit = 0; bit < 6; ++bit)
+	{
+		if(!(snap.mask & (1 << bit)))
+			continue;
+		p = end;
+		unsigned long v = strtoul(p, &end, 10);
+		if(end == p)
+			throw GrovePi::I2CError("[GrovePiError parsing snapshot response]\n");
+		if(bit < 3)
+			snap.analog[bit] = (uint16_t)v;
+		else
+			snap.digital[bit - 3] = v != 0;
+	}
+	return snap;
+}
+
+/**
+ * バイナリの応答は u8 mask, u32 時刻, u8 デジタルのレベル (mask と同じビット位置),
+ * 読んだアナログピンごとに u16
+ */
+static GrovePi::Snapshot decode_snapshot(const GrovePi::Reply &reply)
+{
+	const GrovePi::Frame *frame = checked_frame(reply, 6, "[GrovePiError in snapshot]\n");
+	if(frame == NULL)
+		return parse_snapshot(reply.line());
+
+	GrovePi::Snapshot snap;
+	memset(&snap, 0, sizeof(snap));
+	snap.mask = frame->payload[0];
+	snap.pico_us = (uint32_t)frame_u16(*frame, 1) | ((uint32_t)frame_u16(*frame, 3) << 16);
+	for(int i = 0; i < 3; ++i)
+		snap.digital[i] = (frame->payload[5] >> (3 + i)) & 1;
+	size_t offset = 6;
+	for(int i = 0; i < 3; ++i)
+	{
+		if(!(snap.mask & (1 << i)))
+			continue;
+		if(offset + 2 > frame->length)
+			throw GrovePi::I2CError("[GrovePiError parsing snapshot response]\n");
+		snap.analog[i] = frame_u16(*frame, offset);
+		offset += 2;
+	}
+	return snap;
+}
+
+/**
+ * value of an analog pin in the snapshot
+ * @param  pin analog pin number (0/1/2), which must be in the mask
+ * @return     read_u16() value (0-65535)
+ */
+uint16_t GrovePi::Snapshot::analogValue(uint8_t pin) const
+{
+	if(pin > 2 || !has((uint8_t)(SNAPSHOT_A0 << pin)))
+		throw I2CError("[GrovePiError in Snapshot::analogValue: pin not in the snapshot]\n");
+	return analog[pin];
+}
+
+/**
+ * level of a digital pin in the snapshot
+ * @param  pin digital pin number (16/18/20), which must be in the mask
+ * @return     level of the pin
+ */
+bool GrovePi::Snapshot::digitalValue(uint8_t pin) const
+{
+	if((pin != 16 && pin != 18 && pin != 20) || !has((uint8_t)(SNAPSHOT_D16 << ((pin - 16) / 2))))
+		throw I2CError("[GrovePiError in Snapshot::digitalValue: pin not in the snapshot]\n");
+	return digital[(pin - 16) / 2];
+}
+
+/**
+ * read several inputs back-to-back on the Pico in one round trip
+ * the pins are not reconfigured, so digital outputs report the level they drive
+ * @param  mask pins to read (SNAPSHOT_A0 ... SNAPSHOT_D20, SNAPSHOT_ALL)
+ * @return      future of the values and the Pico timestamp of the first sample
+ */
+GrovePi::Future<GrovePi::Snapshot> GrovePi::Device::snapshotAsync(uint8_t mask)
+{
+	if(mask == 0 || (mask & ~SNAPSHOT_ALL))
+		throw I2CError("[GrovePiError in snapshot: bad pin mask]\n");
+
+	// 読み取るデジタルピンに溜まっている書き込みは先に送る (ピンの設定は変わらないのでキャッシュは残す)
+	if(state->cache_enabled)
 	{
-		if(g_mac.gl_pathc > 0)
-			mac_path = g_mac.gl_pathv[0];
-		globfree(&g_mac);
+		static const uint8_t DIGITAL[3] = { 16, 18, 20 };
+		bool pending = false;
+		{
+			std::lock_guard<std::mutex> lk(state->cache_mutex);
+			for(int i = 0; i < 3; ++i)
+				if(mask & (SNAPSHOT_D16 << i))
+					pending = pending || state->cache_pending[DIGITAL[i]];
+		}
+		if(pending)
+			flush_writes(state);
 	}
 
-	glob_t g_acm;
-	int ret_acm = glob("/dev/ttyACM*", 0, NULL, &g_acm);
-	if(ret_acm == 0)
-	{
-		if(g_acm.gl_pathc > 0)
-			acm_path = g_acm.gl_pathv[0];
-		globfree(&g_acm);
-	}
+	if(state->binary_mode)
+		return Future<Snapshot>(submit_frame(state, OP_SNAPSHOT, 0, &mask, 1), decode_snapshot);
+
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = put_text(buf, put_uint(buf, put_text(buf, 0, "snapshot("), mask), ")");
+	return Future<Snapshot>(submit_text(state, CMD_OTHER, buf, n), decode_snapshot);
+}
+
+static void decode_ledStripWrite(const GrovePi::Reply &reply)
+{
+	if(checked_frame(reply, 0, "[GrovePiError in ledStripWrite]\n") == NULL && reply.line() == "error")
+		throw GrovePi::I2CError("[GrovePiError in ledStripWrite]\n");
+}
+
+/**
+ * send one frame to the WS2812 strip set up on the pin (see LedStrip)
+ * in binary mode the pixels go out as they are, otherwise base64 encoded
+ * @param  pin  number given to ledStripInit
+ * @param  rgb  [leds] pixels as R, G, B bytes
+ * @param  leds number of pixels (up to 341)
+ * @return      future that throws if the Pico rejected the frame
+ */
+GrovePi::Future<void> GrovePi::Device::ledStripWriteAsync(uint8_t pin, const uint8_t *rgb, size_t leds)
+{
+	size_t len = leds * 3;
+	if(len > FRAME_MAX_PAYLOAD)
+		throw I2CError("[GrovePiError in ledStripWrite: up to 341 LEDs]\n");
+
+	if(state->binary_mode)
+		return Future<void>(submit_frame(state, OP_LED_STRIP_WRITE, pin, rgb, len), decode_ledStripWrite);
+
+	// 組み立て用の文字列はスレッドごとに使い回す (setText と同じ)
+	static thread_local std::string cmd;
+	char header[COMMAND_BUF_SIZE];
+	size_t n = put_text(header, put_uint(header, put_text(header, 0, "ledStripWrite("), pin), ", ");
+	cmd.assign(header, n);
+	append_base64(cmd, rgb, len);
+	cmd.push_back(')');
+	return Future<void>(submit_text(state, CMD_OTHER, cmd.data(), cmd.size()), decode_ledStripWrite);
+}
+
+GrovePi::Future<void> GrovePi::pinModeAsync(uint8_t pin, uint8_t mode)
+{
+	return defaultDevice().pinModeAsync(pin, mode);
+}
+
+GrovePi::Future<void> GrovePi::digitalWriteAsync(uint8_t pin, bool value)
+{
+	return defaultDevice().digitalWriteAsync(pin, value);
+}
+
+GrovePi::Future<bool> GrovePi::digitalReadAsync(uint8_t pin)
+{
+	return defaultDevice().digitalReadAsync(pin);
+}
+
+GrovePi::Future<void> GrovePi::analogWriteAsync(uint8_t pin, uint8_t value)
+{
+	return defaultDevice().analogWriteAsync(pin, value);
+}
+
+GrovePi::Future<short> GrovePi::analogReadAsync(uint8_t pin)
+{
+	return defaultDevice().analogReadAsync(pin);
+}
+
+GrovePi::Future<short> GrovePi::ultrasonicReadAsync(uint8_t pin)
+{
+	return defaultDevice().ultrasonicReadAsync(pin);
+}
+
+GrovePi::Future<void> GrovePi::setTextAsync(uint8_t bus, const char *text)
+{
+	return defaultDevice().setTextAsync(bus, text);
+}
+
+GrovePi::Future<void> GrovePi::setRGBAsync(uint8_t bus, uint8_t r, uint8_t g, uint8_t b)
+{
+	return defaultDevice().setRGBAsync(bus, r, g, b);
+}
+
+GrovePi::Future<GrovePi::DHTReading> GrovePi::dhtReadAsync(uint8_t pin, uint8_t module_type)
+{
+	return defaultDevice().dhtReadAsync(pin, module_type);
+}
+
+GrovePi::Future<GrovePi::Snapshot> GrovePi::snapshotAsync(uint8_t mask)
+{
+	return defaultDevice().snapshotAsync(mask);
+}
 
-	glob_t g_usb;
-	int ret_usb = glob("/dev/ttyUSB*", 0, NULL, &g_usb);
-	if(ret_usb == 0)
-	{
-		if(g_usb.gl_pathc > 0)
-			usb_path = g_usb.gl_pathv[0];
-		globfree(&g_usb);
-	}
+/**
+ * バッチにコマンドを 1 件追加する
+ * @param command コマンド文字列
+ * @param len     コマンド文字列の長さ
+ * @param entry   応答の書き戻し先
+ */
+void GrovePi::Batch::append(const char *command, size_t len, const Entry &entry)
+{
+	if(!entries.empty())
+		line += "; ";
+	line.append(command, len);
+	entries.push_back(entry);
+}
 
-	const char *candidates[] = {
-	    env_path,
-	    mac_path.empty() ? NULL : mac_path.c_str(),
-	    acm_path.empty() ? NULL : acm_path.c_str(),
-	    usb_path.empty() ? NULL : usb_path.c_str(),
-	};
+GrovePi::Batch &GrovePi::Batch::pinMode(uint8_t pin, uint8_t mode)
+{
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_pinMode(buf, pin, mode);
+	device->state->remember_mode(pin, mode);
+	append(buf, n, Entry(Entry::PIN_MODE));
+	return *this;
+}
 
-	for(size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); ++i)
-	{
-		const char *path = candidates[i];
-		if(path == NULL || path[0] == '\0')
-			continue;
+GrovePi::Batch &GrovePi::Batch::digitalWrite(uint8_t pin, bool value)
+{
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_digitalWrite(buf, pin, value);
+	device->state->remember_output(pin, value ? 1 : 0);
+	append(buf, n, Entry(Entry::DIGITAL_WRITE));
+	return *this;
+}
 
-		int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
-		if(fd < 0)
-			continue;
+GrovePi::Batch &GrovePi::Batch::digitalRead(uint8_t pin, bool &value)
+{
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_digitalRead(buf, pin);
+	Entry e(Entry::DIGITAL_READ);
+	e.flag = &value;
+	append(buf, n, e);
+	return *this;
+}
 
-		struct termios tio;
-		if(tcgetattr(fd, &tio) != 0)
-		{
-			close(fd);
-			continue;
-		}
+GrovePi::Batch &GrovePi::Batch::analogWrite(uint8_t pin, uint8_t value)
+{
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_analogWrite(buf, pin, value);
+	device->state->remember_output(pin, CACHE_ANALOG | value);
+	append(buf, n, Entry(Entry::ANALOG_WRITE));
+	return *this;
+}
 
-		cfmakeraw(&tio);
-		cfsetispeed(&tio, B115200);
-		cfsetospeed(&tio, B115200);
-		tio.c_cflag |= (CLOCAL | CREAD);
-		tio.c_cflag &= ~CRTSCTS;
+GrovePi::Batch &GrovePi::Batch::analogRead(uint8_t pin, short &value)
+{
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_analogRead(buf, pin);
+	Entry e(Entry::ANALOG_READ);
+	e.number = &value;
+	append(buf, n, e);
+	return *this;
+}
 
-		if(tcsetattr(fd, TCSANOW, &tio) != 0)
-		{
-			close(fd);
-			continue;
-		}
+GrovePi::Batch &GrovePi::Batch::ultrasonicRead(uint8_t pin, short &value)
+{
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_ultrasonicRead(buf, pin);
+	Entry e(Entry::ULTRASONIC_READ);
+	e.number = &value;
+	append(buf, n, e);
+	return *this;
+}
 
-		serial_fd = fd;
-		if(DEBUG)
-			fprintf(stderr, "[GrovePi] opened serial at %s\n", path);
-		break;
-	}
+GrovePi::Batch &GrovePi::Batch::setText(uint8_t bus, const char *text)
+{
+	if(!entries.empty())
+		line += "; ";
+	format_setText(line, bus, text);
+	entries.push_back(Entry(Entry::SET_TEXT));
+	return *this;
+}
 
-	if(serial_fd < 0)
-		throw GrovePi::I2CError("[GrovePiError opening serial device]\n");
+GrovePi::Batch &GrovePi::Batch::setRGB(uint8_t bus, uint8_t r, uint8_t g, uint8_t b)
+{
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_setRGB(buf, bus, r, g, b);
+	device->state->remember_output(CACHE_RGB_BASE + bus, ((int32_t)r << 16) | ((int32_t)g << 8) | b);
+	append(buf, n, Entry(Entry::SET_RGB));
+	return *this;
+}
 
-	return serial_fd;
+GrovePi::Batch &GrovePi::Batch::dhtRead(uint8_t pin, uint8_t module_type, float &temp, float &humidity)
+{
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = format_dhtRead(buf, pin, module_type);
+	Entry e(Entry::DHT_READ);
+	e.temp = &temp;
+	e.humidity = &humidity;
+	append(buf, n, e);
+	return *this;
 }
 
-static void serial_write_line(const std::string &line)
+void GrovePi::Batch::clear()
 {
-	int fd = open_serial_port();
-	std::string data = line;
-	data.push_back('\n');
+	line.clear();
+	entries.clear();
+}
 
-	const char *buf = data.c_str();
-	ssize_t total = 0;
-	ssize_t len = (ssize_t)data.size();
+/**
+ * 応答 1 件を対応する出力先へ書き戻す
+ * @param entry 書き戻し先
+ * @param resp  応答文字列
+ */
+static void scatter(const GrovePi::Batch::Entry &entry, const ReplyText &resp)
+{
+	typedef GrovePi::Batch::Entry Entry;
 
-	while(total < len)
+	switch(entry.kind)
 	{
-		ssize_t w = write(fd, buf + total, len - total);
-		if(w < 0)
+		case Entry::PIN_MODE:
+			parse_pinMode(resp);
+			break;
+		case Entry::DIGITAL_WRITE:
+			parse_digitalWrite(resp);
+			break;
+		case Entry::DIGITAL_READ:
+			*entry.flag = parse_digitalRead(resp);
+			break;
+		case Entry::ANALOG_WRITE:
+			parse_analogWrite(resp);
+			break;
+		case Entry::ANALOG_READ:
+			*entry.number = parse_analogRead(resp);
+			break;
+		case Entry::ULTRASONIC_READ:
+			*entry.number = parse_ultrasonicRead(resp);
+			break;
+		case Entry::SET_TEXT:
+			parse_setText(resp);
+			break;
+		case Entry::SET_RGB:
+			parse_setRGB(resp);
+			break;
+		case Entry::DHT_READ:
 		{
-			if(errno == EINTR)
-				continue;
-			throw GrovePi::I2CError("[GrovePiError writing to serial]\n");
+			GrovePi::DHTReading reading = parse_dhtRead(resp);
+			*entry.temp = reading.temp;
+			*entry.humidity = reading.humidity;
+			break;
 		}
-		total += w;
 	}
 }
 
-static std::string serial_read_line()
+/**
+ * send every queued command as one line and scatter the results
+ * into the outputs given when they were queued
+ * the batch is empty afterwards and can be reused
+ * if some of the commands fail, the others are still written back
+ * and the first error is thrown
+ */
+void GrovePi::Batch::flush()
 {
-	int fd = open_serial_port();
-	std::string line;
-	char ch;
-	int empty_loops = 0;
+	if(entries.empty())
+		return;
 
-	while(true)
+	// 失敗しても空になるよう、抜けるときに消す (line と entries の確保済み領域は次回も使う)
+	struct Reset
+	{
+		Batch &batch;
+		~Reset() { batch.clear(); }
+	} reset = { *this };
+
+	// バッチの中身は書き込みキャッシュを通らないので、先に溜まった書き込みを送ってから使い直す
+	if(device->state->cache_enabled)
+	{
+		flush_writes(device->state);
+		device->state->cache_forget_all();
+	}
+
+	Reply reply = submit_text(device->state, CMD_BATCH, line);
+	const std::string &resp = reply.line();
+
+	// 応答は ";" 区切りでコマンドと同じ数だけ並ぶ
+	if((size_t)std::count(resp.begin(), resp.end(), ';') + 1 != entries.size())
+		throw I2CError("[GrovePiError parsing batch response]\n");
+
+	bool failed = false;
+	std::string first_error;
+	size_t start = 0;
+	for(size_t i = 0; i < entries.size(); ++i)
 	{
-		ssize_t r = read(fd, &ch, 1);
-		if(r < 0)
+		size_t end = resp.find(';', start);
+		if(end == std::string::npos)
+			end = resp.size();
+		ReplyText part(resp.data() + start, end - start);
+		start = end + 1;
+		try
 		{
-			// retry if the read is interrupted
-			if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
-			{
-				if(++empty_loops > 5000)
-					throw GrovePi::I2CError("[GrovePiError reading from serial: timeout]\n");
-				usleep(1000);
-				continue;
-			}
-			throw GrovePi::I2CError("[GrovePiError reading from serial]\n");
+			scatter(entries[i], part);
 		}
-		if(r == 0)
+		catch(I2CError &error)
 		{
-			if(++empty_loops > 5000)
-				throw GrovePi::I2CError("[GrovePiError reading from serial: timeout]\n");
-			usleep(1000);
-			continue;
+			if(!failed)
+				first_error = error.what();
+			failed = true;
 		}
-
-		if(ch == '\n')
-			break;
-		if(ch == '\r')
-			continue;
-		line.push_back(ch);
 	}
 
-	return line;
-}
-
-void GrovePi::initGrovePi()
-{
-	open_serial_port();
-}
-
-/**
- * sleep raspberry
- * @param milliseconds time
- */
-void GrovePi::delay(unsigned int milliseconds)
-{
-	usleep(milliseconds * 1000);
+	if(failed)
+		throw I2CError(first_error.c_str());
 }
 
 /**
@@ -272,15 +3773,9 @@ void GrovePi::delay(unsigned int milliseconds)
  * @param  pin  number
  * @param  mode OUTPUT/INPUT
  */
-void GrovePi::pinMode(uint8_t pin, uint8_t mode)
+void GrovePi::Device::pinMode(uint8_t pin, uint8_t mode)
 {
-	const char *mode_str = (mode == INPUT) ? "INPUT" : "OUTPUT";
-	char buf[64];
-	snprintf(buf, sizeof(buf), "pinMode(%u, %s)", pin, mode_str);
-	serial_write_line(buf);
-	std::string resp = serial_read_line();
-	if(resp == "error")
-		throw I2CError("[GrovePiError in pinMode]\n");
+	pinModeAsync(pin, mode).get();
 }
 
 /**
@@ -288,15 +3783,9 @@ void GrovePi::pinMode(uint8_t pin, uint8_t mode)
  * @param  pin   number
  * @param  value HIGH or LOW
  */
-void GrovePi::digitalWrite(uint8_t pin, bool value)
+void GrovePi::Device::digitalWrite(uint8_t pin, bool value)
 {
-	const char *val_str = value ? "HIGH" : "LOW";
-	char buf[64];
-	snprintf(buf, sizeof(buf), "digitalWrite(%u, %s)", pin, val_str);
-	serial_write_line(buf);
-	std::string resp = serial_read_line();
-	if(resp == "error")
-		throw I2CError("[GrovePiError in digitalWrite]\n");
+	digitalWriteAsync(pin, value).get();
 }
 
 /**
@@ -304,16 +3793,9 @@ void GrovePi::digitalWrite(uint8_t pin, bool value)
  * @param  pin number
  * @return     HIGH or LOW
  */
-bool GrovePi::digitalRead(uint8_t pin)
+bool GrovePi::Device::digitalRead(uint8_t pin)
 {
-	char buf[64];
-	snprintf(buf, sizeof(buf), "digitalRead(%u)", pin);
-	serial_write_line(buf);
-	std::string resp = serial_read_line();
-	if(resp == "error")
-		throw I2CError("[GrovePiError in digitalRead]\n");
-	int v = atoi(resp.c_str());
-	return v != 0;
+	return digitalReadAsync(pin).get();
 }
 
 /**
@@ -321,14 +3803,9 @@ bool GrovePi::digitalRead(uint8_t pin)
  * @param  pin   number
  * @param  value 0-255
  */
-void GrovePi::analogWrite(uint8_t pin, uint8_t value)
+void GrovePi::Device::analogWrite(uint8_t pin, uint8_t value)
 {
-	char buf[64];
-	snprintf(buf, sizeof(buf), "analogWrite(%u, %u)", pin, value);
-	serial_write_line(buf);
-	std::string resp = serial_read_line();
-	if(resp == "error")
-		throw I2CError("[GrovePiError in analogWrite]\n");
+	analogWriteAsync(pin, value).get();
 }
 
 /**
@@ -336,21 +3813,9 @@ void GrovePi::analogWrite(uint8_t pin, uint8_t value)
  * @param  pin number
  * @return     16-bit data
  */
-short GrovePi::analogRead(uint8_t pin)
+short GrovePi::Device::analogRead(uint8_t pin)
 {
-	char buf[64];
-	snprintf(buf, sizeof(buf), "analogRead(%u)", pin);
-	serial_write_line(buf);
-	std::string resp = serial_read_line();
-	if(resp == "error")
-		throw I2CError("[GrovePiError in analogRead]\n");
-
-	long raw = strtol(resp.c_str(), NULL, 10);
-	if(raw < 0)
-		return -1;
-	
-	short scaled = (short)(raw >> 6);
-	return scaled;
+	return analogReadAsync(pin).get();
 }
 
 /**
@@ -358,19 +3823,9 @@ short GrovePi::analogRead(uint8_t pin)
  * @param  pin number
  * @return     time taken for the sound to travel back?
  */
-short GrovePi::ultrasonicRead(uint8_t pin)
+short GrovePi::Device::ultrasonicRead(uint8_t pin)
 {
-	char buf[64];
-	snprintf(buf, sizeof(buf), "ultrasonicRead(%u)", pin);
-	serial_write_line(buf);
-	std::string resp = serial_read_line();
-	if(resp == "error")
-		return -1;
-
-	long dist = strtol(resp.c_str(), NULL, 10);
-	if(dist < 0)
-		return -1;
-	return (short)dist;
+	return ultrasonicReadAsync(pin).get();
 }
 
 /**
@@ -378,29 +3833,9 @@ short GrovePi::ultrasonicRead(uint8_t pin)
  * @param  bus   I2C バス番号 (0/1)
  * @param  text  表示文字列（最大 32 文字程度を推奨）
  */
-void GrovePi::setText(uint8_t bus, const char *text)
+void GrovePi::Device::setText(uint8_t bus, const char *text)
 {
-	if(text == NULL)
-		text = "";
-
-	std::string t(text);
-	for(size_t i = 0; i < t.size(); ++i)
-	{
-		if(t[i] == '\r' || t[i] == '\n')
-			t[i] = ' ';
-	}
-
-	char header[32];
-	snprintf(header, sizeof(header), "setText(%u, ", bus);
-
-	std::string cmd(header);
-	cmd += t;
-	cmd.push_back(')');
-
-	serial_write_line(cmd);
-	std::string resp = serial_read_line();
-	if(resp == "error")
-		throw I2CError("[GrovePiError in setText]\n");
+	setTextAsync(bus, text).get();
 }
 
 /**
@@ -410,14 +3845,9 @@ void GrovePi::setText(uint8_t bus, const char *text)
  * @param  g   緑成分 (0-255)
  * @param  b   青成分 (0-255)
  */
-void GrovePi::setRGB(uint8_t bus, uint8_t r, uint8_t g, uint8_t b)
+void GrovePi::Device::setRGB(uint8_t bus, uint8_t r, uint8_t g, uint8_t b)
 {
-	char buf[64];
-	snprintf(buf, sizeof(buf), "setRGB(%u, %u, %u, %u)", bus, r, g, b);
-	serial_write_line(buf);
-	std::string resp = serial_read_line();
-	if(resp == "error")
-		throw I2CError("[GrovePiError in setRGB]\n");
+	setRGBAsync(bus, r, g, b).get();
 }
 
 /**
@@ -427,22 +3857,271 @@ void GrovePi::setRGB(uint8_t bus, uint8_t r, uint8_t g, uint8_t b)
  * @param  temp         取得した温度[℃]
  * @param  humidity     取得した湿度[%]
  */
-void GrovePi::dhtRead(uint8_t pin, uint8_t module_type, float &temp, float &humidity)
+void GrovePi::Device::dhtRead(uint8_t pin, uint8_t module_type, float &temp, float &humidity)
+{
+	DHTReading reading = dhtReadAsync(pin, module_type).get();
+	temp = reading.temp;
+	humidity = reading.humidity;
+}
+
+/**
+ * take several analog samples in a tight loop on the Pico and return their mean,
+ * which is less noisy and finer than a single analogRead() (one round trip in total)
+ * @param  pin         analog pin number (0/1/2)
+ * @param  samples     number of samples (1-1024)
+ * @param  with_stddev also compute the standard deviation
+ * @return             mean, min and max (and stddev) in read_u16() units (0-65535)
+ */
+GrovePi::AnalogAverage GrovePi::Device::analogReadAvg(uint8_t pin, unsigned int samples, bool with_stddev)
+{
+	touch_pin(state, pin);
+
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = put_uint(buf, put_text(buf, 0, "analogReadAvg("), pin);
+	n = put_uint(buf, put_text(buf, n, ", "), samples);
+	n = put_text(buf, n, with_stddev ? ", 1)" : ", 0)");
+	// 応答はスロットの行を直接読む (コピーしない)
+	Reply reply = submit_text(state, CMD_OTHER, buf, n);
+	return parse_analogReadAvg(reply.line(), samples, with_stddev);
+}
+
+/**
+ * read several inputs back-to-back on the Pico in one round trip
+ * @param  mask pins to read (SNAPSHOT_A0 ... SNAPSHOT_D20, SNAPSHOT_ALL)
+ * @return      values and the Pico timestamp of the first sample
+ */
+GrovePi::Snapshot GrovePi::Device::snapshot(uint8_t mask)
+{
+	return snapshotAsync(mask).get();
+}
+
+/**
+ * read A0-A2 and D16/D18/D20 in one round trip, same as snapshot(SNAPSHOT_ALL)
+ */
+GrovePi::Snapshot GrovePi::Device::readAll()
+{
+	return snapshotAsync(SNAPSHOT_ALL).get();
+}
+
+/**
+ * PWM の波形コマンドを送り、応答を確認する
+ * @param state   送信先の接続
+ * @param pin     PWM 出力ピン
+ * @param command コマンド行
+ * @param len     コマンド行の長さ
+ * @param error   失敗時の例外メッセージ
+ */
+static void play_waveform(const std::shared_ptr<GrovePi::DeviceState> &state, uint8_t pin,
+                          const char *command, size_t len, const char *error)
+{
+	// 再生後の出力は書き込みキャッシュからは分からない
+	touch_pin(state, pin);
+	if(submit_text(state, CMD_OTHER, command, len).line() == "error")
+		throw GrovePi::I2CError(error);
+}
+
+/**
+ * fade a PWM output from one value to another;
+ * the Pico steps the duty cycle on its own timer, so the whole ramp is one command
+ * returns as soon as the ramp has started
+ * @param  pin         number
+ * @param  from        start value (0-255)
+ * @param  to          end value (0-255)
+ * @param  duration_ms length of the ramp (0 sets [to] at once)
+ */
+void GrovePi::Device::analogRamp(uint8_t pin, uint8_t from, uint8_t to, unsigned int duration_ms)
+{
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = put_uint(buf, put_text(buf, 0, "pwmRamp("), pin);
+	n = put_uint(buf, put_text(buf, n, ", "), from);
+	n = put_uint(buf, put_text(buf, n, ", "), to);
+	n = put_text(buf, put_uint(buf, put_text(buf, n, ", "), duration_ms), ")");
+	play_waveform(state, pin, buf, n, "[GrovePiError in analogRamp]\n");
+	// 再接続したら最後の値から続ける
+	state->remember_output(pin, CACHE_ANALOG | to);
+}
+
+/**
+ * upload a table of PWM values that the Pico plays back, one value per period
+ * returns as soon as the playback has started
+ * @param  pin       number
+ * @param  values    values (0-255)
+ * @param  count     number of values (1-256)
+ * @param  period_ms time each value is held (2 ms or more)
+ * @param  repeat    start over after the last value instead of holding it
+ */
+void GrovePi::Device::analogSequence(uint8_t pin, const uint8_t *values, size_t count, unsigned int period_ms, bool repeat)
+{
+	if(count == 0 || count > 256)
+		throw I2CError("[GrovePiError in analogSequence: 1-256 values]\n");
+
+	static const char HEX[] = "0123456789abcdef";
+	// 組み立て用の文字列はスレッドごとに使い回す
+	static thread_local std::string cmd;
+	char header[COMMAND_BUF_SIZE];
+	size_t n = put_uint(header, put_text(header, 0, "pwmSequence("), pin);
+	n = put_uint(header, put_text(header, n, ", "), period_ms);
+	n = put_text(header, n, repeat ? ", 1, " : ", 0, ");
+	cmd.assign(header, n);
+	for(size_t i = 0; i < count; ++i)
+	{
+		cmd.push_back(HEX[values[i] >> 4]);
+		cmd.push_back(HEX[values[i] & 0x0f]);
+	}
+	cmd.push_back(')');
+	play_waveform(state, pin, cmd.data(), cmd.size(), "[GrovePiError in analogSequence]\n");
+	// 繰り返すものは再接続したら最初から再生し直し、そうでなければ最後の値に戻す
+	if(repeat)
+	{
+		state->remember_output(pin, CACHE_UNKNOWN);
+		state->remember_setup(pin, cmd);
+	}
+	else
+		state->remember_output(pin, CACHE_ANALOG | values[count - 1]);
+}
+
+/**
+ * stop the waveform playing on a pin; the output keeps its current value
+ * @param  pin number
+ */
+void GrovePi::Device::analogStop(uint8_t pin)
+{
+	char buf[COMMAND_BUF_SIZE];
+	size_t n = put_text(buf, put_uint(buf, put_text(buf, 0, "pwmStop("), pin), ")");
+	play_waveform(state, pin, buf, n, "[GrovePiError in analogStop]\n");
+	// 止めたときの値は分からない
+	state->remember_output(pin, CACHE_UNKNOWN);
+}
+
+/**
+ * 超音波距離センサーの連続測定コマンドを送り、応答を確認する
+ * @param state   送信先の接続
+ * @param pin     センサーを接続したピン
+ * @param command コマンド行
+ * @param error   失敗時の例外メッセージ
+ */
+static void control_ranger(const std::shared_ptr<GrovePi::DeviceState> &state, uint8_t pin,
+                           const std::string &command, const char *error, bool start)
+{
+	// ピンは Pico 側の PIO が使うので、書き込みキャッシュの値は捨てる
+	touch_pin(state, pin);
+	state->remember_setup(pin, std::string());
+	if(submit_text(state, CMD_OTHER, command).line() == "error")
+		throw GrovePi::I2CError(error);
+	if(start)
+		state->remember_setup(pin, command);
+}
+
+/**
+ * keep measuring an ultrasonic ranger in the background on the Pico;
+ * ultrasonicRead() on this pin then returns the median of the last 5
+ * measurements without waiting for an echo
+ * @param  pin       number (16/18/20)
+ * @param  period_ms time between measurements (30 ms or more)
+ * @param  stream    also push "!ultrasonic <pin> <cm>" after every measurement
+ *                   (see setEventHandler)
+ */
+void GrovePi::Device::ultrasonicStart(uint8_t pin, unsigned int period_ms, bool stream)
 {
 	char buf[64];
-	snprintf(buf, sizeof(buf), "dhtRead(%u, %u)", pin, module_type);
-	serial_write_line(buf);
-	std::string resp = serial_read_line();
-	if(resp == "error")
-		throw I2CError("[GrovePiError in dhtRead]\n");
+	snprintf(buf, sizeof(buf), "ultrasonicStart(%u, %u, %u)", pin, period_ms, stream ? 1 : 0);
+	control_ranger(state, pin, buf, "[GrovePiError in ultrasonicStart]\n", true);
+}
 
-	float t = 0.0f;
-	float h = 0.0f;
-	if(sscanf(resp.c_str(), "%f %f", &t, &h) != 2)
-		throw I2CError("[GrovePiError parsing dhtRead response]\n");
+/**
+ * stop continuous ranging; ultrasonicRead() measures on demand again
+ * @param  pin number
+ */
+void GrovePi::Device::ultrasonicStop(uint8_t pin)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "ultrasonicStop(%u)", pin);
+	control_ranger(state, pin, buf, "[GrovePiError in ultrasonicStop]\n", false);
+}
+
+void GrovePi::pinMode(uint8_t pin, uint8_t mode)
+{
+	defaultDevice().pinMode(pin, mode);
+}
+
+void GrovePi::digitalWrite(uint8_t pin, bool value)
+{
+	defaultDevice().digitalWrite(pin, value);
+}
+
+bool GrovePi::digitalRead(uint8_t pin)
+{
+	return defaultDevice().digitalRead(pin);
+}
+
+void GrovePi::analogWrite(uint8_t pin, uint8_t value)
+{
+	defaultDevice().analogWrite(pin, value);
+}
+
+short GrovePi::analogRead(uint8_t pin)
+{
+	return defaultDevice().analogRead(pin);
+}
+
+short GrovePi::ultrasonicRead(uint8_t pin)
+{
+	return defaultDevice().ultrasonicRead(pin);
+}
+
+void GrovePi::setText(uint8_t bus, const char *text)
+{
+	defaultDevice().setText(bus, text);
+}
+
+void GrovePi::setRGB(uint8_t bus, uint8_t r, uint8_t g, uint8_t b)
+{
+	defaultDevice().setRGB(bus, r, g, b);
+}
+
+void GrovePi::dhtRead(uint8_t pin, uint8_t module_type, float &temp, float &humidity)
+{
+	defaultDevice().dhtRead(pin, module_type, temp, humidity);
+}
+
+GrovePi::AnalogAverage GrovePi::analogReadAvg(uint8_t pin, unsigned int samples, bool with_stddev)
+{
+	return defaultDevice().analogReadAvg(pin, samples, with_stddev);
+}
+
+GrovePi::Snapshot GrovePi::snapshot(uint8_t mask)
+{
+	return defaultDevice().snapshot(mask);
+}
 
-	temp = t;
-	humidity = h;
+GrovePi::Snapshot GrovePi::readAll()
+{
+	return defaultDevice().readAll();
+}
+
+void GrovePi::analogRamp(uint8_t pin, uint8_t from, uint8_t to, unsigned int duration_ms)
+{
+	defaultDevice().analogRamp(pin, from, to, duration_ms);
+}
+
+void GrovePi::analogSequence(uint8_t pin, const uint8_t *values, size_t count, unsigned int period_ms, bool repeat)
+{
+	defaultDevice().analogSequence(pin, values, count, period_ms, repeat);
+}
+
+void GrovePi::analogStop(uint8_t pin)
+{
+	defaultDevice().analogStop(pin);
+}
+
+void GrovePi::ultrasonicStart(uint8_t pin, unsigned int period_ms, bool stream)
+{
+	defaultDevice().ultrasonicStart(pin, period_ms, stream);
+}
+
+void GrovePi::ultrasonicStop(uint8_t pin)
+{
+	defaultDevice().ultrasonicStop(pin);
 }
 
 const char* GrovePi::I2CError::detail()
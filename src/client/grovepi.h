@@ -9,8 +9,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdexcept>
+#include <string>
+#include <memory>
+#include <functional>
+#include <vector>
 
 namespace GrovePi
 {
@@ -31,6 +36,7 @@ namespace GrovePi
   void writeByte(uint8_t byte_val);
   uint8_t readBlock(uint8_t *data_block);
   uint8_t readByte();
+  void setReadTimeout(int milliseconds);
 
   void delay(unsigned int milliseconds);
   void pinMode(uint8_t pin, uint8_t mode);
@@ -45,6 +51,366 @@ namespace GrovePi
 
   void dhtRead(uint8_t pin, uint8_t module_type, float &temp, float &humidity);
 
+  // averaged (oversampled) analog reading, in read_u16() units (0-65535)
+  struct AnalogAverage
+  {
+	  float mean;
+	  uint16_t min;
+	  uint16_t max;
+	  float stddev;        // -1 if not requested
+	  unsigned int samples;
+
+	  // mean scaled to 0.0 - 1.0
+	  float normalized() const { return mean / 65535.0f; }
+  };
+
+  AnalogAverage analogReadAvg(uint8_t pin, unsigned int samples, bool with_stddev = false);
+
+  // pins of snapshot(), one bit each
+  enum SnapshotPin
+  {
+	  SNAPSHOT_A0 = 0x01,
+	  SNAPSHOT_A1 = 0x02,
+	  SNAPSHOT_A2 = 0x04,
+	  SNAPSHOT_D16 = 0x08,
+	  SNAPSHOT_D18 = 0x10,
+	  SNAPSHOT_D20 = 0x20,
+	  SNAPSHOT_ALL = 0x3F
+  };
+
+  // inputs sampled back-to-back by the Pico in one command
+  struct Snapshot
+  {
+	  uint8_t mask;        // pins that were read (SNAPSHOT_*)
+	  uint32_t pico_us;    // Pico's ticks_us() when sampling started (wraps at 2^30)
+	  uint16_t analog[3];  // A0-A2 in read_u16() units (0-65535)
+	  bool digital[3];     // D16, D18, D20
+
+	  bool has(uint8_t pins) const { return (mask & pins) == pins; }
+	  // analog pin 0-2; throws I2CError for other pins or pins left out of the mask
+	  uint16_t analogValue(uint8_t pin) const;
+	  // digital pin 16/18/20; throws I2CError for other pins or pins left out of the mask
+	  bool digitalValue(uint8_t pin) const;
+  };
+
+  Snapshot snapshot(uint8_t mask = SNAPSHOT_ALL);
+  Snapshot readAll();
+
+  // PWM waveforms played back by the Pico (no host involvement per step)
+  void analogRamp(uint8_t pin, uint8_t from, uint8_t to, unsigned int duration_ms);
+  void analogSequence(uint8_t pin, const uint8_t *values, size_t count, unsigned int period_ms, bool repeat = false);
+  void analogStop(uint8_t pin);
+
+  // continuous ultrasonic ranging on the Pico; ultrasonicRead() then returns
+  // the latest median-filtered distance at once
+  void ultrasonicStart(uint8_t pin, unsigned int period_ms, bool stream = false);
+  void ultrasonicStop(uint8_t pin);
+
+  struct DHTReading
+  {
+	  float temp;
+	  float humidity;
+	  // milliseconds since the Pico took this sample (-1 if not reported)
+	  int32_t age_ms;
+  };
+
+  // pipelined commands:
+  // several commands can be written back-to-back and
+  // their replies are matched in FIFO order
+  struct ReplySlot;
+  struct DeviceState;
+
+  // reply frame of the binary mode (see setBinaryMode)
+  struct Frame
+  {
+	  uint8_t op;
+	  uint8_t status;
+	  uint16_t length;
+	  uint8_t payload[16];
+  };
+
+  class Reply
+  {
+	  public:
+
+		  Reply() {
+		  }
+		  Reply(const std::shared_ptr<DeviceState> &_device, const std::shared_ptr<ReplySlot> &_slot)
+			  : device(_device), slot(_slot) {
+		  }
+
+		  bool ready() const;
+		  const std::string &line() const;
+		  const Frame *frame() const;
+
+	  private:
+
+		  std::shared_ptr<DeviceState> device;
+		  std::shared_ptr<ReplySlot> slot;
+  };
+
+  template <typename T>
+  class Future
+  {
+	  public:
+
+		  typedef T (*Decoder)(const Reply &);
+
+		  Future(const Reply &_reply, Decoder _decode) : reply(_reply), decode(_decode) {
+		  }
+
+		  bool ready() const { return reply.ready(); }
+		  T get() const { return decode(reply); }
+
+	  private:
+
+		  Reply reply;
+		  Decoder decode;
+  };
+
+  // asynchronous "!<name> ..." lines pushed by the Pico (streams etc.)
+  typedef std::function<void(const std::string &args)> EventHandler;
+
+  // called with false when the serial connection is lost and with true
+  // once the library has reconnected (see Device::onConnectionChange)
+  typedef std::function<void(bool connected)> ConnectionHandler;
+
+  // instrumentation:
+  // counters are only recorded when the library is built with -DGROVEPI_STATS
+  // (make STATS=1), otherwise the hot path has no instrumentation at all
+
+  // latency histogram with logarithmic buckets (about 12% resolution)
+  struct LatencyHistogram
+  {
+	  static const size_t BUCKETS = 200;
+
+	  uint64_t counts[BUCKETS];
+	  uint64_t total;
+	  uint64_t max_us;
+
+	  LatencyHistogram() : total(0), max_us(0) {
+		  memset(counts, 0, sizeof(counts));
+	  }
+
+	  void record(uint64_t us);
+	  uint64_t percentile(double p) const;
+
+	  static size_t bucketOf(uint64_t us);
+	  static uint64_t bucketValue(size_t bucket);
+  };
+
+  struct CommandStats
+  {
+	  const char *name;
+	  uint64_t count;      // commands sent
+	  uint64_t errors;     // "error" replies, bad frames and lost replies
+	  LatencyHistogram latency; // from writing the command to reading its reply [us]
+  };
+
+  struct Stats
+  {
+	  bool enabled;        // false if built without GROVEPI_STATS
+	  std::string port;
+	  uint64_t bytes_out;
+	  uint64_t bytes_in;
+	  uint64_t writes;
+	  uint64_t write_us;   // time spent in write()
+	  uint64_t wait_us;    // time spent waiting in poll() for reply data
+	  uint64_t timeouts;
+	  std::vector<CommandStats> commands;
+
+	  void print(FILE *out) const;
+  };
+
+  // selects a Pico by the serial number of its USB device
+  struct USBSerial
+  {
+	  std::string number;
+
+	  explicit USBSerial(const std::string &_number) : number(_number) {
+	  }
+  };
+
+  // one connection to a Pico
+  // every device has its own serial port, receive buffer, reply queue
+  // and (optional) event thread, and can be used from several threads
+  // the free functions below use defaultDevice()
+  class Device
+  {
+	  public:
+
+		  Device();
+		  explicit Device(const std::string &path);
+		  explicit Device(const USBSerial &serial);
+		  ~Device();
+
+		  void open();
+		  void close();
+		  std::string portName();
+		  void setReadTimeout(int milliseconds);
+
+		  void pinMode(uint8_t pin, uint8_t mode);
+		  void digitalWrite(uint8_t pin, bool value);
+		  bool digitalRead(uint8_t pin);
+		  void analogWrite(uint8_t pin, uint8_t value);
+		  short analogRead(uint8_t pin);
+		  short ultrasonicRead(uint8_t pin);
+		  void setText(uint8_t bus, const char *text);
+		  void setRGB(uint8_t bus, uint8_t r, uint8_t g, uint8_t b);
+		  void dhtRead(uint8_t pin, uint8_t module_type, float &temp, float &humidity);
+
+		  AnalogAverage analogReadAvg(uint8_t pin, unsigned int samples, bool with_stddev = false);
+		  Snapshot snapshot(uint8_t mask = SNAPSHOT_ALL);
+		  Snapshot readAll();
+
+		  void analogRamp(uint8_t pin, uint8_t from, uint8_t to, unsigned int duration_ms);
+		  void analogSequence(uint8_t pin, const uint8_t *values, size_t count, unsigned int period_ms, bool repeat = false);
+		  void analogStop(uint8_t pin);
+
+		  void ultrasonicStart(uint8_t pin, unsigned int period_ms, bool stream = false);
+		  void ultrasonicStop(uint8_t pin);
+
+		  Reply submit(const std::string &command, std::function<void(const std::string &)> callback = nullptr);
+		  void waitAll();
+
+		  void setBinaryMode(bool enable);
+		  bool binaryMode();
+
+		  void setRequestTags(bool enable);
+		  bool requestTags();
+
+		  void setEventHandler(const std::string &name, EventHandler handler);
+		  void onConnectionChange(ConnectionHandler handler);
+		  void setRestoreCommand(uint8_t pin, const std::string &command);
+		  void startEventThread();
+		  void stopEventThread();
+
+		  Stats getStats();
+		  void resetStats();
+
+		  void setWriteCache(bool enable);
+		  void setWriteBehind(bool enable);
+		  void flushWrites();
+
+		  Future<void> pinModeAsync(uint8_t pin, uint8_t mode);
+		  Future<void> digitalWriteAsync(uint8_t pin, bool value);
+		  Future<bool> digitalReadAsync(uint8_t pin);
+		  Future<void> analogWriteAsync(uint8_t pin, uint8_t value);
+		  Future<short> analogReadAsync(uint8_t pin);
+		  Future<short> ultrasonicReadAsync(uint8_t pin);
+		  Future<void> setTextAsync(uint8_t bus, const char *text);
+		  Future<void> setRGBAsync(uint8_t bus, uint8_t r, uint8_t g, uint8_t b);
+		  Future<DHTReading> dhtReadAsync(uint8_t pin, uint8_t module_type);
+		  Future<Snapshot> snapshotAsync(uint8_t mask = SNAPSHOT_ALL);
+
+		  Future<void> ledStripWriteAsync(uint8_t pin, const uint8_t *rgb, size_t leds);
+
+	  private:
+
+		  Device(const Device &);
+		  Device &operator=(const Device &);
+
+		  friend class Batch;
+		  std::shared_ptr<DeviceState> state;
+  };
+
+  Device &defaultDevice();
+
+  Reply submit(const std::string &command, std::function<void(const std::string &)> callback = nullptr);
+  void waitAll();
+
+  void setBinaryMode(bool enable);
+  bool binaryMode();
+
+  void setRequestTags(bool enable);
+  bool requestTags();
+
+  void setEventHandler(const std::string &name, EventHandler handler);
+  void onConnectionChange(ConnectionHandler handler);
+  void startEventThread();
+  void stopEventThread();
+
+  Stats getStats();
+  void resetStats();
+  void dumpStatsOnSignal(int signo = SIGUSR1);
+
+  void setWriteCache(bool enable);
+  void setWriteBehind(bool enable);
+  void flushWrites();
+
+  Future<void> pinModeAsync(uint8_t pin, uint8_t mode);
+  Future<void> digitalWriteAsync(uint8_t pin, bool value);
+  Future<bool> digitalReadAsync(uint8_t pin);
+  Future<void> analogWriteAsync(uint8_t pin, uint8_t value);
+  Future<short> analogReadAsync(uint8_t pin);
+  Future<short> ultrasonicReadAsync(uint8_t pin);
+  Future<void> setTextAsync(uint8_t bus, const char *text);
+  Future<void> setRGBAsync(uint8_t bus, uint8_t r, uint8_t g, uint8_t b);
+  Future<DHTReading> dhtReadAsync(uint8_t pin, uint8_t module_type);
+  Future<Snapshot> snapshotAsync(uint8_t mask = SNAPSHOT_ALL);
+
+  // batched commands:
+  // queued calls are sent as one ";" separated line and
+  // the combined reply is scattered back into the given outputs
+  class Batch
+  {
+	  public:
+
+		  struct Entry
+		  {
+			  enum Kind
+			  {
+				  PIN_MODE,
+				  DIGITAL_WRITE,
+				  DIGITAL_READ,
+				  ANALOG_WRITE,
+				  ANALOG_READ,
+				  ULTRASONIC_READ,
+				  SET_TEXT,
+				  SET_RGB,
+				  DHT_READ
+			  };
+
+			  Kind kind;
+			  bool *flag;
+			  short *number;
+			  float *temp;
+			  float *humidity;
+
+			  explicit Entry(Kind _kind)
+				  : kind(_kind), flag(NULL), number(NULL), temp(NULL), humidity(NULL) {
+			  }
+		  };
+
+		  Batch() : device(&defaultDevice()) {
+		  }
+		  explicit Batch(Device &_device) : device(&_device) {
+		  }
+
+		  Batch &pinMode(uint8_t pin, uint8_t mode);
+		  Batch &digitalWrite(uint8_t pin, bool value);
+		  Batch &digitalRead(uint8_t pin, bool &value);
+		  Batch &analogWrite(uint8_t pin, uint8_t value);
+		  Batch &analogRead(uint8_t pin, short &value);
+		  Batch &ultrasonicRead(uint8_t pin, short &value);
+		  Batch &setText(uint8_t bus, const char *text);
+		  Batch &setRGB(uint8_t bus, uint8_t r, uint8_t g, uint8_t b);
+		  Batch &dhtRead(uint8_t pin, uint8_t module_type, float &temp, float &humidity);
+
+		  size_t size() const { return entries.size(); }
+		  bool empty() const { return entries.empty(); }
+		  void clear();
+		  void flush();
+
+	  private:
+
+		  Device *device;
+		  std::string line;
+		  std::vector<Entry> entries;
+
+		  void append(const char *command, size_t len, const Entry &entry);
+  };
+
 
   // this class purpose is to give a more meaningful
   // description of problem that's encountered
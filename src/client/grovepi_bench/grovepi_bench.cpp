@@ -0,0 +1,536 @@
+/*
+## License
+
+   The MIT License (MIT)
+
+   GrovePi for the Raspberry Pi: an open source platform for connecting Grove Sensors to the Raspberry Pi.
+   Copyright (C) 2017  Dexter Industries
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+//
+// GrovePi round-trip benchmark
+//
+// Measures the latency (p50/p99/max) and throughput of every basic command
+// in three modes:
+//   sync      : one command, one round trip
+//   pipelined : <depth> *Async() calls in flight, then get() on all of them
+//   batched   : <depth> calls in one GrovePi::Batch line
+// Latencies are per round (one command in sync mode, <depth> commands otherwise).
+//
+// Usage: grovepi_bench.out [--mock] [--port PATH] [--binary] [-n ROUNDS] [-d DEPTH]
+//                          [--json] [--commands name,name,...]
+//        grovepi_bench.out --check
+//   --mock   answer on a pseudo terminal instead of a Pico (no hardware needed)
+//   --binary use the binary framing mode (not supported by --mock)
+//   --check  run the library's self checks against the mock and exit
+//            (non-zero status if one of them fails)
+//
+
+#include "grovepi.h"
+#include "grovepi_bench/mock_pico.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace GrovePi;
+
+// --check で、コマンドを送るスレッドが確保したメモリの回数を数える
+static thread_local bool count_allocations;
+static thread_local unsigned long allocations;
+
+void *operator new(size_t size)
+{
+	if(count_allocations)
+		++allocations;
+	void *p = malloc(size ? size : 1);
+	if(p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	free(p);
+}
+
+// sudo g++ -Wall -pthread grovepi.cpp grovepi_bench/mock_pico.cpp grovepi_bench/grovepi_bench.cpp -o grovepi_bench.out -> without grovepicpp package installed
+
+static const uint8_t DIGITAL_PIN = 16;
+static const uint8_t ANALOG_PIN = 0;
+static const uint8_t ULTRASONIC_PIN = 20;
+static const uint8_t DHT_PIN = 18;
+static const uint8_t LCD_BUS = 1;
+
+struct BenchCommand
+{
+	const char *name;
+	std::function<void(Device &)> sync;
+	std::function<void(Device &, int)> pipelined;
+	std::function<void(Batch &)> batched;
+};
+
+struct BenchResult
+{
+	std::string mode;
+	std::string command;
+	int depth;
+	size_t ops;
+	double p50_us;
+	double p99_us;
+	double max_us;
+	double ops_per_sec;
+};
+
+// バッチの書き戻し先 (値は使わない)
+static bool flag_out;
+static short number_out;
+static float temp_out;
+static float humidity_out;
+
+template <typename F>
+static void run_pipelined(int depth, F issue)
+{
+	std::vector<decltype(issue())> futures;
+	futures.reserve(depth);
+	for(int i = 0; i < depth; ++i)
+		futures.push_back(issue());
+	for(size_t i = 0; i < futures.size(); ++i)
+		futures[i].get();
+}
+
+static std::vector<BenchCommand> make_commands()
+{
+	std::vector<BenchCommand> commands;
+	BenchCommand c;
+
+	c.name = "digitalWrite";
+	c.sync = [](Device &dev) { dev.digitalWrite(DIGITAL_PIN, HIGH); };
+	c.pipelined = [](Device &dev, int depth) {
+		run_pipelined(depth, [&dev]() { return dev.digitalWriteAsync(DIGITAL_PIN, HIGH); });
+	};
+	c.batched = [](Batch &batch) { batch.digitalWrite(DIGITAL_PIN, HIGH); };
+	commands.push_back(c);
+
+	c.name = "digitalRead";
+	c.sync = [](Device &dev) { dev.digitalRead(DIGITAL_PIN); };
+	c.pipelined = [](Device &dev, int depth) {
+		run_pipelined(depth, [&dev]() { return dev.digitalReadAsync(DIGITAL_PIN); });
+	};
+	c.batched = [](Batch &batch) { batch.digitalRead(DIGITAL_PIN, flag_out); };
+	commands.push_back(c);
+
+	c.name = "analogRead";
+	c.sync = [](Device &dev) { dev.analogRead(ANALOG_PIN); };
+	c.pipelined = [](Device &dev, int depth) {
+		run_pipelined(depth, [&dev]() { return dev.analogReadAsync(ANALOG_PIN); });
+	};
+	c.batched = [](Batch &batch) { batch.analogRead(ANALOG_PIN, number_out); };
+	commands.push_back(c);
+
+	c.name = "analogWrite";
+	c.sync = [](Device &dev) { dev.analogWrite(DIGITAL_PIN, 128); };
+	c.pipelined = [](Device &dev, int depth) {
+		run_pipelined(depth, [&dev]() { return dev.analogWriteAsync(DIGITAL_PIN, 128); });
+	};
+	c.batched = [](Batch &batch) { batch.analogWrite(DIGITAL_PIN, 128); };
+	commands.push_back(c);
+
+	c.name = "ultrasonicRead";
+	c.sync = [](Device &dev) { dev.ultrasonicRead(ULTRASONIC_PIN); };
+	c.pipelined = [](Device &dev, int depth) {
+		run_pipelined(depth, [&dev]() { return dev.ultrasonicReadAsync(ULTRASONIC_PIN); });
+	};
+	c.batched = [](Batch &batch) { batch.ultrasonicRead(ULTRASONIC_PIN, number_out); };
+	commands.push_back(c);
+
+	c.name = "dhtRead";
+	c.sync = [](Device &dev) {
+		float temp, humidity;
+		dev.dhtRead(DHT_PIN, 0, temp, humidity);
+	};
+	c.pipelined = [](Device &dev, int depth) {
+		run_pipelined(depth, [&dev]() { return dev.dhtReadAsync(DHT_PIN, 0); });
+	};
+	c.batched = [](Batch &batch) { batch.dhtRead(DHT_PIN, 0, temp_out, humidity_out); };
+	commands.push_back(c);
+
+	c.name = "setText";
+	c.sync = [](Device &dev) { dev.setText(LCD_BUS, "bench 0123456789"); };
+	c.pipelined = [](Device &dev, int depth) {
+		run_pipelined(depth, [&dev]() { return dev.setTextAsync(LCD_BUS, "bench 0123456789"); });
+	};
+	c.batched = [](Batch &batch) { batch.setText(LCD_BUS, "bench 0123456789"); };
+	commands.push_back(c);
+
+	return commands;
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+	if(sorted.empty())
+		return 0.0;
+	size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[i];
+}
+
+/**
+ * 1 つのモード・コマンドについて rounds 回計測する
+ * @param  mode   モード名
+ * @param  name   コマンド名
+ * @param  rounds 計測回数
+ * @param  depth  1 回あたりのコマンド数
+ * @param  round  1 回分の処理
+ * @return        計測結果
+ */
+static BenchResult measure(const char *mode, const char *name, int rounds, int depth, std::function<void()> round)
+{
+	typedef std::chrono::steady_clock Clock;
+
+	// 初回のポートオープンやキャッシュの影響を除くため数回空回しする
+	for(int i = 0; i < 3; ++i)
+		round();
+
+	std::vector<double> samples;
+	samples.reserve(rounds);
+	Clock::time_point begin = Clock::now();
+	for(int i = 0; i < rounds; ++i)
+	{
+		Clock::time_point t0 = Clock::now();
+		round();
+		samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+	}
+	double total_s = std::chrono::duration<double>(Clock::now() - begin).count();
+	std::sort(samples.begin(), samples.end());
+
+	BenchResult r;
+	r.mode = mode;
+	r.command = name;
+	r.depth = depth;
+	r.ops = (size_t)rounds * depth;
+	r.p50_us = percentile(samples, 0.50);
+	r.p99_us = percentile(samples, 0.99);
+	r.max_us = samples.empty() ? 0.0 : samples.back();
+	r.ops_per_sec = total_s > 0 ? r.ops / total_s : 0.0;
+	return r;
+}
+
+static void print_csv(const std::vector<BenchResult> &results)
+{
+	printf("mode,command,depth,ops,p50_us,p99_us,max_us,ops_per_sec\n");
+	for(size_t i = 0; i < results.size(); ++i)
+	{
+		const BenchResult &r = results[i];
+		printf("%s,%s,%d,%zu,%.1f,%.1f,%.1f,%.0f\n", r.mode.c_str(), r.command.c_str(),
+		       r.depth, r.ops, r.p50_us, r.p99_us, r.max_us, r.ops_per_sec);
+	}
+}
+
+static void print_json(const std::vector<BenchResult> &results)
+{
+	printf("[\n");
+	for(size_t i = 0; i < results.size(); ++i)
+	{
+		const BenchResult &r = results[i];
+		printf("  {\"mode\": \"%s\", \"command\": \"%s\", \"depth\": %d, \"ops\": %zu, "
+		       "\"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, \"ops_per_sec\": %.0f}%s\n",
+		       r.mode.c_str(), r.command.c_str(), r.depth, r.ops, r.p50_us, r.p99_us, r.max_us,
+		       r.ops_per_sec, i + 1 < results.size() ? "," : "");
+	}
+	printf("]\n");
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [--mock] [--port PATH] [--binary] [-n ROUNDS] [-d DEPTH] "
+	                "[--json] [--commands name,name,...]\n"
+	                "       %s --check\n", argv0, argv0);
+}
+
+static bool check(bool ok, const char *name)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+	return ok;
+}
+
+/**
+ * 応答が読み取りタイムアウトより遅いときに、次のコマンドが前のコマンドの応答を受け取らないか
+ */
+static bool check_late_reply()
+{
+	MockOptions options;
+	options.latency_us = 50000;
+	MockPico pico(options);
+	pico.start();
+	Device device(pico.path());
+	bool ok = true;
+
+	device.setReadTimeout(20);
+	bool timed_out = false;
+	try
+	{
+		device.digitalRead(DIGITAL_PIN);
+	}
+	catch(I2CError &)
+	{
+		timed_out = true;
+	}
+	ok = check(timed_out, "late reply: the slow read times out") && ok;
+
+	device.setReadTimeout(1000);
+	ok = check(device.ultrasonicRead(DIGITAL_PIN) == 42, "late reply: the next read gets its own value") && ok;
+	ok = check(device.analogRead(ANALOG_PIN) == 32768 >> 6, "late reply: replies stay in order") && ok;
+
+	// タグ付きで待っている他のコマンドは、別のコマンドのタイムアウトで失敗しない
+	device.setRequestTags(true);
+	Future<bool> slow = device.digitalReadAsync(DIGITAL_PIN);
+	device.setReadTimeout(20);
+	timed_out = false;
+	try
+	{
+		device.ultrasonicRead(DIGITAL_PIN);
+	}
+	catch(I2CError &)
+	{
+		timed_out = true;
+	}
+	device.setReadTimeout(1000);
+	bool value = false;
+	try
+	{
+		value = slow.get();
+	}
+	catch(I2CError &)
+	{
+	}
+	ok = check(timed_out && value, "late reply: a timeout leaves other tagged requests waiting") && ok;
+	return ok;
+}
+
+/**
+ * 呼び出しを何度か繰り返して準備 (スロットやバッファの確保) を済ませた後、
+ * 1 回ごとにメモリを確保していないか
+ */
+static bool check_no_allocation(const char *name, std::function<void()> call)
+{
+	for(int i = 0; i < 100; ++i)
+		call();
+	allocations = 0;
+	count_allocations = true;
+	for(int i = 0; i < 20; ++i)
+		call();
+	count_allocations = false;
+
+	char label[96];
+	snprintf(label, sizeof(label), "no allocation: %s (%lu in 20 calls)", name, allocations);
+	return check(allocations == 0, label);
+}
+
+static bool check_allocations(bool tags)
+{
+	MockPico pico;
+	pico.start();
+	Device device(pico.path());
+	device.setRequestTags(tags);
+	bool ok = true;
+
+	static uint8_t rgb[30 * 3];
+	static const uint8_t wave[] = {0, 64, 128, 255};
+	ok = check_no_allocation("digitalWrite", [&]() { device.digitalWrite(DIGITAL_PIN, flag_out = !flag_out); }) && ok;
+	ok = check_no_allocation("digitalRead", [&]() { flag_out = device.digitalRead(DIGITAL_PIN); }) && ok;
+	ok = check_no_allocation("analogRead", [&]() { number_out = device.analogRead(ANALOG_PIN); }) && ok;
+	ok = check_no_allocation("ultrasonicRead", [&]() { number_out = device.ultrasonicRead(ULTRASONIC_PIN); }) && ok;
+	ok = check_no_allocation("setText", [&]() { device.setText(LCD_BUS, "Hello, GrovePi"); }) && ok;
+	ok = check_no_allocation("dhtRead", [&]() { device.dhtRead(DHT_PIN, 0, temp_out, humidity_out); }) && ok;
+	ok = check_no_allocation("analogReadAvg", [&]() { temp_out = device.analogReadAvg(ANALOG_PIN, 16, false).mean; }) && ok;
+	ok = check_no_allocation("ledStripWrite", [&]() { device.ledStripWriteAsync(DIGITAL_PIN, rgb, 30).get(); }) && ok;
+	ok = check_no_allocation("analogRamp", [&]() { device.analogRamp(DHT_PIN, 0, 255, 1000); }) && ok;
+	ok = check_no_allocation("analogSequence", [&]() { device.analogSequence(DHT_PIN, wave, sizeof(wave), 10, false); }) && ok;
+	ok = check_no_allocation("snapshot", [&]() { number_out = device.snapshot(SNAPSHOT_ALL).analog[0]; }) && ok;
+	return ok;
+}
+
+// 例外を投げれば true
+static bool throws(std::function<void()> call)
+{
+	try
+	{
+		call();
+	}
+	catch(I2CError &)
+	{
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Snapshot の値を、範囲外のピンや mask に無いピンで読めないか
+ */
+static bool check_snapshot_accessors()
+{
+	Snapshot snap = Snapshot();
+	snap.mask = SNAPSHOT_A1 | SNAPSHOT_D18;
+	snap.analog[1] = 1234;
+	snap.digital[1] = true;
+	bool ok = true;
+
+	ok = check(snap.analogValue(1) == 1234 && snap.digitalValue(18), "snapshot: pins in the mask read back") && ok;
+	ok = check(throws([&]() { snap.analogValue(0); }) && throws([&]() { snap.digitalValue(20); }),
+	           "snapshot: pins left out of the mask throw") && ok;
+	ok = check(throws([&]() { snap.analogValue(3); }) && throws([&]() { snap.digitalValue(0); }) &&
+	           throws([&]() { snap.digitalValue(15); }) && throws([&]() { snap.digitalValue(19); }),
+	           "snapshot: pins out of range throw") && ok;
+	return ok;
+}
+
+static int run_checks()
+{
+	bool ok = true;
+	try
+	{
+		ok = check_late_reply() && ok;
+		ok = check_allocations(false) && ok;
+		ok = check_allocations(true) && ok;
+		ok = check_snapshot_accessors() && ok;
+	}
+	catch(I2CError &error)
+	{
+		fprintf(stderr, "%s", error.detail());
+		ok = false;
+	}
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+	bool mock = false;
+	bool binary = false;
+	bool json = false;
+	int rounds = 200;
+	int depth = 16;
+	std::string port;
+	std::string only;
+
+	for(int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if(arg == "--check")
+			return run_checks();
+		if(arg == "--mock")
+			mock = true;
+		else if(arg == "--binary")
+			binary = true;
+		else if(arg == "--json")
+			json = true;
+		else if(arg == "--port" && i + 1 < argc)
+			port = argv[++i];
+		else if(arg == "-n" && i + 1 < argc)
+			rounds = atoi(argv[++i]);
+		else if(arg == "-d" && i + 1 < argc)
+			depth = atoi(argv[++i]);
+		else if(arg == "--commands" && i + 1 < argc)
+			only = "," + std::string(argv[++i]) + ",";
+		else
+		{
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if(rounds <= 0 || depth <= 0)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	MockPico pico;
+	std::vector<BenchResult> results;
+
+	try
+	{
+		if(mock)
+		{
+			pico.start();
+			port = pico.path();
+		}
+
+		std::unique_ptr<Device> opened(port.empty() ? new Device() : new Device(port));
+		Device &device = *opened;
+
+		device.pinMode(DIGITAL_PIN, OUTPUT);
+		if(binary)
+			device.setBinaryMode(true);
+
+		std::vector<BenchCommand> commands = make_commands();
+		for(size_t i = 0; i < commands.size(); ++i)
+		{
+			const BenchCommand &c = commands[i];
+			if(!only.empty() && only.find("," + std::string(c.name) + ",") == std::string::npos)
+				continue;
+
+			results.push_back(measure("sync", c.name, rounds, 1, [&]() { c.sync(device); }));
+			results.push_back(measure("pipelined", c.name, rounds, depth, [&]() { c.pipelined(device, depth); }));
+			results.push_back(measure("batched", c.name, rounds, depth, [&]() {
+				Batch batch(device);
+				for(int k = 0; k < depth; ++k)
+					c.batched(batch);
+				batch.flush();
+			}));
+		}
+
+		if(binary)
+			device.setBinaryMode(false);
+	}
+	catch(I2CError &error)
+	{
+		fprintf(stderr, "%s", error.detail());
+		return 1;
+	}
+
+	if(json)
+		print_json(results);
+	else
+		print_csv(results);
+	return 0;
+}
@@ -0,0 +1,344 @@
+#include "mock_pico.h"
+#include "grovepi.h"
+
+#include <errno.h>
+#include <ctype.h>
+#include <poll.h>
+#include <termios.h>
+#include <chrono>
+
+using GrovePi::MockPico;
+
+static uint64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 切断してから次の疑似端末を用意するまでの時間 (USB の再列挙の代わり)
+static const int REENUMERATE_MS = 20;
+
+MockPico::MockPico()
+	: master_fd(-1), slave_fd(-1), stopping(false), handled(0), errors(0), dropped(0), drops(0),
+	  random(options.seed), started_us(0)
+{
+}
+
+MockPico::MockPico(const MockOptions &_options)
+	: options(_options), master_fd(-1), slave_fd(-1), stopping(false), handled(0), errors(0), dropped(0),
+	  drops(0), random(_options.seed), started_us(0)
+{
+}
+
+MockPico::~MockPico()
+{
+	stop();
+}
+
+/**
+ * 疑似端末を作る
+ * 切断を再現する場合は、link_path のシンボリックリンクを新しい端末へ付け替える
+ */
+void MockPico::open_pty()
+{
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0)
+	{
+		if(fd >= 0)
+			close(fd);
+		throw I2CError("[GrovePiError creating mock serial device]\n");
+	}
+
+	slave_path = ptsname(fd);
+
+	// クライアントが開くまでの間に応答がエコーされないよう、こちらで raw にしておく
+	// スレーブ側を開いたままにして、クライアントが閉じても EIO にならないようにする
+	slave_fd = open(slave_path.c_str(), O_RDWR | O_NOCTTY);
+	struct termios tio;
+	if(slave_fd < 0 || tcgetattr(slave_fd, &tio) != 0)
+	{
+		close(fd);
+		if(slave_fd >= 0)
+			close(slave_fd);
+		slave_fd = -1;
+		throw I2CError("[GrovePiError creating mock serial device]\n");
+	}
+	cfmakeraw(&tio);
+	tcsetattr(slave_fd, TCSANOW, &tio);
+	master_fd = fd;
+
+	if(!link_path.empty())
+	{
+		// 開きかけのクライアントが消えたリンクを見ないよう、別名で作ってから置き換える
+		std::string tmp = link_path + ".tmp";
+		unlink(tmp.c_str());
+		if(symlink(slave_path.c_str(), tmp.c_str()) != 0 || rename(tmp.c_str(), link_path.c_str()) != 0)
+		{
+			close_pty();
+			throw I2CError("[GrovePiError creating mock serial device]\n");
+		}
+	}
+}
+
+void MockPico::close_pty()
+{
+	if(master_fd >= 0)
+		close(master_fd);
+	if(slave_fd >= 0)
+		close(slave_fd);
+	master_fd = slave_fd = -1;
+}
+
+/**
+ * create the pseudo terminal and start answering on it
+ */
+void MockPico::start()
+{
+	if(master_fd >= 0)
+		return;
+
+	if(options.disconnect_ms > 0 && link_path.empty())
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), "/tmp/grovepi-mock-%d-%p", (int)getpid(), (void *)this);
+		link_path = buf;
+	}
+	open_pty();
+
+	started_us = now_us();
+	stopping = false;
+	worker = std::thread(&MockPico::run, this);
+}
+
+void MockPico::stop()
+{
+	if(master_fd < 0 && !worker.joinable())
+		return;
+
+	stopping = true;
+	worker.join();
+	close_pty();
+	if(!link_path.empty())
+		unlink(link_path.c_str());
+}
+
+bool MockPico::chance(double rate)
+{
+	return rate > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(random) < rate;
+}
+
+/**
+ * 1 コマンド分の応答を返す
+ * @param  call "name(args)" 形式のコマンド
+ * @return      応答文字列 (改行なし)
+ */
+std::string MockPico::reply(const std::string &call)
+{
+	size_t begin = call.find_first_not_of(' ');
+	size_t paren = call.find('(');
+	if(begin == std::string::npos || paren == std::string::npos || paren < begin)
+		return "error";
+
+	std::string name;
+	for(size_t i = begin; i < paren && call[i] != ' '; ++i)
+		name.push_back((char)tolower((unsigned char)call[i]));
+
+	++handled;
+	if(chance(options.error_rate))
+	{
+		++errors;
+		return "error";
+	}
+
+	if(name == "pinmode" || name == "digitalwrite" || name == "analogwrite" ||
+	   name == "settext" || name == "setrgb" ||
+	   name == "ultrasonicstart" || name == "ultrasonicstop" ||
+	   name == "ledstripinit" || name == "ledstripwrite" || name == "ledstripbrightness" ||
+	   name == "pwmramp" || name == "pwmsequence" || name == "pwmstop" ||
+	   name == "streamanalog" || name == "streamstop" || name == "watchdigital" || name == "unwatchdigital")
+		return "";
+	if(name == "digitalread")
+		return "1";
+	if(name == "analogread")
+		return "32768";
+	if(name == "analogreadavg")
+		return "32768.00 32768 32768";
+	if(name == "ultrasonicread")
+		return "42";
+	if(name == "dhtread")
+		return "23.5 45.0 0";
+
+	uint64_t uptime_us = now_us() - started_us;
+	char buf[128];
+	if(name == "snapshot" || name == "readall")
+	{
+		snprintf(buf, sizeof(buf), "63 %llu 32768 32768 32768 1 1 1",
+		         (unsigned long long)(uptime_us & 0x3FFFFFFF));
+		return buf;
+	}
+	if(name == "stats")
+	{
+		snprintf(buf, sizeof(buf), "uptime_ms=%llu mem_free=150000 mem_alloc=40000 gc=0",
+		         (unsigned long long)(uptime_us / 1000));
+		return buf;
+	}
+	return "error";
+}
+
+// reply() が応答するコマンド名 (小文字)
+static const char *const COMMAND_NAMES[] = {
+	"pinmode", "digitalwrite", "digitalread", "analogwrite", "analogread", "analogreadavg",
+	"settext", "setrgb", "ultrasonicread", "ultrasonicstart", "ultrasonicstop", "dhtread",
+	"ledstripinit", "ledstripwrite", "ledstripbrightness", "pwmramp", "pwmsequence", "pwmstop",
+	"streamanalog", "streamstop", "watchdigital", "unwatchdigital", "snapshot", "readall", "stats"
+};
+
+// line[pos..] が既知のコマンドの "name(" で始まれば true
+static bool starts_call(const std::string &line, size_t pos)
+{
+	size_t paren = line.find('(', pos);
+	if(paren == std::string::npos)
+		return false;
+	size_t begin = line.find_first_not_of(' ', pos);
+	size_t end = line.find_last_not_of(' ', paren - 1);
+	if(begin >= paren || end == std::string::npos || end < begin)
+		return false;
+
+	std::string name;
+	for(size_t i = begin; i <= end; ++i)
+		name.push_back((char)tolower((unsigned char)line[i]));
+	for(size_t i = 0; i < sizeof(COMMAND_NAMES) / sizeof(COMMAND_NAMES[0]); ++i)
+	{
+		if(name == COMMAND_NAMES[i])
+			return true;
+	}
+	return false;
+}
+
+/**
+ * 1 行分の応答を返す
+ * main.py と同じく、直前の空白以外の文字が ")" で後ろが既知のコマンドの "name(" で始まる
+ * ";" だけをバッチの区切りとみなし、
+ * 行頭の "#<n> " のタグは応答にも付ける
+ */
+std::string MockPico::reply_line(const std::string &line)
+{
+	std::string tag;
+	size_t body = 0;
+	if(!line.empty() && line[0] == '#')
+	{
+		size_t end = 1;
+		while(end < line.size() && isdigit((unsigned char)line[end]))
+			++end;
+		if(end == 1 || end > 11 || (end < line.size() && line[end] != ' '))
+			return "error";
+		tag = line.substr(0, end);
+		body = end;
+	}
+
+	std::string out;
+	size_t start = body;
+	bool first = true;
+	for(size_t i = body; i <= line.size(); ++i)
+	{
+		if(i == line.size())
+		{
+			// 末尾の ";" の後ろが空なら区切りとして扱わない
+			if(!first && line.find_first_not_of(' ', start) == std::string::npos)
+				break;
+		}
+		else
+		{
+			if(line[i] != ';')
+				continue;
+			size_t j = i;
+			while(j > start && line[j - 1] == ' ')
+				--j;
+			if(j == start || line[j - 1] != ')' || !starts_call(line, i + 1))
+				continue;
+		}
+		if(!first)
+			out.push_back(';');
+		out += reply(line.substr(start, i - start));
+		first = false;
+		start = i + 1;
+	}
+
+	if(tag.empty())
+		return out;
+	return out.empty() ? tag : tag + " " + out;
+}
+
+/**
+ * 受信スレッド本体
+ * 行ごとに (コマンド数 x latency_us + jitter) 待ってから応答を返し、
+ * disconnect_ms ごとに疑似端末を閉じて作り直す
+ */
+void MockPico::run()
+{
+	std::string pending;
+	char buf[1024];
+	uint64_t next_drop = options.disconnect_ms > 0 ? now_us() + options.disconnect_ms * 1000ull : 0;
+
+	while(!stopping)
+	{
+		if(next_drop != 0 && now_us() >= next_drop)
+		{
+			close_pty();
+			pending.clear();
+			++drops;
+			std::this_thread::sleep_for(std::chrono::milliseconds(REENUMERATE_MS));
+			open_pty();
+			next_drop = now_us() + options.disconnect_ms * 1000ull;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = master_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if(poll(&pfd, 1, 10) <= 0)
+			continue;
+
+		ssize_t r = read(master_fd, buf, sizeof(buf));
+		if(r <= 0)
+			continue;
+		pending.append(buf, (size_t)r);
+
+		size_t eol;
+		while((eol = pending.find('\n')) != std::string::npos)
+		{
+			std::string line = pending.substr(0, eol);
+			pending.erase(0, eol + 1);
+			if(!line.empty() && line[line.size() - 1] == '\r')
+				line.erase(line.size() - 1);
+
+			uint64_t before = handled;
+			std::string out = reply_line(line);
+			if(chance(options.drop_rate))
+			{
+				++dropped;
+				continue;
+			}
+			out.push_back('\n');
+
+			uint64_t delay_us = (handled - before) * options.latency_us;
+			if(options.jitter_us > 0)
+				delay_us += std::uniform_int_distribution<unsigned int>(0, options.jitter_us)(random);
+			if(delay_us > 0)
+				std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+
+			size_t total = 0;
+			while(total < out.size())
+			{
+				ssize_t w = write(master_fd, out.data() + total, out.size() - total);
+				if(w < 0)
+				{
+					if(errno == EINTR || errno == EAGAIN)
+						continue;
+					break;
+				}
+				total += (size_t)w;
+			}
+		}
+	}
+}
@@ -0,0 +1,77 @@
+#ifndef GROVEPI_MOCK_PICO_H
+#define GROVEPI_MOCK_PICO_H
+
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <random>
+
+namespace GrovePi
+{
+  // latency and faults added by MockPico (all off by default)
+  struct MockOptions
+  {
+	  unsigned int latency_us;    // time spent on every command before replying
+	  unsigned int jitter_us;     // uniformly distributed extra time (0 .. jitter_us)
+	  double error_rate;          // probability that a command replies "error"
+	  double drop_rate;           // probability that a line gets no reply at all
+	  unsigned int disconnect_ms; // period of simulated USB drops (0 = never)
+	  uint32_t seed;
+
+	  MockOptions() : latency_us(0), jitter_us(0), error_rate(0.0), drop_rate(0.0), disconnect_ms(0), seed(1) {
+	  }
+  };
+
+  // pseudo terminal that answers the ASCII protocol of main.py
+  // (including ";" batches and "#<n>" request tags) with fixed values,
+  // so the client can be exercised without a Pico
+  // with disconnect_ms set, path() is a symbolic link that is moved to a new
+  // pseudo terminal after every drop, like a Pico coming back on USB
+  class MockPico
+  {
+	  public:
+
+		  MockPico();
+		  explicit MockPico(const MockOptions &options);
+		  ~MockPico();
+
+		  void start();
+		  void stop();
+
+		  // path to pass to GrovePi::Device
+		  const std::string &path() const { return link_path.empty() ? slave_path : link_path; }
+		  uint64_t commands() const { return handled; }
+		  uint64_t injectedErrors() const { return errors; }
+		  uint64_t droppedLines() const { return dropped; }
+		  uint64_t disconnects() const { return drops; }
+
+	  private:
+
+		  MockPico(const MockPico &);
+		  MockPico &operator=(const MockPico &);
+
+		  MockOptions options;
+		  int master_fd;
+		  int slave_fd;
+		  std::string slave_path;
+		  std::string link_path;
+		  std::thread worker;
+		  std::atomic<bool> stopping;
+		  std::atomic<uint64_t> handled;
+		  std::atomic<uint64_t> errors;
+		  std::atomic<uint64_t> dropped;
+		  std::atomic<uint64_t> drops;
+		  std::mt19937 random;
+		  uint64_t started_us;
+
+		  void open_pty();
+		  void close_pty();
+		  void run();
+		  bool chance(double rate);
+		  std::string reply(const std::string &call);
+		  std::string reply_line(const std::string &line);
+  };
+}
+
+#endif
@@ -0,0 +1,543 @@
+#include "grovepi_dsp.h"
+
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define GROVEPI_DSP_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GROVEPI_DSP_NEON
+#endif
+
+using GrovePi::I2CError;
+using GrovePi::dsp::BlockStats;
+using GrovePi::dsp::MovingAverage;
+using GrovePi::dsp::Crossing;
+using GrovePi::dsp::CrossingDetector;
+using GrovePi::dsp::Spectrum;
+
+// 32 ビットの部分和があふれる前に 64 ビットへ移すまでのベクトル数
+// (1 レーンに 1 回あたり最大 2 x 65535 足されるので 2^31 に届かない長さ)
+static const size_t FLUSH_VECTORS = 16384;
+
+/**
+ * convert raw samples to float
+ * @param in     read_u16() samples
+ * @param n      number of samples
+ * @param out    n floats
+ * @param scale  multiplied with every sample
+ * @param offset added after scaling
+ */
+void GrovePi::dsp::toFloat(const uint16_t *in, size_t n, float *out, float scale, float offset)
+{
+	size_t i = 0;
+#if defined(GROVEPI_DSP_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 vscale = _mm_set1_ps(scale);
+	const __m128 voffset = _mm_set1_ps(offset);
+	for(; i + 8 <= n; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+		__m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero));
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(lo, vscale), voffset));
+		_mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_mul_ps(hi, vscale), voffset));
+	}
+#elif defined(GROVEPI_DSP_NEON)
+	const float32x4_t vscale = vdupq_n_f32(scale);
+	const float32x4_t voffset = vdupq_n_f32(offset);
+	for(; i + 8 <= n; i += 8)
+	{
+		uint16x8_t v = vld1q_u16(in + i);
+		float32x4_t lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(v)));
+		float32x4_t hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(v)));
+		vst1q_f32(out + i, vaddq_f32(vmulq_f32(lo, vscale), voffset));
+		vst1q_f32(out + i + 4, vaddq_f32(vmulq_f32(hi, vscale), voffset));
+	}
+#endif
+	for(; i < n; ++i)
+		out[i] = (float)in[i] * scale + offset;
+}
+
+/**
+ * scale raw samples down to the 10 bit range of analogRead()
+ * @param in  read_u16() samples
+ * @param n   number of samples
+ * @param out n values (0-1023), may be in
+ */
+void GrovePi::dsp::toAnalog(const uint16_t *in, size_t n, uint16_t *out)
+{
+	size_t i = 0;
+#if defined(GROVEPI_DSP_SSE2)
+	for(; i + 8 <= n; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_srli_epi16(v, ANALOG_SHIFT));
+	}
+#elif defined(GROVEPI_DSP_NEON)
+	for(; i + 8 <= n; i += 8)
+		vst1q_u16(out + i, vshrq_n_u16(vld1q_u16(in + i), ANALOG_SHIFT));
+#endif
+	for(; i < n; ++i)
+		out[i] = in[i] >> ANALOG_SHIFT;
+}
+
+double BlockStats::peak() const
+{
+	if(count == 0)
+		return 0.0;
+	double up = (double)max - mean;
+	double down = mean - (double)min;
+	return up > down ? up : down;
+}
+
+/**
+ * statistics of one block
+ * @param  in read_u16() samples
+ * @param  n  number of samples
+ * @return    all zero when n is 0
+ */
+BlockStats GrovePi::dsp::stats(const uint16_t *in, size_t n)
+{
+	BlockStats result;
+	result.count = n;
+	result.min = result.max = 0;
+	result.mean = result.rms = result.stddev = 0.0;
+	if(n == 0)
+		return result;
+
+	uint16_t lo = 0xFFFF;
+	uint16_t hi = 0;
+	uint64_t sum = 0;
+	uint64_t sum_sq = 0;
+	size_t i = 0;
+
+#if defined(GROVEPI_DSP_SSE2)
+	// SSE2 には符号なし 16 ビットの min/max と乗算がないので、0x8000 を引いた
+	// 符号付きの値 s で計算し、x = s + 32768 として最後に戻す
+	//   sum(x)   = sum(s) + 32768 n
+	//   sum(x^2) = sum(s^2) + 65536 sum(s) + 2^30 n
+	// _mm_madd_epi16(s, s) は両方 -32768 のときだけ 2^31 になるが、符号なしとして扱えば正しい
+	const __m128i bias = _mm_set1_epi16((short)0x8000);
+	const __m128i ones = _mm_set1_epi16(1);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i vmin = _mm_set1_epi16(0x7FFF);
+	__m128i vmax = _mm_set1_epi16((short)0x8000);
+	__m128i vsq = _mm_setzero_si128();
+	int64_t sum_s = 0;
+	size_t vectors = n / 8;
+	while(vectors > 0)
+	{
+		size_t chunk = vectors < FLUSH_VECTORS ? vectors : FLUSH_VECTORS;
+		__m128i vsum = _mm_setzero_si128();
+		for(size_t k = 0; k < chunk; ++k, i += 8)
+		{
+			__m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), bias);
+			vmin = _mm_min_epi16(vmin, s);
+			vmax = _mm_max_epi16(vmax, s);
+			vsum = _mm_add_epi32(vsum, _mm_madd_epi16(s, ones));
+			__m128i sq = _mm_madd_epi16(s, s);
+			vsq = _mm_add_epi64(vsq, _mm_unpacklo_epi32(sq, zero));
+			vsq = _mm_add_epi64(vsq, _mm_unpackhi_epi32(sq, zero));
+		}
+		int32_t part[4];
+		_mm_storeu_si128((__m128i *)part, vsum);
+		sum_s += (int64_t)part[0] + part[1] + part[2] + part[3];
+		vectors -= chunk;
+	}
+	if(i > 0)
+	{
+		int16_t mins[8], maxs[8];
+		uint64_t sqs[2];
+		_mm_storeu_si128((__m128i *)mins, vmin);
+		_mm_storeu_si128((__m128i *)maxs, vmax);
+		_mm_storeu_si128((__m128i *)sqs, vsq);
+		int16_t smin = mins[0], smax = maxs[0];
+		for(int k = 1; k < 8; ++k)
+		{
+			if(mins[k] < smin)
+				smin = mins[k];
+			if(maxs[k] > smax)
+				smax = maxs[k];
+		}
+		lo = (uint16_t)(smin + 32768);
+		hi = (uint16_t)(smax + 32768);
+		sum = (uint64_t)(sum_s + (int64_t)i * 32768);
+		sum_sq = (uint64_t)((int64_t)(sqs[0] + sqs[1]) + sum_s * 65536 + (int64_t)i * 1073741824);
+	}
+#elif defined(GROVEPI_DSP_NEON)
+	uint16x8_t vmin = vdupq_n_u16(0xFFFF);
+	uint16x8_t vmax = vdupq_n_u16(0);
+	uint64x2_t vsq = vdupq_n_u64(0);
+	size_t vectors = n / 8;
+	while(vectors > 0)
+	{
+		size_t chunk = vectors < FLUSH_VECTORS ? vectors : FLUSH_VECTORS;
+		uint32x4_t vsum = vdupq_n_u32(0);
+		for(size_t k = 0; k < chunk; ++k, i += 8)
+		{
+			uint16x8_t v = vld1q_u16(in + i);
+			vmin = vminq_u16(vmin, v);
+			vmax = vmaxq_u16(vmax, v);
+			vsum = vpadalq_u16(vsum, v);
+			vsq = vpadalq_u32(vsq, vmull_u16(vget_low_u16(v), vget_low_u16(v)));
+			vsq = vpadalq_u32(vsq, vmull_u16(vget_high_u16(v), vget_high_u16(v)));
+		}
+		uint64x2_t wide = vpaddlq_u32(vsum);
+		sum += vgetq_lane_u64(wide, 0) + vgetq_lane_u64(wide, 1);
+		vectors -= chunk;
+	}
+	if(i > 0)
+	{
+		// vminvq_u16 は aarch64 にしかないので、32 ビットの ARM でも使える形でまとめる
+		uint16_t mins[8], maxs[8];
+		vst1q_u16(mins, vmin);
+		vst1q_u16(maxs, vmax);
+		for(int k = 0; k < 8; ++k)
+		{
+			if(mins[k] < lo)
+				lo = mins[k];
+			if(maxs[k] > hi)
+				hi = maxs[k];
+		}
+		sum_sq = vgetq_lane_u64(vsq, 0) + vgetq_lane_u64(vsq, 1);
+	}
+#endif
+
+	for(; i < n; ++i)
+	{
+		uint16_t x = in[i];
+		if(x < lo)
+			lo = x;
+		if(x > hi)
+			hi = x;
+		sum += x;
+		sum_sq += (uint64_t)x * x;
+	}
+
+	result.min = lo;
+	result.max = hi;
+	result.mean = (double)sum / (double)n;
+	double mean_sq = (double)sum_sq / (double)n;
+	result.rms = sqrt(mean_sq);
+	double variance = mean_sq - result.mean * result.mean;
+	result.stddev = variance > 0.0 ? sqrt(variance) : 0.0;
+	return result;
+}
+
+/**
+ * statistics of consecutive windows
+ * @param  in     read_u16() samples
+ * @param  n      number of samples
+ * @param  window samples per window
+ * @param  out    n / window entries
+ * @return        number of windows written
+ */
+size_t GrovePi::dsp::windowStats(const uint16_t *in, size_t n, size_t window, BlockStats *out)
+{
+	if(window == 0)
+		throw I2CError("[GrovePiError in windowStats: window is 0]\n");
+
+	size_t windows = n / window;
+	for(size_t w = 0; w < windows; ++w)
+		out[w] = stats(in + w * window, window);
+	return windows;
+}
+
+/**
+ * nearest-rank percentile of one block
+ * 上位 8 ビットで数えて対象のバケツを決め、その中を下位 8 ビットで数え直す
+ * @param  in read_u16() samples
+ * @param  n  number of samples
+ * @param  p  0.0 (minimum) - 1.0 (maximum); values outside (and NaN) are clamped
+ * @return    the sample value at that rank
+ */
+uint16_t GrovePi::dsp::percentile(const uint16_t *in, size_t n, double p)
+{
+	if(n == 0)
+		throw I2CError("[GrovePiError in percentile: no samples]\n");
+
+	// p の範囲外 (と NaN) は size_t への変換が未定義になるので先に丸める
+	if(!(p > 0.0))
+		p = 0.0;
+	if(p > 1.0)
+		p = 1.0;
+	size_t rank = (size_t)ceil(p * (double)n);
+	if(rank < 1)
+		rank = 1;
+	if(rank > n)
+		rank = n;
+
+	size_t counts[256] = {0};
+	for(size_t i = 0; i < n; ++i)
+		++counts[in[i] >> 8];
+
+	unsigned int high = 0;
+	while(rank > counts[high])
+		rank -= counts[high++];
+
+	size_t fine[256] = {0};
+	for(size_t i = 0; i < n; ++i)
+	{
+		if((in[i] >> 8) == high)
+			++fine[in[i] & 0xFF];
+	}
+
+	unsigned int low = 0;
+	while(rank > fine[low])
+		rank -= fine[low++];
+	return (uint16_t)((high << 8) | low);
+}
+
+MovingAverage::MovingAverage(size_t _window)
+	: next(0), filled(0), sum(0)
+{
+	if(_window == 0)
+		throw I2CError("[GrovePiError in MovingAverage: window is 0]\n");
+	history.assign(_window, 0);
+}
+
+/**
+ * moving average of the next block
+ * @param in  read_u16() samples
+ * @param n   number of samples
+ * @param out n averages
+ */
+void MovingAverage::process(const uint16_t *in, size_t n, float *out)
+{
+	// 1 サンプルごとに前の窓の和に依存するのでベクトル化せず、足し引きだけで更新する
+	const size_t size = history.size();
+	for(size_t i = 0; i < n; ++i)
+	{
+		sum += in[i];
+		if(filled == size)
+			sum -= history[next];
+		else
+			++filled;
+		history[next] = in[i];
+		if(++next == size)
+			next = 0;
+		out[i] = (float)((double)sum / (double)filled);
+	}
+}
+
+void MovingAverage::reset()
+{
+	next = filled = 0;
+	sum = 0;
+}
+
+CrossingDetector::CrossingDetector(uint16_t _threshold, uint16_t _hysteresis)
+	: upper(_threshold > 0xFFFF - _hysteresis ? 0xFFFF : _threshold + _hysteresis),
+	  lower(_threshold < _hysteresis ? 0 : _threshold - _hysteresis),
+	  state(UNKNOWN_STATE), position(0)
+{
+}
+
+void CrossingDetector::reset()
+{
+	state = UNKNOWN_STATE;
+	position = 0;
+}
+
+/**
+ * 範囲 [below, above] の外にある最初のサンプルを探す
+ * 外れたサンプルのない 8 サンプルはまとめて読み飛ばす
+ * @return 見つからなければ n
+ */
+static size_t find_outside(const uint16_t *in, size_t i, size_t n, uint16_t below, uint16_t above)
+{
+#if defined(GROVEPI_DSP_SSE2)
+	// 符号付きの比較しかないので 0x8000 をずらして比べる
+	const __m128i bias = _mm_set1_epi16((short)0x8000);
+	const __m128i vbelow = _mm_set1_epi16((short)(below ^ 0x8000));
+	const __m128i vabove = _mm_set1_epi16((short)(above ^ 0x8000));
+	for(; i + 8 <= n; i += 8)
+	{
+		__m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), bias);
+		__m128i out = _mm_or_si128(_mm_cmplt_epi16(s, vbelow), _mm_cmpgt_epi16(s, vabove));
+		if(_mm_movemask_epi8(out) != 0)
+			break;
+	}
+#elif defined(GROVEPI_DSP_NEON)
+	const uint16x8_t vbelow = vdupq_n_u16(below);
+	const uint16x8_t vabove = vdupq_n_u16(above);
+	for(; i + 8 <= n; i += 8)
+	{
+		uint16x8_t v = vld1q_u16(in + i);
+		uint16x8_t out = vorrq_u16(vcltq_u16(v, vbelow), vcgtq_u16(v, vabove));
+		uint16x4_t half = vorr_u16(vget_low_u16(out), vget_high_u16(out));
+		if(vget_lane_u64(vreinterpret_u64_u16(half), 0) != 0)
+			break;
+	}
+#endif
+	for(; i < n; ++i)
+	{
+		if(in[i] < below || in[i] > above)
+			return i;
+	}
+	return n;
+}
+
+/**
+ * threshold crossings of the next block
+ * @param  in      read_u16() samples
+ * @param  n       number of samples
+ * @param  out     max_out entries
+ * @param  max_out size of out
+ * @return         number of crossings written
+ */
+size_t CrossingDetector::process(const uint16_t *in, size_t n, Crossing *out, size_t max_out)
+{
+	size_t found = 0;
+	size_t i = 0;
+	while(i < n)
+	{
+		// 今の状態から抜けるサンプルだけを探す (LOW なら上限より上、HIGH なら下限より下)
+		if(state == LOW_STATE)
+			i = find_outside(in, i, n, 0, upper);
+		else if(state == HIGH_STATE)
+			i = find_outside(in, i, n, lower, 0xFFFF);
+		else
+			i = find_outside(in, i, n, lower, upper);
+		if(i == n)
+			break;
+
+		bool rising = in[i] > upper;
+		if(state != UNKNOWN_STATE && found < max_out)
+		{
+			out[found].index = position + i;
+			out[found].rising = rising;
+			++found;
+		}
+		state = rising ? HIGH_STATE : LOW_STATE;
+		++i;
+	}
+	position += n;
+	return found;
+}
+
+/**
+ * precompute the window and twiddle factors for blocks of _size samples
+ * @param _size power of two, 2 - MAX_SIZE
+ */
+Spectrum::Spectrum(size_t _size)
+	: n(_size)
+{
+	if(n < 2 || n > MAX_SIZE || (n & (n - 1)) != 0)
+		throw I2CError("[GrovePiError in Spectrum: size is not a power of two]\n");
+
+	window.resize(n);
+	for(size_t i = 0; i < n; ++i)
+		window[i] = (float)(0.5 - 0.5 * cos(2.0 * M_PI * (double)i / (double)n));
+
+	cos_table.resize(n / 2);
+	sin_table.resize(n / 2);
+	for(size_t k = 0; k < n / 2; ++k)
+	{
+		cos_table[k] = (float)cos(2.0 * M_PI * (double)k / (double)n);
+		sin_table[k] = (float)-sin(2.0 * M_PI * (double)k / (double)n);
+	}
+
+	unsigned int bits = 0;
+	while(((size_t)1 << bits) < n)
+		++bits;
+	reversed.resize(n);
+	for(size_t i = 0; i < n; ++i)
+	{
+		uint32_t r = 0;
+		for(unsigned int b = 0; b < bits; ++b)
+		{
+			if(i & ((size_t)1 << b))
+				r |= 1u << (bits - 1 - b);
+		}
+		reversed[i] = r;
+	}
+
+	re.resize(n);
+	im.resize(n);
+	bin_power.resize(n / 2 + 1);
+}
+
+// re / im (ビット反転順に並べ済み) をその場で変換する基数 2 の FFT
+void Spectrum::transform()
+{
+	for(size_t len = 2; len <= n; len <<= 1)
+	{
+		size_t half = len / 2;
+		size_t step = n / len;
+		for(size_t start = 0; start < n; start += len)
+		{
+			for(size_t k = 0; k < half; ++k)
+			{
+				float wr = cos_table[k * step];
+				float wi = sin_table[k * step];
+				size_t a = start + k;
+				size_t b = a + half;
+				float tr = re[b] * wr - im[b] * wi;
+				float ti = re[b] * wi + im[b] * wr;
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+	}
+}
+
+/**
+ * power spectrum of one block
+ * @param in  size() read_u16() samples
+ * @param out bins() values
+ */
+void Spectrum::power(const uint16_t *in, float *out)
+{
+	// 平均を引いて float にするところまではベクトル化した toFloat() に任せ、
+	// 窓を掛けながらビット反転順に並べ替える
+	float mean = (float)stats(in, n).mean;
+	toFloat(in, n, im.data(), 1.0f, -mean);
+	for(size_t i = 0; i < n; ++i)
+		re[reversed[i]] = im[i] * window[i];
+	for(size_t i = 0; i < n; ++i)
+		im[i] = 0.0f;
+
+	transform();
+
+	for(size_t k = 0; k <= n / 2; ++k)
+		out[k] = re[k] * re[k] + im[k] * im[k];
+}
+
+/**
+ * energy of frequency bands of one block
+ * @param in             size() read_u16() samples
+ * @param sample_rate_hz rate the block was sampled at
+ * @param edges_hz       bands + 1 ascending band edges
+ * @param bands          number of bands
+ * @param out            bands values
+ */
+void Spectrum::bandEnergies(const uint16_t *in, float sample_rate_hz, const float *edges_hz, size_t bands,
+                            float *out)
+{
+	if(sample_rate_hz <= 0.0f)
+		throw I2CError("[GrovePiError in Spectrum: sample rate is 0]\n");
+
+	power(in, bin_power.data());
+
+	const double bin_hz = (double)sample_rate_hz / (double)n;
+	const size_t count = bins();
+	for(size_t b = 0; b < bands; ++b)
+	{
+		double first = ceil((double)edges_hz[b] / bin_hz);
+		double last = ceil((double)edges_hz[b + 1] / bin_hz);
+		size_t k = first < 0.0 ? 0 : (size_t)first;
+		size_t end = last < 0.0 ? 0 : (size_t)last;
+		if(end > count)
+			end = count;
+
+		float energy = 0.0f;
+		for(; k < end; ++k)
+			energy += bin_power[k];
+		out[b] = energy;
+	}
+}
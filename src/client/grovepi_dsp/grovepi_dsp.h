@@ -0,0 +1,145 @@
+#ifndef GROVEPI_DSP_H
+#define GROVEPI_DSP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "grovepi.h"
+
+// post-processing of streamed read_u16() samples (see AnalogStream)
+// the kernels work on contiguous blocks, write into buffers given by the
+// caller and never allocate; they use SSE2 on x86 and NEON on ARM
+// (aarch64, or 32-bit builds with -mfpu=neon) and plain C++ elsewhere
+namespace GrovePi
+{
+  namespace dsp
+  {
+	  // scale of analogRead(): read_u16() >> 6 gives 0-1023
+	  static const int ANALOG_SHIFT = 6;
+
+	  // out[i] = in[i] * scale + offset
+	  // the default scale maps 0-65535 to 0.0-1.0
+	  void toFloat(const uint16_t *in, size_t n, float *out, float scale = 1.0f / 65535.0f, float offset = 0.0f);
+
+	  // out[i] = in[i] >> ANALOG_SHIFT (same values as analogRead()); in and out may be the same buffer
+	  void toAnalog(const uint16_t *in, size_t n, uint16_t *out);
+
+	  struct BlockStats
+	  {
+		  size_t count;
+		  uint16_t min;
+		  uint16_t max;
+		  double mean;
+		  double rms;        // sqrt(mean of squares), includes the DC level
+		  double stddev;     // population standard deviation (AC part of rms)
+
+		  // largest deviation from the mean, in raw units (peak level of an AC signal)
+		  double peak() const;
+	  };
+
+	  // min/max/mean/rms/stddev of one block in a single pass
+	  BlockStats stats(const uint16_t *in, size_t n);
+
+	  // stats() of consecutive windows of window samples (a shorter tail is left out)
+	  // returns the number of windows written to out
+	  size_t windowStats(const uint16_t *in, size_t n, size_t window, BlockStats *out);
+
+	  // nearest-rank percentile (p = 0.0-1.0) of one block, in two counting passes
+	  // without sorting or copying the block (n must not be 0)
+	  uint16_t percentile(const uint16_t *in, size_t n, double p);
+
+	  // mean of the last window samples, carried over from block to block
+	  class MovingAverage
+	  {
+		  public:
+
+			  explicit MovingAverage(size_t _window);
+
+			  // out[i] = mean of the window ending at in[i]
+			  // (until the window is full, the mean of the samples seen so far)
+			  void process(const uint16_t *in, size_t n, float *out);
+			  void reset();
+			  size_t window() const { return history.size(); }
+
+		  private:
+
+			  std::vector<uint16_t> history;
+			  size_t next;
+			  size_t filled;
+			  uint64_t sum;
+	  };
+
+	  // where a level crossing was found
+	  struct Crossing
+	  {
+		  uint64_t index;  // sample index counted from the first processed block
+		  bool rising;
+	  };
+
+	  // threshold crossings with hysteresis over a sequence of blocks:
+	  // a rising crossing is a sample above threshold + hysteresis after the
+	  // level was below threshold - hysteresis, and the other way round
+	  class CrossingDetector
+	  {
+		  public:
+
+			  CrossingDetector(uint16_t _threshold, uint16_t _hysteresis = 0);
+
+			  // finds the crossings of the next block and writes at most max_out of them
+			  // returns the number of crossings written (later ones in the block are lost)
+			  size_t process(const uint16_t *in, size_t n, Crossing *out, size_t max_out);
+			  void reset();
+
+			  // true once the level was above the upper bound (until it falls below the lower one)
+			  bool high() const { return state == HIGH_STATE; }
+
+		  private:
+
+			  enum State { UNKNOWN_STATE, LOW_STATE, HIGH_STATE };
+
+			  uint16_t upper;
+			  uint16_t lower;
+			  State state;
+			  uint64_t position;
+	  };
+
+	  // Hann-windowed power spectrum of blocks of a fixed power-of-two size
+	  // the tables and work buffers are allocated once by the constructor
+	  class Spectrum
+	  {
+		  public:
+
+			  static const size_t MAX_SIZE = 4096;
+
+			  explicit Spectrum(size_t _size);
+
+			  size_t size() const { return n; }
+			  size_t bins() const { return n / 2 + 1; }
+
+			  // power of bins() frequency bins (bin k is k * sample_rate / size() Hz)
+			  // of the first size() samples of in, with the mean removed
+			  void power(const uint16_t *in, float *out);
+
+			  // energy in bands [edges_hz[b], edges_hz[b + 1]) for b < bands
+			  // (edges_hz has bands + 1 ascending entries)
+			  void bandEnergies(const uint16_t *in, float sample_rate_hz, const float *edges_hz, size_t bands,
+			                    float *out);
+
+		  private:
+
+			  size_t n;
+			  std::vector<float> window;
+			  std::vector<float> cos_table;
+			  std::vector<float> sin_table;
+			  std::vector<uint32_t> reversed;
+			  std::vector<float> re;
+			  std::vector<float> im;
+			  std::vector<float> bin_power;
+
+			  void transform();
+	  };
+  }
+}
+
+#endif
@@ -0,0 +1,113 @@
+#include "grovepi_ledstrip.h"
+
+using GrovePi::LedStrip;
+
+/**
+ * WS2812 strip on a digital pin of defaultDevice()
+ * @param _pin        digital pin number (16/18/20) wired to DIN
+ * @param _count      number of LEDs (up to MAX_LEDS)
+ * @param _brightness global brightness (0-255), applied on the Pico
+ */
+LedStrip::LedStrip(uint8_t _pin, unsigned int _count, uint8_t _brightness)
+	: dev(&defaultDevice()), pin_number(_pin), count(_count > MAX_LEDS ? MAX_LEDS : _count),
+	  brightness(_brightness), frame(count * 3, 0)
+{
+}
+
+/**
+ * WS2812 strip on a digital pin of the given Pico
+ * @param _device     device the strip is connected to
+ * @param _pin        digital pin number (16/18/20) wired to DIN
+ * @param _count      number of LEDs (up to MAX_LEDS)
+ * @param _brightness global brightness (0-255), applied on the Pico
+ */
+LedStrip::LedStrip(Device &_device, uint8_t _pin, unsigned int _count, uint8_t _brightness)
+	: dev(&_device), pin_number(_pin), count(_count > MAX_LEDS ? MAX_LEDS : _count),
+	  brightness(_brightness), frame(count * 3, 0)
+{
+}
+
+LedStrip::~LedStrip()
+{
+	try
+	{
+		wait();
+	}
+	catch(I2CError &)
+	{
+	}
+}
+
+/**
+ * set up the strip on the Pico (needs ws2812.py on the Pico)
+ * the LEDs keep their colours until the first show()
+ */
+void LedStrip::begin()
+{
+	wait();
+
+	char buf[64];
+	snprintf(buf, sizeof(buf), "ledStripInit(%u, %u, %u)", pin_number, count, brightness);
+	dev->setRestoreCommand(pin_number, "");
+	if(dev->submit(buf).line() == "error")
+		throw I2CError("[GrovePiError in ledStripInit]\n");
+	dev->setRestoreCommand(pin_number, buf);
+}
+
+/**
+ * change the global brightness; takes effect with the next show()
+ * @param _brightness 0-255
+ */
+void LedStrip::setBrightness(uint8_t _brightness)
+{
+	wait();
+
+	char buf[64];
+	snprintf(buf, sizeof(buf), "ledStripBrightness(%u, %u)", pin_number, _brightness);
+	if(dev->submit(buf).line() == "error")
+		throw I2CError("[GrovePiError in ledStripBrightness]\n");
+	brightness = _brightness;
+
+	// a reconnect sets the strip up again with the new brightness
+	snprintf(buf, sizeof(buf), "ledStripInit(%u, %u, %u)", pin_number, count, brightness);
+	dev->setRestoreCommand(pin_number, buf);
+}
+
+void LedStrip::setPixel(unsigned int index, uint8_t r, uint8_t g, uint8_t b)
+{
+	if(index >= count)
+		return;
+	uint8_t *p = &frame[index * 3];
+	p[0] = r;
+	p[1] = g;
+	p[2] = b;
+}
+
+void LedStrip::fill(uint8_t r, uint8_t g, uint8_t b)
+{
+	for(unsigned int i = 0; i < count; ++i)
+		setPixel(i, r, g, b);
+}
+
+/**
+ * send the current pixels as one frame
+ * returns as soon as the frame is written; only the reply of the previous
+ * frame is waited for, so the next frame can be prepared meanwhile
+ */
+void LedStrip::show()
+{
+	// 応答待ちは 1 フレームまでにして、Pico の受信が追いつかないときは待つ
+	wait();
+	in_flight.reset(new Future<void>(dev->ledStripWriteAsync(pin_number, &frame[0], count)));
+}
+
+/**
+ * wait until the Pico has accepted the last frame, throws if it was rejected
+ */
+void LedStrip::wait()
+{
+	if(!in_flight)
+		return;
+	std::unique_ptr<Future<void> > pending(in_flight.release());
+	pending->get();
+}
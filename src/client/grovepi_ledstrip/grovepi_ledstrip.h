@@ -0,0 +1,55 @@
+#ifndef GROVEPI_LEDSTRIP_H
+#define GROVEPI_LEDSTRIP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <vector>
+
+#include "grovepi.h"
+
+namespace GrovePi
+{
+  // WS2812 (NeoPixel) strip driven by the Pico's PIO;
+  // the pixels are kept on the host and show() sends the whole frame as one command
+  class LedStrip
+  {
+	  public:
+
+		  static const unsigned int MAX_LEDS = 341;
+
+		  LedStrip(uint8_t _pin, unsigned int _count, uint8_t _brightness = 255);
+		  LedStrip(Device &_device, uint8_t _pin, unsigned int _count, uint8_t _brightness = 255);
+		  ~LedStrip();
+
+		  void begin();
+		  void setBrightness(uint8_t _brightness);
+
+		  void setPixel(unsigned int index, uint8_t r, uint8_t g, uint8_t b);
+		  void fill(uint8_t r, uint8_t g, uint8_t b);
+		  void clear() { fill(0, 0, 0); }
+
+		  void show();
+		  void wait();
+
+		  unsigned int size() const { return count; }
+		  uint8_t *pixels() { return &frame[0]; }
+		  Device &device() const { return *dev; }
+		  uint8_t pin() const { return pin_number; }
+
+	  private:
+
+		  LedStrip(const LedStrip &);
+		  LedStrip &operator=(const LedStrip &);
+
+		  Device *const dev;
+		  const uint8_t pin_number;
+		  const unsigned int count;
+		  uint8_t brightness;
+
+		  std::vector<uint8_t> frame;       // R, G, B per LED
+		  std::unique_ptr<Future<void> > in_flight;
+  };
+}
+
+#endif
@@ -0,0 +1,93 @@
+//
+// GrovePi Example for a WS2812 (NeoPixel) LED strip
+//
+// The pixels live on the host and every show() sends the whole frame
+// as one command, which the Pico shifts out with its PIO.
+//
+/*
+## License
+
+   The MIT License (MIT)
+
+   GrovePi for the Raspberry Pi: an open source platform for connecting Grove Sensors to the Raspberry Pi.
+   Copyright (C) 2017  Dexter Industries
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "grovepi_ledstrip.h"
+
+using namespace GrovePi;
+
+// sudo g++ -Wall -pthread grovepi.cpp grovepi_ledstrip/grovepi_ledstrip.cpp grovepi_ledstrip/grovepi_ledstrip_example.cpp -o grovepi_ledstrip_example.out -> without grovepicpp package installed
+
+// colour wheel: 0-255 goes r - g - b - back to r
+static void wheel(uint8_t pos, uint8_t &r, uint8_t &g, uint8_t &b)
+{
+	if(pos < 85)
+	{
+		r = 255 - pos * 3; g = pos * 3; b = 0;
+	}
+	else if(pos < 170)
+	{
+		pos -= 85;
+		r = 0; g = 255 - pos * 3; b = pos * 3;
+	}
+	else
+	{
+		pos -= 170;
+		r = pos * 3; g = 0; b = 255 - pos * 3;
+	}
+}
+
+int main()
+{
+	int pin = 18;     // DIN of the strip is connected to digital port D18
+	int leds = 144;   // number of LEDs on the strip
+
+	try
+	{
+		initGrovePi();
+		setBinaryMode(true); // raw frames instead of base64 text
+
+		LedStrip strip(pin, leds, 64);
+		strip.begin();
+
+		// rainbow at about 60 frames per second
+		for(unsigned int frame = 0; ; ++frame)
+		{
+			for(int i = 0; i < leds; ++i)
+			{
+				uint8_t r, g, b;
+				wheel((uint8_t)(i * 256 / leds + frame), r, g, b);
+				strip.setPixel(i, r, g, b);
+			}
+			strip.show();
+			delay(16);
+		}
+	}
+	catch(I2CError &error)
+	{
+		printf("%s", error.detail());
+
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,215 @@
+#include "grovepi_recorder.h"
+
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using GrovePi::Recorder;
+using GrovePi::Record;
+using GrovePi::RecorderHeader;
+
+static const char RECORDER_MAGIC[8] = "GPREC01";
+
+static uint64_t monotonic_ns()
+{
+	// vDSO で処理されるのでシステムコールにはならない
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * open (or create) the ring file and map it
+ * an existing file with the same record layout keeps its records and capacity,
+ * anything else is truncated to a new ring
+ * @param path      file to record into
+ * @param _capacity records in the ring when the file is created
+ */
+Recorder::Recorder(const std::string &path, size_t _capacity)
+	: file_path(path), fd(-1), slots(0), map_size(0), header(NULL), records(NULL)
+{
+	if(_capacity == 0)
+		throw I2CError("[GrovePiError in Recorder: capacity is 0]\n");
+
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if(fd < 0)
+		throw I2CError("[GrovePiError opening recorder file]\n");
+
+	// 既存のファイルを同じ形式なら続きから使う
+	RecorderHeader existing;
+	struct stat st;
+	bool reuse = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(existing) &&
+	             pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing) &&
+	             memcmp(existing.magic, RECORDER_MAGIC, sizeof(RECORDER_MAGIC)) == 0 &&
+	             existing.record_size == sizeof(Record) && existing.header_size == sizeof(RecorderHeader) &&
+	             existing.capacity > 0 &&
+	             (uint64_t)st.st_size == sizeof(RecorderHeader) + existing.capacity * sizeof(Record);
+
+	slots = reuse ? (size_t)existing.capacity : _capacity;
+	map_size = sizeof(RecorderHeader) + slots * sizeof(Record);
+	if(!reuse && (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)map_size) != 0))
+	{
+		::close(fd);
+		throw I2CError("[GrovePiError creating recorder file]\n");
+	}
+
+	void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+	{
+		::close(fd);
+		throw I2CError("[GrovePiError mapping recorder file]\n");
+	}
+
+	header = (RecorderHeader *)map;
+	records = (Record *)((char *)map + sizeof(RecorderHeader));
+	if(!reuse)
+	{
+		// 新しいファイルは 0 で埋まっているので、ヘッダだけ書く (magic は最後)
+		header->record_size = sizeof(Record);
+		header->header_size = sizeof(RecorderHeader);
+		header->capacity = slots;
+		__atomic_store_n(&header->next, 0, __ATOMIC_RELAXED);
+		memcpy(header->magic, RECORDER_MAGIC, sizeof(RECORDER_MAGIC));
+	}
+}
+
+Recorder::~Recorder()
+{
+	munmap(header, map_size);
+	::close(fd);
+}
+
+/**
+ * 1 レコードを書き込む
+ * 書き込み位置は fetch_add で取るので、複数のスレッドから同時に呼べる
+ * seq を最後に書き、読み手は seq が一致するレコードだけを使う
+ */
+void Recorder::append(uint64_t host_ns, uint8_t kind, uint8_t pin, double value, uint32_t pico_us, uint8_t flags)
+{
+	uint64_t n = __atomic_fetch_add(&header->next, 1, __ATOMIC_RELAXED);
+	Record &r = records[n % slots];
+
+	__atomic_store_n(&r.seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r.host_ns = host_ns;
+	r.value = value;
+	r.pico_us = pico_us;
+	r.pin = pin;
+	r.kind = kind;
+	r.flags = flags;
+	__atomic_store_n(&r.seq, (uint32_t)(n + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * append one value timestamped with the host's monotonic clock
+ * @param kind  RecordKind
+ * @param pin   pin (or bus) the value was read from
+ * @param value the value
+ */
+void Recorder::record(uint8_t kind, uint8_t pin, double value)
+{
+	append(monotonic_ns(), kind, pin, value, 0, 0);
+}
+
+/**
+ * append one value that also has the Pico's timestamp
+ * @param kind    RecordKind
+ * @param pin     pin (or bus) the value was read from
+ * @param value   the value
+ * @param pico_us Pico's ticks_us() when it was sampled
+ */
+void Recorder::record(uint8_t kind, uint8_t pin, double value, uint32_t pico_us)
+{
+	append(monotonic_ns(), kind, pin, value, pico_us, Record::HAS_PICO_TIME);
+}
+
+/**
+ * append every pin of a snapshot (all with the snapshot's Pico time)
+ */
+void Recorder::record(const Snapshot &snapshot)
+{
+	uint64_t now = monotonic_ns();
+	for(uint8_t i = 0; i < 3; ++i)
+	{
+		if(snapshot.has((uint8_t)(SNAPSHOT_A0 << i)))
+			append(now, RECORD_ANALOG, i, snapshot.analog[i], snapshot.pico_us, Record::HAS_PICO_TIME);
+	}
+	for(uint8_t i = 0; i < 3; ++i)
+	{
+		if(snapshot.has((uint8_t)(SNAPSHOT_D16 << i)))
+			append(now, RECORD_DIGITAL, (uint8_t)(16 + 2 * i), snapshot.digital[i] ? 1 : 0,
+			       snapshot.pico_us, Record::HAS_PICO_TIME);
+	}
+}
+
+/**
+ * append the temperature and humidity of a DHT reading,
+ * timestamped when the Pico took the sample if its age is known
+ * @param pin     pin the sensor is connected to
+ * @param reading result of dhtReadAsync()
+ */
+void Recorder::record(uint8_t pin, const DHTReading &reading)
+{
+	uint64_t now = monotonic_ns();
+	if(reading.age_ms > 0)
+		now -= (uint64_t)reading.age_ms * 1000000ull;
+	append(now, RECORD_TEMPERATURE, pin, reading.temp, 0, 0);
+	append(now, RECORD_HUMIDITY, pin, reading.humidity, 0, 0);
+}
+
+/**
+ * append every sample of a stream block (call it from the stream callback)
+ */
+void Recorder::record(const SampleBlock &block)
+{
+	uint64_t now = monotonic_ns();
+	for(size_t i = 0; i < block.count; ++i)
+		append(now, RECORD_SAMPLE, block.pin, block.samples[i], 0, 0);
+}
+
+/**
+ * append a digital edge (call it from the onChange() callback)
+ */
+void Recorder::record(const DigitalChange &change)
+{
+	append(monotonic_ns(), RECORD_EDGE, change.pin, change.level ? 1 : 0, change.pico_us, Record::HAS_PICO_TIME);
+}
+
+/**
+ * handler that records "!<name> <pin> <value>" events such as "!ultrasonic 16 42"
+ * @param  kind RecordKind to store them as
+ * @return      handler for setEventHandler()
+ */
+GrovePi::EventHandler Recorder::eventHandler(uint8_t kind)
+{
+	return [this, kind](const std::string &args) {
+		char *end;
+		unsigned long pin = strtoul(args.c_str(), &end, 10);
+		if(end == args.c_str())
+			return;
+		const char *value_str = end;
+		double value = strtod(value_str, &end);
+		if(end == value_str)
+			return;
+		record(kind, (uint8_t)pin, value);
+	};
+}
+
+/**
+ * write the mapped records back to the file now
+ * (the kernel does it on its own, this is only needed before a power cut)
+ */
+void Recorder::sync()
+{
+	if(msync(header, map_size, MS_SYNC) != 0)
+		throw I2CError("[GrovePiError syncing recorder file]\n");
+}
+
+/**
+ * @return records written so far (including those already overwritten)
+ */
+uint64_t Recorder::count() const
+{
+	return __atomic_load_n(&header->next, __ATOMIC_RELAXED);
+}
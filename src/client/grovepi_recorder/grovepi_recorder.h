@@ -0,0 +1,100 @@
+#ifndef GROVEPI_RECORDER_H
+#define GROVEPI_RECORDER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#include "grovepi.h"
+#include "grovepi_stream/grovepi_stream.h"
+#include "grovepi_watch/grovepi_watch.h"
+
+namespace GrovePi
+{
+  // what a record holds (Record::kind)
+  enum RecordKind
+  {
+	  RECORD_DIGITAL = 1,     // digitalRead / snapshot, value 0 or 1
+	  RECORD_ANALOG = 2,      // analogRead (0-1023) or snapshot (read_u16 units)
+	  RECORD_ULTRASONIC = 3,  // distance in cm
+	  RECORD_TEMPERATURE = 4, // DHT temperature in degrees C
+	  RECORD_HUMIDITY = 5,    // DHT relative humidity in %
+	  RECORD_SAMPLE = 6,      // one AnalogStream sample (read_u16 units)
+	  RECORD_EDGE = 7,        // digital edge from onChange(), value = level after the edge
+	  RECORD_USER = 128       // first kind free for the application
+  };
+
+  // one fixed-size record of the ring file
+  struct Record
+  {
+	  static const uint8_t HAS_PICO_TIME = 0x01;
+
+	  uint64_t host_ns;  // CLOCK_MONOTONIC of the host
+	  double value;
+	  uint32_t pico_us;  // Pico's ticks_us() if flags has HAS_PICO_TIME
+	  uint32_t seq;      // low 32 bits of (record number + 1), written last
+	  uint8_t pin;
+	  uint8_t kind;      // RecordKind
+	  uint8_t flags;
+	  uint8_t reserved[5];
+  };
+
+  // header at the start of the ring file
+  struct RecorderHeader
+  {
+	  char magic[8];     // "GPREC01"
+	  uint32_t record_size;
+	  uint32_t header_size;
+	  uint64_t capacity; // records in the ring
+	  uint64_t next;     // records written so far (the ring holds the last capacity of them)
+	  uint8_t reserved[32];
+  };
+
+  // appends records to a memory-mapped ring file: no allocation and
+  // no system call per record, safe to call from several threads
+  // (the event thread included); the oldest records are overwritten
+  // the file stays readable by grovepi_recorder_export while recording
+  class Recorder
+  {
+	  public:
+
+		  static const size_t DEFAULT_CAPACITY = 1 << 20;
+
+		  explicit Recorder(const std::string &path, size_t _capacity = DEFAULT_CAPACITY);
+		  ~Recorder();
+
+		  void record(uint8_t kind, uint8_t pin, double value);
+		  void record(uint8_t kind, uint8_t pin, double value, uint32_t pico_us);
+
+		  void record(const Snapshot &snapshot);
+		  void record(uint8_t pin, const DHTReading &reading);
+		  void record(const SampleBlock &block);
+		  void record(const DigitalChange &change);
+
+		  // handler for "!<name> <pin> <value>" events
+		  // (e.g. setEventHandler("ultrasonic", recorder.eventHandler(RECORD_ULTRASONIC)))
+		  EventHandler eventHandler(uint8_t kind);
+
+		  void sync();
+
+		  uint64_t count() const;
+		  size_t capacity() const { return slots; }
+		  const std::string &path() const { return file_path; }
+
+	  private:
+
+		  Recorder(const Recorder &);
+		  Recorder &operator=(const Recorder &);
+
+		  const std::string file_path;
+		  int fd;
+		  size_t slots;
+		  size_t map_size;
+		  RecorderHeader *header;
+		  Record *records;
+
+		  void append(uint64_t host_ns, uint8_t kind, uint8_t pin, double value, uint32_t pico_us, uint8_t flags);
+  };
+}
+
+#endif
@@ -0,0 +1,74 @@
+//
+// GrovePi Example for logging sensor values to a memory-mapped ring file
+//
+// Every value the loop reads is appended to /tmp/grovepi.rec as a fixed-size
+// record instead of a printf line; export it afterwards with
+//   grovepi_recorder_export.out /tmp/grovepi.rec > samples.csv
+//
+/*
+## License
+
+   The MIT License (MIT)
+
+   GrovePi for the Raspberry Pi: an open source platform for connecting Grove Sensors to the Raspberry Pi.
+   Copyright (C) 2017  Dexter Industries
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "grovepi_recorder.h"
+
+using namespace GrovePi;
+
+// sudo g++ -Wall -pthread grovepi.cpp grovepi_recorder/grovepi_recorder.cpp grovepi_recorder/grovepi_recorder_example.cpp -o grovepi_recorder_example.out -> without grovepicpp package installed
+
+int main()
+{
+	int light_sensor_pin = 1; // analog port A1
+	int dht_pin = 4;          // digital port D4 for the DHT sensor
+	Recorder recorder("/tmp/grovepi.rec");
+
+	try
+	{
+		initGrovePi();
+
+		for(unsigned int tick = 0; ; ++tick)
+		{
+			// one round trip for all analog and digital inputs, timestamped by the Pico
+			recorder.record(snapshot());
+			recorder.record(RECORD_ANALOG, light_sensor_pin, analogRead(light_sensor_pin));
+
+			// the DHT is slow, read it once a second
+			if(tick % 10 == 0)
+				recorder.record(dht_pin, dhtReadAsync(dht_pin, 0).get());
+
+			if(tick % 100 == 0)
+				printf("[%llu records in %s]\n", (unsigned long long)recorder.count(), recorder.path().c_str());
+			delay(100);
+		}
+	}
+	catch(I2CError &error)
+	{
+		printf("%s", error.detail());
+
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,145 @@
+//
+// GrovePi recorder export tool
+//
+// Prints the records of a GrovePi::Recorder ring file as CSV, oldest first.
+// The file can still be recorded into; records being overwritten are skipped,
+// and the export stops at a record that is still being written.
+//
+// Usage: grovepi_recorder_export.out FILE [--since N]
+//   --since N only print records numbered N and later
+//             (stderr ends with "resume with --since M"; pass M to continue)
+//
+/*
+## License
+
+   The MIT License (MIT)
+
+   GrovePi for the Raspberry Pi: an open source platform for connecting Grove Sensors to the Raspberry Pi.
+   Copyright (C) 2017  Dexter Industries
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "grovepi_recorder.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace GrovePi;
+
+static const char *kind_name(uint8_t kind)
+{
+	switch(kind)
+	{
+		case RECORD_DIGITAL: return "digital";
+		case RECORD_ANALOG: return "analog";
+		case RECORD_ULTRASONIC: return "ultrasonic";
+		case RECORD_TEMPERATURE: return "temperature";
+		case RECORD_HUMIDITY: return "humidity";
+		case RECORD_SAMPLE: return "sample";
+		case RECORD_EDGE: return "edge";
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL;
+	uint64_t since = 0;
+	bool usage = false;
+	for(int i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "--since") == 0 && i + 1 < argc)
+			since = strtoull(argv[++i], NULL, 10);
+		else if(path == NULL && argv[i][0] != '-')
+			path = argv[i];
+		else
+			usage = true;
+	}
+	if(path == NULL || usage)
+	{
+		fprintf(stderr, "usage: %s FILE [--since N]\n", argv[0]);
+		return 2;
+	}
+
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(RecorderHeader))
+	{
+		fprintf(stderr, "%s: cannot read\n", path);
+		return 1;
+	}
+
+	void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: cannot map\n", path);
+		return 1;
+	}
+
+	const RecorderHeader *header = (const RecorderHeader *)map;
+	if(memcmp(header->magic, "GPREC01", 8) != 0 || header->record_size != sizeof(Record) ||
+	   header->header_size != sizeof(RecorderHeader) || header->capacity == 0 ||
+	   (uint64_t)st.st_size < sizeof(RecorderHeader) + header->capacity * sizeof(Record))
+	{
+		fprintf(stderr, "%s: not a recorder file\n", path);
+		return 1;
+	}
+
+	const Record *records = (const Record *)((const char *)map + sizeof(RecorderHeader));
+	uint64_t next = __atomic_load_n(&header->next, __ATOMIC_ACQUIRE);
+	uint64_t first = next > header->capacity ? next - header->capacity : 0;
+	if(since > first)
+		first = since;
+
+	// 次に書き出しを始める番号
+	uint64_t resume = next > since ? next : since;
+	printf("record,host_ns,pico_us,pin,kind,value\n");
+	for(uint64_t n = first; n < next; ++n)
+	{
+		// 書き込み中・上書き済みのレコードは seq が一致しない
+		const Record &slot = records[n % header->capacity];
+		uint32_t seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+		Record r = slot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(seq != (uint32_t)(n + 1) || __atomic_load_n(&slot.seq, __ATOMIC_RELAXED) != seq)
+		{
+			// seq が新しければ上書き済みなので飛ばす
+			// 古ければまだ書き込み中なので、ここで止めて次回はここから書き出す
+			if((int32_t)(seq - (uint32_t)(n + 1)) > 0)
+				continue;
+			resume = n;
+			break;
+		}
+
+		printf("%llu,%llu,", (unsigned long long)n, (unsigned long long)r.host_ns);
+		if(r.flags & Record::HAS_PICO_TIME)
+			printf("%u", r.pico_us);
+		const char *name = kind_name(r.kind);
+		if(name != NULL)
+			printf(",%u,%s,%.9g\n", r.pin, name, r.value);
+		else
+			printf(",%u,%u,%.9g\n", r.pin, r.kind, r.value);
+	}
+	fprintf(stderr, "resume with --since %llu\n", (unsigned long long)resume);
+
+	munmap(map, (size_t)st.st_size);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,442 @@
+#include "grovepi_scheduler.h"
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <exception>
+
+using GrovePi::Scheduler;
+
+// 期限なし (run() は終わりの時刻を持たない)
+static const uint64_t FOREVER_NS = ~0ull;
+
+uint64_t Scheduler::monotonic_ns()
+{
+	// timerfd と同じ CLOCK_MONOTONIC で数える
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * 最初の run() からの経過時間 (それまでは 0 とみなす)
+ */
+uint64_t Scheduler::elapsed_ns() const
+{
+	return started ? monotonic_ns() - epoch_ns : 0;
+}
+
+// 期限は最初の run() を 0 として数える
+void Scheduler::start()
+{
+	if(started)
+		return;
+	epoch_ns = monotonic_ns();
+	started = true;
+}
+
+Scheduler::Scheduler()
+	: dev(&defaultDevice()), batch(*dev)
+{
+	init();
+}
+
+/**
+ * scheduler for the tasks of one device
+ * @param _device device the batched commands are sent to
+ */
+Scheduler::Scheduler(Device &_device)
+	: dev(&_device), batch(_device)
+{
+	init();
+}
+
+void Scheduler::init()
+{
+	epoch_ns = 0;
+	started = false;
+	coalesce_ns = DEFAULT_COALESCE_US * 1000ull;
+	armed_ns = 0;
+	next_id = 1;
+	next_order = 0;
+	in_tick = false;
+	stopping = false;
+	tick_count = transaction_count = wakeup_count = 0;
+
+	// 待ち合わせはタイマー 1 本と停止用の eventfd だけにする
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(epoll_fd < 0 || timer_fd < 0 || stop_fd < 0)
+	{
+		if(epoll_fd >= 0)
+			close(epoll_fd);
+		if(timer_fd >= 0)
+			close(timer_fd);
+		if(stop_fd >= 0)
+			close(stop_fd);
+		throw I2CError("[GrovePiError creating scheduler timer]\n");
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = timer_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+	ev.data.fd = stop_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev);
+}
+
+Scheduler::~Scheduler()
+{
+	if(epoll_fd >= 0)
+		close(epoll_fd);
+	if(timer_fd >= 0)
+		close(timer_fd);
+	if(stop_fd >= 0)
+		close(stop_fd);
+	epoll_fd = timer_fd = stop_fd = -1;
+}
+
+Scheduler::TaskId Scheduler::add(uint64_t at_ns, uint64_t period_ns, PollFunction poll, DoneFunction done,
+                                 FailFunction fail)
+{
+	TaskId id = next_id++;
+	Task &task = tasks[id];
+	task.period_ns = period_ns;
+	task.poll = poll;
+	task.done = done;
+	task.fail = fail;
+	task.stats.runs = task.stats.missed = task.stats.max_late_us = 0;
+	task.cancelled = false;
+	push(at_ns, id);
+	return id;
+}
+
+void Scheduler::push(uint64_t at_ns, TaskId id)
+{
+	// 同じ期限なら登録順に実行する
+	Deadline deadline = { at_ns, next_order++, id };
+	deadlines.push(deadline);
+}
+
+/**
+ * run a task periodically
+ * @param  period_ms period (must not be 0)
+ * @param  poll      queues the task's commands into the tick's batch (may be nullptr)
+ * @param  done      called after the batch has been sent (may be nullptr)
+ * @param  phase_ms  offset of the deadlines from the first run()
+ * @return           id for cancel() and taskStats()
+ */
+Scheduler::TaskId Scheduler::every(unsigned int period_ms, PollFunction poll, DoneFunction done,
+                                   unsigned int phase_ms)
+{
+	if(period_ms == 0)
+		throw I2CError("[GrovePiError in Scheduler: period is 0]\n");
+
+	// 期限は開始からの周期の倍数にそろえ、登録した時刻によらず同じ周期のタスクが同じ tick に乗るようにする
+	uint64_t period_ns = period_ms * 1000000ull;
+	uint64_t at_ns = phase_ms * 1000000ull;
+	uint64_t now_ns = elapsed_ns();
+	if(at_ns < now_ns)
+		at_ns += (now_ns - at_ns + period_ns - 1) / period_ns * period_ns;
+	return add(at_ns, period_ns, poll, done, nullptr);
+}
+
+/**
+ * run a task once
+ * @param  delay_ms time from now (from the first run() when it has not been called yet)
+ * @param  poll     queues the task's commands into the tick's batch (may be nullptr)
+ * @param  done     called after the batch has been sent (may be nullptr)
+ * @return          id for cancel()
+ */
+Scheduler::TaskId Scheduler::after(unsigned int delay_ms, PollFunction poll, DoneFunction done)
+{
+	return add(elapsed_ns() + delay_ms * 1000000ull, 0, poll, done, nullptr);
+}
+
+/**
+ * remove a task (also from within a task)
+ * @param id returned by every() or after()
+ */
+void Scheduler::cancel(TaskId id)
+{
+	std::map<TaskId, Task>::iterator it = tasks.find(id);
+	if(it == tasks.end())
+		return;
+
+	// tick の途中では実行中の関数を消さないよう、印を付けて終わってから消す
+	if(in_tick)
+	{
+		if(!it->second.cancelled)
+			cancelled.push_back(id);
+		it->second.cancelled = true;
+	}
+	else
+		tasks.erase(it);
+}
+
+bool Scheduler::taskStats(TaskId id, TaskStats &stats) const
+{
+	std::map<TaskId, Task>::const_iterator it = tasks.find(id);
+	if(it == tasks.end())
+		return false;
+	stats = it->second.stats;
+	return true;
+}
+
+/**
+ * how close deadlines must be to share a tick (and its transaction)
+ * @param microseconds tasks due up to this much later run early with the current tick
+ */
+void Scheduler::setCoalesce(unsigned int microseconds)
+{
+	coalesce_ns = microseconds * 1000ull;
+}
+
+/**
+ * called with the error when the batch of a tick fails
+ * without a handler the error is thrown out of run()
+ * the done callbacks of the tasks that had commands in the batch are skipped
+ */
+void Scheduler::onError(ErrorHandler handler)
+{
+	error_handler = handler;
+}
+
+/**
+ * run the tasks until stop() is called or no task is left
+ */
+void Scheduler::run()
+{
+	start();
+	run_until(FOREVER_NS);
+}
+
+/**
+ * run the tasks for a while (or until stop() is called)
+ * @param milliseconds time to run for
+ */
+void Scheduler::runFor(unsigned int milliseconds)
+{
+	start();
+	run_until(elapsed_ns() + milliseconds * 1000000ull);
+}
+
+/**
+ * make run() return after the current tick
+ * can be called from a task, another thread or a signal handler
+ */
+void Scheduler::stop()
+{
+	stopping = true;
+	uint64_t one = 1;
+	ssize_t written = write(stop_fd, &one, sizeof(one));
+	(void)written;
+}
+
+void Scheduler::sweep()
+{
+	for(size_t i = 0; i < cancelled.size(); ++i)
+		tasks.erase(cancelled[i]);
+	cancelled.clear();
+}
+
+void Scheduler::run_until(uint64_t end_ns)
+{
+	while(!stopping)
+	{
+		uint64_t now_ns = elapsed_ns();
+		if(end_ns != FOREVER_NS && now_ns >= end_ns)
+			break;
+
+		// 取り消されたタスクの期限は先頭に来たときに捨てる
+		while(!deadlines.empty() && tasks.find(deadlines.top().id) == tasks.end())
+			deadlines.pop();
+
+		if(deadlines.empty())
+		{
+			if(end_ns == FOREVER_NS)
+				break;
+			wait(end_ns);
+			continue;
+		}
+
+		uint64_t at_ns = deadlines.top().at_ns;
+		if(at_ns <= now_ns + coalesce_ns)
+			tick(now_ns);
+		else
+			wait(at_ns < end_ns ? at_ns : end_ns);
+	}
+	stopping = false;
+}
+
+/**
+ * 次の期限まで (または stop() まで) 眠る
+ * 期限が変わったときだけタイマーを設定し直す
+ */
+void Scheduler::wait(uint64_t until_ns)
+{
+	if(until_ns != armed_ns)
+	{
+		uint64_t at_ns = epoch_ns + until_ns;
+		struct itimerspec spec;
+		spec.it_interval.tv_sec = spec.it_interval.tv_nsec = 0;
+		spec.it_value.tv_sec = (time_t)(at_ns / 1000000000ull);
+		spec.it_value.tv_nsec = (long)(at_ns % 1000000000ull);
+		timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+		armed_ns = until_ns;
+	}
+
+	struct epoll_event events[2];
+	int n = epoll_wait(epoll_fd, events, 2, -1);
+	if(n < 0)
+	{
+		if(errno == EINTR)
+			return;
+		throw I2CError("[GrovePiError waiting for scheduler timer]\n");
+	}
+
+	++wakeup_count;
+	for(int i = 0; i < n; ++i)
+	{
+		uint64_t count;
+		ssize_t r = read(events[i].data.fd, &count, sizeof(count));
+		(void)r;
+		// 満了したタイマーは次の wait() で必ず設定し直す
+		if(events[i].data.fd == timer_fd)
+			armed_ns = 0;
+	}
+}
+
+/**
+ * 期限の来たタスクを 1 回分実行する
+ * 全タスクのコマンドを 1 つのバッチにまとめて送ってから、完了の関数を呼ぶ
+ */
+void Scheduler::tick(uint64_t now_ns)
+{
+	++tick_count;
+	in_tick = true;
+	due.clear();
+	rescheduled.clear();
+
+	// 期限の順に取り出し、周期タスクは次の期限を決める
+	// (この tick の間に再び取り出さないよう、次の期限は最後にまとめて積む)
+	uint64_t limit_ns = now_ns + coalesce_ns;
+	while(!deadlines.empty() && deadlines.top().at_ns <= limit_ns)
+	{
+		Deadline deadline = deadlines.top();
+		deadlines.pop();
+		std::map<TaskId, Task>::iterator it = tasks.find(deadline.id);
+		if(it == tasks.end() || it->second.cancelled)
+			continue;
+
+		Task &task = it->second;
+		++task.stats.runs;
+		uint64_t late_us = now_ns > deadline.at_ns ? (now_ns - deadline.at_ns) / 1000 : 0;
+		if(late_us > task.stats.max_late_us)
+			task.stats.max_late_us = late_us;
+
+		if(task.period_ns != 0)
+		{
+			// 1 周期以上遅れたら、過ぎた期限はまとめて飛ばす
+			uint64_t next_ns = deadline.at_ns + task.period_ns;
+			if(next_ns <= now_ns)
+			{
+				uint64_t skipped = (now_ns - next_ns) / task.period_ns + 1;
+				task.stats.missed += skipped;
+				next_ns += skipped * task.period_ns;
+			}
+			Deadline next = { next_ns, 0, deadline.id };
+			rescheduled.push_back(next);
+		}
+
+		Due entry = { deadline.id, false };
+		due.push_back(entry);
+	}
+	for(size_t i = 0; i < rescheduled.size(); ++i)
+		push(rescheduled[i].at_ns, rescheduled[i].id);
+
+	// タスクの例外は最初の 1 つを覚えておき、残りのタスクを実行してから投げる
+	std::exception_ptr thrown;
+
+	for(size_t i = 0; i < due.size(); ++i)
+	{
+		Task &task = tasks[due[i].id];
+		if(task.cancelled || !task.poll)
+			continue;
+		size_t before = batch.size();
+		try
+		{
+			task.poll(batch);
+		}
+		catch(...)
+		{
+			if(!thrown)
+				thrown = std::current_exception();
+		}
+		due[i].queued = batch.size() != before;
+	}
+
+	bool failed = false;
+	std::string error;
+	if(!batch.empty())
+	{
+		++transaction_count;
+		try
+		{
+			batch.flush();
+		}
+		catch(I2CError &e)
+		{
+			failed = true;
+			error = e.what();
+		}
+	}
+
+	bool unhandled = false;
+	for(size_t i = 0; i < due.size(); ++i)
+	{
+		Task &task = tasks[due[i].id];
+		if(task.cancelled)
+			continue;
+		try
+		{
+			if(failed && due[i].queued)
+			{
+				if(task.fail)
+					task.fail(I2CError(error.c_str()));
+				else
+					unhandled = true;
+			}
+			else if(task.done)
+				task.done();
+		}
+		catch(...)
+		{
+			if(!thrown)
+				thrown = std::current_exception();
+		}
+
+		// 1 回だけのタスクは実行し終えたら消す
+		if(task.period_ns == 0 && !task.cancelled)
+		{
+			cancelled.push_back(due[i].id);
+			task.cancelled = true;
+		}
+	}
+
+	in_tick = false;
+	sweep();
+
+	if(thrown)
+		std::rethrow_exception(thrown);
+	if(unhandled)
+	{
+		if(!error_handler)
+			throw I2CError(error.c_str());
+		error_handler(I2CError(error.c_str()));
+	}
+}
@@ -0,0 +1,335 @@
+#ifndef GROVEPI_SCHEDULER_H
+#define GROVEPI_SCHEDULER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "grovepi.h"
+
+// C++20 coroutines (co_await scheduler.analogRead(0)) when built with -std=c++20
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#include <exception>
+#define GROVEPI_SCHEDULER_COROUTINES
+#endif
+
+namespace GrovePi
+{
+#ifdef GROVEPI_SCHEDULER_COROUTINES
+  // return type of a coroutine run by Scheduler::spawn()
+  // it may only co_await the awaitables of its Scheduler
+  class Routine
+  {
+	  public:
+
+		  struct promise_type
+		  {
+			  std::exception_ptr error;
+
+			  Routine get_return_object() {
+				  return Routine(std::coroutine_handle<promise_type>::from_promise(*this));
+			  }
+			  std::suspend_always initial_suspend() noexcept { return {}; }
+			  std::suspend_always final_suspend() noexcept { return {}; }
+			  void return_void() {
+			  }
+			  void unhandled_exception() { error = std::current_exception(); }
+		  };
+
+		  Routine(Routine &&other) : handle(other.handle) { other.handle = nullptr; }
+		  ~Routine() {
+			  if(handle)
+				  handle.destroy();
+		  }
+
+	  private:
+
+		  Routine(const Routine &);
+		  Routine &operator=(const Routine &);
+
+		  friend class Scheduler;
+		  explicit Routine(std::coroutine_handle<promise_type> _handle) : handle(_handle) {
+		  }
+
+		  std::coroutine_handle<promise_type> handle;
+  };
+#endif
+
+  // runs periodic and one-shot tasks on one thread from a timerfd/epoll loop
+  // every task whose deadline falls into the same tick queues its commands into
+  // one Batch, which is sent as a single transaction before the tasks' done
+  // callbacks run; deadlines are counted from the first run(), so tasks
+  // with related periods share ticks and do not drift
+  class Scheduler
+  {
+	  public:
+
+		  typedef uint64_t TaskId;
+		  typedef std::function<void(Batch &)> PollFunction;
+		  typedef std::function<void()> DoneFunction;
+		  typedef std::function<void(const I2CError &)> ErrorHandler;
+
+		  struct TaskStats
+		  {
+			  uint64_t runs;
+			  uint64_t missed;       // periods skipped because the tick came too late
+			  uint64_t max_late_us;  // worst start of a tick after the deadline
+		  };
+
+		  // tasks due within this time of a tick are run by that tick
+		  static const unsigned int DEFAULT_COALESCE_US = 1000;
+
+		  Scheduler();
+		  explicit Scheduler(Device &_device);
+		  ~Scheduler();
+
+		  TaskId every(unsigned int period_ms, PollFunction poll, DoneFunction done = nullptr, unsigned int phase_ms = 0);
+		  TaskId after(unsigned int delay_ms, PollFunction poll, DoneFunction done = nullptr);
+		  void cancel(TaskId id);
+		  bool taskStats(TaskId id, TaskStats &stats) const;
+
+		  void setCoalesce(unsigned int microseconds);
+		  void onError(ErrorHandler handler);
+
+		  void run();
+		  void runFor(unsigned int milliseconds);
+		  void stop();
+
+		  Device &device() const { return *dev; }
+		  uint64_t ticks() const { return tick_count; }
+		  uint64_t transactions() const { return transaction_count; }
+		  uint64_t wakeups() const { return wakeup_count; }
+
+#ifdef GROVEPI_SCHEDULER_COROUTINES
+		  // starts the coroutine on the next tick
+		  void spawn(Routine routine);
+
+		  // resumes the coroutine after a delay or with the result of a command;
+		  // commands of coroutines resumed by the same tick share its transaction
+		  class Await
+		  {
+			  public:
+
+				  bool await_ready() const noexcept { return false; }
+				  void await_suspend(std::coroutine_handle<Routine::promise_type> handle) {
+					  scheduler->suspend(handle, this);
+				  }
+
+			  protected:
+
+				  Await(Scheduler &_scheduler, uint64_t _delay_ns)
+					  : scheduler(&_scheduler), delay_ns(_delay_ns), failed(false) {
+				  }
+				  virtual ~Await() {
+				  }
+
+				  void check() const {
+					  if(failed)
+						  throw I2CError(error.c_str());
+				  }
+
+			  private:
+
+				  friend class Scheduler;
+				  virtual void queue(Batch &batch) = 0;
+
+				  Scheduler *scheduler;
+				  uint64_t delay_ns;
+				  bool failed;
+				  std::string error;
+		  };
+
+		  class Sleep : public Await
+		  {
+			  public:
+
+				  Sleep(Scheduler &_scheduler, uint64_t _delay_ns) : Await(_scheduler, _delay_ns) {
+				  }
+				  void await_resume() {
+				  }
+
+			  private:
+
+				  void queue(Batch &) {
+				  }
+		  };
+
+		  class Transaction : public Await
+		  {
+			  public:
+
+				  Transaction(Scheduler &_scheduler, PollFunction _fill) : Await(_scheduler, 0), fill(_fill) {
+				  }
+				  void await_resume() { check(); }
+
+			  private:
+
+				  void queue(Batch &batch) { fill(batch); }
+				  PollFunction fill;
+		  };
+
+		  template <typename T>
+		  class Reading : public Await
+		  {
+			  public:
+
+				  typedef Batch &(Batch::*Method)(uint8_t, T &);
+
+				  Reading(Scheduler &_scheduler, Method _method, uint8_t _pin)
+					  : Await(_scheduler, 0), method(_method), pin(_pin), value() {
+				  }
+				  T await_resume() {
+					  check();
+					  return value;
+				  }
+
+			  private:
+
+				  void queue(Batch &batch) { (batch.*method)(pin, value); }
+				  Method method;
+				  uint8_t pin;
+				  T value;
+		  };
+
+		  Sleep sleep(unsigned int milliseconds) { return Sleep(*this, milliseconds * 1000000ull); }
+		  Transaction transaction(PollFunction fill) { return Transaction(*this, fill); }
+		  Reading<short> analogRead(uint8_t pin) { return Reading<short>(*this, &Batch::analogRead, pin); }
+		  Reading<bool> digitalRead(uint8_t pin) { return Reading<bool>(*this, &Batch::digitalRead, pin); }
+		  Reading<short> ultrasonicRead(uint8_t pin) { return Reading<short>(*this, &Batch::ultrasonicRead, pin); }
+		  Transaction digitalWrite(uint8_t pin, bool value) {
+			  return transaction([pin, value](Batch &batch) { batch.digitalWrite(pin, value); });
+		  }
+		  Transaction analogWrite(uint8_t pin, uint8_t value) {
+			  return transaction([pin, value](Batch &batch) { batch.analogWrite(pin, value); });
+		  }
+#endif
+
+	  private:
+
+		  Scheduler(const Scheduler &);
+		  Scheduler &operator=(const Scheduler &);
+
+		  typedef std::function<void(const I2CError &)> FailFunction;
+
+		  struct Task
+		  {
+			  uint64_t period_ns;  // 0 = one-shot
+			  PollFunction poll;
+			  DoneFunction done;
+			  FailFunction fail;   // takes the error instead of the error handler
+			  TaskStats stats;
+			  bool cancelled;
+		  };
+
+		  struct Due
+		  {
+			  TaskId id;
+			  bool queued;         // added commands to the tick's batch
+		  };
+
+		  struct Deadline
+		  {
+			  uint64_t at_ns;
+			  uint64_t order;
+			  TaskId id;
+
+			  bool operator>(const Deadline &other) const {
+				  return at_ns != other.at_ns ? at_ns > other.at_ns : order > other.order;
+			  }
+		  };
+
+		  Device *const dev;
+		  Batch batch;
+		  int epoll_fd;
+		  int timer_fd;
+		  int stop_fd;
+		  uint64_t epoch_ns;
+		  bool started;
+		  uint64_t coalesce_ns;
+		  uint64_t armed_ns;
+		  TaskId next_id;
+		  uint64_t next_order;
+		  std::map<TaskId, Task> tasks;
+		  std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline> > deadlines;
+		  std::vector<Due> due;
+		  std::vector<Deadline> rescheduled;
+		  std::vector<TaskId> cancelled;
+		  bool in_tick;
+		  ErrorHandler error_handler;
+		  std::atomic<bool> stopping;
+		  uint64_t tick_count;
+		  uint64_t transaction_count;
+		  uint64_t wakeup_count;
+
+		  static uint64_t monotonic_ns();
+		  uint64_t elapsed_ns() const;
+		  void init();
+		  void start();
+		  TaskId add(uint64_t at_ns, uint64_t period_ns, PollFunction poll, DoneFunction done, FailFunction fail);
+		  void push(uint64_t at_ns, TaskId id);
+		  void sweep();
+		  void run_until(uint64_t end_ns);
+		  void wait(uint64_t until_ns);
+		  void tick(uint64_t now_ns);
+
+#ifdef GROVEPI_SCHEDULER_COROUTINES
+		  // 中断中のコルーチンを持つ (実行されずに消えたタスクと一緒に破棄する)
+		  struct Suspended
+		  {
+			  std::coroutine_handle<Routine::promise_type> handle;
+
+			  explicit Suspended(std::coroutine_handle<Routine::promise_type> _handle) : handle(_handle) {
+			  }
+			  ~Suspended() {
+				  if(handle)
+					  handle.destroy();
+			  }
+			  std::coroutine_handle<Routine::promise_type> release() {
+				  std::coroutine_handle<Routine::promise_type> h = handle;
+				  handle = nullptr;
+				  return h;
+			  }
+		  };
+
+		  static void resume(std::coroutine_handle<Routine::promise_type> handle) {
+			  handle.resume();
+			  if(handle.done())
+			  {
+				  std::exception_ptr error = handle.promise().error;
+				  handle.destroy();
+				  if(error)
+					  std::rethrow_exception(error);
+			  }
+		  }
+
+		  void suspend(std::coroutine_handle<Routine::promise_type> handle, Await *await) {
+			  std::shared_ptr<Suspended> routine = std::make_shared<Suspended>(handle);
+			  add(elapsed_ns() + await->delay_ns, 0,
+			      [await](Batch &batch) { await->queue(batch); },
+			      [routine]() { resume(routine->release()); },
+			      [routine, await](const I2CError &error) {
+				      await->failed = true;
+				      await->error = error.what();
+				      resume(routine->release());
+			      });
+		  }
+#endif
+  };
+
+#ifdef GROVEPI_SCHEDULER_COROUTINES
+  inline void Scheduler::spawn(Routine routine)
+  {
+	  std::shared_ptr<Suspended> started = std::make_shared<Suspended>(routine.handle);
+	  routine.handle = nullptr;
+	  add(elapsed_ns(), 0, nullptr, [started]() { resume(started->release()); }, nullptr);
+  }
+#endif
+}
+
+#endif
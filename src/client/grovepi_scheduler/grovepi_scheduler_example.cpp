@@ -0,0 +1,114 @@
+//
+// GrovePi Example for driving several sensors at their own rates from one thread
+//
+// Every task runs on its own period; the commands of the tasks that are due
+// at the same tick are sent to the Pico as one batch.
+// Build with -std=c++20 to also run the coroutine below.
+//
+/*
+## License
+
+   The MIT License (MIT)
+
+   GrovePi for the Raspberry Pi: an open source platform for connecting Grove Sensors to the Raspberry Pi.
+   Copyright (C) 2017  Dexter Industries
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "grovepi_scheduler.h"
+
+using namespace GrovePi;
+
+// sudo g++ -Wall -pthread grovepi.cpp grovepi_scheduler/grovepi_scheduler.cpp grovepi_scheduler/grovepi_scheduler_example.cpp -o grovepi_scheduler_example.out -> without grovepicpp package installed
+
+#ifdef GROVEPI_SCHEDULER_COROUTINES
+// turns the LED on for a second whenever the ranger sees something closer than 20 cm
+static Routine proximity_light(Scheduler &scheduler, uint8_t ranger_pin, uint8_t led_pin)
+{
+	while(true)
+	{
+		short distance = co_await scheduler.ultrasonicRead(ranger_pin);
+		if(distance < 20)
+		{
+			co_await scheduler.digitalWrite(led_pin, HIGH);
+			co_await scheduler.sleep(1000);
+			co_await scheduler.digitalWrite(led_pin, LOW);
+		}
+		co_await scheduler.sleep(200);
+	}
+}
+#endif
+
+int main()
+{
+	int light_sensor_pin = 0; // analog port A0 for the Grove Light Sensor
+	int button_pin = 16;      // digital port D16 for the Grove Button
+	int led_pin = 18;         // digital port D18 for the Grove LED
+	int ranger_pin = 20;      // digital port D20 for the Grove Ultrasonic Ranger
+
+	try
+	{
+		initGrovePi();
+		pinMode(button_pin, INPUT);
+		pinMode(led_pin, OUTPUT);
+
+		Scheduler scheduler;
+
+		// light level 10 times a second
+		short light = 0;
+		scheduler.every(100, [&](Batch &batch) {
+			batch.analogRead(light_sensor_pin, light);
+		}, [&]() {
+			printf("[light = %d]\n", light);
+		});
+
+		// button 50 times a second, printed when it changes
+		bool pressed = false, was_pressed = false;
+		scheduler.every(20, [&](Batch &batch) {
+			batch.digitalRead(button_pin, pressed);
+		}, [&]() {
+			if(pressed != was_pressed)
+				printf("[button %s]\n", pressed ? "pressed" : "released");
+			was_pressed = pressed;
+		});
+
+#ifdef GROVEPI_SCHEDULER_COROUTINES
+		scheduler.spawn(proximity_light(scheduler, ranger_pin, led_pin));
+#else
+		// distance 5 times a second
+		short distance = 0;
+		scheduler.every(200, [&](Batch &batch) {
+			batch.ultrasonicRead(ranger_pin, distance);
+		}, [&]() {
+			printf("[distance = %d cm]\n", distance);
+		});
+#endif
+
+		scheduler.run();
+	}
+	catch(I2CError &error)
+	{
+		printf("%s", error.detail());
+
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,459 @@
+/*
+## License
+
+   The MIT License (MIT)
+
+   GrovePi for the Raspberry Pi: an open source platform for connecting Grove Sensors to the Raspberry Pi.
+   Copyright (C) 2017  Dexter Industries
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+//
+// GrovePi soak test
+//
+// Replays a command trace (or a built-in mix of basic commands) for a long
+// time and prints one CSV row per report interval plus a "total" row:
+// throughput, latency percentiles, error replies, lost replies, USB drops and
+// reconnects, sends that fell behind the trace schedule, and the memory of
+// this process (and of the firmware with --stats).
+//
+// Traces are written by any program linked with the library when
+// GROVEPI_TRACE=<file> is set: "<us since the first command> <command line>"
+// per line; binary frames are written as the equivalent text command. They are
+// replayed in a loop at the recorded pace (--speed 2 is twice as fast,
+// --speed 0 as fast as the replies come back).
+//
+// Usage: grovepi_soak.out [--mock] [--port PATH] [--trace FILE] [--speed X]
+//                         [--duration TIME] [--report TIME] [-d DEPTH]
+//                         [--timeout MS] [--stats]
+//                         [--latency US] [--jitter US] [--error-rate P]
+//                         [--drop-rate P] [--disconnect-every MS] [--seed N]
+//   TIME is a number of seconds with an optional s/m/h suffix (e.g. 4h)
+//   --latency ... --seed configure the faults of the --mock emulator
+//
+
+#include "grovepi.h"
+#include "grovepi_bench/mock_pico.h"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace GrovePi;
+
+// sudo g++ -Wall -pthread grovepi.cpp grovepi_bench/mock_pico.cpp grovepi_soak/grovepi_soak.cpp -o grovepi_soak.out -> without grovepicpp package installed
+
+typedef std::chrono::steady_clock Clock;
+
+struct TraceEntry
+{
+	uint64_t t_us;
+	std::string command;
+};
+
+// --trace を指定しないときの負荷 (--speed 0 と同じく待たずに繰り返す)
+static const char *const DEFAULT_MIX[] = {
+	"digitalWrite(16, HIGH)",
+	"analogRead(0)",
+	"digitalRead(18)",
+	"digitalWrite(16, LOW)",
+	"analogRead(0); analogRead(1); analogRead(2)",
+};
+
+// 応答待ちの 1 コマンド
+struct Pending
+{
+	Reply reply;
+	Clock::time_point sent;
+};
+
+// 集計 (区間ごとと全体)
+struct Totals
+{
+	uint64_t ops;
+	uint64_t errors;   // "error" を含む応答
+	uint64_t failures; // 失われた応答 (タイムアウト・再接続の失敗)
+	uint64_t late;     // 記録した時刻より遅れて送ったコマンド
+	LatencyHistogram latency;
+
+	Totals() : ops(0), errors(0), failures(0), late(0) {
+	}
+};
+
+static std::atomic<uint64_t> disconnects(0);
+static std::atomic<uint64_t> reconnects(0);
+
+/**
+ * 時間の指定を秒に直す ("30", "90s", "15m", "4h")
+ * @return 不正なら負の値
+ */
+static double parse_time(const std::string &s)
+{
+	char *end = NULL;
+	double v = strtod(s.c_str(), &end);
+	if(end == s.c_str() || v < 0)
+		return -1.0;
+	std::string unit(end);
+	if(unit.empty() || unit == "s")
+		return v;
+	if(unit == "m")
+		return v * 60;
+	if(unit == "h")
+		return v * 3600;
+	return -1.0;
+}
+
+/**
+ * GROVEPI_TRACE で記録したファイルを読む
+ * "#" で始まる行は読み飛ばす
+ */
+static bool load_trace(const std::string &file, std::vector<TraceEntry> &trace)
+{
+	FILE *fp = fopen(file.c_str(), "r");
+	if(fp == NULL)
+		return false;
+
+	char buf[4096];
+	while(fgets(buf, sizeof(buf), fp) != NULL)
+	{
+		std::string line(buf);
+		while(!line.empty() && (line[line.size() - 1] == '\n' || line[line.size() - 1] == '\r'))
+			line.erase(line.size() - 1);
+		if(line.empty() || line[0] == '#')
+			continue;
+
+		char *end = NULL;
+		unsigned long long t = strtoull(line.c_str(), &end, 10);
+		if(end == line.c_str() || *end != ' ')
+			continue;
+		TraceEntry entry;
+		entry.t_us = t;
+		entry.command = end + 1;
+		trace.push_back(entry);
+	}
+	fclose(fp);
+	return true;
+}
+
+// このプロセスの常駐メモリ [KiB]
+static long rss_kb()
+{
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if(fp == NULL)
+		return -1;
+	long size = 0, resident = 0;
+	int n = fscanf(fp, "%ld %ld", &size, &resident);
+	fclose(fp);
+	return n == 2 ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+}
+
+/**
+ * ファームウェアの空きメモリを stats() で読む
+ * @return 読めなければ -1
+ */
+static long firmware_mem_free(Device &device)
+{
+	try
+	{
+		std::string line = device.submit("stats()").line();
+		size_t at = line.find("mem_free=");
+		if(at != std::string::npos)
+			return atol(line.c_str() + at + 9);
+	}
+	catch(I2CError &)
+	{
+	}
+	return -1;
+}
+
+/**
+ * 先頭の応答を待って集計に加える
+ */
+static void retire(std::vector<Pending> &ring, size_t &head, size_t &count, Totals &interval, Totals &total)
+{
+	Pending &p = ring[head];
+	head = (head + 1) % ring.size();
+	--count;
+
+	bool error = false;
+	bool failed = false;
+	try
+	{
+		error = p.reply.line().find("error") != std::string::npos;
+	}
+	catch(I2CError &)
+	{
+		failed = true;
+	}
+	uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - p.sent).count();
+	// 使い終わった応答はすぐに手放して、ライブラリ側で使い回せるようにする
+	p.reply = Reply();
+
+	Totals *targets[2] = {&interval, &total};
+	for(int i = 0; i < 2; ++i)
+	{
+		Totals &t = *targets[i];
+		++t.ops;
+		if(failed)
+			++t.failures;
+		else
+		{
+			if(error)
+				++t.errors;
+			t.latency.record(us);
+		}
+	}
+}
+
+static void print_header()
+{
+	printf("window,elapsed_s,ops,ops_per_sec,p50_us,p99_us,p999_us,max_us,"
+	       "errors,failures,disconnects,reconnects,late,rss_kb,rss_growth_kb,fw_mem_free\n");
+}
+
+static void print_row(const char *window, double elapsed_s, double span_s, const Totals &t,
+                      long rss, long rss_base, long fw_mem_free)
+{
+	printf("%s,%.1f,%llu,%.0f,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%ld,%ld,%ld\n", window, elapsed_s,
+	       (unsigned long long)t.ops, span_s > 0 ? t.ops / span_s : 0.0,
+	       (unsigned long long)t.latency.percentile(0.50), (unsigned long long)t.latency.percentile(0.99),
+	       (unsigned long long)t.latency.percentile(0.999), (unsigned long long)t.latency.max_us,
+	       (unsigned long long)t.errors, (unsigned long long)t.failures,
+	       (unsigned long long)disconnects, (unsigned long long)reconnects, (unsigned long long)t.late,
+	       rss, rss >= 0 && rss_base >= 0 ? rss - rss_base : 0, fw_mem_free);
+	fflush(stdout);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [--mock] [--port PATH] [--trace FILE] [--speed X] [--duration TIME] "
+	                "[--report TIME] [-d DEPTH] [--timeout MS] [--stats] [--latency US] [--jitter US] "
+	                "[--error-rate P] [--drop-rate P] [--disconnect-every MS] [--seed N]\n", argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	bool mock = false;
+	bool poll_stats = false;
+	double speed = 1.0;
+	double duration_s = 60;
+	double report_s = 10;
+	int depth = 1;
+	int timeout_ms = 1000;
+	std::string port;
+	std::string trace_file;
+	MockOptions options;
+
+	for(int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if(arg == "--mock")
+			mock = true;
+		else if(arg == "--stats")
+			poll_stats = true;
+		else if(arg == "--port" && has_value)
+			port = argv[++i];
+		else if(arg == "--trace" && has_value)
+			trace_file = argv[++i];
+		else if(arg == "--speed" && has_value)
+			speed = atof(argv[++i]);
+		else if(arg == "--duration" && has_value)
+			duration_s = parse_time(argv[++i]);
+		else if(arg == "--report" && has_value)
+			report_s = parse_time(argv[++i]);
+		else if(arg == "-d" && has_value)
+			depth = atoi(argv[++i]);
+		else if(arg == "--timeout" && has_value)
+			timeout_ms = atoi(argv[++i]);
+		else if(arg == "--latency" && has_value)
+			options.latency_us = (unsigned int)atoi(argv[++i]);
+		else if(arg == "--jitter" && has_value)
+			options.jitter_us = (unsigned int)atoi(argv[++i]);
+		else if(arg == "--error-rate" && has_value)
+			options.error_rate = atof(argv[++i]);
+		else if(arg == "--drop-rate" && has_value)
+			options.drop_rate = atof(argv[++i]);
+		else if(arg == "--disconnect-every" && has_value)
+			options.disconnect_ms = (unsigned int)atoi(argv[++i]);
+		else if(arg == "--seed" && has_value)
+			options.seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+		else
+		{
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if(duration_s <= 0 || report_s <= 0 || depth <= 0 || speed < 0)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	std::vector<TraceEntry> trace;
+	if(!trace_file.empty())
+	{
+		if(!load_trace(trace_file, trace))
+		{
+			fprintf(stderr, "cannot read trace %s\n", trace_file.c_str());
+			return 2;
+		}
+		if(trace.empty())
+		{
+			fprintf(stderr, "trace %s has no commands\n", trace_file.c_str());
+			return 2;
+		}
+	}
+	else
+	{
+		speed = 0;
+		for(size_t i = 0; i < sizeof(DEFAULT_MIX) / sizeof(DEFAULT_MIX[0]); ++i)
+		{
+			TraceEntry entry;
+			entry.t_us = 0;
+			entry.command = DEFAULT_MIX[i];
+			trace.push_back(entry);
+		}
+	}
+	// 1 周の長さ (最後のコマンドの時刻までで、次の周はその直後から始める)
+	uint64_t pass_us = trace.back().t_us;
+
+	MockPico pico(options);
+	Totals interval;
+	Totals total;
+
+	try
+	{
+		if(mock)
+		{
+			pico.start();
+			port = pico.path();
+		}
+
+		std::unique_ptr<Device> opened(port.empty() ? new Device() : new Device(port));
+		Device &device = *opened;
+		device.setReadTimeout(timeout_ms);
+		device.onConnectionChange([](bool connected) {
+			if(connected)
+				++reconnects;
+			else
+				++disconnects;
+		});
+		device.open();
+
+		print_header();
+
+		std::vector<Pending> ring(depth);
+		size_t head = 0;
+		size_t count = 0;
+
+		Clock::time_point begin = Clock::now();
+		Clock::time_point end = begin + std::chrono::microseconds((uint64_t)(duration_s * 1e6));
+		Clock::time_point next_report = begin + std::chrono::microseconds((uint64_t)(report_s * 1e6));
+		Clock::time_point last_report = begin;
+		Clock::time_point pass_start = begin;
+		long rss_base = -1;
+		size_t index = 0;
+
+		while(true)
+		{
+			Clock::time_point now = Clock::now();
+			if(now >= next_report || now >= end)
+			{
+				while(count > 0)
+					retire(ring, head, count, interval, total);
+				long rss = rss_kb();
+				// 1 回目の区間で確保が落ち着いた後を基準に、メモリの伸びを見る
+				if(rss_base < 0)
+					rss_base = rss;
+				long fw = poll_stats ? firmware_mem_free(device) : -1;
+				now = Clock::now();
+				print_row("interval", std::chrono::duration<double>(now - begin).count(),
+				          std::chrono::duration<double>(now - last_report).count(), interval, rss, rss_base, fw);
+				interval = Totals();
+				last_report = now;
+				next_report = now + std::chrono::microseconds((uint64_t)(report_s * 1e6));
+				if(now >= end)
+				{
+					print_row("total", std::chrono::duration<double>(now - begin).count(),
+					          std::chrono::duration<double>(now - begin).count(), total, rss, rss_base, fw);
+					break;
+				}
+			}
+
+			const TraceEntry &entry = trace[index];
+			Clock::time_point due = pass_start;
+			if(speed > 0)
+				due += std::chrono::microseconds((uint64_t)(entry.t_us / speed));
+
+			if(due > now)
+			{
+				// 待つ間に先に送ったコマンドの応答を受け取り、応答が無ければ時刻まで眠る
+				if(count > 0)
+					retire(ring, head, count, interval, total);
+				else
+					std::this_thread::sleep_until(std::min(due, next_report));
+				continue;
+			}
+			if(speed > 0 && now - due > std::chrono::milliseconds(1))
+			{
+				++interval.late;
+				++total.late;
+			}
+
+			if(count == ring.size())
+				retire(ring, head, count, interval, total);
+
+			Pending &p = ring[(head + count) % ring.size()];
+			p.sent = Clock::now();
+			try
+			{
+				p.reply = device.submit(entry.command);
+				++count;
+			}
+			catch(I2CError &)
+			{
+				// 送れなかった (再接続の失敗) コマンドも、失われた応答として数える
+				++interval.ops;
+				++interval.failures;
+				++total.ops;
+				++total.failures;
+			}
+
+			if(++index == trace.size())
+			{
+				index = 0;
+				if(speed > 0)
+					pass_start += std::chrono::microseconds((uint64_t)(pass_us / speed));
+			}
+		}
+	}
+	catch(I2CError &error)
+	{
+		fprintf(stderr, "%s", error.detail());
+		return 1;
+	}
+
+	if(mock)
+		fprintf(stderr, "mock: %llu commands, %llu injected errors, %llu dropped lines, %llu disconnects\n",
+		        (unsigned long long)pico.commands(), (unsigned long long)pico.injectedErrors(),
+		        (unsigned long long)pico.droppedLines(), (unsigned long long)pico.disconnects());
+	return total.ops > total.failures ? 0 : 1;
+}
@@ -0,0 +1,267 @@
+#include "grovepi_stream.h"
+
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+using GrovePi::AnalogStream;
+using GrovePi::SampleBlock;
+
+// 動作中のストリーム (デバイスとピン番号の組で振り分ける)
+// 受信スレッドからの呼び出し中に解放されないよう stream_mutex で保護する
+static const size_t MAX_STREAM_PINS = 32;
+static std::vector<AnalogStream *> streams;
+static std::mutex stream_mutex;
+
+/**
+ * "!stream <pin> <seq> <overruns> <base64>" を該当ストリームへ振り分ける
+ * @param device 通知を受け取ったデバイス
+ * @param args   通知名より後ろの文字列
+ */
+static void on_stream_event(GrovePi::Device *device, const std::string &args)
+{
+	unsigned long pin = strtoul(args.c_str(), NULL, 10);
+
+	std::lock_guard<std::mutex> lk(stream_mutex);
+	for(size_t i = 0; i < streams.size(); ++i)
+	{
+		if(&streams[i]->device() == device && streams[i]->pin() == pin)
+		{
+			streams[i]->onEvent(args);
+			break;
+		}
+	}
+}
+
+static void unregister_stream(AnalogStream *stream)
+{
+	std::lock_guard<std::mutex> lk(stream_mutex);
+	streams.erase(std::remove(streams.begin(), streams.end(), stream), streams.end());
+}
+
+static int base64_value(char c)
+{
+	if(c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if(c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if(c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if(c == '+')
+		return 62;
+	if(c == '/')
+		return 63;
+	return -1;
+}
+
+/**
+ * base64 で送られたリトルエンディアンの uint16 列を復号する
+ * @param  src   base64 文字列
+ * @param  out   出力先
+ * @param  limit 出力先の要素数
+ * @return       復号したサンプル数
+ */
+static size_t decode_samples(const char *src, uint16_t *out, size_t limit)
+{
+	uint32_t bits = 0;
+	int nbits = 0;
+	size_t nbytes = 0;
+	uint8_t low = 0;
+
+	for(; *src != '\0'; ++src)
+	{
+		int v = base64_value(*src);
+		if(v < 0)
+			break;
+
+		bits = (bits << 6) | (uint32_t)v;
+		nbits += 6;
+		if(nbits < 8)
+			continue;
+
+		nbits -= 8;
+		uint8_t byte = (uint8_t)(bits >> nbits);
+		if((nbytes & 1) == 0)
+			low = byte;
+		else
+		{
+			size_t i = nbytes >> 1;
+			if(i >= limit)
+				break;
+			out[i] = (uint16_t)(low | (byte << 8));
+		}
+		++nbytes;
+	}
+
+	return nbytes >> 1;
+}
+
+/**
+ * continuous sampling of one analog pin on the Pico of defaultDevice()
+ * @param _pin        analog pin number (0/1/2)
+ * @param _rate_hz    sampling rate
+ * @param _block_size samples per pushed block (max SampleBlock::MAX_SAMPLES)
+ */
+AnalogStream::AnalogStream(uint8_t _pin, unsigned int _rate_hz, unsigned int _block_size)
+	: dev(&defaultDevice()), pin_number(_pin), rate_hz(_rate_hz),
+	  block_size(_block_size > SampleBlock::MAX_SAMPLES ? SampleBlock::MAX_SAMPLES : _block_size),
+	  active(false), next_seq(0), last_overruns(0), dropped_blocks(0), head(0), tail(0)
+{
+}
+
+/**
+ * continuous sampling of one analog pin on the given Pico
+ * @param _device     device to stream from
+ * @param _pin        analog pin number (0/1/2)
+ * @param _rate_hz    sampling rate
+ * @param _block_size samples per pushed block (max SampleBlock::MAX_SAMPLES)
+ */
+AnalogStream::AnalogStream(Device &_device, uint8_t _pin, unsigned int _rate_hz, unsigned int _block_size)
+	: dev(&_device), pin_number(_pin), rate_hz(_rate_hz),
+	  block_size(_block_size > SampleBlock::MAX_SAMPLES ? SampleBlock::MAX_SAMPLES : _block_size),
+	  active(false), next_seq(0), last_overruns(0), dropped_blocks(0), head(0), tail(0)
+{
+}
+
+AnalogStream::~AnalogStream()
+{
+	try
+	{
+		stop();
+	}
+	catch(I2CError &)
+	{
+	}
+}
+
+/**
+ * start streaming, blocks are queued and read with pop()
+ */
+void AnalogStream::start()
+{
+	start(Callback());
+}
+
+/**
+ * start streaming
+ * the callback (if any) is called from the event thread for every block,
+ * otherwise blocks are queued and read with pop()
+ * don't call stop() from inside the callback
+ * @param _callback function called for every block
+ */
+void AnalogStream::start(Callback _callback)
+{
+	if(pin_number >= MAX_STREAM_PINS)
+		throw I2CError("[GrovePiError in streamAnalog]\n");
+
+	stop();
+
+	{
+		std::lock_guard<std::mutex> lk(stream_mutex);
+		callback = _callback;
+		next_seq = 0;
+		head = tail = 0;
+		last_overruns = 0;
+		dropped_blocks = 0;
+		streams.push_back(this);
+	}
+
+	Device *device = dev;
+	dev->setEventHandler("stream", [device](const std::string &args) { on_stream_event(device, args); });
+	dev->startEventThread();
+
+	char buf[64];
+	snprintf(buf, sizeof(buf), "streamAnalog(%u, %u, %u)", pin_number, rate_hz, block_size);
+	if(dev->submit(buf).line() == "error")
+	{
+		unregister_stream(this);
+		throw I2CError("[GrovePiError in streamAnalog]\n");
+	}
+	dev->setRestoreCommand(pin_number, buf);
+	active = true;
+}
+
+void AnalogStream::stop()
+{
+	if(!active)
+		return;
+	active = false;
+
+	unregister_stream(this);
+	dev->setRestoreCommand(pin_number, "");
+
+	char buf[64];
+	snprintf(buf, sizeof(buf), "streamStop(%u)", pin_number);
+	if(dev->submit(buf).line() == "error")
+		throw I2CError("[GrovePiError in streamStop]\n");
+}
+
+/**
+ * take the oldest queued block
+ * @param  block where to copy it
+ * @return       false if the queue is empty
+ */
+bool AnalogStream::pop(SampleBlock &block)
+{
+	size_t t = tail.load(std::memory_order_relaxed);
+	if(t == head.load(std::memory_order_acquire))
+		return false;
+
+	const SampleBlock &src = queue[t % QUEUE_LENGTH];
+	block.pin = src.pin;
+	block.seq = src.seq;
+	block.overruns = src.overruns;
+	block.dropped = src.dropped;
+	block.count = src.count;
+	memcpy(block.samples, src.samples, src.count * sizeof(src.samples[0]));
+
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+}
+
+/**
+ * decode one "!stream" event (called from the event thread)
+ * @param args "<pin> <seq> <overruns> <base64>"
+ */
+void AnalogStream::onEvent(const std::string &args)
+{
+	const char *p = args.c_str();
+	char *end;
+
+	strtoul(p, &end, 10);
+	uint32_t seq = (uint32_t)strtoul(end, &end, 10);
+	uint32_t overruns = (uint32_t)strtoul(end, &end, 10);
+	while(*end == ' ')
+		++end;
+
+	// seq starts again from 0 when the stream is restarted after a reconnect
+	// (or the Pico was reset); only a jump forward means lost blocks
+	if(seq > next_seq)
+		dropped_blocks += seq - next_seq;
+	next_seq = seq + 1;
+	last_overruns = overruns;
+
+	SampleBlock *block = &scratch;
+	size_t h = head.load(std::memory_order_relaxed);
+	bool queued = !callback;
+	if(queued)
+	{
+		if(h - tail.load(std::memory_order_acquire) >= QUEUE_LENGTH)
+		{
+			++dropped_blocks;
+			return;
+		}
+		block = &queue[h % QUEUE_LENGTH];
+	}
+
+	block->pin = pin_number;
+	block->seq = seq;
+	block->overruns = overruns;
+	block->dropped = dropped_blocks;
+	block->count = decode_samples(end, block->samples, SampleBlock::MAX_SAMPLES);
+
+	if(queued)
+		head.store(h + 1, std::memory_order_release);
+	else
+		callback(*block);
+}
@@ -0,0 +1,76 @@
+#ifndef GROVEPI_STREAM_H
+#define GROVEPI_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <functional>
+#include <string>
+
+#include "grovepi.h"
+
+namespace GrovePi
+{
+  // one block of raw ADC samples pushed by the Pico
+  struct SampleBlock
+  {
+	  static const size_t MAX_SAMPLES = 256;
+
+	  uint8_t pin;
+	  uint32_t seq;        // block sequence number counted by the Pico
+	  uint32_t overruns;   // samples lost in the Pico's ring buffer (cumulative)
+	  uint32_t dropped;    // blocks lost on the host (cumulative)
+	  size_t count;
+	  uint16_t samples[MAX_SAMPLES]; // read_u16() values (0-65535)
+  };
+
+  class AnalogStream
+  {
+	  public:
+
+		  typedef std::function<void(const SampleBlock &)> Callback;
+		  static const size_t QUEUE_LENGTH = 64;
+
+		  AnalogStream(uint8_t _pin, unsigned int _rate_hz, unsigned int _block_size = 64);
+		  AnalogStream(Device &_device, uint8_t _pin, unsigned int _rate_hz, unsigned int _block_size = 64);
+		  ~AnalogStream();
+
+		  void start();
+		  void start(Callback _callback);
+		  void stop();
+		  bool running() const { return active; }
+		  Device &device() const { return *dev; }
+		  uint8_t pin() const { return pin_number; }
+
+		  bool pop(SampleBlock &block);
+		  uint32_t overruns() const { return last_overruns; }
+		  uint32_t dropped() const { return dropped_blocks; }
+
+		  void onEvent(const std::string &args);
+
+	  private:
+
+		  AnalogStream(const AnalogStream &);
+		  AnalogStream &operator=(const AnalogStream &);
+
+		  Device *const dev;
+		  const uint8_t pin_number;
+		  const unsigned int rate_hz;
+		  const unsigned int block_size;
+
+		  bool active;
+		  Callback callback;
+		  uint32_t next_seq;
+
+		  std::atomic<uint32_t> last_overruns;
+		  std::atomic<uint32_t> dropped_blocks;
+
+		  // single-producer (event thread) / single-consumer (pop) queue
+		  SampleBlock queue[QUEUE_LENGTH];
+		  std::atomic<size_t> head;
+		  std::atomic<size_t> tail;
+		  SampleBlock scratch;
+  };
+}
+
+#endif
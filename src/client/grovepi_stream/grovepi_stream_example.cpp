@@ -0,0 +1,77 @@
+//
+// GrovePi Example for streaming the Grove Sound Sensor at a fixed sampling rate
+//
+// The Pico samples A0 on a hardware timer and pushes blocks of raw samples,
+// so the loop below does not pay one round trip per sample.
+//
+/*
+## License
+
+   The MIT License (MIT)
+
+   GrovePi for the Raspberry Pi: an open source platform for connecting Grove Sensors to the Raspberry Pi.
+   Copyright (C) 2017  Dexter Industries
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "grovepi_stream.h"
+#include "grovepi_dsp/grovepi_dsp.h"
+
+using namespace GrovePi;
+
+// sudo g++ -Wall -pthread grovepi.cpp grovepi_stream/grovepi_stream.cpp grovepi_dsp/grovepi_dsp.cpp grovepi_stream/grovepi_stream_example.cpp -o grovepi_stream_example.out -> without grovepicpp package installed
+
+int main()
+{
+	int sound_sensor_pin = 0; // analog port A0 for the Grove Sound Sensor
+	AnalogStream stream(sound_sensor_pin, 8000, 128); // 8 kHz, 128 samples per block
+
+	try
+	{
+		initGrovePi();
+		stream.start();
+
+		SampleBlock block;
+		while(true)
+		{
+			if(!stream.pop(block))
+			{
+				delay(5);
+				continue;
+			}
+
+			// RMS and peak of the block, scaled to 0 -> 1023 like analogRead()
+			uint16_t scaled[SampleBlock::MAX_SAMPLES];
+			dsp::toAnalog(block.samples, block.count, scaled);
+			dsp::BlockStats level = dsp::stats(scaled, block.count);
+
+			printf("[seq %u][rms = %.1f][peak = %d][overruns = %u][dropped = %u]\n",
+				block.seq, level.rms, level.max, block.overruns, block.dropped);
+		}
+	}
+	catch(I2CError &error)
+	{
+		printf("%s", error.detail());
+
+		return -1;
+	}
+
+	return 0;
+}
@@ -43,6 +43,16 @@ int main()
 	{
 		initGrovePi(); // initialize communication with the GrovePi
 
+		// let the Pico measure every 50 ms in the background (needs ultrasonic.py on the Pico);
+		// without it every ultrasonicRead() measures on demand
+		try
+		{
+			ultrasonicStart(pin, 50);
+		}
+		catch(I2CError &error)
+		{
+		}
+
 		// do this indefinitely
 		while(true)
 		{
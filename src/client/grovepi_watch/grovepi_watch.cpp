@@ -0,0 +1,140 @@
+#include "grovepi_watch.h"
+
+#include <stdlib.h>
+#include <mutex>
+#include <vector>
+
+using GrovePi::DigitalChange;
+
+// Pico の time.ticks_us() は 30 bit で一周する
+static const uint32_t PICO_TICKS_MASK = 0x3FFFFFFF;
+
+// 監視中のピン (デバイスとピン番号の組で振り分ける)
+struct WatchedPin
+{
+	GrovePi::Device *device;
+	uint8_t pin;
+	GrovePi::ChangeCallback callback;
+	bool seen;
+	uint32_t last_us;
+};
+
+static std::vector<WatchedPin> watches;
+static std::mutex watch_mutex;
+
+/**
+ * "!change <pin> <level> <t_us> <overruns>" を該当ピンのコールバックへ渡す
+ * @param device 通知を受け取ったデバイス
+ * @param args   通知名より後ろの文字列
+ */
+static void on_change_event(GrovePi::Device *device, const std::string &args)
+{
+	const char *p = args.c_str();
+	char *end;
+
+	DigitalChange change;
+	change.pin = (uint8_t)strtoul(p, &end, 10);
+	change.level = strtoul(end, &end, 10) != 0;
+	change.pico_us = (uint32_t)strtoul(end, &end, 10);
+	change.overruns = (uint32_t)strtoul(end, &end, 10);
+	change.since_us = 0;
+
+	GrovePi::ChangeCallback callback;
+	{
+		std::lock_guard<std::mutex> lk(watch_mutex);
+		for(size_t i = 0; i < watches.size(); ++i)
+		{
+			WatchedPin &w = watches[i];
+			if(w.device != device || w.pin != change.pin)
+				continue;
+
+			if(w.seen)
+				change.since_us = (change.pico_us - w.last_us) & PICO_TICKS_MASK;
+			w.seen = true;
+			w.last_us = change.pico_us;
+			callback = w.callback;
+			break;
+		}
+	}
+
+	// コールバックから onChange() を呼べるよう、ロックを外してから呼ぶ
+	if(callback)
+		callback(change);
+}
+
+static void remove_watch(GrovePi::Device *device, uint8_t pin)
+{
+	std::lock_guard<std::mutex> lk(watch_mutex);
+	for(size_t i = 0; i < watches.size(); ++i)
+	{
+		if(watches[i].device == device && watches[i].pin == pin)
+		{
+			watches.erase(watches.begin() + i);
+			break;
+		}
+	}
+}
+
+/**
+ * watch a digital input of defaultDevice() and call the callback on every edge
+ * @param pin         digital pin number (16/18/20)
+ * @param callback    function called from the event thread, nullptr stops watching
+ * @param edge        EDGE_RISING, EDGE_FALLING or EDGE_BOTH
+ * @param debounce_ms edges closer than this to the previous one are ignored by the Pico
+ */
+void GrovePi::onChange(uint8_t pin, ChangeCallback callback, uint8_t edge, unsigned int debounce_ms)
+{
+	onChange(defaultDevice(), pin, callback, edge, debounce_ms);
+}
+
+/**
+ * watch a digital input of the given Pico and call the callback on every edge
+ * @param device      device the pin belongs to
+ * @param pin         digital pin number (16/18/20)
+ * @param callback    function called from the event thread, nullptr stops watching
+ * @param edge        EDGE_RISING, EDGE_FALLING or EDGE_BOTH
+ * @param debounce_ms edges closer than this to the previous one are ignored by the Pico
+ */
+void GrovePi::onChange(Device &device, uint8_t pin, ChangeCallback callback, uint8_t edge, unsigned int debounce_ms)
+{
+	remove_watch(&device, pin);
+	device.setRestoreCommand(pin, "");
+
+	char buf[64];
+	if(!callback)
+	{
+		snprintf(buf, sizeof(buf), "unwatchDigital(%u)", pin);
+		if(device.submit(buf).line() == "error")
+			throw I2CError("[GrovePiError in unwatchDigital]\n");
+		return;
+	}
+
+	const char *edge_str = "BOTH";
+	if(edge == EDGE_RISING)
+		edge_str = "RISING";
+	else if(edge == EDGE_FALLING)
+		edge_str = "FALLING";
+
+	WatchedPin w;
+	w.device = &device;
+	w.pin = pin;
+	w.callback = callback;
+	w.seen = false;
+	w.last_us = 0;
+	{
+		std::lock_guard<std::mutex> lk(watch_mutex);
+		watches.push_back(w);
+	}
+
+	Device *dev = &device;
+	device.setEventHandler("change", [dev](const std::string &args) { on_change_event(dev, args); });
+	device.startEventThread();
+
+	snprintf(buf, sizeof(buf), "watchDigital(%u, %s, %u)", pin, edge_str, debounce_ms);
+	if(device.submit(buf).line() == "error")
+	{
+		remove_watch(&device, pin);
+		throw I2CError("[GrovePiError in watchDigital]\n");
+	}
+	device.setRestoreCommand(pin, buf);
+}
@@ -0,0 +1,38 @@
+#ifndef GROVEPI_WATCH_H
+#define GROVEPI_WATCH_H
+
+#include <stdint.h>
+#include <functional>
+
+#include "grovepi.h"
+
+namespace GrovePi
+{
+  // edges to report (watchDigital on the Pico)
+  enum Edge
+  {
+	  EDGE_RISING = 1,
+	  EDGE_FALLING = 2,
+	  EDGE_BOTH = 3
+  };
+
+  // one edge of a watched digital input, timestamped by the Pico
+  struct DigitalChange
+  {
+	  uint8_t pin;
+	  bool level;          // level after the edge
+	  uint32_t pico_us;    // time.ticks_us() on the Pico (wraps every 2^30 us)
+	  uint32_t since_us;   // time since the previous edge of this pin (0 for the first one)
+	  uint32_t overruns;   // edges lost in the Pico's ring buffer (cumulative)
+  };
+
+  typedef std::function<void(const DigitalChange &)> ChangeCallback;
+
+  // the Pico watches the pin with Pin.irq and pushes every edge,
+  // the callback is called from the event thread (started if needed)
+  // a nullptr callback stops watching the pin
+  void onChange(uint8_t pin, ChangeCallback callback, uint8_t edge = EDGE_BOTH, unsigned int debounce_ms = 0);
+  void onChange(Device &device, uint8_t pin, ChangeCallback callback, uint8_t edge = EDGE_BOTH, unsigned int debounce_ms = 0);
+}
+
+#endif
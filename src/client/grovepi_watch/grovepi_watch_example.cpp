@@ -0,0 +1,66 @@
+//
+// GrovePi Example for the Grove Button without polling
+//
+// The Pico watches the button pin with an interrupt and pushes every edge,
+// so presses shorter than a polling interval are not missed.
+//
+/*
+## License
+
+   The MIT License (MIT)
+
+   GrovePi for the Raspberry Pi: an open source platform for connecting Grove Sensors to the Raspberry Pi.
+   Copyright (C) 2017  Dexter Industries
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "grovepi_watch.h"
+
+using namespace GrovePi;
+
+// sudo g++ -Wall -pthread grovepi.cpp grovepi_watch/grovepi_watch.cpp grovepi_watch/grovepi_watch_example.cpp -o grovepi_watch_example.out -> without grovepicpp package installed
+
+int main()
+{
+	int button_pin = 16; // Grove Button is connected to digital port D16 on the GrovePi
+
+	try
+	{
+		initGrovePi();
+
+		// ignore contact bounce shorter than 5 ms
+		onChange(button_pin, [](const DigitalChange &change) {
+			printf("[pin %d][button %s][%u us since the last edge][overruns = %u]\n",
+				change.pin, change.level ? "pressed" : "released", change.since_us, change.overruns);
+		}, EDGE_BOTH, 5);
+
+		// the callback runs on the event thread
+		while(true)
+			delay(1000);
+	}
+	catch(I2CError &error)
+	{
+		printf("%s", error.detail());
+
+		return -1;
+	}
+
+	return 0;
+}
@@ -1,44 +1,69 @@
 from machine import I2C
 from time import sleep_ms
+
+_TRIGGER = b"\xac\x33\x00"
+# Time the sensor needs for one conversion after a trigger
+CONVERSION_MS = 80
+
 class DHT20(object):
     def __init__(self, i2c):
         self.i2c = i2c
+        self.data = bytearray(7)
+        self.status = bytearray(1)
         if (self.dht20_read_status() & 0x80) == 0x80:
             self.dht20_init()  
             
     def read_dht20(self):
-        self.i2c.writeto(0x38, bytes([0xac,0x33,0x00]))
-        sleep_ms(80)
+        self.trigger()
+        sleep_ms(CONVERSION_MS)
         cnt = 0
-        while (self.dht20_read_status() & 0x80) == 0x80:
+        while self.busy():
             sleep_ms(1)
+            cnt += 1
             if cnt >= 100:
-                cnt += 1
                 break
         data = self.i2c.readfrom(0x38, 7, True)
         n = []
         for i in data[:]:
             n.append(i)
         return n
+
+    # Non-blocking read: trigger(), then collect() once busy() is False
+    # (at least CONVERSION_MS later). Nothing waits in between.
+    def trigger(self):
+        self.i2c.writeto(0x38, _TRIGGER)
+
+    def busy(self):
+        return (self.dht20_read_status() & 0x80) == 0x80
+
+    def collect(self):
+        # Returns (temperature, humidity), raises OSError if the CRC does not match
+        data = self.data
+        self.i2c.readfrom_into(0x38, data)
+        if self.calc_crc8(data) != data[6]:
+            raise OSError("DHT20 CRC mismatch")
+        humidity = ((data[1] << 12) | (data[2] << 4) | (data[3] >> 4)) * 100 / 1048576
+        temperature = (((data[3] & 0x0f) << 16) | (data[4] << 8) | data[5]) * 200 / 1048576 - 50
+        return temperature, humidity
         
     def dht20_read_status(self):
-        data = self.i2c.readfrom(0x38, 1, True)
-        return data[0]
+        self.i2c.readfrom_into(0x38, self.status)
+        return self.status[0]
     
     def dht20_init(self):
-        i2c.writeto(0x38, bytes([0xa8,0x00,0x00]))
+        self.i2c.writeto(0x38, bytes([0xa8,0x00,0x00]))
         sleep_ms(10)
-        i2c.writeto(0x38, bytes([0xbe,0x08,0x00]))
+        self.i2c.writeto(0x38, bytes([0xbe,0x08,0x00]))
         
     def calc_crc8(self,data):
         crc = 0xff
-        for i in data[:-1]:
-            crc ^= i
+        for i in range(len(data) - 1):
+            crc ^= data[i]
             for j in range(8):
                 if crc & 0x80:
-                    crc = (crc << 1) ^ 0x31
+                    crc = ((crc << 1) ^ 0x31) & 0xff
                 else:
-                    crc = (crc << 1)
+                    crc = (crc << 1) & 0xff
         return crc
     
     def dht20_temperature(self):
@@ -8,10 +8,31 @@ USB シリアル(CDC-ACM)経由でテキストベースのプロトコルを受
 """
 
 import sys
+import gc
 import time
-from machine import ADC, Pin, I2C, PWM, time_pulse_us
+import array
+import binascii
+import select
+import struct
+import math
+import machine
+import micropython
+from micropython import const
+from machine import ADC, Pin, I2C, PWM, Timer, time_pulse_us
 import dht
 
+try:
+    import _thread
+except ImportError:
+    _thread = None  # スレッドが無いポートでは低速な処理も core 0 で行う
+
+try:
+    # Grove 温湿度センサー V2.0 (DHT20, I2C) 用ドライバ
+    # 別途 dht20.py を Pico 本体に配置しておくこと。
+    from dht20 import DHT20, CONVERSION_MS as _DHT20_CONVERSION_MS
+except ImportError:
+    DHT20 = None  # ドライバ未配置の場合は DHT20 を無効化
+
 # GrovePi アナログピン番号(0/1/2) → Pico ADC へのマッピング
 ANALOG_PINS = {
     0: ADC(0),  # A0 -> GP26
@@ -47,11 +68,43 @@ try:
 except ImportError:
     LCD1602 = None  # ドライバ未配置の場合は LCD 機能を無効化
 
+try:
+    # 超音波距離センサーのトリガーとエコー計測を PIO で行うドライバ
+    # 別途 ultrasonic.py を Pico 本体に配置しておくこと。
+    from ultrasonic import Ultrasonic
+except ImportError:
+    Ultrasonic = None  # ドライバ未配置の場合は time_pulse_us で測る
+
+try:
+    # WS2812 (NeoPixel) LED テープ用の PIO ドライバ
+    # 別途 ws2812.py を Pico 本体に配置しておくこと。
+    from ws2812 import WS2812
+except ImportError:
+    WS2812 = None  # ドライバ未配置の場合は LED テープ機能を無効化
+
+_LCD_COLS = const(16)
+_LCD_ROWS = const(2)
+_LCD_BLANK = " " * (_LCD_COLS * _LCD_ROWS)
+
+
+class _Lcd:
+    """LCD 1 台分のドライバと、表示内容・バックライト色のシャドウ。
+
+    frame は 2x16 の表示内容 (32 文字の str)。None のときは表示内容が不明で、
+    次の書き込みで clear() からやり直す。rgb は最後に設定した色 (不明なら None)。
+    """
+
+    def __init__(self, lcd):
+        self.lcd = lcd
+        self.frame = None
+        self.rgb = None
+
+
 _LCD_CACHE = {}
 
 
 def _get_lcd(key):
-    """指定された I2C チャネルに対応する LCD インスタンスを取得する。
+    """指定された I2C チャネルに対応する LCD (_Lcd) を取得する。
 
     必要に応じて遅延初期化を行う。
     """
@@ -67,9 +120,34 @@ def _get_lcd(key):
         raise KeyError("UNKNOWN_LCD_CHANNEL")
 
     i2c = I2C_BUSES[k]
-    lcd = LCD1602(i2c, 2, 16)
-    _LCD_CACHE[k] = lcd
-    return lcd
+    entry = _Lcd(LCD1602(i2c, 2, 16))
+    _LCD_CACHE[k] = entry
+    return entry
+
+
+def _lcd_runs(old, new):
+    """old と new で異なる文字の範囲 (start, end) を行ごとに列挙する。
+
+    setCursor も 1 文字の書き込みも I2C 1 回分なので、
+    1 文字だけ一致している隙間は分けずに 1 つの範囲にまとめる。
+    """
+    runs = []
+    for row in range(_LCD_ROWS):
+        base = row * _LCD_COLS
+        start = -1
+        end = -1
+        for i in range(base, base + _LCD_COLS):
+            if old[i] == new[i]:
+                continue
+            if start >= 0 and i - end > 1:
+                runs.append((start, end))
+                start = -1
+            if start < 0:
+                start = i
+            end = i + 1
+        if start >= 0:
+            runs.append((start, end))
+    return runs
 
 
 def write_lcd(name, raw_text):
@@ -78,8 +156,12 @@ def write_lcd(name, raw_text):
     16x2 の LCD を想定し、先頭 16 文字を 1 行目、
     17〜32 文字目を 2 行目に表示する。33 文字目以降は切り捨て。
 
+    表示内容のシャドウと比べて、変わった文字の範囲だけを
+    setCursor() + print() で書き換える。表示内容が不明なとき (初回・I2C エラー後) だけ
+    clear() してから書き込む。
     """
-    lcd = _get_lcd(name)
+    entry = _get_lcd(name)
+    lcd = entry.lcd
 
     if not isinstance(raw_text, str):
         raw_text = _to_str(raw_text)
@@ -90,22 +172,29 @@ def write_lcd(name, raw_text):
     text = text.replace("\r", " ").replace("\n", " ")
     text = text[:32]
 
-    line1 = text[:16]
-    line2 = text[16:32]
+    # 書き込まれない桁は空白として扱う (clear() 後の表示と同じになる)
+    new = text + _LCD_BLANK[len(text):]
 
-    # Seeed のサンプルと同じイメージで、clear() + home() のみを使って
-    # 行頭から書き込む（スペース塗りつぶしは行わない）
-    try:
-        lcd.clear()
-    except Exception:
-        # clear が失敗しても最低限 home から書き込む
-        pass
+    old = entry.frame
+    if old is None:
+        # clear() 直後の表示は全桁空白
+        old = _LCD_BLANK
+        try:
+            lcd.clear()
+        except Exception:
+            # clear が失敗した場合は空白で上書きするしかないので、全桁を書き直す
+            old = None
 
-    lcd.home()
-    lcd.print(line1)
-    if line2:
-        lcd.setCursor(0, 1)
-        lcd.print(line2)
+    entry.frame = None
+    if old is None:
+        runs = [(0, _LCD_COLS), (_LCD_COLS, 2 * _LCD_COLS)]
+    else:
+        runs = _lcd_runs(old, new)
+    for start, end in runs:
+        lcd.setCursor(start % _LCD_COLS, start // _LCD_COLS)
+        lcd.print(new[start:end])
+    # 途中で I2C エラーになった場合は frame が None のまま残り、次回は全体を書き直す
+    entry.frame = new
 
 # 本体オンボード LED
 LED = Pin("LED", Pin.OUT, value=0)
@@ -142,6 +231,36 @@ def read_line():
     # CRLF / LF をまとめて扱い、前後の空白も削除
     return _to_str(line).strip()
 
+# バッチ実行中は各コマンドの応答をここに溜め、最後に 1 行にまとめて送信する
+_BATCH = None
+
+# 実行中の行に付いていたタグ ("#<n>")。タグ付きの応答は順番を待たずに送る
+_TAG = None
+_TAG_MAX_LEN = const(11)  # "#" と 10 桁まで
+
+
+def send_reply(s):
+    """応答 1 件を送信する。
+
+    バッチ実行中は送信せずに _BATCH へ追加する。
+
+    Args:
+        s: 改行を含まない応答文字列。
+    """
+    if _BATCH is not None:
+        _BATCH.append(s)
+    elif _TAG is not None:
+        _write_tagged(_TAG, s)
+    elif _REPLIES:
+        # 先に受け付けた低速コマンドの応答を待ってから送る
+        _REPLIES.append(s)
+    else:
+        sys.stdout.write(s + "\n")
+
+def send_ok():
+    """成功時の空応答を送信する。"""
+    send_reply("")
+
 def send_number(n):
     """数値を 10 進数文字列 + 改行で送信する。
 
@@ -152,7 +271,14 @@ def send_number(n):
         s = str(int(n))
     except Exception:
         s = "0"
-    sys.stdout.write(s + "\n")
+    send_reply(s)
+
+def _write_tagged(tag, s):
+    """タグ付きの応答行 "#<n> <reply>" を送信する (応答が空なら "#<n>")。"""
+    if s:
+        sys.stdout.write(tag + " " + s + "\n")
+    else:
+        sys.stdout.write(tag + "\n")
 
 def send_error():
     """エラー時の共通レスポンスを送信する。
@@ -160,7 +286,21 @@ def send_error():
     Returns:
         なし。
     """
-    sys.stdout.write("error\n")
+    send_reply("error")
+
+
+def send_event(text):
+    """非同期通知 \"!<text>\" を送信する。バイナリモード中は通知フレームにする。
+
+    Args:
+        text: 先頭の \"!\" と改行を含まない通知文字列。
+    """
+    if _BINARY:
+        _send_event_frame(text)
+        return
+    sys.stdout.write("!")
+    sys.stdout.write(text)
+    sys.stdout.write("\n")
 
 
 def send_two_floats(a, b):
@@ -169,19 +309,19 @@ def send_two_floats(a, b):
         s = "{} {}".format(float(a), float(b))
     except Exception:
         s = "0 0"
-    sys.stdout.write(s + "\n")
+    send_reply(s)
 
-def _parse_int(token):
-    """int 変換のヘルパー。失敗したら None を返す。"""
-    try:
-        return int(token)
-    except Exception:
-        return None
+_PWM_CACHE = {}
+# 波形を再生中のピン -> _PwmPlayer
+_PWM_PLAYERS = {}
 
 
-_PWM_CACHE = {}
-_DHT_CACHE = {}
-_DHT_LAST = {}
+# ピンごとに最後に設定した入出力方向 (毎回の Pin.init() を省くため)
+# PWM や DHT など別の用途で使った後は _DIR_UNKNOWN に戻し、次回に設定し直す
+_DIR_UNKNOWN = const(0)
+_DIR_IN = const(1)
+_DIR_OUT = const(2)
+_PIN_DIR = bytearray(32)
 
 
 def pinMode(pin_no, mode):
@@ -189,9 +329,8 @@ def pinMode(pin_no, mode):
 
     Args:
         pin_no: 設定対象のピン番号。デジタルピンは 16/18/20、アナログピンは 0/1/2。
-        mode: 文字列 \"INPUT\"/\"OUTPUT\"（大文字小文字は問わない）、またはそれに相当する値。
+        mode: 0 = INPUT, 1 = OUTPUT。
     """
-    m = str(mode).lower()
     # アナログピンは何もしない (成功扱い)
     if pin_no in ANALOG_PINS:
         return
@@ -200,39 +339,49 @@ def pinMode(pin_no, mode):
     if pin is None:
         raise KeyError("UNKNOWN_DIGITAL_PIN")
 
-    if m in ("in", "input"):
-        pin.init(mode=Pin.IN)
-    elif m in ("out", "output"):
+    _pwm_stop(pin_no)
+    _watch_stop(pin_no)
+    _ranger_stop(pin_no)
+    _strip_stop(pin_no)
+    _dht_stop(pin_no)
+    if mode:
         pin.init(mode=Pin.OUT)
+        _PIN_DIR[pin_no] = _DIR_OUT
     else:
-        raise ValueError("UNKNOWN_MODE")
+        pin.init(mode=Pin.IN)
+        _PIN_DIR[pin_no] = _DIR_IN
 
 
+@micropython.native
 def digitalWrite(pin_no, value):
     """digitalWrite(pin, value)
 
     Args:
         pin_no: 出力対象のデジタルピン番号 (16/18/20)。
-        value: 文字列 \"HIGH\"/\"LOW\"（大文字小文字は問わない）、または真偽値に変換可能な値。
+        value: 0 = LOW, 1 = HIGH。
     """
     pin = DIGITAL_PINS.get(pin_no)
     if pin is None:
         raise KeyError("UNKNOWN_DIGITAL_PIN")
 
-    token = str(value).lower()
-    if token == "high":
-        v = 1
-    elif token == "low":
-        v = 0
-    else:
-        raise ValueError("UNKNOWN_LEVEL")
+    v = 1 if value else 0
+    if _PIN_DIR[pin_no] == _DIR_OUT:
+        pin.value(v)
+        return
 
+    _pwm_stop(pin_no)
+    _watch_stop(pin_no)
+    _ranger_stop(pin_no)
+    _strip_stop(pin_no)
+    _dht_stop(pin_no)
     try:
         pin.init(mode=Pin.OUT, value=v)
     except Exception:
         pin.value(v)
+    _PIN_DIR[pin_no] = _DIR_OUT
 
 
+@micropython.native
 def digitalRead(pin_no):
     """digitalRead(pin) -> 0/1
 
@@ -246,14 +395,21 @@ def digitalRead(pin_no):
     if pin is None:
         raise KeyError("UNKNOWN_DIGITAL_PIN")
 
-    try:
-        pin.init(mode=Pin.IN)
-    except Exception:
-        pass
+    if _PIN_DIR[pin_no] != _DIR_IN:
+        _pwm_stop(pin_no)
+        _ranger_stop(pin_no)
+        _strip_stop(pin_no)
+        _dht_stop(pin_no)
+        try:
+            pin.init(mode=Pin.IN)
+        except Exception:
+            pass
+        _PIN_DIR[pin_no] = _DIR_IN
     v = pin.value()
     return 1 if v else 0
 
 
+@micropython.native
 def analogRead(pin_no):
     """analogRead(pin) -> 0〜65535
 
@@ -269,6 +425,128 @@ def analogRead(pin_no):
     return adc.read_u16()
 
 
+# snapshot の mask: ビット 0〜2 が A0〜A2、ビット 3〜5 が D16/D18/D20
+_SNAPSHOT_ALL = const(0x3F)
+_SNAPSHOT_ADC = (ANALOG_PINS[0].read_u16, ANALOG_PINS[1].read_u16, ANALOG_PINS[2].read_u16)
+_SNAPSHOT_PINS = (DIGITAL_PINS[16].value, DIGITAL_PINS[18].value, DIGITAL_PINS[20].value)
+# 読み取った値 ([0]: 時刻, [1 + i]: mask のビット i の値)
+_SNAPSHOT = array.array("I", [0] * 7)
+# 直前の snapshot の mask (応答の組み立て用)
+_SNAPSHOT_MASK = bytearray(1)
+
+
+def snapshot(mask=_SNAPSHOT_ALL):
+    """snapshot([mask]) -> _SNAPSHOT
+
+    mask で指定したピンを続けて読み、読み始めた時刻と一緒に返す。
+    ピンの設定は変えないので、出力にしているデジタルピンは出力中のレベルを返す。
+
+    Args:
+        mask: 読むピンのビットマスク (ビット 0〜2: A0〜A2, ビット 3〜5: D16/D18/D20)。省略時は全ピン。
+
+    Returns:
+        _SNAPSHOT 配列 ([0] が ticks_us、[1 + i] がビット i のピンの値。指定しなかったピンは不定)。
+    """
+    if mask <= 0 or mask > _SNAPSHOT_ALL:
+        raise ValueError("BAD_MASK")
+
+    out = _SNAPSHOT
+    adc = _SNAPSHOT_ADC
+    pins = _SNAPSHOT_PINS
+    # ピンごとの時刻のずれを小さくするため、ループもヒープ確保もせずに続けて読む
+    out[0] = time.ticks_us()
+    if mask & 0x01:
+        out[1] = adc[0]()
+    if mask & 0x02:
+        out[2] = adc[1]()
+    if mask & 0x04:
+        out[3] = adc[2]()
+    if mask & 0x08:
+        out[4] = pins[0]()
+    if mask & 0x10:
+        out[5] = pins[1]()
+    if mask & 0x20:
+        out[6] = pins[2]()
+    _SNAPSHOT_MASK[0] = mask
+    return out
+
+
+def readAll():
+    """readAll() -> snapshot(0x3F) と同じ"""
+    return snapshot(_SNAPSHOT_ALL)
+
+
+# analogReadAvg の最大サンプル数 (合計値が viper の 32 bit 整数に収まる範囲)
+_AVG_MAX_SAMPLES = const(1024)
+_AVG_BUF = array.array("H", [0] * _AVG_MAX_SAMPLES)
+# [0]: 合計, [1]: 最小値, [2]: 最大値
+_AVG_OUT = array.array("I", [0, 0, 0])
+
+
+@micropython.viper
+def _adc_fill(read, buf: ptr16, n: int):
+    """read() を n 回続けて呼び、結果を buf に書き込む。"""
+    for i in range(n):
+        buf[i] = int(read())
+
+
+@micropython.viper
+def _adc_sum(buf: ptr16, n: int, out: ptr32):
+    """buf の先頭 n 個の合計・最小値・最大値を out に書き込む。"""
+    total = 0
+    lo = 65535
+    hi = 0
+    for i in range(n):
+        v = buf[i]
+        total += v
+        if v < lo:
+            lo = v
+        if v > hi:
+            hi = v
+    out[0] = total
+    out[1] = lo
+    out[2] = hi
+
+
+def analogReadAvg(pin_no, n, spread=0):
+    """analogReadAvg(pin, n[, spread]) -> (mean, min, max[, stddev])
+
+    ADC を n 回続けて読み、平均値を返す (オーバーサンプリング)。
+    平均値は小数なので、read_u16() の 16 bit より細かい分解能になる。
+
+    Args:
+        pin_no: アナログピン番号 (0/1/2)。
+        n: サンプル数 (1〜1024)。
+        spread: 1 なら標準偏差も返す (省略時 0)。
+
+    Returns:
+        (mean, min, max) または (mean, min, max, stddev)。いずれも read_u16() と同じ 0〜65535 の単位。
+    """
+    adc = ANALOG_PINS.get(pin_no)
+    if adc is None:
+        raise KeyError("UNKNOWN_ANALOG_PIN")
+    if n < 1 or n > _AVG_MAX_SAMPLES:
+        raise ValueError("BAD_COUNT")
+
+    buf = _AVG_BUF
+    out = _AVG_OUT
+    _adc_fill(adc.read_u16, buf, n)
+    _adc_sum(buf, n, out)
+    mean = out[0] / n
+    if not spread:
+        return mean, out[1], out[2]
+
+    # 2 乗和は 32 bit を超え、Pico の float (単精度) では桁落ちするので、
+    # n^2 * 分散 = n * Σv^2 - (Σv)^2 を Python の整数で正確に求めてから割る
+    total = out[0]
+    sq = 0
+    for i in range(n):
+        v = buf[i]
+        sq += v * v
+    var = (n * sq - total * total) / (n * n)
+    return mean, out[1], out[2], math.sqrt(var)
+
+
 def analogWrite(pin_no, value):
     """analogWrite(pin, value[0-255])
 
@@ -276,39 +554,161 @@ def analogWrite(pin_no, value):
         pin_no: PWM 出力対象のデジタルピン番号 (16/18/20)。
         value: 0〜255 の整数。0 で OFF, 255 で最大デューティ。
     """
+    pwm = _get_pwm(pin_no)
+    pwm.duty_u16(_duty(value))
+
+
+def _get_pwm(pin_no):
+    """ピンの PWM インスタンスを返す (再生中の波形は止める)。"""
     pin = DIGITAL_PINS.get(pin_no)
     if pin is None:
         raise KeyError("UNKNOWN_DIGITAL_PIN")
 
+    _pwm_stop(pin_no)
+    _watch_stop(pin_no)
+    _ranger_stop(pin_no)
+    _strip_stop(pin_no)
+    _dht_stop(pin_no)
     pwm = _PWM_CACHE.get(pin_no)
     if pwm is None:
         pwm = PWM(pin)
         pwm.freq(1000)  # 1kHz 程度の PWM
         _PWM_CACHE[pin_no] = pwm
+    _PIN_DIR[pin_no] = _DIR_UNKNOWN
+    return pwm
+
 
+def _duty(value):
+    """analogWrite の値 (0〜255) -> duty_u16 の値 (0〜65535)"""
     v = int(value)
     if v < 0:
         v = 0
     if v > 255:
         v = 255
+    return v * 257  # 0–255 -> 0–65535 へ線形変換
 
-    duty = int(v * 257)  # 0–255 -> 0–65535 へ線形変換
-    pwm.duty_u16(duty)
 
+# --- PWM 波形の再生 (フェードなど) ---
+
+# 1 つの波形の最大ステップ数と、ステップ周期の最小値 [ms]
+_PWM_MAX_STEPS = const(256)
+_PWM_MIN_PERIOD_MS = const(2)
 
-def ultrasonicRead(pin_no):
-    """ultrasonicRead(pin) -> distance[cm]
+
+class _PwmPlayer:
+    """duty 値のテーブルをタイマー割り込みで 1 ステップずつ PWM に設定する。
+
+    _AnalogStream と同じく、割り込みハンドラ内でヒープ確保が起きないよう
+    テーブルとインデックスは生成時に確保しておく。
+    """
+
+    def __init__(self, pwm, duties, period_ms, repeat):
+        self.pwm = pwm
+        self.duties = duties
+        self.count = len(duties)
+        self.repeat = repeat
+        self.idx = array.array("I", [0])
+        # 1 ステップ目はすぐに出力する
+        pwm.duty_u16(duties[0])
+        self.timer = Timer()
+        if self.count > 1 or repeat:
+            self.timer.init(mode=Timer.PERIODIC, period=period_ms, callback=self._step)
+
+    def _step(self, _t):
+        idx = self.idx
+        i = idx[0] + 1
+        if i >= self.count:
+            if not self.repeat:
+                self.timer.deinit()
+                return
+            i = 0
+        idx[0] = i
+        self.pwm.duty_u16(self.duties[i])
+
+    def stop(self):
+        self.timer.deinit()
+
+
+def _pwm_stop(pin_no):
+    """ピンで再生中の波形を止める (duty はそのときの値のまま)。"""
+    if _PWM_PLAYERS:
+        player = _PWM_PLAYERS.pop(pin_no, None)
+        if player is not None:
+            player.stop()
+
+
+def _pwm_play(pin_no, duties, period_ms, repeat):
+    if period_ms < _PWM_MIN_PERIOD_MS:
+        raise ValueError("BAD_PERIOD")
+    pwm = _get_pwm(pin_no)
+    _PWM_PLAYERS[pin_no] = _PwmPlayer(pwm, duties, period_ms, repeat)
+
+
+def pwmRamp(pin_no, start, end, duration_ms):
+    """pwmRamp(pin, from, to, duration_ms)
+
+    PWM 出力を from から to まで duration_ms かけて直線的に変化させる。
+    ステップは 16 bit の duty 値で補間するので、analogWrite の 256 段階より滑らかになる。
 
     Args:
-        pin_no: 超音波距離センサーを接続したデジタルピン番号 (16/18/20)。
+        pin_no: PWM 出力対象のデジタルピン番号 (16/18/20)。
+        start: 開始値 (0〜255)。
+        end: 終了値 (0〜255)。
+        duration_ms: 変化にかける時間 [ms]。0 なら end をすぐに設定する。
+    """
+    d0 = _duty(start)
+    d1 = _duty(end)
+    if duration_ms < 0:
+        raise ValueError("BAD_DURATION")
+
+    steps = min(_PWM_MAX_STEPS, duration_ms // _PWM_MIN_PERIOD_MS)
+    if steps < 1:
+        _pwm_play(pin_no, array.array("H", [d1]), _PWM_MIN_PERIOD_MS, False)
+        return
 
-    Returns:
-        距離[cm] を表す整数。
+    # 最初のステップは start、steps 周期後 (ほぼ duration_ms 後) にちょうど end になる
+    duties = array.array("H", [0] * (steps + 1))
+    for k in range(steps + 1):
+        duties[k] = d0 + (d1 - d0) * k // steps
+    _pwm_play(pin_no, duties, duration_ms // steps, False)
+
+
+def pwmSequence(pin_no, period_ms, repeat, values):
+    """pwmSequence(pin, period_ms, repeat, values)
+
+    値のテーブルを period_ms ごとに 1 つずつ PWM に設定する。
+
+    Args:
+        pin_no: PWM 出力対象のデジタルピン番号 (16/18/20)。
+        period_ms: 1 ステップの長さ [ms] (2 以上)。
+        repeat: 0 = 最後の値で止める, 1 = 先頭に戻って繰り返す。
+        values: 各ステップの値 (0〜255) を 2 桁の 16 進数で並べた文字列 (最大 256 ステップ)。
     """
-    pin = DIGITAL_PINS.get(pin_no)
-    if pin is None:
+    try:
+        raw = binascii.unhexlify(values)
+    except Exception:
+        raise ValueError("BAD_VALUES")
+    if not raw or len(raw) > _PWM_MAX_STEPS:
+        raise ValueError("BAD_VALUES")
+
+    duties = array.array("H", [0] * len(raw))
+    for k in range(len(raw)):
+        duties[k] = raw[k] * 257
+    _pwm_play(pin_no, duties, period_ms, bool(repeat))
+
+
+def pwmStop(pin_no):
+    """pwmStop(pin)
+
+    再生中の pwmRamp / pwmSequence を止める。出力はそのときの値のまま残る。
+    """
+    if pin_no not in DIGITAL_PINS:
         raise KeyError("UNKNOWN_DIGITAL_PIN")
+    _pwm_stop(pin_no)
 
+
+def _pulse_us(pin_no, pin):
+    """トリガーパルスを出してエコーのパルス幅 [us] を測る (PIO を使わない場合)。"""
     # トリガーパルス送信
     pin.init(mode=Pin.OUT)
     pin.value(0)
@@ -319,18 +719,282 @@ def ultrasonicRead(pin_no):
 
     # エコー計測
     pin.init(mode=Pin.IN)
+    _PIN_DIR[pin_no] = _DIR_IN
     try:
-        duration = time_pulse_us(pin, 1, 30000)  # 30ms タイムアウト
+        duration = time_pulse_us(pin, 1, _RANGE_TIMEOUT_US)  # 30ms タイムアウト
     except Exception:
         raise RuntimeError("PULSE_TIMEOUT")
 
     if duration <= 0:
         raise RuntimeError("PULSE_ERROR")
+    return duration
+
 
+def _distance_cm(duration):
     distance_cm = duration / 58.0
     return int(distance_cm + 0.5)
 
 
+# エコー待ちのタイムアウト [us]
+_RANGE_TIMEOUT_US = const(30000)
+# 連続測定の最短周期 [ms] (前の測定のエコーが消えるまで待つ)
+_RANGE_MIN_PERIOD_MS = const(30)
+# 連続測定で中央値を取る測定回数
+_RANGE_MEDIAN = const(5)
+# PIO1 のステートマシン (ws2812.py は PIO0 のステートマシン 0 を使う)
+_RANGE_SM = {16: 4, 18: 5, 20: 6}
+
+_RANGERS = {}
+
+
+class _Ranger:
+    """超音波距離センサー 1 個分の PIO ドライバと連続測定の状態。
+
+    連続測定中は period ごとにメインループ (_PUMPS) から測定を開始し、
+    結果を待たずに戻る。直近 _RANGE_MEDIAN 回の中央値を value に保持する。
+    """
+
+    def __init__(self, pin_no):
+        self.pin_no = pin_no
+        self.pio = Ultrasonic(_RANGE_SM[pin_no], pin_no, _RANGE_TIMEOUT_US)
+        self.period = 0      # 連続測定の周期 [ms] (0 なら停止中)
+        self.stream = False  # 測定ごとに "!ultrasonic" 通知を送るか
+        self.next = 0
+        self.samples = []    # 直近の測定値 [cm]
+        self.misses = 0      # 連続したタイムアウトの回数
+        self.value = None    # 中央値 [cm]
+
+    def measure(self):
+        """1 回測定して距離 [cm] を返す (単発の ultrasonicRead 用)。"""
+        pio = self.pio
+        if not pio.busy:
+            pio.trigger()
+        # 立ち上がり待ちと計測がそれぞれ最大 30 ms かかる
+        deadline = time.ticks_add(time.ticks_ms(), 2 * _RANGE_TIMEOUT_US // 1000 + 10)
+        while not pio.ready():
+            if time.ticks_diff(deadline, time.ticks_ms()) < 0:
+                raise RuntimeError("PULSE_TIMEOUT")
+        duration = pio.result()
+        if duration is None or duration <= 0:
+            raise RuntimeError("PULSE_TIMEOUT")
+        return _distance_cm(duration)
+
+    def pump(self, now):
+        pio = self.pio
+        if pio.busy:
+            if not pio.ready():
+                return
+            self._add(pio.result())
+        if time.ticks_diff(now, self.next) < 0:
+            return
+        self.next = time.ticks_add(now, self.period)
+        pio.trigger()
+
+    def _add(self, duration):
+        if duration is None or duration <= 0:
+            # 外れ値ではなく応答なし。続いた場合だけ値を捨てる
+            self.misses += 1
+            if self.misses >= _RANGE_MEDIAN:
+                self.samples = []
+                self.value = None
+            return
+        self.misses = 0
+        samples = self.samples
+        samples.append(_distance_cm(duration))
+        if len(samples) > _RANGE_MEDIAN:
+            samples.pop(0)
+        self.value = sorted(samples)[(len(samples) - 1) // 2]
+        if self.stream:
+            send_event("ultrasonic {} {}".format(self.pin_no, self.value))
+
+    def stop(self):
+        self.pio.deinit()
+
+
+def _get_ranger(pin_no):
+    r = _RANGERS.get(pin_no)
+    if r is None:
+        _pwm_stop(pin_no)
+        _watch_stop(pin_no)
+        _strip_stop(pin_no)
+        _dht_stop(pin_no)
+        r = _Ranger(pin_no)
+        _RANGERS[pin_no] = r
+        # ピンは PIO が使うので、次の digitalRead/digitalWrite で設定し直す
+        _PIN_DIR[pin_no] = _DIR_UNKNOWN
+    return r
+
+
+def _pump_rangers():
+    now = time.ticks_ms()
+    for r in _RANGERS.values():
+        if r.period:
+            r.pump(now)
+
+
+def _ranger_stop(pin_no):
+    if _RANGERS:
+        r = _RANGERS.pop(pin_no, None)
+        if r is not None:
+            r.stop()
+        _update_ranger_pump()
+
+
+def _update_ranger_pump():
+    running = False
+    for r in _RANGERS.values():
+        if r.period:
+            running = True
+    if running and _pump_rangers not in _PUMPS:
+        _PUMPS.append(_pump_rangers)
+    elif not running and _pump_rangers in _PUMPS:
+        _PUMPS.remove(_pump_rangers)
+
+
+def ultrasonicRead(pin_no):
+    """ultrasonicRead(pin) -> distance[cm]
+
+    連続測定中 (ultrasonicStart) は、測定を待たずに直近の中央値を返す。
+
+    Args:
+        pin_no: 超音波距離センサーを接続したデジタルピン番号 (16/18/20)。
+
+    Returns:
+        距離[cm] を表す整数。
+    """
+    pin = DIGITAL_PINS.get(pin_no)
+    if pin is None:
+        raise KeyError("UNKNOWN_DIGITAL_PIN")
+
+    r = _RANGERS.get(pin_no)
+    if r is not None and r.period:
+        if r.value is None:
+            raise RuntimeError("NO_ECHO")
+        return r.value
+
+    if Ultrasonic is None:
+        return _distance_cm(_pulse_us(pin_no, pin))
+    return _get_ranger(pin_no).measure()
+
+
+def ultrasonicStart(pin_no, period_ms, stream=0):
+    """ultrasonicStart(pin, period_ms[, stream])
+
+    period_ms ごとにバックグラウンドで測定を続ける (PIO ドライバが必要)。
+
+    Args:
+        pin_no: 超音波距離センサーを接続したデジタルピン番号 (16/18/20)。
+        period_ms: 測定周期 [ms] (30 以上)。
+        stream: 1 なら測定ごとに "!ultrasonic <pin> <cm>" を送る (省略時 0)。
+    """
+    if pin_no not in DIGITAL_PINS:
+        raise KeyError("UNKNOWN_DIGITAL_PIN")
+    if Ultrasonic is None:
+        raise RuntimeError("PIO_NOT_AVAILABLE")
+    if period_ms < _RANGE_MIN_PERIOD_MS:
+        raise ValueError("BAD_PERIOD")
+
+    r = _get_ranger(pin_no)
+    r.period = period_ms
+    r.stream = bool(stream)
+    r.next = time.ticks_ms()
+    _update_ranger_pump()
+
+
+def ultrasonicStop(pin_no):
+    """ultrasonicStop(pin)
+
+    Args:
+        pin_no: 連続測定を止めるデジタルピン番号。動作中でなければ何もしない。
+    """
+    if pin_no not in DIGITAL_PINS:
+        raise KeyError("UNKNOWN_DIGITAL_PIN")
+    _ranger_stop(pin_no)
+
+
+# 1 フレームの最大 LED 数 (バイナリフレームの payload 1024 バイトに RGB で収まる数)
+_STRIP_MAX_LEDS = const(341)
+
+# LED テープは PIO0 のステートマシン 0 で 1 本だけ駆動する
+_STRIP = None
+_STRIP_PIN = -1
+
+
+def _strip_stop(pin_no):
+    global _STRIP, _STRIP_PIN
+    if _STRIP is not None and pin_no == _STRIP_PIN:
+        _STRIP.deinit()
+        _STRIP = None
+        _STRIP_PIN = -1
+
+
+def _get_strip(pin_no):
+    if _STRIP is None or pin_no != _STRIP_PIN:
+        raise RuntimeError("NO_STRIP")
+    return _STRIP
+
+
+def ledStripInit(pin_no, count, brightness=255):
+    """ledStripInit(pin, count[, brightness])
+
+    Args:
+        pin_no: WS2812 LED テープの DIN を接続したデジタルピン番号 (16/18/20)。
+        count: LED の数 (1〜341)。
+        brightness: 明るさ (0〜255、省略時 255)。
+    """
+    global _STRIP, _STRIP_PIN
+    if pin_no not in DIGITAL_PINS:
+        raise KeyError("UNKNOWN_DIGITAL_PIN")
+    if WS2812 is None:
+        raise RuntimeError("PIO_NOT_AVAILABLE")
+    if count < 1 or count > _STRIP_MAX_LEDS:
+        raise ValueError("BAD_LED_COUNT")
+    if brightness < 0 or brightness > 255:
+        raise ValueError("OUT_OF_RANGE")
+
+    if _STRIP is not None:
+        _strip_stop(_STRIP_PIN)
+    _pwm_stop(pin_no)
+    _watch_stop(pin_no)
+    _ranger_stop(pin_no)
+    _dht_stop(pin_no)
+    _STRIP = WS2812(pin_no, count, brightness / 255)
+    _STRIP_PIN = pin_no
+    # ピンは PIO が使うので、次の digitalRead/digitalWrite で設定し直す
+    _PIN_DIR[pin_no] = _DIR_UNKNOWN
+
+
+def ledStripWrite(pin_no, rgb, n=None):
+    """ledStripWrite(pin, base64)
+
+    R, G, B の順に並んだバイト列を 1 フレームとして表示する。
+
+    Args:
+        pin_no: ledStripInit で設定したピン番号。
+        rgb: LED ごとに R, G, B の 3 バイトを並べたバイト列。
+            テキストでは Base64 で送る。LED の数より短ければ残りは前のまま。
+        n: rgb の有効な長さ [byte] (省略時は全体)。
+    """
+    strip = _get_strip(pin_no)
+    if n is None:
+        n = len(rgb)
+    if n % 3:
+        raise ValueError("BAD_FRAME_LENGTH")
+    strip.pixels_write(rgb, n // 3)
+
+
+def ledStripBrightness(pin_no, brightness):
+    """ledStripBrightness(pin, brightness)
+
+    Args:
+        pin_no: ledStripInit で設定したピン番号。
+        brightness: 明るさ (0〜255)。次の ledStripWrite から反映される。
+    """
+    if brightness < 0 or brightness > 255:
+        raise ValueError("OUT_OF_RANGE")
+    _get_strip(pin_no).set_brightness(brightness / 255)
+
+
 def setText(bus, text):
     """setText(bus, text)
 
@@ -365,51 +1029,648 @@ def setRGB(bus, r, g, b):
     else:
         raise ValueError("UNKNOWN_I2C_BUS")
 
-    lcd = _get_lcd(key)
+    entry = _get_lcd(key)
+    rgb = (int(r), int(g), int(b))
+    # 同じ色なら I2C に書き込まない
+    if rgb == entry.rgb:
+        return
+    lcd = entry.lcd
     if hasattr(lcd, "set_rgb"):
-        lcd.set_rgb(int(r), int(g), int(b))
+        entry.rgb = None
+        lcd.set_rgb(rgb[0], rgb[1], rgb[2])
+        entry.rgb = rgb
+
+
+# DHT11 は 1 秒、DHT22 と DHT20 は 2 秒より短い間隔で測ると失敗しやすい (データシートの最小間隔)
+_DHT_INTERVAL_MS = (1000, 2000, 2000)
+# dhtRead の module_type
+_DHT_MODULE_DHT20 = const(2)
+# DHT20 の変換がこの時間を過ぎても終わらなければ、その回の計測を諦める
+_DHT20_TIMEOUT_MS = const(200)
+# この時間 dhtRead されなかったセンサーは計測をやめる
+_DHT_IDLE_MS = const(60000)
+
+
+class _DhtSensor:
+    """DHT センサー 1 個分のドライバと最新の計測値。
+
+    計測はコマンドの合間にメインループ (_PUMPS) から、センサーの最小間隔ごとに行う。
+    """
+
+    def __init__(self, pin_no, module_type):
+        if module_type == 0:
+            driver = dht.DHT11
+        elif module_type == 1:
+            driver = dht.DHT22
+        else:
+            raise ValueError("UNKNOWN_DHT_MODULE_TYPE")
+
+        # DHT ライブラリは Pin 番号から新しい Pin インスタンスを受け取る想定なので、
+        # DIGITAL_PINS ではなくピン番号から直接生成する。
+        self.sensor = driver(Pin(pin_no, Pin.IN))
+        if pin_no < len(_PIN_DIR):
+            _PIN_DIR[pin_no] = _DIR_UNKNOWN
+            _DHT_PINS[pin_no] = 1
+        self.interval = _DHT_INTERVAL_MS[module_type]
+        self.value = None      # (temp, hum)
+        self.taken = 0         # value を計測した時刻 [ms]
+        self.next = time.ticks_ms()
+        self.last_read = self.next
+
+    def measure(self, now):
+        """計測して value を更新する。失敗時は前回値を残す。"""
+        self.next = time.ticks_add(now, self.interval)
+        try:
+            # DHT11 / DHT22 系は、データシート上も「連続して高速に測定するとエラーになりうる」
+            # という性質を持つため、ここで measure() が例外を投げることがある。
+            # センサー仕様起因の一時的なエラーでホスト側アプリが落ちないよう、
+            # 正常に取得できた値を残しておき、失敗時はその値を返す。
+            self.sensor.measure()
+            self.value = (float(self.sensor.temperature()), float(self.sensor.humidity()))
+            self.taken = now
+        except Exception:
+            pass
+
+    def poll(self, now):
+        """計測時刻になっていれば計測する。センサーを待って止まった場合は True を返す。"""
+        if time.ticks_diff(now, self.next) < 0:
+            return False
+        self.measure(now)
+        return True
+
+
+class _Dht20Sensor:
+    """I2C 接続の DHT20 1 個分のドライバと最新の計測値。
+
+    変換開始 (trigger) と読み出し (collect) をメインループの別々の呼び出しで行い、
+    約 80 ms の変換中も他のコマンドを処理する。CRC が合わない結果は捨てる。
+    """
+
+    def __init__(self, bus):
+        if DHT20 is None:
+            raise RuntimeError("DHT20_NOT_AVAILABLE")
+        i2c = I2C_BUSES.get("i2c{}".format(bus))
+        if i2c is None:
+            raise ValueError("UNKNOWN_I2C_BUS")
+        self.sensor = DHT20(i2c)
+        self.interval = _DHT_INTERVAL_MS[_DHT_MODULE_DHT20]
+        self.value = None       # (temp, hum)
+        self.taken = 0          # value を計測した時刻 [ms]
+        self.next = time.ticks_ms()
+        self.last_read = self.next
+        self.converting = False
+        self.started = 0        # 変換を始めた時刻 [ms]
+
+    def poll(self, now):
+        """状態を 1 つ進める。I2C の短い転送だけで、変換の完了は待たない。"""
+        if self.converting:
+            elapsed = time.ticks_diff(now, self.started)
+            if elapsed < _DHT20_CONVERSION_MS:
+                return False
+            try:
+                if self.sensor.busy():
+                    if elapsed > _DHT20_TIMEOUT_MS:
+                        self.converting = False
+                    return False
+                self.converting = False
+                temp, hum = self.sensor.collect()
+                self.value = (temp, hum)
+                self.taken = now
+            except Exception:
+                # I2C エラーや CRC 不一致の場合は前回値を残す
+                self.converting = False
+            return False
+
+        if time.ticks_diff(now, self.next) < 0:
+            return False
+        self.next = time.ticks_add(now, self.interval)
+        try:
+            self.sensor.trigger()
+        except Exception:
+            return False
+        self.converting = True
+        self.started = now
+        return False
+
+    def measure(self, now):
+        """その場で 1 回計測する (初回の dhtRead 用)。"""
+        self.poll(now)
+        while self.converting:
+            time.sleep_ms(1)
+            self.poll(time.ticks_ms())
+
+
+_DHT_SENSORS = {}
+
+# DHT11/DHT22 を計測しているかもしれないピン (core 1 が立て、core 0 が _dht_stop で下ろす)
+_DHT_PINS = bytearray(32)
+
+
+def _pump_dht():
+    """最小間隔が過ぎた DHT11/DHT22 を 1 つだけ計測する (1 回の停止を短くするため)。
+
+    DHT20 は待たずに状態を進めるだけなので、止まらずに次のセンサーへ進む。
+    """
+    now = time.ticks_ms()
+    for key, st in _DHT_SENSORS.items():
+        if time.ticks_diff(now, st.last_read) > _DHT_IDLE_MS:
+            del _DHT_SENSORS[key]
+            break
+        if st.poll(now):
+            break
+    if not _DHT_SENSORS and _pump_dht in _DHT_PUMPS:
+        _DHT_PUMPS.remove(_pump_dht)
+
+
+def _dht_forget(pin_no):
+    """pin_no の DHT11/DHT22 の計測をやめる。_DHT_SENSORS を回している core 1 で実行する。"""
+    for module_type in (0, 1):
+        _DHT_SENSORS.pop((pin_no, module_type), None)
+    if not _DHT_SENSORS and _pump_dht in _DHT_PUMPS:
+        _DHT_PUMPS.remove(_pump_dht)
+
+
+def _dht_stop(pin_no):
+    """pin_no を別の用途に使う前に、バックグラウンドの DHT の計測を止める。
+
+    計測はスタートパルスでピンを Low に駆動し、入力に戻すので、
+    止めないと後から設定した出力が最大 _DHT_IDLE_MS の間上書きされる。
+    """
+    if not _DHT_PINS[pin_no]:
+        return
+    _DHT_PINS[pin_no] = 0
+    _on_core1(_dht_forget, pin_no)
 
 
 def dhtRead(pin_no, module_type):
-    """dhtRead(pin, module_type) -> (temp, hum)
+    """dhtRead(pin, module_type) -> (temp, hum, age_ms)
+
+    初回はその場で計測して返し、以降はバックグラウンドで計測した最新の値を待たずに返す。
 
     Args:
         pin_no: DHT センサーを接続したピン番号 (デジタルピン番号)。
-        module_type: 0 = BLUE モジュール(DHT11), 1 = WHITE モジュール(DHT22)。
+        module_type: 0 = BLUE モジュール(DHT11), 1 = WHITE モジュール(DHT22),
+            2 = DHT20 (I2C)。DHT20 の場合 pin_no は I2C バス番号 (0/1)。
 
     Returns:
-        (temp, hum): 温度[℃], 湿度[%] のタプル。
+        (temp, hum, age_ms): 温度[℃], 湿度[%], 計測してからの経過時間[ms] のタプル。
+    """
+    key = (pin_no, module_type)
+    now = time.ticks_ms()
+    st = _DHT_SENSORS.get(key)
+    if st is None:
+        if module_type == _DHT_MODULE_DHT20:
+            st = _Dht20Sensor(pin_no)
+        else:
+            st = _DhtSensor(pin_no, module_type)
+        st.measure(now)
+        _DHT_SENSORS[key] = st
+        if _pump_dht not in _DHT_PUMPS:
+            _DHT_PUMPS.append(_pump_dht)
+
+    st.last_read = now
+    if st.value is None:
+        # 一度も成功していない場合だけ、上位にエラーとして伝える。
+        raise RuntimeError("DHT_NO_DATA")
+    return st.value[0], st.value[1], time.ticks_diff(now, st.taken)
+
+# --- アナログ連続サンプリング (ストリーミング) ---
+
+# 1 ストリームあたりのリングバッファ長 (サンプル数, 2 のべき乗)
+_STREAM_RING_SIZE = 1024
+_STREAM_RING_MASK = _STREAM_RING_SIZE - 1
+_STREAM_MAX_BLOCK = 256
+_STREAM_MAX_RATE = 50000
+
+_STREAMS = {}
+
+# メインループから定期的に呼び出す関数 (非同期通知の送信など)
+_PUMPS = []
+
+# core 1 のワーカーが待ち時間に呼び出す関数
+_CORE1_PUMPS = []
+
+# DHT のバックグラウンド計測は dhtRead と同じコアで行う
+_DHT_PUMPS = _CORE1_PUMPS if _thread else _PUMPS
+
+
+class _AnalogStream:
+    """1 本のアナログピンをタイマー割り込みでサンプリングするストリーム。
+
+    割り込みハンドラ内でヒープ確保が起きないよう、
+    バッファとインデックスはすべて生成時に確保しておく。
+    """
+
+    def __init__(self, pin_no, adc, rate_hz, block):
+        self.pin_no = pin_no
+        self.adc = adc
+        self.block_len = block
+        self.ring = array.array("H", [0] * _STREAM_RING_SIZE)
+        self.block = array.array("H", [0] * block)
+        # [0]: 書き込み位置, [1]: 未送信サンプル数, [2]: 上書きで失ったサンプル数
+        self.idx = array.array("I", [0, 0, 0])
+        self.seq = 0
+        self.timer = Timer()
+        self.timer.init(mode=Timer.PERIODIC, freq=rate_hz, callback=self._sample)
+
+    def _sample(self, _t):
+        idx = self.idx
+        w = idx[0]
+        self.ring[w] = self.adc.read_u16()
+        idx[0] = (w + 1) & _STREAM_RING_MASK
+        if idx[1] < _STREAM_RING_SIZE:
+            idx[1] += 1
+        else:
+            idx[2] += 1
+
+    def stop(self):
+        self.timer.deinit()
+
+    def pump(self):
+        """1 ブロック分たまっていれば \"!stream\" 行として送信する。"""
+        idx = self.idx
+        n = self.block_len
+        if idx[1] < n:
+            return
+
+        state = machine.disable_irq()
+        r = (idx[0] - idx[1]) & _STREAM_RING_MASK
+        overruns = idx[2]
+        machine.enable_irq(state)
+
+        ring = self.ring
+        block = self.block
+        for i in range(n):
+            block[i] = ring[(r + i) & _STREAM_RING_MASK]
+
+        state = machine.disable_irq()
+        idx[1] -= n
+        machine.enable_irq(state)
+
+        b64 = _to_str(binascii.b2a_base64(block))
+        send_event("stream {} {} {} {}".format(self.pin_no, self.seq, overruns, b64[:-1]))
+        self.seq += 1
+
+
+def _pump_streams():
+    for st in _STREAMS.values():
+        st.pump()
+
+
+def streamAnalog(pin_no, rate_hz, block=64):
+    """streamAnalog(pin, rate_hz[, block])
+
+    Args:
+        pin_no: アナログピン番号 (0/1/2)。
+        rate_hz: サンプリング周波数 [Hz]。
+        block: 1 回の通知にまとめるサンプル数 (省略時 64)。
+    """
+    adc = ANALOG_PINS.get(pin_no)
+    if adc is None:
+        raise KeyError("UNKNOWN_ANALOG_PIN")
+    if rate_hz <= 0 or rate_hz > _STREAM_MAX_RATE:
+        raise ValueError("BAD_RATE")
+    if block <= 0 or block > _STREAM_MAX_BLOCK:
+        raise ValueError("BAD_BLOCK")
+
+    streamStop(pin_no)
+    _STREAMS[pin_no] = _AnalogStream(pin_no, adc, rate_hz, block)
+    if _pump_streams not in _PUMPS:
+        _PUMPS.append(_pump_streams)
+
+
+def streamStop(pin_no):
+    """streamStop(pin)
+
+    Args:
+        pin_no: 停止するアナログピン番号。動作中でなければ何もしない。
+    """
+    st = _STREAMS.pop(pin_no, None)
+    if st is not None:
+        st.stop()
+    if not _STREAMS and _pump_streams in _PUMPS:
+        _PUMPS.remove(_pump_streams)
+
+# --- デジタル入力の変化通知 ---
+
+# 1 ピンあたりのエッジのリングバッファ長 (2 のべき乗)
+_WATCH_RING_SIZE = const(32)
+_WATCH_RING_MASK = const(31)
+
+_WATCHES = {}
+
+
+class _DigitalWatch:
+    """1 本のデジタルピンのエッジを Pin.irq で記録する。
+
+    割り込みハンドラ (hard IRQ) 内でヒープ確保が起きないよう、
+    リングバッファとインデックスはすべて生成時に確保しておく。
+    """
+
+    def __init__(self, pin_no, pin, trigger, debounce_us):
+        self.pin_no = pin_no
+        self.pin = pin
+        self.both = trigger == (Pin.IRQ_RISING | Pin.IRQ_FALLING)
+        self.rising = trigger == Pin.IRQ_RISING
+        self.debounce_us = debounce_us
+        self.times = array.array("I", [0] * _WATCH_RING_SIZE)
+        self.levels = bytearray(_WATCH_RING_SIZE)
+        # [0]: 書き込み位置, [1]: 未送信のエッジ数, [2]: 上書きで失ったエッジ数,
+        # [3]: 最後に記録したエッジの時刻, [4]: 最後に記録したレベル
+        self.idx = array.array("I", [0, 0, 0, 0, pin.value()])
+        self.recorded = False
+        pin.irq(handler=self._irq, trigger=trigger, hard=True)
+
+    def _irq(self, pin):
+        now = time.ticks_us()
+        idx = self.idx
+        if self.both:
+            v = pin.value()
+            # チャタリングで同じレベルが続いた場合は変化とみなさない
+            if v == idx[4]:
+                return
+        else:
+            v = 1 if self.rising else 0
+        if self.recorded and time.ticks_diff(now, idx[3]) < self.debounce_us:
+            return
+        self.recorded = True
+        idx[3] = now
+        idx[4] = v
+        w = idx[0]
+        self.times[w] = now
+        self.levels[w] = v
+        idx[0] = (w + 1) & _WATCH_RING_MASK
+        if idx[1] < _WATCH_RING_SIZE:
+            idx[1] += 1
+        else:
+            idx[2] += 1
+
+    def stop(self):
+        self.pin.irq(handler=None)
+
+    def pump(self):
+        """記録済みのエッジを 1 つずつ "!change" 行として送信する。"""
+        idx = self.idx
+        while idx[1]:
+            state = machine.disable_irq()
+            r = (idx[0] - idx[1]) & _WATCH_RING_MASK
+            t = self.times[r]
+            v = self.levels[r]
+            overruns = idx[2]
+            idx[1] -= 1
+            machine.enable_irq(state)
+            send_event("change {} {} {} {}".format(self.pin_no, v, t, overruns))
+
+
+def _pump_watches():
+    for w in _WATCHES.values():
+        w.pump()
+
+
+def _watch_stop(pin_no):
+    if _WATCHES:
+        w = _WATCHES.pop(pin_no, None)
+        if w is not None:
+            w.stop()
+        if not _WATCHES and _pump_watches in _PUMPS:
+            _PUMPS.remove(_pump_watches)
+
+
+def watchDigital(pin_no, trigger, debounce_ms=0):
+    """watchDigital(pin, edge[, debounce_ms])
+
+    ピンを入力にして、変化するたびに "!change" 通知を送る。
+
+    Args:
+        pin_no: 監視するデジタルピン番号 (16/18/20)。
+        trigger: 監視するエッジ (_edge でパースした Pin.IRQ_* の値)。
+        debounce_ms: 直前のエッジからこの時間内のエッジは無視する [ms] (省略時 0)。
     """
-    # DHT ライブラリは Pin 番号から新しい Pin インスタンスを受け取る想定なので、
-    # DIGITAL_PINS ではなくピン番号から直接生成する。
-    pin = Pin(pin_no, Pin.IN)
+    pin = DIGITAL_PINS.get(pin_no)
+    if pin is None:
+        raise KeyError("UNKNOWN_DIGITAL_PIN")
+    if debounce_ms < 0:
+        raise ValueError("BAD_DEBOUNCE")
+
+    _watch_stop(pin_no)
+    _pwm_stop(pin_no)
+    _ranger_stop(pin_no)
+    _strip_stop(pin_no)
+    _dht_stop(pin_no)
+    pin.init(mode=Pin.IN)
+    _PIN_DIR[pin_no] = _DIR_IN
+    _WATCHES[pin_no] = _DigitalWatch(pin_no, pin, trigger, debounce_ms * 1000)
+    if _pump_watches not in _PUMPS:
+        _PUMPS.append(_pump_watches)
+
+
+def unwatchDigital(pin_no):
+    """unwatchDigital(pin)
+
+    Args:
+        pin_no: 監視をやめるデジタルピン番号。監視中でなければ何もしない。
+    """
+    if pin_no not in DIGITAL_PINS:
+        raise KeyError("UNKNOWN_DIGITAL_PIN")
+    _watch_stop(pin_no)
+
+
+# --- 2 つ目のコア (core 1) での低速な処理 ---
+#
+# I2C (LCD, DHT20) と DHT の計測、ビットバングの超音波計測は core 1 のワーカーで行う。
+# core 0 はその間も USB からコマンドを読み、速いコマンドを先に実行する。
+# 応答はコマンドを受け付けた順のまま送る (_REPLIES で順番を待つ)。
+# 2 つのコアで共有するのは、ロックで守った確保済みのジョブのリング (_JOBS) だけにする。
+
+_JOB_SLOTS = const(8)
+
+
+class _Job:
+    """core 1 で実行するコマンド 1 件。"""
+
+    def __init__(self):
+        self.func = None
+        self.args = None
+        self.result = None
+        self.failed = False
+        self.done = False      # core 1 が実行を終えた
+        self.entry = None      # 応答を待つコマンドのコマンド表の項目 (同期実行なら None)
+        self.pin = -1          # 実行中に使うピン (-1 なら I2C だけ)
+        self.t0 = 0
+        self.tag = None        # タグ付きのコマンドなら "#<n>"
+        self.released = False  # core 0 が結果を受け取った
+
+
+_JOBS = [_Job() for _ in range(_JOB_SLOTS)]
+# [0]: core 0 が入れた数, [1]: core 1 が実行した数, [2]: core 0 が解放した数
+_JOB_COUNTS = array.array("I", [0, 0, 0])
+_JOB_LOCK = _thread.allocate_lock() if _thread else None
 
-    if module_type == 0:
-        sensor = dht.DHT11(pin)
-    elif module_type == 1:
-        sensor = dht.DHT22(pin)
+# 応答待ちの列 (コマンド順)。_Job なら実行待ち、文字列なら送信待ちの応答
+_REPLIES = []
+
+# core 1 で実行中のタグ付きのコマンド。終わった順に応答を送る
+_TAGGED = []
+
+
+# core 1 で実行するコマンド。PIO ドライバが無い場合は超音波のビットバング計測も含める
+_CORE1_FUNCS = (setText, setRGB, dhtRead) + ((ultrasonicRead,) if Ultrasonic is None else ())
+
+
+def _job_pin(func, args):
+    """core 1 のコマンドが使うデジタルピン番号を返す (I2C だけなら -1)。"""
+    if func is ultrasonicRead or (func is dhtRead and args[1] != _DHT_MODULE_DHT20):
+        return args[0]
+    return -1
+
+
+def _core1_main():
+    jobs = _JOBS
+    counts = _JOB_COUNTS
+    lock = _JOB_LOCK
+    while True:
+        with lock:
+            pending = counts[1] != counts[0]
+        if pending:
+            job = jobs[counts[1] % _JOB_SLOTS]
+            try:
+                job.result = job.func(*job.args)
+                job.failed = False
+            except Exception:
+                job.failed = True
+            with lock:
+                job.done = True
+                counts[1] += 1
+            continue
+        for pump in _CORE1_PUMPS:
+            pump()
+        time.sleep_ms(1)
+
+
+def _submit_job(func, args, entry=None, pin=-1):
+    """ジョブを core 1 に渡す。リングが一杯なら空くまで応答を送りながら待つ。"""
+    counts = _JOB_COUNTS
+    while counts[0] - counts[2] >= _JOB_SLOTS:
+        _send_replies()
+    job = _JOBS[counts[0] % _JOB_SLOTS]
+    job.func = func
+    job.args = args
+    job.entry = entry
+    job.pin = pin
+    job.t0 = time.ticks_us()
+    job.done = False
+    job.released = False
+    with _JOB_LOCK:
+        counts[0] += 1
+    return job
+
+
+def _release_job(job):
+    job.released = True
+    job.func = job.args = job.result = None
+    # スロットはリングの順に解放する
+    counts = _JOB_COUNTS
+    while counts[2] != counts[0] and _JOBS[counts[2] % _JOB_SLOTS].released:
+        counts[2] += 1
+
+
+def _on_core1(func, *args):
+    """func(*args) を core 1 で実行し、終わるまで待って結果を返す (バッチ・バイナリ用)。"""
+    if _thread is None:
+        return func(*args)
+    job = _submit_job(func, args)
+    while not job.done:
+        _send_replies()
+    result, failed = job.result, job.failed
+    _release_job(job)
+    if failed:
+        raise RuntimeError("CORE1_FAILED")
+    return result
+
+
+def _defer(entry, args, pin):
+    """低速なコマンドを core 1 に渡し、応答は _send_replies で送る。"""
+    job = _submit_job(entry[0], args, entry, pin)
+    job.tag = _TAG
+    if _TAG is None:
+        _REPLIES.append(job)
     else:
-        raise ValueError("UNKNOWN_DHT_MODULE_TYPE")
+        _TAGGED.append(job)
 
-    key = (pin_no, module_type)
 
+def _finish_job(job):
+    """終わったジョブの応答行を作って計測値に加え、スロットを解放する。"""
+    global _BATCH
+    # 応答関数は send_reply で送るので、_BATCH に受けて書き出す
+    # (バッチの実行中に呼ばれた場合は、そのバッチの _BATCH を退避しておく)
+    saved = _BATCH
+    _BATCH = []
     try:
-        # DHT11 / DHT22 系は、データシート上も「連続して高速に測定するとエラーになりうる」
-        # という性質を持つため、ここで measure() が例外を投げることがある。
-        # センサー仕様起因の一時的なエラーでホスト側アプリが落ちないよう、
-        # 正常に取得できた値をキャッシュしておき、失敗時はその値を返す。
-        sensor.measure()
-        temp = sensor.temperature()
-        hum = sensor.humidity()
-        _DHT_CACHE[key] = (float(temp), float(hum))
+        if job.failed:
+            send_error()
+        else:
+            job.entry[2](job.result)
     except Exception:
-        # 計測エラー時は新規計測は諦め、前回値があればそれを返す。
-        if key in _DHT_CACHE:
-            return _DHT_CACHE[key]
-        # 一度も成功していない場合だけ、上位にエラーとして伝える。
-        raise
+        _BATCH = ["error"]
+    out = _BATCH
+    _BATCH = saved
+    _record(job.entry[4], job.t0, job.failed)
+    tag = job.tag
+    _release_job(job)
+    return out, tag
+
+
+def _send_replies():
+    """終わったコマンドの応答を送る。
+
+    タグ付きのコマンドは終わった順に、タグの無いコマンドは _REPLIES の先頭から順に送る。
+    """
+    tagged = _TAGGED
+    i = 0
+    while i < len(tagged):
+        if not tagged[i].done:
+            i += 1
+            continue
+        out, tag = _finish_job(tagged.pop(i))
+        for r in out:
+            _write_tagged(tag, r)
+
+    replies = _REPLIES
+    while replies:
+        head = replies[0]
+        if isinstance(head, str):
+            sys.stdout.write(head + "\n")
+            replies.pop(0)
+            continue
+        if not head.done:
+            return
+        replies.pop(0)
+        out, _ = _finish_job(head)
+        for r in out:
+            sys.stdout.write(r + "\n")
+
+
+def _wait_replies():
+    """受け付けたコマンドの応答をすべて送り終えるまで待つ。"""
+    while _REPLIES or _TAGGED:
+        _send_replies()
+
+
+def _busy_pin(args_str):
+    """先頭の引数のピンを core 1 のジョブが使っていれば True。"""
+    i = args_str.find(",")
+    try:
+        pin = int(args_str if i < 0 else args_str[:i])
+    except ValueError:
+        return False
+    for r in _REPLIES:
+        if not isinstance(r, str) and r.pin == pin:
+            return True
+    for r in _TAGGED:
+        if r.pin == pin:
+            return True
+    return False
 
-    return _DHT_CACHE[key]
 
 def _parse_call(line):
     """\"func(arg1, arg2, ...)\" 形式の 1 行をパースする。
@@ -434,15 +1695,262 @@ def _parse_call(line):
     return name, args_str
 
 
-def _split_args(args_str, maxsplit=-1):
-    """カンマ区切りの引数文字列を分割してトリムする."""
-    if not args_str:
-        return []
-    if maxsplit == 1:
-        parts = args_str.split(",", 1)
+# --- コマンド表 ---
+#
+# コマンド名 -> (実行関数, 引数パーサのタプル, 応答関数, 必須の引数の数, 計測値)
+# 応答関数は実行関数の戻り値を受け取って応答を送る。None なら実行関数が自分で送る。
+# 計測値は [呼び出し回数, エラー数, 累積実行時間 us, 最大実行時間 us] (stats() で返す)。
+# C++ クライアントが送る名前 (pinMode など) と小文字の名前の両方で登録し、
+# 通常は name.lower() を呼ばずに引けるようにする。
+
+_COMMANDS = {}
+
+# 登録順の (コマンド名, 計測値) (stats() の出力順)
+_COMMAND_STATS = []
+
+_MODE_TOKENS = {"INPUT": 0, "OUTPUT": 1, "input": 0, "output": 1, "in": 0, "out": 1}
+_LEVEL_TOKENS = {"HIGH": 1, "LOW": 0, "high": 1, "low": 0}
+_EDGE_TOKENS = {
+    "rising": Pin.IRQ_RISING,
+    "falling": Pin.IRQ_FALLING,
+    "both": Pin.IRQ_RISING | Pin.IRQ_FALLING,
+}
+
+
+def _token(s):
+    """文字列引数 (前後の空白を除く)。"""
+    return s.strip()
+
+
+def _mode(s):
+    """\"INPUT\"/\"OUTPUT\" (大文字小文字は問わない) -> 0/1"""
+    s = s.strip()
+    m = _MODE_TOKENS.get(s)
+    if m is None:
+        m = _MODE_TOKENS.get(s.lower())
+        if m is None:
+            raise ValueError("UNKNOWN_MODE")
+    return m
+
+
+def _level(s):
+    """\"HIGH\"/\"LOW\" (大文字小文字は問わない) -> 1/0"""
+    s = s.strip()
+    v = _LEVEL_TOKENS.get(s)
+    if v is None:
+        v = _LEVEL_TOKENS.get(s.lower())
+        if v is None:
+            raise ValueError("UNKNOWN_LEVEL")
+    return v
+
+
+def _edge(s):
+    """\"RISING\"/\"FALLING\"/\"BOTH\" (大文字小文字は問わない) -> Pin.IRQ_* の値"""
+    e = _EDGE_TOKENS.get(s.strip().lower())
+    if e is None:
+        raise ValueError("UNKNOWN_EDGE")
+    return e
+
+
+def _base64(s):
+    """Base64 文字列引数 -> バイト列"""
+    return binascii.a2b_base64(s.strip())
+
+
+def _reply_ok(_):
+    send_ok()
+
+
+def _reply_snapshot(values):
+    mask = _SNAPSHOT_MASK[0]
+    parts = [str(mask), str(values[0])]
+    for i in range(6):
+        if mask & (1 << i):
+            parts.append(str(values[1 + i]))
+    send_reply(" ".join(parts))
+
+
+def _reply_avg(values):
+    if len(values) == 3:
+        send_reply("{:.2f} {} {}".format(values[0], values[1], values[2]))
     else:
-        parts = args_str.split(",")
-    return [p.strip() for p in parts if p.strip() != ""]
+        send_reply("{:.2f} {} {} {:.2f}".format(values[0], values[1], values[2], values[3]))
+
+
+def _reply_dht(values):
+    send_reply("{} {} {}".format(float(values[0]), float(values[1]), int(values[2])))
+
+
+def _command(name, func, parsers, reply, required=None):
+    """コマンドを登録する。
+
+    Args:
+        name: コマンド名 (C++ API と同じ表記)。
+        func: 実行関数。パース済みの引数を受け取る。
+        parsers: 引数ごとのパーサ (文字列 -> 値)。失敗時は例外を投げる。
+        reply: 応答関数、または None。
+        required: 必須の引数の数。省略時は全引数が必須。
+            これより後ろの引数は省略でき、実行関数の既定値が使われる。
+    """
+    counters = [0, 0, 0, 0]
+    entry = (func, parsers, reply, len(parsers) if required is None else required, counters)
+    _COMMANDS[name] = entry
+    _COMMANDS[name.lower()] = entry
+    _COMMAND_STATS.append((name, counters))
+
+
+# GC の回数は直接取得できないため、gc.mem_free() が前回より増えていたら
+# その間に回収があったとみなして数える (実際の回数の下限)。
+# gc.mem_free() はヒープ全体を走査するので、標本化は _GC_SAMPLE_MS ごとに限る。
+_GC_SAMPLE_MS = const(100)
+_GC_STATE = [0, 0, 0]  # [前回の mem_free, 観測した回収の回数, 前回の標本化時刻 ms]
+_BOOT_MS = time.ticks_ms()
+
+
+def _record(counters, t0, failed):
+    """コマンド 1 件の実行時間を計測値に加える。"""
+    dt = time.ticks_diff(time.ticks_us(), t0)
+    counters[0] += 1
+    if failed:
+        counters[1] += 1
+    counters[2] += dt
+    if dt > counters[3]:
+        counters[3] = dt
+
+
+def _sample_gc(force=False):
+    """mem_free を標本化し、前回より増えていれば GC の回数を数える。"""
+    st = _GC_STATE
+    now = time.ticks_ms()
+    if not force and time.ticks_diff(now, st[2]) < _GC_SAMPLE_MS:
+        return
+    st[2] = now
+    free = gc.mem_free()
+    if free > st[0] and st[0]:
+        st[1] += 1
+    st[0] = free
+
+
+def stats(reset=0):
+    """stats([reset]) -> 計測値の 1 行
+
+    Args:
+        reset: 0 以外なら、返した後に計測値をクリアする。
+
+    Returns:
+        "uptime_ms=<ms> mem_free=<bytes> mem_alloc=<bytes> gc=<回数> "
+        に続けて、実行されたコマンドごとに
+        "<name>=<回数>/<エラー数>/<累積 us>/<最大 us>" を空白区切りで並べた文字列。
+    """
+    _sample_gc(True)
+    parts = [
+        "uptime_ms={}".format(time.ticks_diff(time.ticks_ms(), _BOOT_MS)),
+        "mem_free={}".format(_GC_STATE[0]),
+        "mem_alloc={}".format(gc.mem_alloc()),
+        "gc={}".format(_GC_STATE[1]),
+    ]
+    for name, c in _COMMAND_STATS:
+        if c[0]:
+            parts.append("{}={}/{}/{}/{}".format(name, c[0], c[1], c[2], c[3]))
+    if reset:
+        for _, c in _COMMAND_STATS:
+            c[0] = c[1] = c[2] = c[3] = 0
+        _GC_STATE[1] = 0
+    return " ".join(parts)
+
+
+def _binaryMode(enable):
+    # 応答はテキストで返し、その直後からバイナリフレームで受け付ける
+    _wait_replies()
+    send_ok()
+    if enable:
+        _enter_binary_mode()
+
+
+# --- GrovePi C++ API 対応コマンド ---
+_command("pinMode", pinMode, (int, _mode), _reply_ok)
+_command("digitalWrite", digitalWrite, (int, _level), _reply_ok)
+_command("digitalRead", digitalRead, (int,), send_number)
+_command("analogRead", analogRead, (int,), send_number)
+_command("analogWrite", analogWrite, (int, int), _reply_ok)
+_command("ultrasonicRead", ultrasonicRead, (int,), send_number)
+
+# --- 超音波距離センサーの連続測定 (Pico 専用拡張) ---
+_command("ultrasonicStart", ultrasonicStart, (int, int, int), _reply_ok, required=2)
+_command("ultrasonicStop", ultrasonicStop, (int,), _reply_ok)
+
+# --- WS2812 LED テープ (Pico 専用拡張) ---
+_command("ledStripInit", ledStripInit, (int, int, int), _reply_ok, required=2)
+_command("ledStripWrite", ledStripWrite, (int, _base64), _reply_ok)
+_command("ledStripBrightness", ledStripBrightness, (int, int), _reply_ok)
+
+# --- アナログ入力の平均化 (Pico 専用拡張) ---
+_command("analogReadAvg", analogReadAvg, (int, int, int), _reply_avg, required=2)
+_command("snapshot", snapshot, (int,), _reply_snapshot, required=0)
+_command("readAll", readAll, (), _reply_snapshot)
+
+# --- PWM 波形の再生 (Pico 専用拡張) ---
+_command("pwmRamp", pwmRamp, (int, int, int, int), _reply_ok)
+_command("pwmSequence", pwmSequence, (int, int, int, _token), _reply_ok)
+_command("pwmStop", pwmStop, (int,), _reply_ok)
+
+# --- LCD 表示系の拡張コマンド ---
+# setText は最初の "," より後ろをすべてテキストとして扱う
+_command("setText", setText, (_token, _token), _reply_ok)
+_command("setRGB", setRGB, (_token, int, int, int), _reply_ok)
+
+# --- DHT 温湿度センサー (Pico 専用拡張) ---
+_command("dhtRead", dhtRead, (int, int), _reply_dht)
+
+# --- バイナリフレームモード (Pico 専用拡張) ---
+_command("binaryMode", _binaryMode, (int,), None)
+
+# --- アナログ連続サンプリング (Pico 専用拡張) ---
+_command("streamAnalog", streamAnalog, (int, int, int), _reply_ok, required=2)
+_command("streamStop", streamStop, (int,), _reply_ok)
+
+# --- デジタル入力の変化通知 (Pico 専用拡張) ---
+_command("watchDigital", watchDigital, (int, _edge, int), _reply_ok, required=2)
+_command("unwatchDigital", unwatchDigital, (int,), _reply_ok)
+
+# --- 計測 (Pico 専用拡張) ---
+_command("stats", stats, (int,), send_reply, required=0)
+
+
+def _parse_args(entry, args_str):
+    """引数文字列をパースして引数のタプルを返す。"""
+    _, parsers, _, required, _ = entry
+    parts = args_str.split(",") if args_str else []
+    if len(parts) < required or len(parts) > len(parsers):
+        raise ValueError("ARITY")
+    return tuple(parsers[i](parts[i]) for i in range(len(parts)))
+
+
+def _call(entry, args_str):
+    """引数文字列をパースして実行関数を呼び出し、その戻り値を返す。"""
+    func, parsers, _, required, _ = entry
+    if func in _CORE1_FUNCS:
+        return _on_core1(func, *_parse_args(entry, args_str))
+    n = len(parsers)
+
+    # 1・2 引数のコマンドは引数リストを作らずに直接パースする
+    if n == required:
+        if n == 1:
+            return func(parsers[0](args_str))
+        if n == 2:
+            i = args_str.find(",")
+            if i < 0:
+                raise ValueError("ARITY")
+            return func(parsers[0](args_str[:i]), parsers[1](args_str[i + 1 :]))
+        if n == 0:
+            if args_str:
+                raise ValueError("ARITY")
+            return func()
+
+    parts = args_str.split(",") if args_str else []
+    if len(parts) < required or len(parts) > n:
+        raise ValueError("ARITY")
+    return func(*[parsers[i](parts[i]) for i in range(len(parts))])
 
 
 def handle_command(line):
@@ -452,218 +1960,430 @@ def handle_command(line):
         send_error()
         return
 
-    cmd = name.lower()
-
-    # --- GrovePi C++ API 対応コマンド ---
-
-    # pinMode(pin, mode)
-    if cmd == "pinmode":
-        parts = _split_args(args_str)
-        if len(parts) != 2:
+    entry = _COMMANDS.get(name)
+    if entry is None:
+        entry = _COMMANDS.get(name.lower())
+        if entry is None:
             send_error()
             return
 
-        pin_no = _parse_int(parts[0])
-        if pin_no is None:
-            send_error()
-            return
-        mode = parts[1]
+    if (_REPLIES or _TAGGED) and _busy_pin(args_str):
+        # core 1 で実行中のコマンドと同じピンを使うなら、その完了を待つ
+        _wait_replies()
 
+    t0 = time.ticks_us()
+    if _BATCH is None and entry[0] in _CORE1_FUNCS:
+        # 単独のテキストコマンドは完了を待たずに次のコマンドへ進む
         try:
-            pinMode(pin_no, mode)
-            sys.stdout.write("\n")
+            args = _parse_args(entry, args_str)
         except Exception:
             send_error()
+            _record(entry[4], t0, True)
+            return
+        _defer(entry, args, _job_pin(entry[0], args))
         return
 
-    # digitalWrite(pin, value)
-    if cmd == "digitalwrite":
-        parts = _split_args(args_str)
-        if len(parts) != 2:
-            send_error()
-            return
+    try:
+        result = _call(entry, args_str)
+    except Exception:
+        send_error()
+        _record(entry[4], t0, True)
+        return
 
-        pin_no = _parse_int(parts[0])
-        if pin_no is None:
-            send_error()
-            return
+    reply = entry[2]
+    if reply is not None:
+        reply(result)
+    _record(entry[4], t0, False)
 
-        try:
-            digitalWrite(pin_no, parts[1])
-            sys.stdout.write("\n")
-        except Exception:
-            send_error()
-        return
+def _starts_call(line, pos):
+    """line[pos:] が登録済みのコマンドの "name(" で始まれば True。"""
+    l = line.find("(", pos)
+    if l < 0:
+        return False
+    name = line[pos:l].strip()
+    return name in _COMMANDS or name.lower() in _COMMANDS
 
-    # digitalRead(pin)
-    if cmd == "digitalread":
-        parts = _split_args(args_str)
-        if len(parts) != 1:
-            send_error()
-            return
 
-        pin_no = _parse_int(parts[0])
-        if pin_no is None:
-            send_error()
-            return
+def _split_calls(line):
+    """";" 区切りで複数のコマンドを並べた 1 行を分割する。
 
-        try:
-            v = digitalRead(pin_no)
-            send_number(v)
-        except Exception:
-            send_error()
-        return
+    setText のテキストに ";" が含まれても壊れないよう、
+    直前の空白以外の文字が ")" で、後ろが登録済みのコマンドの "name(" で始まる
+    ";" だけを区切りとみなす (単体の setText(0, f(x);g) は分割しない)。
 
-    # analogRead(pin)
-    if cmd == "analogread":
-        parts = _split_args(args_str)
-        if len(parts) != 1:
-            send_error()
-            return
+    Returns:
+        コマンド文字列のリスト。区切りが無ければ None。
+    """
+    i = line.find(";")
+    if i < 0:
+        return None
 
-        pin_no = _parse_int(parts[0])
-        if pin_no is None:
-            send_error()
-            return
+    calls = []
+    start = 0
+    while i >= 0:
+        j = i - 1
+        while j >= start and line[j] == " ":
+            j -= 1
+        if j >= start and line[j] == ")" and _starts_call(line, i + 1):
+            calls.append(line[start:i])
+            start = i + 1
+        i = line.find(";", i + 1)
+
+    rest = line[start:]
+    if rest.strip():
+        calls.append(rest)
+
+    if len(calls) <= 1:
+        return None
+    return calls
 
-        try:
-            v = analogRead(pin_no)
-            send_number(v)
-        except Exception:
-            send_error()
-        return
 
-    # analogWrite(pin, value)
-    if cmd == "analogwrite":
-        parts = _split_args(args_str)
-        if len(parts) != 2:
-            send_error()
-            return
+def _collect_replies(calls):
+    """複数のコマンドを実行し、応答を \";\" で連結した文字列を返す。"""
+    global _BATCH
 
-        pin_no = _parse_int(parts[0])
-        value = _parse_int(parts[1])
-        if pin_no is None or value is None:
-            send_error()
-            return
+    _BATCH = []
+    try:
+        for call in calls:
+            try:
+                handle_command(call)
+            except Exception:
+                send_error()
+        return ";".join(_BATCH)
+    finally:
+        _BATCH = None
 
-        try:
-            analogWrite(pin_no, value)
-            sys.stdout.write("\n")
-        except Exception:
-            send_error()
-        return
 
-    # ultrasonicRead(pin)
-    if cmd == "ultrasonicread":
-        parts = _split_args(args_str)
-        if len(parts) != 1:
-            send_error()
-            return
+def _split_tag(line):
+    """行頭のタグ \"#<n> \" を切り離す。
 
-        pin_no = _parse_int(parts[0])
-        if pin_no is None:
-            send_error()
-            return
+    Returns:
+        (tag, rest)。タグが無ければ (None, line)、不正なタグなら (\"\", line)。
+    """
+    if not line.startswith("#"):
+        return None, line
+    end = line.find(" ")
+    if end < 0:
+        end = len(line)
+    tag = line[:end]
+    if end == 1 or end > _TAG_MAX_LEN or not tag[1:].isdigit():
+        return "", line
+    return tag, line[end + 1:].strip()
 
-        try:
-            distance = ultrasonicRead(pin_no)
-            send_number(distance)
-        except Exception:
-            send_error()
+
+def handle_line(line):
+    """1 行を処理する。複数コマンドの場合は応答を \";\" で連結して 1 行で返す。
+
+    行頭に \"#<n> \" のタグがあれば、応答にも同じタグを付け、他のコマンドを待たずに返す。
+    """
+    global _TAG
+    tag, line = _split_tag(line)
+    if tag == "":
+        send_error()
         return
+    _TAG = tag
+    try:
+        calls = _split_calls(line)
+        if calls is None:
+            handle_command(line)
+        else:
+            send_reply(_collect_replies(calls))
+    finally:
+        _TAG = None
 
-    # --- LCD 表示系の拡張コマンド ---
 
-    # setText(bus, text...)
-    if cmd == "settext":
-        # 第1引数: bus, 第2引数: 以降すべてテキストとして扱う
-        parts = _split_args(args_str, maxsplit=1)
-        if len(parts) != 2:
-            send_error()
-            return
+# --- バイナリフレームモード ---
+#
+# 要求: A5 | op | pin | len(LE16) | payload | crc8
+# 応答: 5A | op | status | len(LE16) | payload | crc8
+# crc8 は op から payload までを対象とする (多項式 0x31, 初期値 0xFF; dht20.py と同じ)
 
-        bus_token = parts[0].lower()
-        if bus_token in ("0", "i2c0"):
-            key = "i2c0"
-        elif bus_token in ("1", "i2c1"):
-            key = "i2c1"
-        else:
-            send_error()
-            return
+_OP_PIN_MODE = const(0x01)
+_OP_DIGITAL_WRITE = const(0x02)
+_OP_DIGITAL_READ = const(0x03)
+_OP_ANALOG_WRITE = const(0x04)
+_OP_ANALOG_READ = const(0x05)
+_OP_ULTRASONIC_READ = const(0x06)
+_OP_SET_TEXT = const(0x07)
+_OP_SET_RGB = const(0x08)
+_OP_DHT_READ = const(0x09)
+_OP_LED_STRIP_WRITE = const(0x0A)
+_OP_SNAPSHOT = const(0x0B)
+_OP_TEXT = const(0x7E)
+_OP_ASCII_MODE = const(0x7F)
+_OP_EVENT = const(0xE0)
 
-        text = parts[1]
-        try:
-            setText(bus_token, text)
-            sys.stdout.write("\n")
-        except Exception:
-            send_error()
-        return
+_SYNC_REQUEST = const(0xA5)
+_SYNC_REPLY = const(0x5A)
+
+_STATUS_OK = const(0)
+_STATUS_ERROR = const(1)
+_STATUS_BAD_FRAME = const(2)
+
+_FRAME_MAX_PAYLOAD = const(1024)
+
+_BINARY = False
+
+
+def _make_crc8_table():
+    table = bytearray(256)
+    for i in range(256):
+        crc = i
+        for _ in range(8):
+            if crc & 0x80:
+                crc = ((crc << 1) ^ 0x31) & 0xFF
+            else:
+                crc = (crc << 1) & 0xFF
+        table[i] = crc
+    return table
+
+
+_CRC8_TABLE = _make_crc8_table()
+
+# 受信・送信用バッファは起動時に確保しておき、フレームごとのヒープ確保を避ける
+_RX_HDR = bytearray(4)
+_RX_PAYLOAD = bytearray(_FRAME_MAX_PAYLOAD)
+_RX_CRC = bytearray(1)
+_TX = bytearray(5 + 16 + 1)
+
+_STDIN = sys.stdin.buffer
+_STDOUT = sys.stdout.buffer
+
+if sys.implementation.name == "micropython":
+
+    def _read_into(buf, n):
+        return _STDIN.readinto(buf, n)
+
+    def _write_from(buf, n):
+        _STDOUT.write(buf, n)
+
+else:
+    # ホスト上の CPython で動かす場合 (エミュレーション用)
+
+    def _read_into(buf, n):
+        return _STDIN.readinto(memoryview(buf)[:n])
+
+    def _write_from(buf, n):
+        _STDOUT.write(bytes(buf[:n]))
+        _STDOUT.flush()
+
+
+@micropython.native
+def _crc8(buf, start, end, crc):
+    table = _CRC8_TABLE
+    for i in range(start, end):
+        crc = table[crc ^ buf[i]]
+    return crc
+
+
+def _enter_binary_mode():
+    global _BINARY
+    _BINARY = True
+
+
+def _send_frame(op, status, n):
+    """_TX[5:5+n] に詰めた payload を応答フレームとして送信する。"""
+    _TX[0] = _SYNC_REPLY
+    _TX[1] = op
+    _TX[2] = status
+    _TX[3] = n & 0xFF
+    _TX[4] = n >> 8
+    _TX[5 + n] = _crc8(_TX, 1, 5 + n, 0xFF)
+    _write_from(_TX, 6 + n)
+
+
+def _send_bytes_frame(op, data):
+    """可変長 (テキストなど) の payload を応答フレームとして送信する。"""
+    n = len(data)
+    hdr = _TX
+    hdr[0] = _SYNC_REPLY
+    hdr[1] = op
+    hdr[2] = _STATUS_OK
+    hdr[3] = n & 0xFF
+    hdr[4] = n >> 8
+    crc = _crc8(hdr, 1, 5, 0xFF)
+    crc = _crc8(data, 0, n, crc)
+    _write_from(hdr, 5)
+    _STDOUT.write(data)
+    hdr[0] = crc
+    _write_from(hdr, 1)
+
+
+def _send_event_frame(text):
+    _send_bytes_frame(_OP_EVENT, text.encode())
 
-    # setRGB(bus, r, g, b)
-    if cmd == "setrgb":
-        parts = _split_args(args_str)
-        if len(parts) != 4:
-            send_error()
-            return
 
-        bus_token = parts[0].lower()
-        if bus_token in ("0", "i2c0"):
-            key = "i2c0"
-        elif bus_token in ("1", "i2c1"):
-            key = "i2c1"
-        else:
-            send_error()
-            return
+# オペコード -> 同名のテキストコマンドの計測値
+_OP_STATS = {
+    _OP_PIN_MODE: _COMMANDS["pinMode"][4],
+    _OP_DIGITAL_WRITE: _COMMANDS["digitalWrite"][4],
+    _OP_DIGITAL_READ: _COMMANDS["digitalRead"][4],
+    _OP_ANALOG_WRITE: _COMMANDS["analogWrite"][4],
+    _OP_ANALOG_READ: _COMMANDS["analogRead"][4],
+    _OP_ULTRASONIC_READ: _COMMANDS["ultrasonicRead"][4],
+    _OP_SET_TEXT: _COMMANDS["setText"][4],
+    _OP_SET_RGB: _COMMANDS["setRGB"][4],
+    _OP_DHT_READ: _COMMANDS["dhtRead"][4],
+    _OP_LED_STRIP_WRITE: _COMMANDS["ledStripWrite"][4],
+    _OP_SNAPSHOT: _COMMANDS["snapshot"][4],
+}
 
-        r = _parse_int(parts[1])
-        g = _parse_int(parts[2])
-        b = _parse_int(parts[3])
-        if r is None or g is None or b is None:
-            send_error()
-            return
 
-        try:
-            setRGB(bus_token, r, g, b)
-            sys.stdout.write("\n")
-        except Exception:
-            send_error()
+def _handle_op(op, pin_no, n):
+    """コマンド 1 件を実行し、応答 payload の長さを返す。"""
+    payload = _RX_PAYLOAD
+
+    if op == _OP_PIN_MODE:
+        pinMode(pin_no, payload[0])
+        return 0
+
+    if op == _OP_DIGITAL_WRITE:
+        digitalWrite(pin_no, payload[0])
+        return 0
+
+    if op == _OP_DIGITAL_READ:
+        _TX[5] = digitalRead(pin_no)
+        return 1
+
+    if op == _OP_ANALOG_WRITE:
+        analogWrite(pin_no, payload[0])
+        return 0
+
+    if op == _OP_ANALOG_READ:
+        struct.pack_into("<H", _TX, 5, analogRead(pin_no))
+        return 2
+
+    if op == _OP_ULTRASONIC_READ:
+        if ultrasonicRead in _CORE1_FUNCS:
+            distance = _on_core1(ultrasonicRead, pin_no)
+        else:
+            distance = ultrasonicRead(pin_no)
+        struct.pack_into("<H", _TX, 5, distance)
+        return 2
+
+    if op == _OP_SET_TEXT:
+        _on_core1(setText, pin_no, _to_str(bytes(payload[:n])))
+        return 0
+
+    if op == _OP_SET_RGB:
+        _on_core1(setRGB, pin_no, payload[0], payload[1], payload[2])
+        return 0
+
+    if op == _OP_DHT_READ:
+        temp, hum, age = _on_core1(dhtRead, pin_no, payload[0])
+        struct.pack_into("<hHI", _TX, 5, int(round(temp * 10)), int(round(hum * 10)), age)
+        return 8
+
+    if op == _OP_SNAPSHOT:
+        # u8 mask, u32 時刻, u8 デジタルピンのレベル (mask と同じビット位置), 読んだアナログピンごとに u16
+        mask = payload[0]
+        values = snapshot(mask)
+        struct.pack_into("<BI", _TX, 5, mask, values[0])
+        _TX[10] = (values[4] << 3 if mask & 0x08 else 0) | (values[5] << 4 if mask & 0x10 else 0) | (
+            values[6] << 5 if mask & 0x20 else 0)
+        n = 6
+        for i in range(3):
+            if mask & (1 << i):
+                struct.pack_into("<H", _TX, 5 + n, values[1 + i])
+                n += 2
+        return n
+
+    if op == _OP_LED_STRIP_WRITE:
+        # 受信バッファからそのまま変換して送る (コピーなし)
+        ledStripWrite(pin_no, payload, n)
+        return 0
+
+    raise ValueError("UNKNOWN_OP")
+
+
+def handle_frame():
+    """バイナリフレームを 1 つ読み取って実行する。"""
+    global _BINARY
+
+    # 同期バイトが来るまで読み捨てる
+    if _read_into(_RX_CRC, 1) != 1 or _RX_CRC[0] != _SYNC_REQUEST:
         return
 
-    # --- DHT 温湿度センサー (Pico 専用拡張) ---
+    hdr = _RX_HDR
+    _read_into(hdr, 4)
+    op = hdr[0]
+    pin_no = hdr[1]
+    n = hdr[2] | (hdr[3] << 8)
+    if n > _FRAME_MAX_PAYLOAD:
+        _send_frame(op, _STATUS_BAD_FRAME, 0)
+        return
 
-    # dhtRead(pin, module_type)
-    if cmd == "dhtread":
-        parts = _split_args(args_str)
-        if len(parts) != 2:
-            send_error()
-            return
+    if n:
+        _read_into(_RX_PAYLOAD, n)
+    _read_into(_RX_CRC, 1)
 
-        pin_no = _parse_int(parts[0])
-        module_type = _parse_int(parts[1])
-        if pin_no is None or module_type is None:
-            send_error()
-            return
+    crc = _crc8(hdr, 0, 4, 0xFF)
+    crc = _crc8(_RX_PAYLOAD, 0, n, crc)
+    if crc != _RX_CRC[0]:
+        _send_frame(op, _STATUS_BAD_FRAME, 0)
+        return
 
-        try:
-            temp, hum = dhtRead(pin_no, module_type)
-            send_two_floats(temp, hum)
-        except Exception:
-            send_error()
+    if op == _OP_TEXT:
+        line = _to_str(bytes(_RX_PAYLOAD[:n]))
+        calls = _split_calls(line)
+        reply = _collect_replies(calls if calls is not None else (line,))
+        _send_bytes_frame(_OP_TEXT, reply.encode())
         return
 
-    send_error()
+    if op == _OP_ASCII_MODE:
+        _send_frame(op, _STATUS_OK, 0)
+        _BINARY = False
+        return
+
+    counters = _OP_STATS.get(op)
+    t0 = time.ticks_us()
+    try:
+        _send_frame(op, _STATUS_OK, _handle_op(op, pin_no, n))
+        failed = False
+    except Exception:
+        _send_frame(op, _STATUS_ERROR, 0)
+        failed = True
+    if counters is not None:
+        _record(counters, t0, failed)
+
 
 def main():
-    """標準入力からのコマンドを無限ループで処理するエントリポイント。"""
+    """標準入力からのコマンドを無限ループで処理するエントリポイント。
+
+    非同期通知を送る機能や core 1 で実行中のコマンドがある間は stdin を短い周期でポーリングし、
+    コマンドを待つ合間に _PUMPS の関数を呼び出して、終わったコマンドの応答を送る。
+    """
+    poller = select.poll()
+    poller.register(sys.stdin, select.POLLIN)
+
+    if _thread is not None:
+        _thread.start_new_thread(_core1_main, ())
+
     while True:
+        if _REPLIES or _TAGGED:
+            _send_replies()
+        if _PUMPS or _REPLIES or _TAGGED:
+            for pump in _PUMPS:
+                pump()
+            if not poller.poll(1):
+                continue
+        if _BINARY:
+            LED.value(1)
+            try:
+                handle_frame()
+            finally:
+                LED.value(0)
+            _sample_gc()
+            continue
         line = read_line()
         if line is None:
             continue
         LED.value(1)
         try:
-            handle_command(line)
+            handle_line(line)
         finally:
             LED.value(0)
+        _sample_gc()
 
 if __name__ == "__main__":
     main()
@@ -0,0 +1,64 @@
+from machine import Pin
+import rp2
+
+# Grove Ultrasonic Ranger 用の PIO プログラム
+# SIG ピン 1 本でトリガーパルスを出し、同じピンでエコーのパルス幅を測る。
+# 2 MHz で動かすので 1 サイクル 0.5 us、計測ループは 2 命令 = 1 us で 1 カウント。
+#
+# TX FIFO に入れたタイムアウト値 [us] ごとに 1 回測定し、RX FIFO に残りカウントを返す。
+# パルス幅 [us] = タイムアウト値 - 返した値。タイムアウトした場合は 0xFFFFFFFF を返す。
+@rp2.asm_pio(set_init=rp2.PIO.OUT_LOW)
+def ranger():
+    pull(block)
+    mov(x, osr)
+    # 10 us のトリガーパルス
+    set(pindirs, 1)
+    set(pins, 1) [19]
+    set(pins, 0)
+    set(pindirs, 0)
+    # エコーの立ち上がりを待つ
+    mov(y, x)
+    label("wait_high")
+    jmp(pin, "rising")
+    jmp(y_dec, "wait_high")
+    jmp("done")
+    label("rising")
+    # エコーが High の間カウントする
+    mov(y, x)
+    label("measure")
+    jmp(pin, "high")
+    jmp("done")
+    label("high")
+    jmp(y_dec, "measure")
+    label("done")
+    mov(isr, y)
+    push(block)
+
+class Ultrasonic():
+    TIMEOUT = 0xFFFFFFFF
+
+    def __init__(self, sm_id, pin_num, timeout_us = 30000):
+        pin = Pin(pin_num, Pin.IN)
+        self.timeout_us = timeout_us
+        self.sm = rp2.StateMachine(sm_id, ranger, freq=2_000_000, set_base=pin, jmp_pin=pin)
+        self.sm.active(1)
+        self.busy = False
+
+    def trigger(self):
+        """測定を開始する (すぐに戻る)。"""
+        self.sm.put(self.timeout_us)
+        self.busy = True
+
+    def ready(self):
+        return self.sm.rx_fifo() > 0
+
+    def result(self):
+        """測定結果のパルス幅 [us] を返す。タイムアウトなら None。"""
+        v = self.sm.get()
+        self.busy = False
+        if v == self.TIMEOUT:
+            return None
+        return self.timeout_us - v
+
+    def deinit(self):
+        self.sm.active(0)
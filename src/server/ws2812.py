@@ -1,5 +1,7 @@
 import array, time
 from machine import Pin
+from micropython import const
+import micropython
 import rp2
 
 # Configure the number of WS2812 LEDs.
@@ -17,24 +19,88 @@ def ws2812():
     label("do_zero")
     nop() .side(0) [T2 - 1]
     wrap()
-class WS2812():        
-    def __init__(self, pin_num, led_count, brightness = 0.5):
+# Address of the PIO0 TX FIFO (TXF0) and its DREQ number (both step by one per state machine)
+_PIO0_TXF0 = const(0x50200010)
+_DREQ_PIO0_TX0 = const(0)
+
+# Time to shift out one LED (24 bits) and the reset time that latches a frame, in us
+_LED_US = const(30)
+_RESET_US = const(300)
+
+# Scale ar (0x00GGRRBB) through the brightness table into the word the PIO shifts out (0xGGRRBB00)
+@micropython.viper
+def _pack_words(src: ptr32, out: ptr32, lut: ptr8, n: int):
+    for i in range(n):
+        c = src[i]
+        out[i] = (lut[(c >> 16) & 0xFF] << 24) | (lut[(c >> 8) & 0xFF] << 16) | (lut[c & 0xFF] << 8)
+
+# Same for a buffer of R, G, B bytes
+@micropython.viper
+def _pack_rgb(src: ptr8, out: ptr32, lut: ptr8, n: int):
+    j = 0
+    for i in range(n):
+        out[i] = (lut[src[j + 1]] << 24) | (lut[src[j]] << 16) | (lut[src[j + 2]] << 8)
+        j += 3
+
+class WS2812():
+    def __init__(self, pin_num, led_count, brightness = 0.5, sm_id = 0):
         self.Pin = Pin
         self.led_count = led_count
-        self.brightness = brightness
-        self.sm = rp2.StateMachine(0, ws2812, freq=8_000_000, sideset_base=Pin(pin_num))
+        self.sm = rp2.StateMachine(sm_id, ws2812, freq=8_000_000, sideset_base=Pin(pin_num))
         self.sm.active(1)
-        self.ar = array.array("I", [0 for _ in range(led_count)])
-        
+        self.ar = array.array("I", bytearray(4 * led_count))
+        # The output buffer and the brightness table are allocated once and reused for every frame
+        self._out = array.array("I", bytearray(4 * led_count))
+        self._lut = bytearray(256)
+        self.set_brightness(brightness)
+        self._latch = time.ticks_us()
+        self._dma = None
+        if hasattr(rp2, "DMA"):
+            # With DMA the CPU is free while the frame is being shifted out
+            self._dma = rp2.DMA()
+            self._txf = _PIO0_TXF0 + 4 * sm_id
+            self._ctrl = self._dma.pack_ctrl(size=2, inc_write=False, treq_sel=_DREQ_PIO0_TX0 + sm_id)
+
+    def set_brightness(self, brightness):
+        # brightness is 0.0 - 1.0 and applies from the next frame
+        level = int(brightness * 256)
+        level = 0 if level < 0 else 256 if level > 256 else level
+        lut = self._lut
+        for v in range(256):
+            lut[v] = (v * level) >> 8
+        self.brightness = brightness
+
+    def wait(self):
+        # Wait until the previous frame has been sent and latched
+        dma = self._dma
+        if dma is not None:
+            while dma.active():
+                pass
+        while time.ticks_diff(self._latch, time.ticks_us()) > 0:
+            pass
+
+    def _send(self, n):
+        if self._dma is not None:
+            self._latch = time.ticks_add(time.ticks_us(), n * _LED_US + _RESET_US)
+            self._dma.config(read=self._out, write=self._txf, count=n, ctrl=self._ctrl, trigger=True)
+        else:
+            self.sm.put(self._out)
+            # put() returns once the last words are in the 4-deep FIFO
+            self._latch = time.ticks_add(time.ticks_us(), 4 * _LED_US + _RESET_US)
+
     def pixels_show(self):
-        dimmer_ar = array.array("I", [0 for _ in range(self.led_count)])
-        for i,c in enumerate(self.ar):
-            r = int(((c >> 8) & 0xFF) * self.brightness)
-            g = int(((c >> 16) & 0xFF) * self.brightness)
-            b = int((c & 0xFF) * self.brightness)
-            dimmer_ar[i] = (g<<16) + (r<<8) + b
-        self.sm.put(dimmer_ar, 8)
-        time.sleep_ms(10)
+        self.wait()
+        _pack_words(self.ar, self._out, self._lut, self.led_count)
+        self._send(self.led_count)
+
+    def pixels_write(self, rgb, n):
+        # Show n LEDs from a buffer of R, G, B bytes without touching ar.
+        # LEDs past n keep their previous colour.
+        if n > self.led_count:
+            n = self.led_count
+        self.wait()
+        _pack_rgb(rgb, self._out, self._lut, n)
+        self._send(self.led_count)
 
     def pixels_set(self, i, color):
         self.ar[i] = (color[1]<<16) + (color[0]<<8) + color[2]
@@ -43,6 +109,12 @@ class WS2812():
         for i in range(len(self.ar)):
             self.pixels_set(i, color)
 
+    def deinit(self):
+        self.wait()
+        if self._dma is not None:
+            self._dma.close()
+        self.sm.active(0)
+
     def color_chase(self,color, wait):
         for i in range(self.led_count):
             self.pixels_set(i, color)
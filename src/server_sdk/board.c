@@ -0,0 +1,32 @@
+#include "board.h"
+
+#include "hardware/gpio.h"
+
+// I2C0: SCL -> GP9, SDA -> GP8 / I2C1: SCL -> GP7, SDA -> GP6
+static const uint I2C_SDA[2] = {8, 6};
+static const uint I2C_SCL[2] = {9, 7};
+
+static bool i2c_ready[2];
+
+/**
+ * Grove Shield の I2C ポートを返す (LCD と DHT20 が使うので core 1 からだけ呼ぶ)
+ * @param  bus I2C バス番号 (0/1)
+ * @return     初期化済みの I2C、範囲外なら NULL
+ */
+i2c_inst_t *board_i2c(int bus)
+{
+	if(bus < 0 || bus > 1)
+		return NULL;
+
+	i2c_inst_t *i2c = bus ? i2c1 : i2c0;
+	if(!i2c_ready[bus])
+	{
+		i2c_init(i2c, 400000);
+		gpio_set_function(I2C_SDA[bus], GPIO_FUNC_I2C);
+		gpio_set_function(I2C_SCL[bus], GPIO_FUNC_I2C);
+		gpio_pull_up(I2C_SDA[bus]);
+		gpio_pull_up(I2C_SCL[bus]);
+		i2c_ready[bus] = true;
+	}
+	return i2c;
+}
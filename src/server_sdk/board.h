@@ -0,0 +1,47 @@
+#ifndef GROVEPI_BOARD_H
+#define GROVEPI_BOARD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pico/stdlib.h"
+#include "hardware/i2c.h"
+
+// Grove Shield for Pi Pico v1.0 のピン配置 (main.py の ANALOG_PINS / DIGITAL_PINS / I2C_BUSES と同じ)
+// アナログピン 0/1/2 -> ADC0〜2 (GP26〜GP28)、デジタルピン 16/18/20 -> GP16/GP18/GP20
+#define BOARD_ANALOG_PINS 3
+#define BOARD_DIGITAL_PINS 3
+#define BOARD_ADC_GPIO 26
+#define BOARD_GPIO_COUNT 30
+
+static inline bool board_analog_pin(int pin)
+{
+	return pin >= 0 && pin < BOARD_ANALOG_PINS;
+}
+
+static inline bool board_digital_pin(int pin)
+{
+	return pin == 16 || pin == 18 || pin == 20;
+}
+
+// デジタルピン 16/18/20 -> 0〜2 (ピンごとの状態の添字)
+static inline int board_digital_index(int pin)
+{
+	return (pin - 16) >> 1;
+}
+
+// MicroPython の time.ticks_us() と同じく 2^30 us で一周する時刻
+static inline uint32_t board_ticks_us(void)
+{
+	return time_us_32() & 0x3FFFFFFF;
+}
+
+static inline uint32_t board_ticks_ms(void)
+{
+	return to_ms_since_boot(get_absolute_time());
+}
+
+// I2C バス 0/1 (初回に 400 kHz で初期化する)。範囲外なら NULL
+i2c_inst_t *board_i2c(int bus);
+
+#endif
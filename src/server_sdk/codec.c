@@ -0,0 +1,104 @@
+#include "codec.h"
+
+static const char BASE64_CHARS[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t base64_encode(const uint8_t *data, size_t n, char *out)
+{
+	char *p = out;
+	size_t i = 0;
+	for(; i + 3 <= n; i += 3)
+	{
+		uint32_t v = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8) | data[i + 2];
+		*p++ = BASE64_CHARS[v >> 18];
+		*p++ = BASE64_CHARS[(v >> 12) & 0x3F];
+		*p++ = BASE64_CHARS[(v >> 6) & 0x3F];
+		*p++ = BASE64_CHARS[v & 0x3F];
+	}
+	if(i < n)
+	{
+		uint32_t v = (uint32_t)data[i] << 16;
+		if(i + 1 < n)
+			v |= (uint32_t)data[i + 1] << 8;
+		*p++ = BASE64_CHARS[v >> 18];
+		*p++ = BASE64_CHARS[(v >> 12) & 0x3F];
+		*p++ = i + 1 < n ? BASE64_CHARS[(v >> 6) & 0x3F] : '=';
+		*p++ = '=';
+	}
+	return (size_t)(p - out);
+}
+
+static int base64_value(char c)
+{
+	if(c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if(c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if(c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if(c == '+')
+		return 62;
+	if(c == '/')
+		return 63;
+	return -1;
+}
+
+int base64_decode(const char *s, size_t n, uint8_t *out, size_t size)
+{
+	size_t len = 0;
+	uint32_t acc = 0;
+	int bits = 0;
+	size_t pad = 0;
+
+	for(size_t i = 0; i < n; ++i)
+	{
+		if(s[i] == '=')
+		{
+			++pad;
+			continue;
+		}
+		int v = base64_value(s[i]);
+		// "=" の後ろに文字が続くものは不正
+		if(v < 0 || pad)
+			return -1;
+		acc = (acc << 6) | (uint32_t)v;
+		bits += 6;
+		if(bits >= 8)
+		{
+			bits -= 8;
+			if(len >= size)
+				return -1;
+			out[len++] = (uint8_t)(acc >> bits);
+		}
+	}
+	// 4 文字単位になるよう "=" で埋めてあること
+	if((n % 4) != 0 || pad > 2)
+		return -1;
+	return (int)len;
+}
+
+static int hex_value(char c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+int hex_decode(const char *s, size_t n, uint8_t *out, size_t size)
+{
+	if(n % 2 || n / 2 > size)
+		return -1;
+	for(size_t i = 0; i < n; i += 2)
+	{
+		int hi = hex_value(s[i]);
+		int lo = hex_value(s[i + 1]);
+		if(hi < 0 || lo < 0)
+			return -1;
+		out[i / 2] = (uint8_t)((hi << 4) | lo);
+	}
+	return (int)(n / 2);
+}
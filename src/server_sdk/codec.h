@@ -0,0 +1,17 @@
+#ifndef GROVEPI_CODEC_H
+#define GROVEPI_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Base64 (binascii.b2a_base64 と同じ標準のアルファベット、"=" で埋める)
+// out には 4 * ((n + 2) / 3) バイトを書く。終端の NUL は付けない
+size_t base64_encode(const uint8_t *data, size_t n, char *out);
+
+// 復号したバイト数を返す。不正な文字列や out に入りきらない場合は -1
+int base64_decode(const char *s, size_t n, uint8_t *out, size_t size);
+
+// 2 桁ずつの 16 進数 (binascii.unhexlify と同じ、大文字小文字は問わない)。不正なら -1
+int hex_decode(const char *s, size_t n, uint8_t *out, size_t size);
+
+#endif
@@ -0,0 +1,84 @@
+#include "core1.h"
+
+#include "hardware/sync.h"
+#include "pico/multicore.h"
+
+#include "dht.h"
+
+static Job jobs[JOB_SLOTS];
+// core 0 だけが更新する: 渡した数と解放した数
+static uint32_t submitted;
+static uint32_t released;
+
+static void run(Job *job)
+{
+	switch(job->kind)
+	{
+		case JOB_SET_TEXT:
+			job->ok = lcd_set_text(job->bus, job->text, job->text_len);
+			break;
+		case JOB_SET_RGB:
+			job->ok = lcd_set_rgb(job->bus, job->args[0], job->args[1], job->args[2]);
+			break;
+		case JOB_DHT_READ:
+			job->ok = dht_read(job->bus, job->args[0], &job->temp, &job->hum, &job->age_ms);
+			break;
+		default:
+			job->ok = false;
+			break;
+	}
+	// 結果を書き終えてから done を立てる
+	__dmb();
+	job->done = true;
+}
+
+static void core1_main(void)
+{
+	for(;;)
+	{
+		uint32_t slot;
+		dht_service();
+		// ジョブが無い間は 1 ms ごとに DHT のバックグラウンド計測を進める
+		if(multicore_fifo_pop_timeout_us(1000, &slot))
+		{
+			run(&jobs[slot % JOB_SLOTS]);
+			continue;
+		}
+		dht_pump();
+	}
+}
+
+void core1_init(void)
+{
+	multicore_launch_core1(core1_main);
+}
+
+bool core1_can_submit(void)
+{
+	return submitted - released < JOB_SLOTS;
+}
+
+Job *core1_job(void)
+{
+	Job *job = &jobs[submitted % JOB_SLOTS];
+	job->done = false;
+	job->released = false;
+	job->command = NULL;
+	job->pin = -1;
+	job->tag_len = 0;
+	return job;
+}
+
+void core1_submit(Job *job)
+{
+	__dmb();
+	multicore_fifo_push_blocking((uint32_t)(job - jobs));
+	++submitted;
+}
+
+void core1_release(Job *job)
+{
+	job->released = true;
+	while(released != submitted && jobs[released % JOB_SLOTS].released)
+		++released;
+}
@@ -0,0 +1,66 @@
+#ifndef GROVEPI_CORE1_H
+#define GROVEPI_CORE1_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lcd.h"
+
+// --- 2 つ目のコア (core 1) での低速な処理 ---
+//
+// I2C (LCD, DHT20) と DHT11/DHT22 の計測は core 1 で行う。
+// core 0 はその間も USB からコマンドを読み、速いコマンドを先に実行する。
+// 2 つのコアで共有するのは、確保済みのジョブのリングだけにする。
+// ジョブの番号は multicore FIFO で渡し、結果は done を立てて返す。
+
+#define JOB_SLOTS 8
+
+enum
+{
+	JOB_SET_TEXT,
+	JOB_SET_RGB,
+	JOB_DHT_READ,
+};
+
+struct Command;
+
+typedef struct
+{
+	// core 0 が入れる要求
+	uint8_t kind;
+	int16_t bus;               // setText/setRGB の I2C バス、dhtRead のピン (DHT20 ならバス)
+	int16_t args[3];           // setRGB の r, g, b / dhtRead の module_type
+	uint8_t text_len;
+	char text[LCD_CHARS];
+
+	// core 1 が返す結果
+	bool ok;
+	float temp;
+	float hum;
+	uint32_t age_ms;
+	volatile bool done;
+
+	// core 0 だけが使う応答待ちの情報
+	const struct Command *command;
+	int16_t pin;               // 実行中に使うデジタルピン (-1 なら I2C だけ)
+	uint32_t t0;
+	uint8_t tag_len;
+	char tag[12];              // タグ付きのコマンドなら "#<n>"
+	bool released;
+} Job;
+
+void core1_init(void);
+
+// 空きスロットがあれば true
+bool core1_can_submit(void);
+
+// 空きスロットを返す (core1_can_submit() が true のときだけ呼ぶ)
+Job *core1_job(void);
+
+// core1_job() で受け取って要求を詰めたジョブを core 1 に渡す
+void core1_submit(Job *job);
+
+// 結果を受け取ったジョブのスロットを解放する (スロットはリングの順に空く)
+void core1_release(Job *job);
+
+#endif
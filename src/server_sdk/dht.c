@@ -0,0 +1,342 @@
+#include "dht.h"
+
+#include "hardware/gpio.h"
+#include "hardware/sync.h"
+
+#include "board.h"
+#include "io.h"
+#include "serial.h"
+
+// DHT11 は 1 秒、DHT22 と DHT20 は 2 秒より短い間隔で測ると失敗しやすい (データシートの最小間隔)
+static const uint32_t DHT_INTERVAL_MS[3] = {1000, 2000, 2000};
+// DHT20 の変換時間と、これを過ぎても終わらなければその回の計測を諦める時間
+#define DHT20_CONVERSION_MS 80
+#define DHT20_TIMEOUT_MS 200
+#define DHT20_ADDR 0x38
+// この時間 dhtRead されなかったセンサーは計測をやめる
+#define DHT_IDLE_MS 60000
+
+#define DHT_MAX_SENSORS 6
+
+// DHT センサー 1 個分の状態と最新の計測値
+typedef struct
+{
+	bool used;
+	uint8_t pin;          // DHT20 なら I2C バス番号
+	uint8_t type;
+	bool has_value;
+	float temp;
+	float hum;
+	uint32_t taken;       // 値を計測した時刻 [ms]
+	uint32_t next;        // 次に計測する時刻 [ms]
+	uint32_t last_read;   // 最後に dhtRead された時刻 [ms]
+	bool converting;      // DHT20 の変換中
+	uint32_t started;     // DHT20 の変換を始めた時刻 [ms]
+} DhtSensor;
+
+static DhtSensor sensors[DHT_MAX_SENSORS];
+// DHT11/DHT22 を計測しているピン (core 1 だけが書き換え、core 0 は dht_forget() で読む)
+static volatile uint32_t active_pins;
+// core 0 から計測の中止を頼まれたピン (-1 なら無し)
+static volatile int forget_pin = -1;
+
+static void update_active_pins(void)
+{
+	uint32_t pins = 0;
+	for(int i = 0; i < DHT_MAX_SENSORS; ++i)
+	{
+		if(sensors[i].used && sensors[i].type != DHT_MODULE_DHT20)
+			pins |= 1u << sensors[i].pin;
+	}
+	active_pins = pins;
+}
+
+static bool elapsed(uint32_t now, uint32_t t)
+{
+	return (int32_t)(now - t) >= 0;
+}
+
+// --- DHT11 / DHT22 ---
+
+// ピンが level の間待ち、その長さ [us] を返す。timeout_us を過ぎたら -1
+static int32_t level_us(uint pin, bool level, uint32_t timeout_us)
+{
+	uint32_t t0 = time_us_32();
+	while(gpio_get(pin) == level)
+		if(time_us_32() - t0 > timeout_us)
+			return -1;
+	return (int32_t)(time_us_32() - t0);
+}
+
+/**
+ * 1 回計測して 40 bit を読む
+ * core 1 はこのファームウェアの割り込みを受けないので、ビットの長さの計測が乱れない
+ */
+static bool dht_measure_pin(uint pin, uint8_t data[5])
+{
+	gpio_init(pin);
+	gpio_pull_up(pin);
+	// 開始信号: 18 ms Low にしてから離す
+	gpio_put(pin, 0);
+	gpio_set_dir(pin, GPIO_OUT);
+	sleep_ms(18);
+	gpio_set_dir(pin, GPIO_IN);
+
+	// 応答: Low 80 us -> High 80 us の後、ビットごとに Low 50 us + High 26〜28 us (0) / 70 us (1)
+	if(level_us(pin, true, 100) < 0 || level_us(pin, false, 100) < 0 || level_us(pin, true, 100) < 0)
+		return false;
+	for(int i = 0; i < 5; ++i)
+		data[i] = 0;
+	for(int i = 0; i < 40; ++i)
+	{
+		if(level_us(pin, false, 100) < 0)
+			return false;
+		int32_t high = level_us(pin, true, 100);
+		if(high < 0)
+			return false;
+		data[i / 8] = (uint8_t)((data[i / 8] << 1) | (high > 48 ? 1 : 0));
+	}
+	return ((data[0] + data[1] + data[2] + data[3]) & 0xFF) == data[4];
+}
+
+// 計測して値を更新する。失敗時は前回値を残す
+static void dht_measure(DhtSensor *st, uint32_t now)
+{
+	st->next = now + DHT_INTERVAL_MS[st->type];
+	uint8_t d[5];
+	bool ok = dht_measure_pin(st->pin, d);
+	// ピンを直接使ったので、次の digitalRead/digitalWrite で設定し直す
+	io_forget(st->pin);
+	if(!ok)
+		return;
+
+	if(st->type == DHT_MODULE_DHT11)
+	{
+		st->hum = d[0] + d[1] * 0.1f;
+		st->temp = d[2] + (d[3] & 0x7F) * 0.1f;
+		if(d[3] & 0x80)
+			st->temp = -st->temp;
+	}
+	else
+	{
+		st->hum = ((d[0] << 8) | d[1]) * 0.1f;
+		st->temp = (((d[2] & 0x7F) << 8) | d[3]) * 0.1f;
+		if(d[2] & 0x80)
+			st->temp = -st->temp;
+	}
+	st->has_value = true;
+	st->taken = now;
+}
+
+// --- DHT20 ---
+
+static bool dht20_status(i2c_inst_t *i2c, uint8_t *status)
+{
+	return i2c_read_timeout_us(i2c, DHT20_ADDR, status, 1, false, 5000) == 1;
+}
+
+static bool dht20_write(i2c_inst_t *i2c, uint8_t a, uint8_t b, uint8_t c)
+{
+	uint8_t cmd[3] = {a, b, c};
+	return i2c_write_timeout_us(i2c, DHT20_ADDR, cmd, 3, false, 5000) == 3;
+}
+
+// dht20.py の DHT20.__init__ と同じ初期化
+static bool dht20_begin(int bus)
+{
+	i2c_inst_t *i2c = board_i2c(bus);
+	uint8_t status;
+	if(!i2c || !dht20_status(i2c, &status))
+		return false;
+	if(status & 0x80)
+	{
+		if(!dht20_write(i2c, 0xA8, 0x00, 0x00))
+			return false;
+		sleep_ms(10);
+		if(!dht20_write(i2c, 0xBE, 0x08, 0x00))
+			return false;
+	}
+	return true;
+}
+
+// 変換の結果を読む。I2C エラーや CRC 不一致なら false
+static bool dht20_collect(i2c_inst_t *i2c, float *temp, float *hum)
+{
+	uint8_t d[7];
+	if(i2c_read_timeout_us(i2c, DHT20_ADDR, d, 7, false, 5000) != 7)
+		return false;
+	if(crc8(d, 6, 0xFF) != d[6])
+		return false;
+	uint32_t h = ((uint32_t)d[1] << 12) | ((uint32_t)d[2] << 4) | (d[3] >> 4);
+	uint32_t t = ((uint32_t)(d[3] & 0x0F) << 16) | ((uint32_t)d[4] << 8) | d[5];
+	*hum = h * 100.0f / 1048576.0f;
+	*temp = t * 200.0f / 1048576.0f - 50.0f;
+	return true;
+}
+
+/**
+ * DHT20 の状態を 1 つ進める。I2C の短い転送だけで、変換の完了は待たない
+ * 変換開始 (0xAC) と読み出しを別々の呼び出しで行い、約 80 ms の変換中も他の処理を進める
+ */
+static void dht20_poll(DhtSensor *st, uint32_t now)
+{
+	i2c_inst_t *i2c = board_i2c(st->pin);
+	if(st->converting)
+	{
+		uint32_t t = now - st->started;
+		if(t < DHT20_CONVERSION_MS)
+			return;
+		uint8_t status;
+		if(!dht20_status(i2c, &status))
+		{
+			st->converting = false;
+			return;
+		}
+		if(status & 0x80)
+		{
+			if(t > DHT20_TIMEOUT_MS)
+				st->converting = false;
+			return;
+		}
+		st->converting = false;
+		float temp, hum;
+		if(dht20_collect(i2c, &temp, &hum))
+		{
+			st->temp = temp;
+			st->hum = hum;
+			st->has_value = true;
+			st->taken = now;
+		}
+		return;
+	}
+
+	if(!elapsed(now, st->next))
+		return;
+	st->next = now + DHT_INTERVAL_MS[DHT_MODULE_DHT20];
+	if(!dht20_write(i2c, 0xAC, 0x33, 0x00))
+		return;
+	st->converting = true;
+	st->started = now;
+}
+
+// 計測時刻になっていれば計測する。センサーを待って止まった場合は true
+static bool dht_poll(DhtSensor *st, uint32_t now)
+{
+	if(st->type == DHT_MODULE_DHT20)
+	{
+		dht20_poll(st, now);
+		return false;
+	}
+	if(!elapsed(now, st->next))
+		return false;
+	dht_measure(st, now);
+	return true;
+}
+
+bool dht_read(int pin, int module_type, float *temp, float *hum, uint32_t *age_ms)
+{
+	DhtSensor *st = NULL;
+	DhtSensor *free_slot = NULL;
+	for(int i = 0; i < DHT_MAX_SENSORS; ++i)
+	{
+		if(!sensors[i].used)
+		{
+			if(!free_slot)
+				free_slot = &sensors[i];
+			continue;
+		}
+		if(sensors[i].pin == pin && sensors[i].type == module_type)
+		{
+			st = &sensors[i];
+			break;
+		}
+	}
+
+	uint32_t now = board_ticks_ms();
+	if(!st)
+	{
+		if(!free_slot || module_type < 0 || module_type > DHT_MODULE_DHT20)
+			return false;
+		if(module_type == DHT_MODULE_DHT20 ? !dht20_begin(pin) : (pin < 0 || pin >= BOARD_GPIO_COUNT))
+			return false;
+
+		st = free_slot;
+		st->pin = (uint8_t)pin;
+		st->type = (uint8_t)module_type;
+		st->has_value = false;
+		st->converting = false;
+		st->next = now;
+		// 初回はその場で計測する (DHT20 は変換が終わるまで待つ)
+		if(module_type == DHT_MODULE_DHT20)
+		{
+			dht20_poll(st, now);
+			while(st->converting)
+			{
+				sleep_ms(1);
+				dht20_poll(st, board_ticks_ms());
+			}
+		}
+		else
+			dht_measure(st, now);
+		st->used = true;
+		update_active_pins();
+		now = board_ticks_ms();
+	}
+
+	st->last_read = now;
+	if(!st->has_value)
+		return false;
+	*temp = st->temp;
+	*hum = st->hum;
+	*age_ms = now - st->taken;
+	return true;
+}
+
+/**
+ * 最小間隔が過ぎた DHT11/DHT22 を 1 つだけ計測する (1 回の停止を短くするため)
+ * DHT20 は待たずに状態を進めるだけなので、止まらずに次のセンサーへ進む
+ */
+void dht_pump(void)
+{
+	uint32_t now = board_ticks_ms();
+	for(int i = 0; i < DHT_MAX_SENSORS; ++i)
+	{
+		DhtSensor *st = &sensors[i];
+		if(!st->used)
+			continue;
+		if(now - st->last_read > DHT_IDLE_MS)
+		{
+			st->used = false;
+			update_active_pins();
+			continue;
+		}
+		if(dht_poll(st, now))
+			break;
+	}
+}
+
+void dht_forget(int pin)
+{
+	if(pin < 0 || pin >= BOARD_GPIO_COUNT || !(active_pins & (1u << pin)))
+		return;
+	forget_pin = pin;
+	// 計測中ならその回が終わるまで待つ (止まった後で core 0 がピンを設定し直す)
+	while(forget_pin >= 0)
+		tight_loop_contents();
+	__dmb();
+}
+
+void dht_service(void)
+{
+	int pin = forget_pin;
+	if(pin < 0)
+		return;
+	for(int i = 0; i < DHT_MAX_SENSORS; ++i)
+	{
+		if(sensors[i].used && sensors[i].pin == pin && sensors[i].type != DHT_MODULE_DHT20)
+			sensors[i].used = false;
+	}
+	update_active_pins();
+	__dmb();
+	forget_pin = -1;
+}
@@ -0,0 +1,36 @@
+#ifndef GROVEPI_DHT_H
+#define GROVEPI_DHT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// --- DHT 温湿度センサー (DHT11/DHT22 はビットバング、DHT20 は I2C) ---
+//
+// 計測はピンや I2C を待つので、dht_read() も dht_pump() も core 1 から呼ぶ。
+// dht_forget() だけは core 0 から呼び、core 1 が dht_service() で処理する。
+
+// dhtRead の module_type
+#define DHT_MODULE_DHT11 0
+#define DHT_MODULE_DHT22 1
+#define DHT_MODULE_DHT20 2
+
+/**
+ * 初回はその場で計測し、以降はバックグラウンドで計測した最新の値を待たずに返す
+ * @param  pin         デジタルピン番号 (DHT20 の場合は I2C バス番号 0/1)
+ * @param  module_type DHT_MODULE_*
+ * @param  age_ms      値を計測してからの経過時間 [ms]
+ * @return             一度も計測に成功していなければ false
+ */
+bool dht_read(int pin, int module_type, float *temp, float *hum, uint32_t *age_ms);
+
+// 最小間隔が過ぎたセンサーを計測し直す (core 1 のワーカーが待ち時間に呼ぶ)
+void dht_pump(void);
+
+// pin の DHT11/DHT22 のバックグラウンド計測をやめさせ、core 1 が止めるまで待つ
+// (core 0 がピンを別の用途に使い直すときに呼ぶ)
+void dht_forget(int pin);
+
+// dht_forget() の要求を処理する (core 1 のワーカーがジョブの合間に呼ぶ)
+void dht_service(void);
+
+#endif
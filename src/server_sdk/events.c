@@ -0,0 +1,260 @@
+#include "events.h"
+
+#include <stdio.h>
+
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+
+#include "board.h"
+#include "codec.h"
+#include "io.h"
+#include "serial.h"
+
+// --- アナログ連続サンプリング ---
+
+// 1 ストリームあたりのリングバッファ長 (サンプル数, 2 のべき乗)
+#define STREAM_RING_SIZE 1024
+#define STREAM_RING_MASK (STREAM_RING_SIZE - 1)
+
+typedef struct
+{
+	repeating_timer_t timer;
+	bool active;
+	uint8_t channel;
+	uint16_t block;
+	uint32_t seq;
+	uint32_t period;              // サンプリング周期 [1/256 us]
+	uint32_t phase;               // 周期の端数の累積 [1/256 us]
+	volatile uint32_t w;          // 書き込み位置
+	volatile uint32_t count;      // 未送信サンプル数
+	volatile uint32_t overruns;   // 上書きで失ったサンプル数
+	uint16_t ring[STREAM_RING_SIZE];
+} Stream;
+
+static Stream streams[BOARD_ANALOG_PINS];
+
+// "!stream" 通知の組み立て用 (1 ブロック最大 256 サンプル = 512 バイト)
+static uint8_t block_bytes[2 * STREAM_MAX_BLOCK];
+static char event_text[48 + 4 * ((2 * STREAM_MAX_BLOCK + 2) / 3)];
+
+// --- デジタル入力の変化通知 ---
+
+// 1 ピンあたりのエッジのリングバッファ長 (2 のべき乗)
+#define WATCH_RING_SIZE 32
+#define WATCH_RING_MASK (WATCH_RING_SIZE - 1)
+
+typedef struct
+{
+	volatile bool active;
+	uint8_t pin;
+	uint8_t edge;
+	uint32_t debounce_us;
+	bool recorded;
+	uint32_t last_us;             // 最後に記録したエッジの時刻 (time_us_32)
+	uint8_t last_level;
+	volatile uint32_t w;
+	volatile uint32_t count;
+	volatile uint32_t overruns;
+	uint32_t times[WATCH_RING_SIZE];
+	uint8_t levels[WATCH_RING_SIZE];
+} Watch;
+
+static Watch watches[BOARD_DIGITAL_PINS];
+
+/**
+ * タイマー割り込みで ADC を 1 回読み、リングバッファに書き込む
+ * 周期を 1/256 us 単位で積み上げて次の間隔を決めるので、1 us で割り切れない rate_hz でも平均は合う
+ */
+static bool stream_sample(repeating_timer_t *t)
+{
+	Stream *st = (Stream *)t->user_data;
+	uint32_t w = st->w;
+	st->ring[w] = io_adc_u16(st->channel);
+	st->w = (w + 1) & STREAM_RING_MASK;
+	if(st->count < STREAM_RING_SIZE)
+		st->count = st->count + 1;
+	else
+		st->overruns = st->overruns + 1;
+
+	st->phase += st->period;
+	t->delay_us = -(int64_t)(st->phase >> 8);
+	st->phase &= 0xFF;
+	return true;
+}
+
+/**
+ * streamAnalog(pin, rate_hz[, block])
+ * @param  pin     アナログピン番号 (0/1/2)
+ * @param  rate_hz サンプリング周波数 [Hz] (1〜50000)
+ * @param  block   1 回の通知にまとめるサンプル数 (1〜256)
+ */
+bool stream_start(int pin, int rate_hz, int block)
+{
+	if(!board_analog_pin(pin) || rate_hz <= 0 || rate_hz > STREAM_MAX_RATE || block <= 0 || block > STREAM_MAX_BLOCK)
+		return false;
+
+	stream_stop(pin);
+	Stream *st = &streams[pin];
+	st->channel = (uint8_t)pin;
+	st->block = (uint16_t)block;
+	st->seq = 0;
+	st->w = st->count = st->overruns = 0;
+	st->period = (uint32_t)(256000000ull / (uint32_t)rate_hz);
+	st->phase = st->period & 0xFF;
+	st->active = add_repeating_timer_us(-(int64_t)(st->period >> 8), stream_sample, st, &st->timer);
+	return st->active;
+}
+
+bool stream_stop(int pin)
+{
+	// main.py と同じく、サンプリングしていないピンを止めても成功にする
+	if(!board_analog_pin(pin))
+		return true;
+	Stream *st = &streams[pin];
+	if(st->active)
+	{
+		cancel_repeating_timer(&st->timer);
+		st->active = false;
+	}
+	return true;
+}
+
+// 1 ブロック分たまっていれば "!stream" 通知として送信する
+static void stream_pump(Stream *st)
+{
+	uint32_t n = st->block;
+	if(st->count < n)
+		return;
+
+	uint32_t irq = save_and_disable_interrupts();
+	uint32_t r = (st->w - st->count) & STREAM_RING_MASK;
+	uint32_t overruns = st->overruns;
+	restore_interrupts(irq);
+
+	for(uint32_t i = 0; i < n; ++i)
+	{
+		uint16_t v = st->ring[(r + i) & STREAM_RING_MASK];
+		block_bytes[2 * i] = (uint8_t)v;
+		block_bytes[2 * i + 1] = (uint8_t)(v >> 8);
+	}
+
+	irq = save_and_disable_interrupts();
+	st->count -= n;
+	restore_interrupts(irq);
+
+	int len = snprintf(event_text, sizeof(event_text), "stream %u %lu %lu ", st->channel,
+	                   (unsigned long)st->seq, (unsigned long)overruns);
+	len += (int)base64_encode(block_bytes, 2 * n, event_text + len);
+	serial_event(event_text, (size_t)len);
+	++st->seq;
+}
+
+/**
+ * エッジの割り込み (core 0)。時刻とレベルをリングバッファに記録する
+ * BOTH のときは同じレベルが続くエッジ (チャタリング) を捨てる
+ */
+static void watch_irq(uint gpio, uint32_t events)
+{
+	if(!board_digital_pin((int)gpio))
+		return;
+	Watch *wt = &watches[board_digital_index((int)gpio)];
+	if(!wt->active)
+		return;
+
+	uint32_t now = time_us_32();
+	uint8_t v;
+	if(wt->edge == WATCH_BOTH)
+	{
+		v = gpio_get(gpio) ? 1 : 0;
+		if(v == wt->last_level)
+			return;
+	}
+	else
+		v = (events & WATCH_RISING) ? 1 : 0;
+	if(wt->recorded && now - wt->last_us < wt->debounce_us)
+		return;
+
+	wt->recorded = true;
+	wt->last_us = now;
+	wt->last_level = v;
+	uint32_t w = wt->w;
+	wt->times[w] = now & 0x3FFFFFFF;
+	wt->levels[w] = v;
+	wt->w = (w + 1) & WATCH_RING_MASK;
+	if(wt->count < WATCH_RING_SIZE)
+		wt->count = wt->count + 1;
+	else
+		wt->overruns = wt->overruns + 1;
+}
+
+/**
+ * watchDigital(pin, edge[, debounce_ms])
+ * @param  pin         デジタルピン番号 (16/18/20)。入力にする
+ * @param  edge        WATCH_RISING / WATCH_FALLING / WATCH_BOTH
+ * @param  debounce_ms 直前のエッジからこの時間内のエッジは無視する [ms]
+ */
+bool watch_start(int pin, int edge, int debounce_ms)
+{
+	if(!board_digital_pin(pin) || debounce_ms < 0)
+		return false;
+
+	io_release(pin, false);
+	io_input(pin);
+
+	Watch *wt = &watches[board_digital_index(pin)];
+	wt->pin = (uint8_t)pin;
+	wt->edge = (uint8_t)edge;
+	wt->debounce_us = (uint32_t)debounce_ms * 1000u;
+	wt->recorded = false;
+	wt->last_level = gpio_get(pin) ? 1 : 0;
+	wt->w = wt->count = wt->overruns = 0;
+	gpio_acknowledge_irq(pin, WATCH_BOTH);
+	wt->active = true;
+	gpio_set_irq_enabled(pin, (uint32_t)edge, true);
+	return true;
+}
+
+void watch_stop(int pin)
+{
+	Watch *wt = &watches[board_digital_index(pin)];
+	if(!wt->active)
+		return;
+	gpio_set_irq_enabled(pin, WATCH_BOTH, false);
+	wt->active = false;
+}
+
+// 記録済みのエッジを 1 つずつ "!change" 通知として送信する
+static void watch_pump(Watch *wt)
+{
+	while(wt->count)
+	{
+		uint32_t irq = save_and_disable_interrupts();
+		uint32_t r = (wt->w - wt->count) & WATCH_RING_MASK;
+		uint32_t t = wt->times[r];
+		uint8_t v = wt->levels[r];
+		uint32_t overruns = wt->overruns;
+		wt->count = wt->count - 1;
+		restore_interrupts(irq);
+
+		int len = snprintf(event_text, sizeof(event_text), "change %u %u %lu %lu", wt->pin, v,
+		                   (unsigned long)t, (unsigned long)overruns);
+		serial_event(event_text, (size_t)len);
+	}
+}
+
+void events_init(void)
+{
+	gpio_set_irq_callback(watch_irq);
+	irq_set_enabled(IO_IRQ_BANK0, true);
+}
+
+void events_pump(void)
+{
+	for(int i = 0; i < BOARD_ANALOG_PINS; ++i)
+		if(streams[i].active)
+			stream_pump(&streams[i]);
+	for(int i = 0; i < BOARD_DIGITAL_PINS; ++i)
+		if(watches[i].active)
+			watch_pump(&watches[i]);
+}
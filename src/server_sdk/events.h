@@ -0,0 +1,31 @@
+#ifndef GROVEPI_EVENTS_H
+#define GROVEPI_EVENTS_H
+
+#include <stdbool.h>
+
+// --- 非同期通知を送る機能 (アナログ連続サンプリングとデジタル入力の変化通知) ---
+//
+// サンプリングとエッジの記録は割り込みで確保済みのリングバッファに書き込み、
+// events_pump() がコマンドの合間に "!stream" / "!change" 通知として送る。
+
+// watchDigital の edge (gpio の IRQ イベントのビット)
+#define WATCH_RISING 0x08   // GPIO_IRQ_EDGE_RISE
+#define WATCH_FALLING 0x04  // GPIO_IRQ_EDGE_FALL
+#define WATCH_BOTH (WATCH_RISING | WATCH_FALLING)
+
+#define STREAM_MAX_RATE 50000
+#define STREAM_MAX_BLOCK 256
+#define STREAM_DEFAULT_BLOCK 64
+
+void events_init(void);
+
+// 溜まった通知を送る (メインループからコマンドの合間に呼ぶ)
+void events_pump(void);
+
+bool stream_start(int pin, int rate_hz, int block);
+bool stream_stop(int pin);
+
+bool watch_start(int pin, int edge, int debounce_ms);
+void watch_stop(int pin);
+
+#endif
@@ -0,0 +1,364 @@
+#include "io.h"
+
+#include <math.h>
+
+#include "hardware/adc.h"
+#include "hardware/clocks.h"
+#include "hardware/gpio.h"
+#include "hardware/pwm.h"
+#include "hardware/sync.h"
+
+#include "dht.h"
+#include "events.h"
+#include "ledstrip.h"
+#include "ranger.h"
+
+// ピンごとに最後に設定した用途 (毎回の gpio 設定を省くため)
+enum
+{
+	PIN_UNKNOWN,
+	PIN_IN,
+	PIN_OUT,
+	PIN_PWM,
+};
+
+static volatile uint8_t pin_use[BOARD_GPIO_COUNT];
+
+// analogReadAvg のサンプル (合計を求めた後に標準偏差を計算し直すため保持する)
+static uint16_t avg_buf[AVG_MAX_SAMPLES];
+
+// --- PWM 波形の再生 ---
+
+// duty 値のテーブルをタイマー割り込みで 1 ステップずつ PWM に設定する
+typedef struct
+{
+	repeating_timer_t timer;
+	volatile bool active;
+	uint8_t pin;
+	bool repeat;
+	uint16_t count;
+	uint16_t idx;
+	uint16_t duties[PWM_MAX_STEPS + 1];
+} PwmPlayer;
+
+static PwmPlayer players[BOARD_DIGITAL_PINS];
+
+void io_init(void)
+{
+	for(int pin = 16; pin <= 20; pin += 2)
+	{
+		gpio_init(pin);
+		gpio_put(pin, 0);
+		gpio_set_dir(pin, GPIO_OUT);
+		pin_use[pin] = PIN_OUT;
+	}
+
+	adc_init();
+	for(int ch = 0; ch < BOARD_ANALOG_PINS; ++ch)
+		adc_gpio_init(BOARD_ADC_GPIO + ch);
+}
+
+void io_forget(int pin)
+{
+	if(pin >= 0 && pin < BOARD_GPIO_COUNT)
+		pin_use[pin] = PIN_UNKNOWN;
+}
+
+static void pwm_player_stop(int pin)
+{
+	PwmPlayer *p = &players[board_digital_index(pin)];
+	if(p->active)
+	{
+		cancel_repeating_timer(&p->timer);
+		p->active = false;
+	}
+}
+
+void io_release(int pin, bool keep_watch)
+{
+	pwm_player_stop(pin);
+	if(!keep_watch)
+		watch_stop(pin);
+	ranger_stop(pin);
+	strip_stop(pin);
+	dht_forget(pin);
+}
+
+void io_input(int pin)
+{
+	gpio_set_dir(pin, GPIO_IN);
+	gpio_set_function(pin, GPIO_FUNC_SIO);
+	pin_use[pin] = PIN_IN;
+}
+
+uint16_t io_adc_u16(int channel)
+{
+	// 入力の選択と変換の間にストリームのタイマー割り込みが入らないようにする (変換は 2 us)
+	uint32_t irq = save_and_disable_interrupts();
+	adc_select_input((uint)channel);
+	uint16_t raw = adc_read();
+	restore_interrupts(irq);
+	// 12 bit -> 16 bit (MicroPython の read_u16() と同じ変換)
+	return (uint16_t)((raw << 4) | (raw >> 8));
+}
+
+/**
+ * pinMode(pin, mode)
+ * @param  pin  デジタルピン番号 (16/18/20)。アナログピン (0/1/2) は何もせず成功扱い
+ * @param  mode 0 = INPUT, 1 = OUTPUT
+ */
+bool io_pin_mode(int pin, int mode)
+{
+	if(board_analog_pin(pin))
+		return true;
+	if(!board_digital_pin(pin))
+		return false;
+
+	io_release(pin, false);
+	if(mode)
+	{
+		gpio_set_dir(pin, GPIO_OUT);
+		gpio_set_function(pin, GPIO_FUNC_SIO);
+		pin_use[pin] = PIN_OUT;
+	}
+	else
+		io_input(pin);
+	return true;
+}
+
+bool io_digital_write(int pin, int value)
+{
+	if(!board_digital_pin(pin))
+		return false;
+
+	bool v = value != 0;
+	if(pin_use[pin] == PIN_OUT)
+	{
+		gpio_put(pin, v);
+		return true;
+	}
+
+	io_release(pin, false);
+	// 先に出力値を決めてから切り替え、一瞬だけ前の値が出ないようにする
+	gpio_put(pin, v);
+	gpio_set_dir(pin, GPIO_OUT);
+	gpio_set_function(pin, GPIO_FUNC_SIO);
+	pin_use[pin] = PIN_OUT;
+	return true;
+}
+
+bool io_digital_read(int pin, int *value)
+{
+	if(!board_digital_pin(pin))
+		return false;
+
+	if(pin_use[pin] != PIN_IN)
+	{
+		io_release(pin, true);
+		io_input(pin);
+	}
+	*value = gpio_get(pin) ? 1 : 0;
+	return true;
+}
+
+bool io_analog_read(int pin, uint16_t *value)
+{
+	if(!board_analog_pin(pin))
+		return false;
+	*value = io_adc_u16(pin);
+	return true;
+}
+
+/**
+ * mask で指定したピンを続けて読み、読み始めた時刻と一緒に返す
+ * ピンの設定は変えないので、出力にしているデジタルピンは出力中のレベルを返す
+ */
+bool io_snapshot(int mask, Snapshot *out)
+{
+	if(mask <= 0 || mask > SNAPSHOT_ALL)
+		return false;
+
+	out->mask = (uint8_t)mask;
+	out->t_us = board_ticks_us();
+	for(int i = 0; i < BOARD_ANALOG_PINS; ++i)
+		if(mask & (1 << i))
+			out->values[i] = io_adc_u16(i);
+	for(int i = 0; i < BOARD_DIGITAL_PINS; ++i)
+		if(mask & (8 << i))
+			out->values[3 + i] = gpio_get(16 + 2 * i) ? 1 : 0;
+	return true;
+}
+
+/**
+ * ADC を n 回続けて読み、平均値・最小値・最大値 (と標準偏差) を求める
+ * @param  pin    アナログピン番号 (0/1/2)
+ * @param  n      サンプル数 (1〜1024)
+ * @param  spread true なら標準偏差も求める
+ */
+bool io_analog_avg(int pin, int n, bool spread, AnalogAverage *out)
+{
+	if(!board_analog_pin(pin) || n < 1 || n > AVG_MAX_SAMPLES)
+		return false;
+
+	uint32_t total = 0;
+	uint16_t lo = 65535, hi = 0;
+	for(int i = 0; i < n; ++i)
+	{
+		uint16_t v = io_adc_u16(pin);
+		avg_buf[i] = v;
+		total += v;
+		if(v < lo)
+			lo = v;
+		if(v > hi)
+			hi = v;
+	}
+	out->mean = (double)total / n;
+	out->min = lo;
+	out->max = hi;
+	out->stddev = 0;
+	if(spread)
+	{
+		// n^2 * 分散 = n * Σv^2 - (Σv)^2 を 64 bit の整数で正確に求めてから割る
+		uint64_t sq = 0;
+		for(int i = 0; i < n; ++i)
+			sq += (uint64_t)avg_buf[i] * avg_buf[i];
+		uint64_t var = (uint64_t)n * sq - (uint64_t)total * total;
+		out->stddev = sqrt((double)var / ((double)n * n));
+	}
+	return true;
+}
+
+// analogWrite の値 (0〜255) -> duty 値 (0〜65535)
+static uint16_t duty_u16(int value)
+{
+	if(value < 0)
+		value = 0;
+	if(value > 255)
+		value = 255;
+	return (uint16_t)(value * 257);
+}
+
+/**
+ * ピンを 1 kHz の PWM 出力にする (再生中の波形などは止める)
+ * TOP を 65534 にして、duty 値 65535 がちょうど常時 High になるようにする
+ */
+static void pwm_attach(int pin)
+{
+	io_release(pin, false);
+	if(pin_use[pin] == PIN_PWM)
+		return;
+
+	uint slice = pwm_gpio_to_slice_num(pin);
+	pwm_config cfg = pwm_get_default_config();
+	pwm_config_set_clkdiv(&cfg, (float)clock_get_hz(clk_sys) / (1000.0f * 65535.0f));
+	pwm_config_set_wrap(&cfg, 65534);
+	pwm_init(slice, &cfg, true);
+	gpio_set_function(pin, GPIO_FUNC_PWM);
+	pin_use[pin] = PIN_PWM;
+}
+
+bool io_analog_write(int pin, int value)
+{
+	if(!board_digital_pin(pin))
+		return false;
+	pwm_attach(pin);
+	pwm_set_gpio_level(pin, duty_u16(value));
+	return true;
+}
+
+static bool pwm_step(repeating_timer_t *t)
+{
+	PwmPlayer *p = (PwmPlayer *)t->user_data;
+	uint16_t i = (uint16_t)(p->idx + 1);
+	if(i >= p->count)
+	{
+		if(!p->repeat)
+		{
+			p->active = false;
+			return false;
+		}
+		i = 0;
+	}
+	p->idx = i;
+	pwm_set_gpio_level(p->pin, p->duties[i]);
+	return true;
+}
+
+// players[] に詰めたテーブルの再生を始める (1 ステップ目はすぐに出力する)
+static void pwm_play(PwmPlayer *p, int period_ms)
+{
+	p->idx = 0;
+	pwm_set_gpio_level(p->pin, p->duties[0]);
+	if(p->count > 1 || p->repeat)
+		p->active = add_repeating_timer_ms(-period_ms, pwm_step, p, &p->timer);
+}
+
+// Python の // と同じく負の無限大方向に丸める割り算 (b > 0)
+static int floor_div(int a, int b)
+{
+	return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+/**
+ * pwmRamp(pin, from, to, duration_ms)
+ * 最大 256 ステップ (1 ステップ 2 ms 以上) の duty 値テーブルで from から to まで直線的に変化させる
+ */
+bool io_pwm_ramp(int pin, int from, int to, int duration_ms)
+{
+	if(!board_digital_pin(pin) || duration_ms < 0)
+		return false;
+
+	int d0 = duty_u16(from);
+	int d1 = duty_u16(to);
+	int steps = duration_ms / PWM_MIN_PERIOD_MS;
+	if(steps > PWM_MAX_STEPS)
+		steps = PWM_MAX_STEPS;
+
+	pwm_attach(pin);
+	PwmPlayer *p = &players[board_digital_index(pin)];
+	p->pin = (uint8_t)pin;
+	p->repeat = false;
+	if(steps < 1)
+	{
+		p->duties[0] = (uint16_t)d1;
+		p->count = 1;
+		pwm_play(p, PWM_MIN_PERIOD_MS);
+		return true;
+	}
+
+	// 最初のステップは from、steps 周期後 (ほぼ duration_ms 後) にちょうど to になる
+	for(int k = 0; k <= steps; ++k)
+		p->duties[k] = (uint16_t)(d0 + floor_div((d1 - d0) * k, steps));
+	p->count = (uint16_t)(steps + 1);
+	pwm_play(p, duration_ms / steps);
+	return true;
+}
+
+/**
+ * pwmSequence(pin, period_ms, repeat, values)
+ * @param values 各ステップの値 (0〜255)
+ * @param count  ステップ数 (1〜256)
+ */
+bool io_pwm_sequence(int pin, int period_ms, int repeat, const uint8_t *values, int count)
+{
+	if(!board_digital_pin(pin) || count < 1 || count > PWM_MAX_STEPS || period_ms < PWM_MIN_PERIOD_MS)
+		return false;
+
+	pwm_attach(pin);
+	PwmPlayer *p = &players[board_digital_index(pin)];
+	p->pin = (uint8_t)pin;
+	p->repeat = repeat != 0;
+	for(int k = 0; k < count; ++k)
+		p->duties[k] = (uint16_t)(values[k] * 257);
+	p->count = (uint16_t)count;
+	pwm_play(p, period_ms);
+	return true;
+}
+
+bool io_pwm_stop(int pin)
+{
+	if(!board_digital_pin(pin))
+		return false;
+	pwm_player_stop(pin);
+	return true;
+}
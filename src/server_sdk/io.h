@@ -0,0 +1,65 @@
+#ifndef GROVEPI_IO_H
+#define GROVEPI_IO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "board.h"
+
+// --- デジタル・アナログ入出力と PWM (main.py の pinMode 〜 pwmStop) ---
+//
+// 関数はすべて core 0 から呼ぶ。不正なピン番号や範囲外の値では false を返し、応答は "error" になる。
+
+// snapshot の mask: ビット 0〜2 が A0〜A2、ビット 3〜5 が D16/D18/D20
+#define SNAPSHOT_ALL 0x3F
+
+// analogReadAvg の最大サンプル数
+#define AVG_MAX_SAMPLES 1024
+
+// 1 つの波形の最大ステップ数と、ステップ周期の最小値 [ms]
+#define PWM_MAX_STEPS 256
+#define PWM_MIN_PERIOD_MS 2
+
+typedef struct
+{
+	uint8_t mask;
+	uint32_t t_us;        // 読み始めた時刻 (board_ticks_us)
+	uint16_t values[6];   // [i]: mask のビット i のピンの値 (指定しなかったピンは不定)
+} Snapshot;
+
+typedef struct
+{
+	double mean;
+	uint16_t min;
+	uint16_t max;
+	double stddev;
+} AnalogAverage;
+
+void io_init(void);
+
+// ピンの入出力方向の記録を捨てる (PIO や DHT が直接ピンを使った後に呼ぶ)
+void io_forget(int pin);
+
+// ピンを別の用途に切り替える前に、動作中の波形・変化通知・超音波の連続測定・LED テープを止める
+// keep_watch なら変化通知は止めない (digitalRead は入力のまま監視を続けられる)
+void io_release(int pin, bool keep_watch);
+
+// ピンを入力にする (io_release は呼ばない)
+void io_input(int pin);
+
+// ADC の生値 (read_u16() と同じ 0〜65535)。タイマー割り込みのストリームとも共有する
+uint16_t io_adc_u16(int channel);
+
+bool io_pin_mode(int pin, int mode);
+bool io_digital_write(int pin, int value);
+bool io_digital_read(int pin, int *value);
+bool io_analog_read(int pin, uint16_t *value);
+bool io_analog_write(int pin, int value);
+bool io_analog_avg(int pin, int n, bool spread, AnalogAverage *out);
+bool io_snapshot(int mask, Snapshot *out);
+
+bool io_pwm_ramp(int pin, int from, int to, int duration_ms);
+bool io_pwm_sequence(int pin, int period_ms, int repeat, const uint8_t *values, int count);
+bool io_pwm_stop(int pin);
+
+#endif
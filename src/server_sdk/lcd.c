@@ -0,0 +1,220 @@
+#include "lcd.h"
+
+#include <string.h>
+
+#include "board.h"
+
+// lcd1602.py の LCD1602_RGB と同じアドレスとコマンド
+#define LCD_ADDR 0x3E
+#define RGB_ADDR 0x62
+
+#define LCD_CLEARDISPLAY 0x01
+#define LCD_ENTRYMODESET 0x04
+#define LCD_DISPLAYCONTROL 0x08
+#define LCD_FUNCTIONSET 0x20
+#define LCD_ENTRYLEFT 0x02
+#define LCD_DISPLAYON 0x04
+#define LCD_2LINE 0x08
+
+#define REG_RED 0x04
+#define REG_GREEN 0x03
+#define REG_BLUE 0x02
+
+// 1 回の I2C 転送のタイムアウト [us] (LCD が無い場合に止まらないように)
+#define LCD_I2C_TIMEOUT_US 5000
+
+// LCD 1 台分の状態と、表示内容・バックライト色のシャドウ
+typedef struct
+{
+	bool ready;
+	bool frame_valid;        // false なら表示内容が不明で、次の書き込みで clear() からやり直す
+	char frame[LCD_CHARS];
+	bool rgb_valid;
+	unsigned char rgb[3];
+} Lcd;
+
+static Lcd lcds[2];
+
+static bool write2(i2c_inst_t *i2c, uint8_t addr, uint8_t a, uint8_t b)
+{
+	uint8_t buf[2] = {a, b};
+	return i2c_write_timeout_us(i2c, addr, buf, 2, false, LCD_I2C_TIMEOUT_US) == 2;
+}
+
+static bool command(i2c_inst_t *i2c, uint8_t cmd)
+{
+	return write2(i2c, LCD_ADDR, 0x80, cmd);
+}
+
+static bool clear(i2c_inst_t *i2c)
+{
+	if(!command(i2c, LCD_CLEARDISPLAY))
+		return false;
+	sleep_ms(2);
+	return true;
+}
+
+static bool set_rgb(i2c_inst_t *i2c, int r, int g, int b)
+{
+	return write2(i2c, RGB_ADDR, REG_RED, (uint8_t)r) &&
+	       write2(i2c, RGB_ADDR, REG_GREEN, (uint8_t)g) &&
+	       write2(i2c, RGB_ADDR, REG_BLUE, (uint8_t)b);
+}
+
+// HD44780 の初期化手順 (lcd1602.py の LCD1602_RGB.__init__ と同じ)
+static bool begin(i2c_inst_t *i2c)
+{
+	const uint8_t function = LCD_FUNCTIONSET | LCD_DISPLAYON | LCD_2LINE;
+
+	// 電源投入後 40 ms 以上待ってからコマンドを送る
+	sleep_ms(50);
+	if(!command(i2c, function))
+		return false;
+	sleep_us(4500);
+	command(i2c, function);
+	sleep_us(150);
+	command(i2c, function);
+	command(i2c, function);
+	return command(i2c, LCD_DISPLAYCONTROL | LCD_DISPLAYON | LCD_2LINE) &&
+	       clear(i2c) &&
+	       command(i2c, LCD_ENTRYMODESET | LCD_ENTRYLEFT) &&
+	       write2(i2c, RGB_ADDR, 0x00, 0x00) &&
+	       write2(i2c, RGB_ADDR, 0x01, 0x00) &&
+	       write2(i2c, RGB_ADDR, 0x08, 0xAA) &&
+	       set_rgb(i2c, 255, 255, 255);
+}
+
+// 必要に応じて遅延初期化した LCD を返す。初期化に失敗したら NULL (次回やり直す)
+static Lcd *get_lcd(int bus, i2c_inst_t **i2c)
+{
+	*i2c = board_i2c(bus);
+	if(!*i2c)
+		return NULL;
+	Lcd *lcd = &lcds[bus];
+	if(!lcd->ready)
+	{
+		if(!begin(*i2c))
+			return NULL;
+		lcd->ready = true;
+		lcd->frame_valid = false;
+		lcd->rgb_valid = false;
+	}
+	return lcd;
+}
+
+static bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// frame[start:end] を書き換える (setCursor も 1 文字の書き込みも I2C 1 回分)
+static bool write_run(i2c_inst_t *i2c, const char *frame, int start, int end)
+{
+	int col = start % LCD_COLS;
+	if(!command(i2c, (uint8_t)((start < LCD_COLS ? 0x80 : 0xC0) | col)))
+		return false;
+	for(int i = start; i < end; ++i)
+		if(!write2(i2c, LCD_ADDR, 0x40, (uint8_t)frame[i]))
+			return false;
+	return true;
+}
+
+/**
+ * setText(bus, text)
+ * 前後の空白を除き、改行をスペースにして、先頭 16 文字を 1 行目、17〜32 文字目を 2 行目に表示する
+ * 表示内容が不明なとき (初回・I2C エラー後) だけ clear() してから書き込む
+ * @param  bus  I2C バス番号 (0/1)
+ * @param  text 表示する文字列 (UTF-8 のまま 1 バイトを 1 文字として扱う)
+ */
+bool lcd_set_text(int bus, const char *text, size_t n)
+{
+	i2c_inst_t *i2c;
+	Lcd *lcd = get_lcd(bus, &i2c);
+	if(!lcd)
+		return false;
+
+	while(n && is_space(*text))
+		++text, --n;
+	while(n && is_space(text[n - 1]))
+		--n;
+	if(n > LCD_CHARS)
+		n = LCD_CHARS;
+
+	// 書き込まれない桁は空白として扱う (clear() 後の表示と同じになる)
+	char next[LCD_CHARS];
+	for(size_t i = 0; i < LCD_CHARS; ++i)
+	{
+		char c = i < n ? text[i] : ' ';
+		next[i] = (c == '\r' || c == '\n') ? ' ' : c;
+	}
+
+	bool full = false;
+	if(!lcd->frame_valid)
+	{
+		// clear() 直後の表示は全桁空白。clear が失敗した場合は全桁を書き直す
+		memset(lcd->frame, ' ', LCD_CHARS);
+		full = !clear(i2c);
+	}
+	lcd->frame_valid = false;
+
+	if(full)
+	{
+		if(!write_run(i2c, next, 0, LCD_COLS) || !write_run(i2c, next, LCD_COLS, LCD_CHARS))
+			return false;
+	}
+	else
+	{
+		// 1 文字だけ一致している隙間は分けずに 1 つの範囲にまとめる
+		for(int row = 0; row < LCD_ROWS; ++row)
+		{
+			int start = -1, end = -1;
+			for(int i = row * LCD_COLS; i < (row + 1) * LCD_COLS; ++i)
+			{
+				if(lcd->frame[i] == next[i])
+					continue;
+				if(start >= 0 && i - end > 1)
+				{
+					if(!write_run(i2c, next, start, end))
+						return false;
+					start = -1;
+				}
+				if(start < 0)
+					start = i;
+				end = i + 1;
+			}
+			if(start >= 0 && !write_run(i2c, next, start, end))
+				return false;
+		}
+	}
+
+	// 途中で I2C エラーになった場合は frame_valid が false のまま残り、次回は全体を書き直す
+	memcpy(lcd->frame, next, LCD_CHARS);
+	lcd->frame_valid = true;
+	return true;
+}
+
+/**
+ * setRGB(bus, r, g, b)
+ * @param  bus I2C バス番号 (0/1)
+ * @param  r   赤成分 (0〜255)
+ * @param  g   緑成分 (0〜255)
+ * @param  b   青成分 (0〜255)
+ */
+bool lcd_set_rgb(int bus, int r, int g, int b)
+{
+	i2c_inst_t *i2c;
+	Lcd *lcd = get_lcd(bus, &i2c);
+	if(!lcd)
+		return false;
+
+	if(lcd->rgb_valid && lcd->rgb[0] == r && lcd->rgb[1] == g && lcd->rgb[2] == b)
+		return true;
+	lcd->rgb_valid = false;
+	if(!set_rgb(i2c, r, g, b))
+		return false;
+	lcd->rgb[0] = (unsigned char)r;
+	lcd->rgb[1] = (unsigned char)g;
+	lcd->rgb[2] = (unsigned char)b;
+	lcd->rgb_valid = true;
+	return true;
+}
@@ -0,0 +1,21 @@
+#ifndef GROVEPI_LCD_H
+#define GROVEPI_LCD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// --- Grove 16x2 LCD (JHD1313M3, RGB バックライト) ---
+//
+// I2C の転送を待つので core 1 から呼ぶ。LCD はバスごとに 1 台で、初回の呼び出しで初期化する。
+
+#define LCD_COLS 16
+#define LCD_ROWS 2
+#define LCD_CHARS (LCD_COLS * LCD_ROWS)
+
+// 表示内容のシャドウと比べて、変わった文字の範囲だけを書き換える
+bool lcd_set_text(int bus, const char *text, size_t n);
+
+// 前回と同じ色なら I2C に書き込まない
+bool lcd_set_rgb(int bus, int r, int g, int b);
+
+#endif
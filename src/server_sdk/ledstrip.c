@@ -0,0 +1,127 @@
+#include "ledstrip.h"
+
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+
+#include "board.h"
+#include "io.h"
+#include "ws2812.pio.h"
+
+// 1 LED (24 bit) を送る時間と、フレームを確定させるリセット時間 [us]
+#define LED_US 30
+#define RESET_US 300
+
+static PIO const strip_pio = pio0;
+static const uint STRIP_SM = 0;
+
+static struct
+{
+	bool active;
+	uint8_t pin;
+	uint16_t count;
+	int program_offset;
+	int dma;
+	uint32_t latch;                  // 前のフレームが確定する時刻 (time_us_32)
+	uint8_t lut[256];                // 明るさを掛けた値のテーブル
+	uint32_t out[STRIP_MAX_LEDS];    // PIO に送る 0xGGRRBB00 の列
+} strip = {.program_offset = -1, .dma = -1};
+
+static void set_brightness(int brightness)
+{
+	// 0〜255 -> 0〜256 (255 でちょうど元の値になる)
+	uint32_t level = (uint32_t)brightness * 256u / 255u;
+	for(uint32_t v = 0; v < 256; ++v)
+		strip.lut[v] = (uint8_t)((v * level) >> 8);
+}
+
+// 前のフレームの送信とリセット時間が終わるまで待つ
+static void wait_latch(void)
+{
+	while(dma_channel_is_busy((uint)strip.dma))
+		tight_loop_contents();
+	while((int32_t)(strip.latch - time_us_32()) > 0)
+		tight_loop_contents();
+}
+
+/**
+ * ledStripInit(pin, count[, brightness])
+ * @param  pin        DIN を接続したデジタルピン番号 (16/18/20)
+ * @param  count      LED の数 (1〜341)
+ * @param  brightness 明るさ (0〜255)
+ */
+bool strip_init(int pin, int count, int brightness)
+{
+	if(!board_digital_pin(pin) || count < 1 || count > STRIP_MAX_LEDS || brightness < 0 || brightness > 255)
+		return false;
+
+	if(strip.active)
+		strip_stop(strip.pin);
+	io_release(pin, false);
+
+	if(strip.program_offset < 0)
+		strip.program_offset = (int)pio_add_program(strip_pio, &ws2812_program);
+	if(strip.dma < 0)
+		strip.dma = dma_claim_unused_channel(true);
+
+	ws2812_program_init(strip_pio, STRIP_SM, (uint)strip.program_offset, (uint)pin,
+	                    (float)clock_get_hz(clk_sys) / 8000000.0f);
+
+	dma_channel_config cfg = dma_channel_get_default_config((uint)strip.dma);
+	channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+	channel_config_set_read_increment(&cfg, true);
+	channel_config_set_write_increment(&cfg, false);
+	channel_config_set_dreq(&cfg, pio_get_dreq(strip_pio, STRIP_SM, true));
+	dma_channel_configure((uint)strip.dma, &cfg, &strip_pio->txf[STRIP_SM], strip.out, 0, false);
+
+	for(int i = 0; i < count; ++i)
+		strip.out[i] = 0;
+	set_brightness(brightness);
+	strip.count = (uint16_t)count;
+	strip.pin = (uint8_t)pin;
+	strip.latch = time_us_32();
+	strip.active = true;
+	// ピンは PIO が使うので、次の digitalRead/digitalWrite で設定し直す
+	io_forget(pin);
+	return true;
+}
+
+/**
+ * 明るさのテーブルで変換してから DMA で送る。CPU は送信中も次のコマンドを処理できる
+ * 送信を始めた時点で戻る (前のフレームの送信中なら、その完了を待つ)
+ */
+bool strip_write(int pin, const uint8_t *rgb, size_t n)
+{
+	if(!strip.active || pin != strip.pin || n % 3)
+		return false;
+
+	size_t leds = n / 3;
+	if(leds > strip.count)
+		leds = strip.count;
+
+	wait_latch();
+	const uint8_t *lut = strip.lut;
+	for(size_t i = 0; i < leds; ++i, rgb += 3)
+		strip.out[i] = ((uint32_t)lut[rgb[1]] << 24) | ((uint32_t)lut[rgb[0]] << 16) | ((uint32_t)lut[rgb[2]] << 8);
+
+	strip.latch = time_us_32() + strip.count * LED_US + RESET_US;
+	dma_channel_transfer_from_buffer_now((uint)strip.dma, strip.out, strip.count);
+	return true;
+}
+
+bool strip_brightness(int pin, int brightness)
+{
+	if(brightness < 0 || brightness > 255 || !strip.active || pin != strip.pin)
+		return false;
+	set_brightness(brightness);
+	return true;
+}
+
+void strip_stop(int pin)
+{
+	if(!strip.active || pin != strip.pin)
+		return;
+	wait_latch();
+	pio_sm_set_enabled(strip_pio, STRIP_SM, false);
+	strip.active = false;
+}
@@ -0,0 +1,22 @@
+#ifndef GROVEPI_LEDSTRIP_H
+#define GROVEPI_LEDSTRIP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// --- WS2812 LED テープ (PIO0 のステートマシン 0 と DMA で 1 本だけ駆動する) ---
+
+// 1 フレームの最大 LED 数 (バイナリフレームの payload 1024 バイトに RGB で収まる数)
+#define STRIP_MAX_LEDS 341
+
+bool strip_init(int pin, int count, int brightness);
+
+// R, G, B の順に並んだ n バイトを 1 フレームとして送り始める。LED の数より短ければ残りは前のまま
+bool strip_write(int pin, const uint8_t *rgb, size_t n);
+
+bool strip_brightness(int pin, int brightness);
+
+void strip_stop(int pin);
+
+#endif
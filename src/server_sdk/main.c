@@ -0,0 +1,1335 @@
+/*
+ * Raspberry Pi Pico + Grove Shield 向けの I/O ファームウェア (pico-sdk 版)。
+ *
+ * src/server/main.py (MicroPython) と同じテキストプロトコル (PROTOCOL.md) を
+ * USB シリアル (TinyUSB CDC) で受け取り、Pico 上の GPIO / ADC / PWM / PIO / I2C を制御する。
+ * バッチ・要求タグ・非同期通知・バイナリフレームモード・stats も同じ形式で応答するので、
+ * ホスト側の C++ ライブラリはどちらのファームウェアでもそのまま動く。
+ *
+ * ヒープは使わず、バッファはすべて静的に確保する (GC による停止が無い)。
+ */
+
+#include <malloc.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+#include "board.h"
+#include "codec.h"
+#include "core1.h"
+#include "dht.h"
+#include "events.h"
+#include "io.h"
+#include "ledstrip.h"
+#include "ranger.h"
+#include "serial.h"
+
+// 1 行の最大長 (341 LED 分の ledStripWrite の Base64 が収まる長さ)
+#define LINE_MAX 2048
+// 1 コマンドの応答の最大長 (stats が最長)
+#define REPLY_MAX 2048
+// バッチの応答の最大長
+#define BATCH_MAX 16384
+// 応答待ちの列の長さと、その間に送れない応答を溜める領域
+#define PENDING_MAX 32
+#define PENDING_TEXT_MAX 4096
+// "#" と 10 桁まで
+#define TAG_MAX_LEN 11
+#define MAX_ARGS 4
+
+typedef struct
+{
+	const char *s;
+	size_t n;
+} Token;
+
+typedef struct
+{
+	int n;
+	Token tok[MAX_ARGS];
+} Args;
+
+typedef struct
+{
+	char *s;
+	size_t n;
+} Reply;
+
+// --- コマンド表 ---
+//
+// core 0 で実行するコマンドは run が応答を作る。
+// core 1 で実行するコマンド (setText/setRGB/dhtRead) は prepare がジョブに要求を詰め、finish が結果から応答を作る。
+// 計測値は stats() で返す。
+
+typedef struct Command
+{
+	const char *name;
+	bool (*run)(const Args *a, Reply *r);
+	bool (*prepare)(const Args *a, Job *job);
+	void (*finish)(const Job *job, Reply *r);
+	uint8_t required;      // 必須の引数の数 (これより後ろは省略できる)
+	uint8_t max;           // 引数の最大数
+	bool rest;             // 最後の引数は "," を含めて ")" の手前まで (setText)
+	uint32_t calls;
+	uint32_t errors;
+	uint64_t total_us;
+	uint32_t max_us;
+} Command;
+
+static char reply_buf[REPLY_MAX];
+static char job_reply_buf[64];
+static uint8_t decode_buf[LINE_MAX * 3 / 4];
+
+// バッチ実行中は各コマンドの応答をここに溜め、最後に 1 行にまとめて送信する
+static bool batch_active;
+static char batch_buf[BATCH_MAX];
+static size_t batch_len;
+static size_t batch_count;
+
+// 実行中の行に付いていたタグ ("#<n>")。タグ付きの応答は順番を待たずに送る
+static const char *cur_tag;
+static size_t cur_tag_len;
+
+// 応答待ちの列 (コマンド順)。job があれば core 1 の完了待ち、無ければ送信待ちの応答
+typedef struct
+{
+	Job *job;
+	uint16_t off;
+	uint16_t len;
+} Pending;
+
+static Pending pending[PENDING_MAX];
+static size_t pending_head;
+static size_t npending;
+static char pending_text[PENDING_TEXT_MAX];
+static size_t pending_text_len;
+
+// core 1 で実行中のタグ付きのコマンド。終わった順に応答を送る
+static Job *tagged[JOB_SLOTS];
+static size_t ntagged;
+
+static uint32_t boot_ms;
+
+static void send_replies(void);
+
+// --- 引数のパース ---
+
+static bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+static Token trim(const char *s, size_t n)
+{
+	while(n && is_space(*s))
+		++s, --n;
+	while(n && is_space(s[n - 1]))
+		--n;
+	Token t = {s, n};
+	return t;
+}
+
+static bool tok_eq(Token t, const char *word)
+{
+	return strlen(word) == t.n && strncasecmp(t.s, word, t.n) == 0;
+}
+
+// 10 進数の整数 (Python の int() と同じく符号を付けてもよい)
+static bool tok_int(Token t, int *v)
+{
+	size_t i = 0;
+	bool neg = false;
+	if(i < t.n && (t.s[i] == '+' || t.s[i] == '-'))
+		neg = t.s[i++] == '-';
+	if(i == t.n)
+		return false;
+	int64_t x = 0;
+	for(; i < t.n; ++i)
+	{
+		if(t.s[i] < '0' || t.s[i] > '9')
+			return false;
+		x = x * 10 + (t.s[i] - '0');
+		if(x > 0x7FFFFFFF)
+			return false;
+	}
+	*v = (int)(neg ? -x : x);
+	return true;
+}
+
+// i 番目の引数 (省略されていれば def)
+static bool arg_int(const Args *a, int i, int def, int *v)
+{
+	if(i >= a->n)
+	{
+		*v = def;
+		return true;
+	}
+	return tok_int(a->tok[i], v);
+}
+
+// "INPUT"/"OUTPUT" (大文字小文字は問わない) -> 0/1
+static bool arg_mode(Token t, int *v)
+{
+	if(tok_eq(t, "input") || tok_eq(t, "in"))
+		*v = 0;
+	else if(tok_eq(t, "output") || tok_eq(t, "out"))
+		*v = 1;
+	else
+		return false;
+	return true;
+}
+
+// "HIGH"/"LOW" (大文字小文字は問わない) -> 1/0
+static bool arg_level(Token t, int *v)
+{
+	if(tok_eq(t, "high"))
+		*v = 1;
+	else if(tok_eq(t, "low"))
+		*v = 0;
+	else
+		return false;
+	return true;
+}
+
+// "RISING"/"FALLING"/"BOTH" (大文字小文字は問わない)
+static bool arg_edge(Token t, int *v)
+{
+	if(tok_eq(t, "rising"))
+		*v = WATCH_RISING;
+	else if(tok_eq(t, "falling"))
+		*v = WATCH_FALLING;
+	else if(tok_eq(t, "both"))
+		*v = WATCH_BOTH;
+	else
+		return false;
+	return true;
+}
+
+// I2C バス番号。0/1, "i2c0"/"i2c1" のいずれか
+static bool arg_bus(Token t, int *v)
+{
+	if(tok_eq(t, "0") || tok_eq(t, "i2c0"))
+		*v = 0;
+	else if(tok_eq(t, "1") || tok_eq(t, "i2c1"))
+		*v = 1;
+	else
+		return false;
+	return true;
+}
+
+static bool arg_byte(const Args *a, int i, int *v)
+{
+	return arg_int(a, i, 0, v) && *v >= 0 && *v <= 255;
+}
+
+static void reply_printf(Reply *r, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(r->s + r->n, REPLY_MAX - r->n, fmt, ap);
+	va_end(ap);
+	if(n > 0)
+		r->n += (size_t)n < REPLY_MAX - r->n ? (size_t)n : REPLY_MAX - 1 - r->n;
+}
+
+// --- GrovePi C++ API 対応コマンド ---
+
+static bool run_pinMode(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin, mode;
+	return tok_int(a->tok[0], &pin) && arg_mode(a->tok[1], &mode) && io_pin_mode(pin, mode);
+}
+
+static bool run_digitalWrite(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin, value;
+	return tok_int(a->tok[0], &pin) && arg_level(a->tok[1], &value) && io_digital_write(pin, value);
+}
+
+static bool run_digitalRead(const Args *a, Reply *r)
+{
+	int pin, value;
+	if(!tok_int(a->tok[0], &pin) || !io_digital_read(pin, &value))
+		return false;
+	reply_printf(r, "%d", value);
+	return true;
+}
+
+static bool run_analogRead(const Args *a, Reply *r)
+{
+	int pin;
+	uint16_t value;
+	if(!tok_int(a->tok[0], &pin) || !io_analog_read(pin, &value))
+		return false;
+	reply_printf(r, "%u", value);
+	return true;
+}
+
+static bool run_analogWrite(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin, value;
+	return tok_int(a->tok[0], &pin) && tok_int(a->tok[1], &value) && io_analog_write(pin, value);
+}
+
+static bool run_ultrasonicRead(const Args *a, Reply *r)
+{
+	int pin, cm;
+	if(!tok_int(a->tok[0], &pin) || !ranger_read(pin, &cm))
+		return false;
+	reply_printf(r, "%d", cm);
+	return true;
+}
+
+// --- 超音波距離センサーの連続測定 (Pico 専用拡張) ---
+
+static bool run_ultrasonicStart(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin, period, stream;
+	return tok_int(a->tok[0], &pin) && tok_int(a->tok[1], &period) && arg_int(a, 2, 0, &stream) &&
+	       ranger_start(pin, period, stream != 0);
+}
+
+static bool run_ultrasonicStop(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin;
+	if(!tok_int(a->tok[0], &pin) || !board_digital_pin(pin))
+		return false;
+	ranger_stop(pin);
+	return true;
+}
+
+// --- WS2812 LED テープ (Pico 専用拡張) ---
+
+static bool run_ledStripInit(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin, count, brightness;
+	return tok_int(a->tok[0], &pin) && tok_int(a->tok[1], &count) && arg_int(a, 2, 255, &brightness) &&
+	       strip_init(pin, count, brightness);
+}
+
+static bool run_ledStripWrite(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin;
+	if(!tok_int(a->tok[0], &pin))
+		return false;
+	int n = base64_decode(a->tok[1].s, a->tok[1].n, decode_buf, sizeof(decode_buf));
+	return n >= 0 && strip_write(pin, decode_buf, (size_t)n);
+}
+
+static bool run_ledStripBrightness(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin, brightness;
+	return tok_int(a->tok[0], &pin) && tok_int(a->tok[1], &brightness) && strip_brightness(pin, brightness);
+}
+
+// --- アナログ入力の平均化・一括読み取り (Pico 専用拡張) ---
+
+static bool run_analogReadAvg(const Args *a, Reply *r)
+{
+	int pin, n, spread;
+	AnalogAverage avg;
+	if(!tok_int(a->tok[0], &pin) || !tok_int(a->tok[1], &n) || !arg_int(a, 2, 0, &spread) ||
+	   !io_analog_avg(pin, n, spread != 0, &avg))
+		return false;
+	reply_printf(r, "%.2f %u %u", avg.mean, avg.min, avg.max);
+	if(spread)
+		reply_printf(r, " %.2f", avg.stddev);
+	return true;
+}
+
+static bool reply_snapshot(int mask, Reply *r)
+{
+	Snapshot snap;
+	if(!io_snapshot(mask, &snap))
+		return false;
+	reply_printf(r, "%u %lu", snap.mask, (unsigned long)snap.t_us);
+	for(int i = 0; i < 6; ++i)
+		if(mask & (1 << i))
+			reply_printf(r, " %u", snap.values[i]);
+	return true;
+}
+
+static bool run_snapshot(const Args *a, Reply *r)
+{
+	int mask;
+	return arg_int(a, 0, SNAPSHOT_ALL, &mask) && reply_snapshot(mask, r);
+}
+
+static bool run_readAll(const Args *a, Reply *r)
+{
+	(void)a;
+	return reply_snapshot(SNAPSHOT_ALL, r);
+}
+
+// --- PWM 波形の再生 (Pico 専用拡張) ---
+
+static bool run_pwmRamp(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin, from, to, duration;
+	return tok_int(a->tok[0], &pin) && tok_int(a->tok[1], &from) && tok_int(a->tok[2], &to) &&
+	       tok_int(a->tok[3], &duration) && io_pwm_ramp(pin, from, to, duration);
+}
+
+static bool run_pwmSequence(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin, period, repeat;
+	if(!tok_int(a->tok[0], &pin) || !tok_int(a->tok[1], &period) || !tok_int(a->tok[2], &repeat))
+		return false;
+	int n = hex_decode(a->tok[3].s, a->tok[3].n, decode_buf, PWM_MAX_STEPS);
+	return n > 0 && io_pwm_sequence(pin, period, repeat, decode_buf, n);
+}
+
+static bool run_pwmStop(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin;
+	return tok_int(a->tok[0], &pin) && io_pwm_stop(pin);
+}
+
+// --- LCD 表示系の拡張コマンド (core 1) ---
+
+static bool prepare_setText(const Args *a, Job *job)
+{
+	int bus;
+	if(!arg_bus(a->tok[0], &bus))
+		return false;
+	// 前後の空白は引数のパースで除いてあるので、ここで 32 文字に切り詰めてよい
+	size_t n = a->tok[1].n < LCD_CHARS ? a->tok[1].n : LCD_CHARS;
+	job->kind = JOB_SET_TEXT;
+	job->bus = (int16_t)bus;
+	memcpy(job->text, a->tok[1].s, n);
+	job->text_len = (uint8_t)n;
+	return true;
+}
+
+static bool prepare_setRGB(const Args *a, Job *job)
+{
+	int bus, red, green, blue;
+	if(!arg_bus(a->tok[0], &bus) || !arg_byte(a, 1, &red) || !arg_byte(a, 2, &green) || !arg_byte(a, 3, &blue))
+		return false;
+	job->kind = JOB_SET_RGB;
+	job->bus = (int16_t)bus;
+	job->args[0] = (int16_t)red;
+	job->args[1] = (int16_t)green;
+	job->args[2] = (int16_t)blue;
+	return true;
+}
+
+static void finish_ok(const Job *job, Reply *r)
+{
+	(void)job;
+	(void)r;
+}
+
+// --- DHT 温湿度センサー (Pico 専用拡張, core 1) ---
+
+static bool prepare_dhtRead(const Args *a, Job *job)
+{
+	int pin, type;
+	if(!tok_int(a->tok[0], &pin) || !tok_int(a->tok[1], &type))
+		return false;
+	job->kind = JOB_DHT_READ;
+	job->bus = (int16_t)pin;
+	job->args[0] = (int16_t)type;
+	// DHT11/DHT22 はピンを直接使うので、同じピンのコマンドは完了を待たせる
+	job->pin = (int16_t)(type == DHT_MODULE_DHT20 ? -1 : pin);
+	return true;
+}
+
+static void finish_dhtRead(const Job *job, Reply *r)
+{
+	// DHT11/DHT22 は 0.1 刻みの値、DHT20 は 20 bit の値なので小数 2 桁まで返す
+	const char *fmt = job->args[0] == DHT_MODULE_DHT20 ? "%.2f %.2f %lu" : "%.1f %.1f %lu";
+	reply_printf(r, fmt, (double)job->temp, (double)job->hum, (unsigned long)job->age_ms);
+}
+
+// --- バイナリフレームモード (Pico 専用拡張) ---
+
+static void wait_replies(void);
+
+static bool run_binaryMode(const Args *a, Reply *r)
+{
+	(void)r;
+	int enable;
+	if(!tok_int(a->tok[0], &enable))
+		return false;
+	// 応答はテキストで返し、その直後からバイナリフレームで受け付ける
+	wait_replies();
+	if(enable)
+		serial_binary = true;
+	return true;
+}
+
+// --- アナログ連続サンプリング・デジタル入力の変化通知 (Pico 専用拡張) ---
+
+static bool run_streamAnalog(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin, rate, block;
+	return tok_int(a->tok[0], &pin) && tok_int(a->tok[1], &rate) && arg_int(a, 2, STREAM_DEFAULT_BLOCK, &block) &&
+	       stream_start(pin, rate, block);
+}
+
+static bool run_streamStop(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin;
+	return tok_int(a->tok[0], &pin) && stream_stop(pin);
+}
+
+static bool run_watchDigital(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin, edge, debounce;
+	return tok_int(a->tok[0], &pin) && arg_edge(a->tok[1], &edge) && arg_int(a, 2, 0, &debounce) &&
+	       watch_start(pin, edge, debounce);
+}
+
+static bool run_unwatchDigital(const Args *a, Reply *r)
+{
+	(void)r;
+	int pin;
+	if(!tok_int(a->tok[0], &pin) || !board_digital_pin(pin))
+		return false;
+	watch_stop(pin);
+	return true;
+}
+
+// --- 計測 (Pico 専用拡張) ---
+
+static bool run_stats(const Args *a, Reply *r);
+
+#define CMD(name, required, max) {#name, run_##name, NULL, NULL, required, max, false, 0, 0, 0, 0}
+#define CORE1_CMD(name, finish, required, max, rest) \
+	{#name, NULL, prepare_##name, finish, required, max, rest, 0, 0, 0, 0}
+
+// 登録順が stats() の出力順 (main.py の _command の順と同じ)
+static Command commands[] = {
+	CMD(pinMode, 2, 2),
+	CMD(digitalWrite, 2, 2),
+	CMD(digitalRead, 1, 1),
+	CMD(analogRead, 1, 1),
+	CMD(analogWrite, 2, 2),
+	CMD(ultrasonicRead, 1, 1),
+	CMD(ultrasonicStart, 2, 3),
+	CMD(ultrasonicStop, 1, 1),
+	CMD(ledStripInit, 2, 3),
+	CMD(ledStripWrite, 2, 2),
+	CMD(ledStripBrightness, 2, 2),
+	CMD(analogReadAvg, 2, 3),
+	CMD(snapshot, 0, 1),
+	CMD(readAll, 0, 0),
+	CMD(pwmRamp, 4, 4),
+	CMD(pwmSequence, 4, 4),
+	CMD(pwmStop, 1, 1),
+	// setText は最初の "," より後ろをすべてテキストとして扱う
+	CORE1_CMD(setText, finish_ok, 2, 2, true),
+	CORE1_CMD(setRGB, finish_ok, 4, 4, false),
+	CORE1_CMD(dhtRead, finish_dhtRead, 2, 2, false),
+	CMD(binaryMode, 1, 1),
+	CMD(streamAnalog, 2, 3),
+	CMD(streamStop, 1, 1),
+	CMD(watchDigital, 2, 3),
+	CMD(unwatchDigital, 1, 1),
+	CMD(stats, 0, 1),
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+// オペコード -> 同名のテキストコマンド (計測値を共有する)
+static Command *op_commands[OP_SNAPSHOT + 1];
+
+static Command *find_command(Token name)
+{
+	for(size_t i = 0; i < NUM_COMMANDS; ++i)
+		if(tok_eq(name, commands[i].name))
+			return &commands[i];
+	return NULL;
+}
+
+static Command *find_command_str(const char *name)
+{
+	Token t = {name, strlen(name)};
+	return find_command(t);
+}
+
+// コマンド 1 件の実行時間を計測値に加える
+static void record(Command *cmd, uint32_t t0, bool failed)
+{
+	uint32_t dt = time_us_32() - t0;
+	++cmd->calls;
+	if(failed)
+		++cmd->errors;
+	cmd->total_us += dt;
+	if(dt > cmd->max_us)
+		cmd->max_us = dt;
+}
+
+/**
+ * stats([reset]) -> 計測値の 1 行
+ * ヒープを使わないので mem_alloc は malloc の使用量 (通常 0)、mem_free はヒープ領域の残り、gc は常に 0
+ */
+static bool run_stats(const Args *a, Reply *r)
+{
+	extern char __StackLimit, __bss_end__;
+	int reset;
+	if(!arg_int(a, 0, 0, &reset))
+		return false;
+
+	struct mallinfo m = mallinfo();
+	size_t heap = (size_t)(&__StackLimit - &__bss_end__);
+	size_t used = (size_t)m.uordblks;
+	reply_printf(r, "uptime_ms=%lu mem_free=%lu mem_alloc=%lu gc=0", (unsigned long)(board_ticks_ms() - boot_ms),
+	             (unsigned long)(heap > used ? heap - used : 0), (unsigned long)used);
+	for(size_t i = 0; i < NUM_COMMANDS; ++i)
+	{
+		const Command *c = &commands[i];
+		if(c->calls)
+			reply_printf(r, " %s=%lu/%lu/%llu/%lu", c->name, (unsigned long)c->calls, (unsigned long)c->errors,
+			             (unsigned long long)c->total_us, (unsigned long)c->max_us);
+	}
+	if(reset)
+		for(size_t i = 0; i < NUM_COMMANDS; ++i)
+			commands[i].calls = commands[i].errors = commands[i].max_us = 0, commands[i].total_us = 0;
+	return true;
+}
+
+// --- 応答の送信 ---
+
+static void write_tagged(const char *tag, size_t tag_len, const char *s, size_t n)
+{
+	serial_write(tag, tag_len);
+	if(n)
+	{
+		serial_write(" ", 1);
+		serial_write(s, n);
+	}
+	serial_write("\n", 1);
+}
+
+static void batch_append(const char *s, size_t n)
+{
+	size_t sep = batch_count ? 1 : 0;
+	// 入りきらない応答は "error" にする (1 行の長さの上限から、通常は起こらない)
+	if(batch_len + sep + n > BATCH_MAX)
+	{
+		s = "error";
+		n = 5;
+	}
+	if(batch_len + sep + n <= BATCH_MAX)
+	{
+		if(sep)
+			batch_buf[batch_len++] = ';';
+		memcpy(batch_buf + batch_len, s, n);
+		batch_len += n;
+	}
+	++batch_count;
+}
+
+static void pending_push(Job *job, const char *s, size_t n)
+{
+	if(npending == PENDING_MAX || (!job && pending_text_len + n > PENDING_TEXT_MAX))
+	{
+		// 列が一杯なら、先に受け付けたコマンドの応答をすべて送ってから続ける
+		wait_replies();
+		if(!job)
+		{
+			serial_line(s, n);
+			return;
+		}
+	}
+	Pending *p = &pending[(pending_head + npending) % PENDING_MAX];
+	p->job = job;
+	p->off = (uint16_t)pending_text_len;
+	p->len = (uint16_t)n;
+	if(!job)
+	{
+		memcpy(pending_text + pending_text_len, s, n);
+		pending_text_len += n;
+	}
+	++npending;
+}
+
+/**
+ * 応答 1 件を送信する
+ * バッチ実行中は _BATCH と同じく溜め、先に受け付けた低速なコマンドの応答待ちがあれば列に並べる
+ */
+static void send_reply(const char *s, size_t n)
+{
+	if(batch_active)
+		batch_append(s, n);
+	else if(cur_tag_len)
+		write_tagged(cur_tag, cur_tag_len, s, n);
+	else if(npending)
+		pending_push(NULL, s, n);
+	else
+		serial_line(s, n);
+}
+
+static void send_error(void)
+{
+	send_reply("error", 5);
+}
+
+// 終わったジョブの応答を作って計測値に加え、スロットを解放する
+static Reply finish_job(Job *job)
+{
+	Reply r = {job_reply_buf, 0};
+	__dmb();
+	Command *cmd = (Command *)job->command;
+	if(job->ok)
+		cmd->finish(job, &r);
+	else
+	{
+		memcpy(r.s, "error", 5);
+		r.n = 5;
+	}
+	record(cmd, job->t0, !job->ok);
+	core1_release(job);
+	return r;
+}
+
+/**
+ * 終わったコマンドの応答を送る
+ * タグ付きのコマンドは終わった順に、タグの無いコマンドは列の先頭から順に送る
+ */
+static void send_replies(void)
+{
+	for(size_t i = 0; i < ntagged;)
+	{
+		Job *job = tagged[i];
+		if(!job->done)
+		{
+			++i;
+			continue;
+		}
+		char tag[sizeof(job->tag)];
+		size_t tag_len = job->tag_len;
+		memcpy(tag, job->tag, tag_len);
+		Reply r = finish_job(job);
+		write_tagged(tag, tag_len, r.s, r.n);
+		memmove(&tagged[i], &tagged[i + 1], (ntagged - i - 1) * sizeof(tagged[0]));
+		--ntagged;
+	}
+
+	while(npending)
+	{
+		Pending *p = &pending[pending_head];
+		if(p->job)
+		{
+			if(!p->job->done)
+				break;
+			Reply r = finish_job(p->job);
+			serial_line(r.s, r.n);
+		}
+		else
+			serial_line(pending_text + p->off, p->len);
+		pending_head = (pending_head + 1) % PENDING_MAX;
+		--npending;
+	}
+	// 全部送ったら、溜める領域を先頭から使い直す
+	if(!npending)
+		pending_text_len = 0;
+}
+
+// 受け付けたコマンドの応答をすべて送り終えるまで待つ
+static void wait_replies(void)
+{
+	while(npending || ntagged)
+	{
+		send_replies();
+		serial_task();
+	}
+}
+
+// core 1 の空きスロットを、空くまで応答を送りながら待って返す
+static Job *acquire_job(void)
+{
+	while(!core1_can_submit())
+	{
+		send_replies();
+		serial_task();
+	}
+	return core1_job();
+}
+
+// ジョブを core 1 で実行し、終わるまで待つ (バッチ・バイナリ用)
+static void run_job(Job *job)
+{
+	core1_submit(job);
+	while(!job->done)
+	{
+		send_replies();
+		serial_task();
+	}
+	__dmb();
+}
+
+// 先頭の引数のピンを core 1 のジョブが使っていれば true
+static bool busy_pin(Token args)
+{
+	const char *comma = memchr(args.s, ',', args.n);
+	int pin;
+	if(!tok_int(trim(args.s, comma ? (size_t)(comma - args.s) : args.n), &pin))
+		return false;
+	for(size_t i = 0; i < npending; ++i)
+	{
+		const Job *job = pending[(pending_head + i) % PENDING_MAX].job;
+		if(job && job->pin == pin)
+			return true;
+	}
+	for(size_t i = 0; i < ntagged; ++i)
+		if(tagged[i]->pin == pin)
+			return true;
+	return false;
+}
+
+static bool split_args(const Command *cmd, Token args, Args *a)
+{
+	a->n = 0;
+	if(args.n)
+	{
+		const char *p = args.s;
+		const char *end = args.s + args.n;
+		for(;;)
+		{
+			if(a->n == cmd->max)
+				return false;
+			const char *comma = (cmd->rest && a->n == cmd->max - 1) ? NULL : memchr(p, ',', (size_t)(end - p));
+			const char *e = comma ? comma : end;
+			a->tok[a->n++] = trim(p, (size_t)(e - p));
+			if(!comma)
+				break;
+			p = comma + 1;
+		}
+	}
+	return a->n >= cmd->required;
+}
+
+// "func(arg1, arg2, ...)" 形式の 1 コマンドを解釈して実行する
+static void handle_command(const char *line, size_t len)
+{
+	Token s = trim(line, len);
+	const char *l = memchr(s.s, '(', s.n);
+	const char *r = NULL;
+	for(size_t i = s.n; i > 0; --i)
+		if(s.s[i - 1] == ')')
+		{
+			r = s.s + i - 1;
+			break;
+		}
+	if(!l || l == s.s || !r || r <= l)
+	{
+		send_error();
+		return;
+	}
+
+	Command *cmd = find_command(trim(s.s, (size_t)(l - s.s)));
+	if(!cmd)
+	{
+		send_error();
+		return;
+	}
+
+	Token args = trim(l + 1, (size_t)(r - l - 1));
+	if((npending || ntagged) && busy_pin(args))
+	{
+		// core 1 で実行中のコマンドと同じピンを使うなら、その完了を待つ
+		wait_replies();
+	}
+
+	uint32_t t0 = time_us_32();
+	Args a;
+	if(!split_args(cmd, args, &a))
+	{
+		send_error();
+		record(cmd, t0, true);
+		return;
+	}
+
+	if(cmd->prepare)
+	{
+		Job *job = acquire_job();
+		if(!cmd->prepare(&a, job))
+		{
+			send_error();
+			record(cmd, t0, true);
+			return;
+		}
+		job->command = cmd;
+		job->t0 = t0;
+		if(batch_active)
+		{
+			run_job(job);
+			Reply rep = finish_job(job);
+			send_reply(rep.s, rep.n);
+			return;
+		}
+		// 単独のテキストコマンドは完了を待たずに次のコマンドへ進む
+		core1_submit(job);
+		if(cur_tag_len)
+		{
+			memcpy(job->tag, cur_tag, cur_tag_len);
+			job->tag_len = (uint8_t)cur_tag_len;
+			tagged[ntagged++] = job;
+		}
+		else
+			pending_push(job, NULL, 0);
+		return;
+	}
+
+	Reply rep = {reply_buf, 0};
+	bool ok = cmd->run(&a, &rep);
+	if(ok)
+		send_reply(rep.s, rep.n);
+	else
+		send_error();
+	record(cmd, t0, !ok);
+}
+
+// s[start..len) が登録済みのコマンドの "name(" で始まれば true
+static bool starts_call(const char *s, size_t start, size_t len)
+{
+	const char *l = memchr(s + start, '(', len - start);
+	return l && find_command(trim(s + start, (size_t)(l - (s + start)))) != NULL;
+}
+
+/**
+ * 次のバッチの区切りの位置 (無ければ len)
+ * setText のテキストに ";" が含まれても壊れないよう、直前の空白以外の文字が ")" で、
+ * 後ろが登録済みのコマンドの "name(" で始まる ";" だけを区切りとみなす (main.py と同じ)
+ */
+static size_t next_separator(const char *s, size_t start, size_t len)
+{
+	for(size_t i = start; i < len; ++i)
+	{
+		if(s[i] != ';')
+			continue;
+		size_t j = i;
+		while(j > start && s[j - 1] == ' ')
+			--j;
+		if(j > start && s[j - 1] == ')' && starts_call(s, i + 1, len))
+			return i;
+	}
+	return len;
+}
+
+static bool is_blank(const char *s, size_t n)
+{
+	return trim(s, n).n == 0;
+}
+
+// 2 つ以上のコマンドを並べた行なら true
+static bool is_batch(const char *s, size_t n)
+{
+	size_t sep = next_separator(s, 0, n);
+	return sep < n && !is_blank(s + sep + 1, n - sep - 1);
+}
+
+// 複数のコマンドを実行し、応答を ";" で連結して batch_buf に溜める
+static void collect_replies(const char *s, size_t n)
+{
+	batch_active = true;
+	batch_len = 0;
+	batch_count = 0;
+	if(!is_batch(s, n))
+		handle_command(s, n);
+	else
+	{
+		for(size_t start = 0; start < n;)
+		{
+			size_t end = next_separator(s, start, n);
+			if(end == n && is_blank(s + start, n - start))
+				break;
+			handle_command(s + start, end - start);
+			start = end + 1;
+		}
+	}
+	batch_active = false;
+}
+
+/**
+ * 1 行を処理する。複数コマンドの場合は応答を ";" で連結して 1 行で返す
+ * 行頭に "#<n> " のタグがあれば、応答にも同じタグを付け、他のコマンドを待たずに返す
+ */
+static void handle_line(const char *line, size_t len)
+{
+	Token s = trim(line, len);
+	if(s.n && s.s[0] == '#')
+	{
+		const char *sp = memchr(s.s, ' ', s.n);
+		size_t end = sp ? (size_t)(sp - s.s) : s.n;
+		bool valid = end > 1 && end <= TAG_MAX_LEN;
+		for(size_t i = 1; valid && i < end; ++i)
+			valid = s.s[i] >= '0' && s.s[i] <= '9';
+		if(!valid)
+		{
+			send_error();
+			return;
+		}
+		cur_tag = s.s;
+		cur_tag_len = end;
+		s = end < s.n ? trim(s.s + end + 1, s.n - end - 1) : trim(s.s + end, 0);
+	}
+
+	if(is_batch(s.s, s.n))
+	{
+		collect_replies(s.s, s.n);
+		send_reply(batch_buf, batch_len);
+	}
+	else
+		handle_command(s.s, s.n);
+	cur_tag = NULL;
+	cur_tag_len = 0;
+}
+
+// --- バイナリフレームモード ---
+//
+// 要求: A5 | op | pin | len(LE16) | payload | crc8
+// 応答: 5A | op | status | len(LE16) | payload | crc8
+
+enum
+{
+	RX_SYNC,
+	RX_HEADER,
+	RX_PAYLOAD,
+	RX_CRC,
+};
+
+static struct
+{
+	int state;
+	uint8_t hdr[4];
+	size_t got;
+	size_t len;
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+} rx;
+
+static void put_u16(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+	put_u16(p, v);
+	put_u16(p + 2, v >> 16);
+}
+
+/**
+ * オペコード 1 件を実行する
+ * @param  out 応答 payload の書き込み先 (16 バイト)
+ * @param  n   応答 payload の長さ
+ */
+static bool handle_op(uint8_t op, int pin, const uint8_t *payload, size_t len, uint8_t *out, size_t *n)
+{
+	*n = 0;
+	switch(op)
+	{
+		case OP_PIN_MODE:
+			return len >= 1 && io_pin_mode(pin, payload[0]);
+
+		case OP_DIGITAL_WRITE:
+			return len >= 1 && io_digital_write(pin, payload[0]);
+
+		case OP_DIGITAL_READ:
+		{
+			int v;
+			if(!io_digital_read(pin, &v))
+				return false;
+			out[0] = (uint8_t)v;
+			*n = 1;
+			return true;
+		}
+
+		case OP_ANALOG_WRITE:
+			return len >= 1 && io_analog_write(pin, payload[0]);
+
+		case OP_ANALOG_READ:
+		{
+			uint16_t v;
+			if(!io_analog_read(pin, &v))
+				return false;
+			put_u16(out, v);
+			*n = 2;
+			return true;
+		}
+
+		case OP_ULTRASONIC_READ:
+		{
+			int cm;
+			if(!ranger_read(pin, &cm) || cm > 0xFFFF)
+				return false;
+			put_u16(out, (uint32_t)cm);
+			*n = 2;
+			return true;
+		}
+
+		case OP_SET_TEXT:
+		case OP_SET_RGB:
+		case OP_DHT_READ:
+		{
+			if(op == OP_SET_RGB ? len < 3 : op == OP_DHT_READ ? len < 1 : pin > 1)
+				return false;
+			Job *job = acquire_job();
+			job->bus = (int16_t)pin;
+			if(op == OP_SET_TEXT)
+			{
+				// lcd_set_text と同じく、前後の空白を除いてから 32 文字に切り詰める
+				Token t = trim((const char *)payload, len);
+				job->kind = JOB_SET_TEXT;
+				job->text_len = (uint8_t)(t.n < LCD_CHARS ? t.n : LCD_CHARS);
+				memcpy(job->text, t.s, job->text_len);
+			}
+			else if(op == OP_SET_RGB)
+			{
+				job->kind = JOB_SET_RGB;
+				for(int i = 0; i < 3; ++i)
+					job->args[i] = payload[i];
+			}
+			else
+			{
+				job->kind = JOB_DHT_READ;
+				job->args[0] = payload[0];
+			}
+			run_job(job);
+			bool ok = job->ok;
+			if(ok && op == OP_DHT_READ)
+			{
+				put_u16(out, (uint16_t)(int16_t)lroundf(job->temp * 10));
+				put_u16(out + 2, (uint32_t)lroundf(job->hum * 10));
+				put_u32(out + 4, job->age_ms);
+				*n = 8;
+			}
+			core1_release(job);
+			return ok;
+		}
+
+		case OP_SNAPSHOT:
+		{
+			// u8 mask, u32 時刻, u8 デジタルピンのレベル (mask と同じビット位置), 読んだアナログピンごとに u16
+			Snapshot snap;
+			if(len < 1 || !io_snapshot(payload[0], &snap))
+				return false;
+			out[0] = snap.mask;
+			put_u32(out + 1, snap.t_us);
+			out[5] = 0;
+			for(int i = 3; i < 6; ++i)
+				if(snap.mask & (1 << i))
+					out[5] |= (uint8_t)(snap.values[i] << i);
+			*n = 6;
+			for(int i = 0; i < 3; ++i)
+				if(snap.mask & (1 << i))
+				{
+					put_u16(out + *n, snap.values[i]);
+					*n += 2;
+				}
+			return true;
+		}
+
+		case OP_LED_STRIP_WRITE:
+			// 受信バッファからそのまま変換して送る (コピーなし)
+			return strip_write(pin, payload, len);
+
+		default:
+			return false;
+	}
+}
+
+static void handle_frame(uint8_t crc)
+{
+	uint8_t op = rx.hdr[0];
+	if(crc8(rx.payload, rx.len, crc8(rx.hdr, 4, 0xFF)) != crc)
+	{
+		serial_frame(op, FRAME_STATUS_BAD_FRAME, NULL, 0);
+		return;
+	}
+
+	if(op == OP_TEXT)
+	{
+		collect_replies((const char *)rx.payload, rx.len);
+		serial_frame(OP_TEXT, FRAME_STATUS_OK, (const uint8_t *)batch_buf, batch_len);
+		return;
+	}
+
+	if(op == OP_ASCII_MODE)
+	{
+		serial_frame(op, FRAME_STATUS_OK, NULL, 0);
+		serial_binary = false;
+		return;
+	}
+
+	Command *cmd = op <= OP_SNAPSHOT ? op_commands[op] : NULL;
+	uint32_t t0 = time_us_32();
+	uint8_t out[16];
+	size_t n;
+	bool ok = handle_op(op, rx.hdr[1], rx.payload, rx.len, out, &n);
+	serial_frame(op, ok ? FRAME_STATUS_OK : FRAME_STATUS_ERROR, out, ok ? n : 0);
+	if(cmd)
+		record(cmd, t0, !ok);
+}
+
+/**
+ * バイナリフレームの受信を進める。同期バイト A5 が来るまでは読み捨てる
+ * @return 使ったバイト数 (フレームを 1 つ処理したらモードが変わることがあるので、そこで戻る)
+ */
+static size_t frame_feed(const uint8_t *p, size_t n)
+{
+	size_t used = 0;
+	while(used < n)
+	{
+		switch(rx.state)
+		{
+			case RX_SYNC:
+				if(p[used++] == FRAME_SYNC_REQUEST)
+				{
+					rx.state = RX_HEADER;
+					rx.got = 0;
+				}
+				break;
+
+			case RX_HEADER:
+				rx.hdr[rx.got++] = p[used++];
+				if(rx.got < 4)
+					break;
+				rx.len = rx.hdr[2] | ((size_t)rx.hdr[3] << 8);
+				rx.got = 0;
+				if(rx.len > FRAME_MAX_PAYLOAD)
+				{
+					serial_frame(rx.hdr[0], FRAME_STATUS_BAD_FRAME, NULL, 0);
+					rx.state = RX_SYNC;
+					return used;
+				}
+				rx.state = rx.len ? RX_PAYLOAD : RX_CRC;
+				break;
+
+			case RX_PAYLOAD:
+			{
+				size_t take = rx.len - rx.got;
+				if(take > n - used)
+					take = n - used;
+				memcpy(rx.payload + rx.got, p + used, take);
+				used += take;
+				rx.got += take;
+				if(rx.got == rx.len)
+					rx.state = RX_CRC;
+				break;
+			}
+
+			case RX_CRC:
+				rx.state = RX_SYNC;
+				handle_frame(p[used++]);
+				return used;
+		}
+	}
+	return used;
+}
+
+// --- 受信 ---
+
+static char line_buf[LINE_MAX];
+static size_t line_len;
+static bool line_overflow;
+
+static void feed(const uint8_t *p, size_t n)
+{
+	while(n)
+	{
+		if(serial_binary)
+		{
+			size_t used = frame_feed(p, n);
+			p += used;
+			n -= used;
+			continue;
+		}
+
+		const uint8_t *eol = memchr(p, '\n', n);
+		size_t take = eol ? (size_t)(eol - p) : n;
+		if(!line_overflow && line_len + take <= LINE_MAX)
+		{
+			memcpy(line_buf + line_len, p, take);
+			line_len += take;
+		}
+		else
+			line_overflow = true;
+		if(!eol)
+			break;
+
+		// 長すぎる行は捨てて error を返す
+		if(line_overflow)
+			send_error();
+		else
+			handle_line(line_buf, line_len);
+		line_len = 0;
+		line_overflow = false;
+		p += take + 1;
+		n -= take + 1;
+	}
+}
+
+int main(void)
+{
+	boot_ms = board_ticks_ms();
+	serial_init();
+	io_init();
+	events_init();
+#ifdef PICO_DEFAULT_LED_PIN
+	gpio_init(PICO_DEFAULT_LED_PIN);
+	gpio_set_dir(PICO_DEFAULT_LED_PIN, GPIO_OUT);
+#endif
+
+	op_commands[OP_PIN_MODE] = find_command_str("pinMode");
+	op_commands[OP_DIGITAL_WRITE] = find_command_str("digitalWrite");
+	op_commands[OP_DIGITAL_READ] = find_command_str("digitalRead");
+	op_commands[OP_ANALOG_WRITE] = find_command_str("analogWrite");
+	op_commands[OP_ANALOG_READ] = find_command_str("analogRead");
+	op_commands[OP_ULTRASONIC_READ] = find_command_str("ultrasonicRead");
+	op_commands[OP_SET_TEXT] = find_command_str("setText");
+	op_commands[OP_SET_RGB] = find_command_str("setRGB");
+	op_commands[OP_DHT_READ] = find_command_str("dhtRead");
+	op_commands[OP_LED_STRIP_WRITE] = find_command_str("ledStripWrite");
+	op_commands[OP_SNAPSHOT] = find_command_str("snapshot");
+
+	core1_init();
+
+	// コマンドを待つ合間に通知を送り、core 1 で終わったコマンドの応答を送る
+	static uint8_t buf[512];
+	for(;;)
+	{
+		serial_task();
+		if(npending || ntagged)
+			send_replies();
+		events_pump();
+		ranger_pump();
+
+		size_t n = serial_read(buf, sizeof(buf));
+		if(n)
+		{
+#ifdef PICO_DEFAULT_LED_PIN
+			gpio_put(PICO_DEFAULT_LED_PIN, 1);
+#endif
+			feed(buf, n);
+#ifdef PICO_DEFAULT_LED_PIN
+			gpio_put(PICO_DEFAULT_LED_PIN, 0);
+#endif
+		}
+		// 届いた分をすべて処理してから、溜めた応答をまとめて USB に渡す
+		serial_flush();
+	}
+}
@@ -0,0 +1,206 @@
+#include "ranger.h"
+
+#include <stdio.h>
+
+#include "hardware/clocks.h"
+#include "hardware/pio.h"
+
+#include "board.h"
+#include "io.h"
+#include "ranger.pio.h"
+#include "serial.h"
+
+// 連続測定で中央値を取る測定回数
+#define RANGE_MEDIAN 5
+
+#define RANGE_NO_ECHO 0xFFFFFFFFu
+
+// 超音波距離センサー 1 個分のステートマシンと連続測定の状態
+typedef struct
+{
+	bool active;          // ステートマシンを動かしている
+	bool busy;            // 測定中 (結果を RX FIFO から受け取っていない)
+	uint8_t pin;
+	uint32_t period_ms;   // 連続測定の周期 (0 なら停止中)
+	bool stream;          // 測定ごとに "!ultrasonic" 通知を送るか
+	uint32_t next;        // 次に測定を始める時刻 [ms]
+	int samples[RANGE_MEDIAN];
+	int nsamples;
+	int misses;           // 連続したタイムアウトの回数
+	int value;            // 中央値 [cm] (-1 なら無し)
+} Ranger;
+
+static Ranger rangers[BOARD_DIGITAL_PINS];
+
+static PIO const ranger_pio = pio1;
+static int program_offset = -1;
+
+static int distance_cm(uint32_t duration_us)
+{
+	return (int)((duration_us + 29) / 58);
+}
+
+static Ranger *ranger_get(int pin)
+{
+	int idx = board_digital_index(pin);
+	Ranger *r = &rangers[idx];
+	if(r->active)
+		return r;
+
+	io_release(pin, false);
+	if(program_offset < 0)
+		program_offset = (int)pio_add_program(ranger_pio, &ranger_program);
+	ranger_program_init(ranger_pio, (uint)idx, (uint)program_offset, (uint)pin,
+	                    (float)clock_get_hz(clk_sys) / 2000000.0f);
+	r->active = true;
+	r->busy = false;
+	r->pin = (uint8_t)pin;
+	r->period_ms = 0;
+	r->stream = false;
+	r->nsamples = 0;
+	r->misses = 0;
+	r->value = -1;
+	// ピンは PIO が使うので、次の digitalRead/digitalWrite で設定し直す
+	io_forget(pin);
+	return r;
+}
+
+static void trigger(Ranger *r)
+{
+	pio_sm_put(ranger_pio, (uint)board_digital_index(r->pin), RANGE_TIMEOUT_US);
+	r->busy = true;
+}
+
+static bool ready(const Ranger *r)
+{
+	return !pio_sm_is_rx_fifo_empty(ranger_pio, (uint)board_digital_index(r->pin));
+}
+
+// 測定結果のパルス幅 [us]。タイムアウトなら 0
+static uint32_t result(Ranger *r)
+{
+	uint32_t v = pio_sm_get(ranger_pio, (uint)board_digital_index(r->pin));
+	r->busy = false;
+	if(v == RANGE_NO_ECHO)
+		return 0;
+	return RANGE_TIMEOUT_US - v;
+}
+
+static void add_sample(Ranger *r, uint32_t duration)
+{
+	if(!duration)
+	{
+		// 外れ値ではなく応答なし。続いた場合だけ値を捨てる
+		if(++r->misses >= RANGE_MEDIAN)
+		{
+			r->nsamples = 0;
+			r->value = -1;
+		}
+		return;
+	}
+	r->misses = 0;
+	if(r->nsamples == RANGE_MEDIAN)
+	{
+		for(int i = 1; i < RANGE_MEDIAN; ++i)
+			r->samples[i - 1] = r->samples[i];
+		--r->nsamples;
+	}
+	r->samples[r->nsamples++] = distance_cm(duration);
+
+	int sorted[RANGE_MEDIAN];
+	for(int i = 0; i < r->nsamples; ++i)
+	{
+		int v = r->samples[i], j = i;
+		for(; j > 0 && sorted[j - 1] > v; --j)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+	r->value = sorted[(r->nsamples - 1) / 2];
+
+	if(r->stream)
+	{
+		char text[32];
+		int len = snprintf(text, sizeof(text), "ultrasonic %u %d", r->pin, r->value);
+		serial_event(text, (size_t)len);
+	}
+}
+
+bool ranger_read(int pin, int *cm)
+{
+	if(!board_digital_pin(pin))
+		return false;
+
+	Ranger *r = &rangers[board_digital_index(pin)];
+	if(r->active && r->period_ms)
+	{
+		if(r->value < 0)
+			return false;
+		*cm = r->value;
+		return true;
+	}
+
+	r = ranger_get(pin);
+	if(!r->busy)
+		trigger(r);
+	// 立ち上がり待ちと計測がそれぞれ最大 30 ms かかる
+	absolute_time_t deadline = make_timeout_time_ms(2 * RANGE_TIMEOUT_US / 1000 + 10);
+	while(!ready(r))
+		if(time_reached(deadline))
+			return false;
+	uint32_t duration = result(r);
+	if(!duration)
+		return false;
+	*cm = distance_cm(duration);
+	return true;
+}
+
+/**
+ * ultrasonicStart(pin, period_ms[, stream])
+ * @param  pin       デジタルピン番号 (16/18/20)
+ * @param  period_ms 測定周期 [ms] (30 以上)
+ * @param  stream    true なら測定ごとに "!ultrasonic <pin> <cm>" を送る
+ */
+bool ranger_start(int pin, int period_ms, bool stream)
+{
+	if(!board_digital_pin(pin) || period_ms < RANGE_MIN_PERIOD_MS)
+		return false;
+
+	Ranger *r = ranger_get(pin);
+	r->period_ms = (uint32_t)period_ms;
+	r->stream = stream;
+	r->next = board_ticks_ms();
+	return true;
+}
+
+void ranger_stop(int pin)
+{
+	int idx = board_digital_index(pin);
+	Ranger *r = &rangers[idx];
+	if(!r->active)
+		return;
+	pio_sm_set_enabled(ranger_pio, (uint)idx, false);
+	pio_sm_clear_fifos(ranger_pio, (uint)idx);
+	pio_sm_restart(ranger_pio, (uint)idx);
+	r->active = false;
+}
+
+void ranger_pump(void)
+{
+	uint32_t now = board_ticks_ms();
+	for(int i = 0; i < BOARD_DIGITAL_PINS; ++i)
+	{
+		Ranger *r = &rangers[i];
+		if(!r->active || !r->period_ms)
+			continue;
+		if(r->busy)
+		{
+			if(!ready(r))
+				continue;
+			add_sample(r, result(r));
+		}
+		if((int32_t)(now - r->next) < 0)
+			continue;
+		r->next = now + r->period_ms;
+		trigger(r);
+	}
+}
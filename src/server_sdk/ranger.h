@@ -0,0 +1,21 @@
+#ifndef GROVEPI_RANGER_H
+#define GROVEPI_RANGER_H
+
+#include <stdbool.h>
+
+// --- 超音波距離センサー (PIO1 のステートマシン 0〜2 で D16/D18/D20 を測る) ---
+
+// エコー待ちのタイムアウト [us] と、連続測定の最短周期 [ms]
+#define RANGE_TIMEOUT_US 30000
+#define RANGE_MIN_PERIOD_MS 30
+
+// ultrasonicRead(pin)。連続測定中は測定を待たずに直近の中央値を返す
+bool ranger_read(int pin, int *cm);
+
+bool ranger_start(int pin, int period_ms, bool stream);
+void ranger_stop(int pin);
+
+// 連続測定中のセンサーの測定を進める (メインループから呼ぶ)
+void ranger_pump(void);
+
+#endif
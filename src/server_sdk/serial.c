@@ -0,0 +1,98 @@
+#include "serial.h"
+
+#include "tusb.h"
+
+bool serial_binary = false;
+
+static uint8_t crc8_table[256];
+
+void serial_init(void)
+{
+	for(int i = 0; i < 256; ++i)
+	{
+		uint8_t crc = (uint8_t)i;
+		for(int b = 0; b < 8; ++b)
+			crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x31) : (uint8_t)(crc << 1);
+		crc8_table[i] = crc;
+	}
+	tusb_init();
+}
+
+void serial_task(void)
+{
+	tud_task();
+}
+
+uint8_t crc8(const uint8_t *buf, size_t n, uint8_t crc)
+{
+	for(size_t i = 0; i < n; ++i)
+		crc = crc8_table[crc ^ buf[i]];
+	return crc;
+}
+
+/**
+ * 受信済みのデータを読む (待たない)
+ * @param  buf  読み込み先
+ * @param  size buf の大きさ
+ * @return      読んだバイト数
+ */
+size_t serial_read(uint8_t *buf, size_t size)
+{
+	if(!tud_cdc_available())
+		return 0;
+	return tud_cdc_read(buf, (uint32_t)size);
+}
+
+/**
+ * 送信 FIFO に書き込む。FIFO が一杯なら、ホストが読むまで USB を処理しながら待つ
+ * ホストがポートを閉じている (DTR が落ちている) 間は、入りきらない分を捨てる
+ */
+void serial_write(const void *data, size_t n)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	while(n)
+	{
+		uint32_t w = tud_cdc_write(p, (uint32_t)n);
+		p += w;
+		n -= w;
+		if(!n)
+			break;
+		tud_cdc_write_flush();
+		tud_task();
+		if(!tud_cdc_connected())
+			return;
+	}
+}
+
+void serial_flush(void)
+{
+	if(tud_cdc_write_available() < CFG_TUD_CDC_TX_BUFSIZE)
+		tud_cdc_write_flush();
+}
+
+void serial_line(const char *s, size_t n)
+{
+	serial_write(s, n);
+	serial_write("\n", 1);
+}
+
+void serial_frame(uint8_t op, uint8_t status, const uint8_t *payload, size_t n)
+{
+	uint8_t hdr[5] = {FRAME_SYNC_REPLY, op, status, (uint8_t)(n & 0xFF), (uint8_t)(n >> 8)};
+	uint8_t crc = crc8(hdr + 1, 4, 0xFF);
+	crc = crc8(payload, n, crc);
+	serial_write(hdr, sizeof(hdr));
+	serial_write(payload, n);
+	serial_write(&crc, 1);
+}
+
+void serial_event(const char *text, size_t n)
+{
+	if(serial_binary)
+	{
+		serial_frame(OP_EVENT, FRAME_STATUS_OK, (const uint8_t *)text, n);
+		return;
+	}
+	serial_write("!", 1);
+	serial_line(text, n);
+}
@@ -0,0 +1,59 @@
+#ifndef GROVEPI_SERIAL_H
+#define GROVEPI_SERIAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// --- USB シリアル (TinyUSB CDC) ---
+//
+// 送信は TinyUSB の送信 FIFO に溜め、serial_flush() でまとめて USB に渡す。
+// 読み書きはすべて core 0 から行う (TinyUSB はスレッドセーフではない)。
+
+// バイナリフレーム (PROTOCOL.md の「バイナリフレームモード」)
+#define FRAME_SYNC_REQUEST 0xA5
+#define FRAME_SYNC_REPLY 0x5A
+#define FRAME_MAX_PAYLOAD 1024
+
+#define FRAME_STATUS_OK 0
+#define FRAME_STATUS_ERROR 1
+#define FRAME_STATUS_BAD_FRAME 2
+
+#define OP_PIN_MODE 0x01
+#define OP_DIGITAL_WRITE 0x02
+#define OP_DIGITAL_READ 0x03
+#define OP_ANALOG_WRITE 0x04
+#define OP_ANALOG_READ 0x05
+#define OP_ULTRASONIC_READ 0x06
+#define OP_SET_TEXT 0x07
+#define OP_SET_RGB 0x08
+#define OP_DHT_READ 0x09
+#define OP_LED_STRIP_WRITE 0x0A
+#define OP_SNAPSHOT 0x0B
+#define OP_TEXT 0x7E
+#define OP_ASCII_MODE 0x7F
+#define OP_EVENT 0xE0
+
+// バイナリフレームモード中なら true (非同期通知もフレームで送る)
+extern bool serial_binary;
+
+void serial_init(void);
+void serial_task(void);
+
+size_t serial_read(uint8_t *buf, size_t size);
+void serial_write(const void *data, size_t n);
+void serial_flush(void);
+
+// s[0:n] と改行を 1 行として送る
+void serial_line(const char *s, size_t n);
+
+// 応答フレーム 5A | op | status | len | payload | crc8
+void serial_frame(uint8_t op, uint8_t status, const uint8_t *payload, size_t n);
+
+// 非同期通知 "!<text>" (バイナリモード中は op 0xE0 のフレーム)
+void serial_event(const char *text, size_t n);
+
+// 多項式 0x31 の CRC8 (dht20.py の calc_crc8 と同じ。初期値は呼び出し側で 0xFF を渡す)
+uint8_t crc8(const uint8_t *buf, size_t n, uint8_t crc);
+
+#endif
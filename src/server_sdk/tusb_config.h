@@ -0,0 +1,26 @@
+#ifndef GROVEPI_TUSB_CONFIG_H
+#define GROVEPI_TUSB_CONFIG_H
+
+// --- TinyUSB の設定 (USB デバイス、CDC 1 つだけ) ---
+
+#define CFG_TUSB_RHPORT0_MODE OPT_MODE_DEVICE
+#define CFG_TUD_ENABLED 1
+
+#ifndef CFG_TUSB_OS
+#define CFG_TUSB_OS OPT_OS_PICO
+#endif
+
+#define CFG_TUD_ENDPOINT0_SIZE 64
+
+#define CFG_TUD_CDC 1
+#define CFG_TUD_MSC 0
+#define CFG_TUD_HID 0
+#define CFG_TUD_MIDI 0
+#define CFG_TUD_VENDOR 0
+
+// 341 LED 分の ledStripWrite の 1 行が入る大きさにして、受信の取りこぼしと送信待ちを減らす
+#define CFG_TUD_CDC_RX_BUFSIZE 2048
+#define CFG_TUD_CDC_TX_BUFSIZE 2048
+#define CFG_TUD_CDC_EP_BUFSIZE 64
+
+#endif
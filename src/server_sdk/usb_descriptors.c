@@ -0,0 +1,110 @@
+#include <string.h>
+
+#include "pico/unique_id.h"
+#include "tusb.h"
+
+// --- USB ディスクリプタ ---
+//
+// ホスト側の自動検出 (ベンダー ID 2e8a とシリアル番号) が MicroPython 版と同じように動くよう、
+// ベンダー ID と、ボード固有 ID から作るシリアル番号を MicroPython と揃える。
+
+#define USB_VID 0x2E8A
+// Raspberry Pi の割り当てのうち、pico-sdk の stdio_usb と同じ番号
+#define USB_PID 0x000A
+
+enum
+{
+	ITF_NUM_CDC,
+	ITF_NUM_CDC_DATA,
+	ITF_NUM_TOTAL,
+};
+
+#define EPNUM_CDC_NOTIF 0x81
+#define EPNUM_CDC_OUT 0x02
+#define EPNUM_CDC_IN 0x82
+
+#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN)
+
+enum
+{
+	STRID_LANGID,
+	STRID_MANUFACTURER,
+	STRID_PRODUCT,
+	STRID_SERIAL,
+	STRID_CDC,
+};
+
+static const tusb_desc_device_t desc_device = {
+	.bLength = sizeof(tusb_desc_device_t),
+	.bDescriptorType = TUSB_DESC_DEVICE,
+	.bcdUSB = 0x0200,
+	// CDC の IAD を使うので Misc / Common / IAD
+	.bDeviceClass = TUSB_CLASS_MISC,
+	.bDeviceSubClass = MISC_SUBCLASS_COMMON,
+	.bDeviceProtocol = MISC_PROTOCOL_IAD,
+	.bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
+	.idVendor = USB_VID,
+	.idProduct = USB_PID,
+	.bcdDevice = 0x0100,
+	.iManufacturer = STRID_MANUFACTURER,
+	.iProduct = STRID_PRODUCT,
+	.iSerialNumber = STRID_SERIAL,
+	.bNumConfigurations = 1,
+};
+
+static const uint8_t desc_configuration[] = {
+	TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0, 250),
+	TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, STRID_CDC, EPNUM_CDC_NOTIF, 8, EPNUM_CDC_OUT, EPNUM_CDC_IN, 64),
+};
+
+static const char *const desc_strings[] = {
+	[STRID_MANUFACTURER] = "Raspberry Pi",
+	[STRID_PRODUCT] = "GrovePiPico",
+	[STRID_CDC] = "GrovePiPico CDC",
+};
+
+uint8_t const *tud_descriptor_device_cb(void)
+{
+	return (uint8_t const *)&desc_device;
+}
+
+uint8_t const *tud_descriptor_configuration_cb(uint8_t index)
+{
+	(void)index;
+	return desc_configuration;
+}
+
+uint16_t const *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+{
+	(void)langid;
+	static uint16_t desc[32];
+	char serial[2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES + 1];
+	const char *s;
+	size_t n;
+
+	if(index == STRID_LANGID)
+	{
+		// 英語 (0x0409) だけ
+		desc[1] = 0x0409;
+		n = 1;
+	}
+	else
+	{
+		if(index == STRID_SERIAL)
+		{
+			pico_get_unique_board_id_string(serial, sizeof(serial));
+			s = serial;
+		}
+		else if(index < sizeof(desc_strings) / sizeof(desc_strings[0]) && desc_strings[index])
+			s = desc_strings[index];
+		else
+			return NULL;
+		n = strlen(s);
+		if(n > 31)
+			n = 31;
+		for(size_t i = 0; i < n; ++i)
+			desc[1 + i] = (uint8_t)s[i];
+	}
+	desc[0] = (uint16_t)((TUSB_DESC_STRING << 8) | (2 * n + 2));
+	return desc;
+}